@@ -1,4 +1,5 @@
 const path = require( 'path' )
+const crypto = require( 'crypto' )
 const semver = require( 'semver' )
 const { Storage } = require( '@google-cloud/storage' )
 const { BigQuery } = require( '@google-cloud/bigquery' )
@@ -8,41 +9,141 @@ const BQ_TABLE = 'firmwares'
 const TABLE_SCHEMA = 'id:string, eventType: string, bucket:string, version:string, fullname:string, filename:string, variant:string, createdAt:timestamp'
 const projectId = process.env.GCLOUD_PROJECT
 
+// Latest firmware per variant, kept by this instance for that long
+const MANIFEST_TTL_MS = 10 * 60 * 1000
+
 const bqClient = new BigQuery( { projectId } )
 const storage = new Storage()
 const bucket = storage.bucket( `${projectId}-firmwares` )
+const manifests = new Map()
 
 
 async function insertIntoBigquery( data ) {
-  const [ datasets ] = await bqClient.getDatasets()
-  let dataset = datasets.find( dataset => dataset.id === BQ_DATASET )  
-  console.log( 'Datasets', datasets, dataset )
-  // let dataset = bqClient.dataset( BQ_DATASET )
-  if ( !dataset ) {
-    [ dataset ] = await bqClient.createDataset( BQ_DATASET )  
+  let table = bqClient.dataset( BQ_DATASET ).table( BQ_TABLE )
+  try {
+    const res = await table.insert( data, { ignoreUnknownValues : true } );
+    console.log( 'Insert', res )
+    return
+  } catch ( e ) {
+    if ( e.code !== 404 ) {
+      console.log( 'Insert Failed', e, JSON.stringify( e ) )
+      return
+    }
   }
 
-  const [ tables ] = await dataset.getTables()
-  let table = tables.find( table => table.id === BQ_TABLE )
-  console.log( 'Tables', tables, table )
-  // let table = dataset.table( BQ_TABLE )    
-  if ( !table ) {
+  // First upload of the project: create the dataset and the table, then retry
+  let [ dataset ] = await bqClient.dataset( BQ_DATASET ).get( { autoCreate : true } )
+  const [ exists ] = await dataset.table( BQ_TABLE ).exists()
+  if ( !exists ) {
     [ table ] = await dataset.createTable( BQ_TABLE, { schema : TABLE_SCHEMA } )
   }
-  
   try {
     const res = await table.insert( data, { ignoreUnknownValues : true } );
     console.log( 'Insert', res )
   } catch ( e ) {
-    console.log( 'Insert Failed', e, JSON.stringify( e ) )        
+    console.log( 'Insert Failed', e, JSON.stringify( e ) )
   }
 }
 
-async function getPublicUrl( filename ) {
-  const file = bucket.file( filename )    
-  await file.makePublic()  
-  const url = `http://${bucket.name}.storage.googleapis.com/${filename}`
-  return url
+// Manifest of the latest firmware of a variant, written on upload to manifests/<variant>.json
+function manifestFile( variant ) {
+  return bucket.file( `manifests/${variant}.json` )
+}
+
+function manifestTag( manifest ) {
+  return `"${manifest.variant}-${manifest.version}-${( manifest.sha256 || '' ).slice( 0, 12 )}"`
+}
+
+// Only used until the first upload after this change writes the manifest
+async function queryLatestFirmware( variant ) {
+  const queryParams = {
+    query : `
+      SELECT 
+        bucket,
+        fullname,
+        version,
+        createdAt
+      FROM \`weuiot.ota.firmwares\`
+      where variant = @variant
+      order by createdAt desc
+      limit 1      
+    `,
+    params : {
+      variant
+    }
+  }
+
+  const [ rows ] = await bqClient.dataset( BQ_DATASET ).table( BQ_TABLE ).query( queryParams )
+  if ( rows.length === 0 ) {
+    return null
+  }
+  const firmware = rows[0]
+  const file = bucket.file( firmware.fullname )
+  const [ metadata ] = await file.getMetadata()
+  await file.makePublic()
+  return {
+    variant,
+    version : firmware.version,
+    fullname : firmware.fullname,
+    sha256 : ( metadata.metadata || {} ).sha256 || '',
+  }
+}
+
+async function saveManifest( manifest ) {
+  await manifestFile( manifest.variant ).save( JSON.stringify( manifest ), { contentType : 'application/json' } )
+  manifests.set( manifest.variant, { manifest, fetchedAt : Date.now() } )
+}
+
+// The manifest object as stored, null only when there is none yet
+async function readManifest( variant ) {
+  try {
+    const [ content ] = await manifestFile( variant ).download()
+    return JSON.parse( content.toString() )
+  } catch ( e ) {
+    if ( e.code === 404 ) {
+      return null
+    }
+    throw e
+  }
+}
+
+// Memory, then the manifest object, then BigQuery
+async function loadManifest( variant ) {
+  const cached = manifests.get( variant )
+  if ( cached && Date.now() - cached.fetchedAt < MANIFEST_TTL_MS ) {
+    return cached.manifest
+  }
+
+  let manifest = await readManifest( variant )
+  if ( !manifest ) {
+    manifest = await queryLatestFirmware( variant )
+    if ( manifest ) {
+      await saveManifest( manifest )
+    }
+  }
+  manifests.set( variant, { manifest, fetchedAt : Date.now() } )
+  return manifest
+}
+
+// SHA-256 of the image, checked by the device before it boots on it
+function computeSha256( file ) {
+  return new Promise( ( resolve, reject ) => {
+    const hash = crypto.createHash( 'sha256' )
+    file.createReadStream()
+      .on( 'error', reject )
+      .on( 'data', chunk => hash.update( chunk ) )
+      .on( 'end', () => resolve( hash.digest( 'hex' ) ) )
+  } )
+}
+
+// Patches made by ota_delta.py sit next to the image: firmware_<variant>.from-<version>.delta
+function deltaName( fullname, fromVersion ) {
+  return fullname.replace( /\.bin$/, `.from-${fromVersion}.delta` )
+}
+
+// Images and deltas are made public once, when they are uploaded
+function getPublicUrl( filename ) {
+  return `http://${bucket.name}.storage.googleapis.com/${filename}`
 }
 
 /**
@@ -56,6 +157,9 @@ exports.insertFirmwaresOnBigquery = ( data, context ) => {
   
   const filename = path.basename( file.name )
   const ext = path.extname( filename )
+  if ( ext === '.delta' ) {
+    return bucket.file( file.name ).makePublic().then( () => 'ok' )
+  }
   if ( ext !== '.bin' ) {
     console.log( 'Not a firmware file.' )
     return 'ok'
@@ -77,7 +181,20 @@ exports.insertFirmwaresOnBigquery = ( data, context ) => {
   }
 
   console.log( 'Row to insert', row )
-  return insertIntoBigquery( row )
+  const firmware = bucket.file( file.name )
+  return computeSha256( firmware )
+    .then( async sha256 => {
+      await firmware.setMetadata( { metadata : { sha256 } } )
+      await firmware.makePublic()
+      await insertIntoBigquery( row )
+
+      // Refresh the manifest, unless an older build was uploaded late. Read from the bucket, not
+      // this instance's cache: any error but a missing manifest fails the event rather than overwriting
+      const current = await readManifest( variant )
+      if ( !current || !semver.gt( current.version, version ) ) {
+        await saveManifest( { variant, version, fullname : file.name, sha256 } )
+      }
+    } )
 };
 
 
@@ -88,42 +205,39 @@ exports.insertFirmwaresOnBigquery = ( data, context ) => {
  */
 exports.getDownloadUrl = async ( req, res ) => {
   try {
-    const { version, variant } = req.query
+    const { version, variant, ota } = req.query
     console.log( 'Fetch version and variant ', version, variant )    
     
-    const queryParams = {
-      query : `
-        SELECT 
-          bucket,
-          fullname,
-          version,
-          createdAt
-        FROM \`weuiot.ota.firmwares\`
-        where variant = @variant
-        order by createdAt desc
-        limit 1      
-      `,
-      params : {
-        variant
-      }
+    const firmware = await loadManifest( variant )
+    if ( !firmware ) {
+      res.status( 204 ).send( 'No new version' );
+      return
     }
 
-    const [ rows ] = await bqClient.dataset( BQ_DATASET ).table( BQ_TABLE ).query( queryParams )
-    if ( rows.length > 0 ) {
-      const firmware = rows[0]
-      
-      // latest > current
-      const needsUpdate = semver.gt( firmware.version, version )      
-      if ( needsUpdate ) {
-        const url = await getPublicUrl( firmware.fullname )
-        console.log( 'Sending url', url )
-        res.status( 200 ).send( url );
-      } else {
-        res.status( 204 ).send( 'Up to date' );  
-      }
+    // The device sends back the tag of its last "up to date" answer
+    const etag = manifestTag( firmware )
+    res.set( 'ETag', etag )
+    if ( req.get( 'If-None-Match' ) === etag ) {
+      res.status( 304 ).end()
+      return
+    }
 
+    // latest > current
+    const needsUpdate = semver.gt( firmware.version, version )      
+    if ( needsUpdate && ota === '2' ) {
+      // url, sha256 and image kind, one per line
+      const delta = deltaName( firmware.fullname, version )
+      const [ hasDelta ] = await bucket.file( delta ).exists()
+      const url = getPublicUrl( hasDelta ? delta : firmware.fullname )
+      console.log( 'Sending url', url, firmware.sha256, hasDelta ? 'delta' : 'full' )
+      res.status( 200 ).send( [ url, firmware.sha256, hasDelta ? 'delta' : 'full' ].join( '\n' ) );
+    } else if ( needsUpdate ) {
+      // Devices older than the resumable OTA only understand the url
+      const url = getPublicUrl( firmware.fullname )
+      console.log( 'Sending url', url )
+      res.status( 200 ).send( url );
     } else {
-      res.status( 204 ).send( 'No new version' );
+      res.status( 204 ).send( 'Up to date' );  
     }
 
   } catch ( err ) {
@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+"""Delta firmware images for the resumable OTA (see src/ota.h for the format).
+
+  ota_delta.py make old.bin new.bin firmware_<variant>.from-<old version>.delta
+  ota_delta.py apply old.bin patch.delta rebuilt.bin
+
+Upload the delta next to the new image, the getDownloadUrl function serves it
+to devices running the old version:
+
+  gsutil cp firmware_esp8266.from-1.0.0.delta gs://<project>-firmwares/1.1.0/
+"""
+
+import hashlib
+import struct
+import sys
+
+MAGIC = 0x3144544F
+OP_END = 0x00
+OP_COPY = 0x01
+OP_DATA = 0x02
+
+BLOCK = 32        # bytes hashed to find a match in the old image
+MIN_COPY = 48     # shorter matches cost more than the literal bytes
+
+
+def make(old, new):
+    index = {}
+    for offset in range(0, len(old) - BLOCK + 1):
+        index.setdefault(old[offset:offset + BLOCK], offset)
+
+    out = bytearray(struct.pack('<III', MAGIC, len(old), len(new)))
+    literal = bytearray()
+
+    def flush_literal():
+        if literal:
+            out.extend(struct.pack('<BI', OP_DATA, len(literal)))
+            out.extend(literal)
+            literal.clear()
+
+    i = 0
+    while i < len(new):
+        source = index.get(new[i:i + BLOCK])
+        if source is None:
+            literal.append(new[i])
+            i += 1
+            continue
+
+        length = BLOCK
+        while i + length < len(new) and source + length < len(old) and new[i + length] == old[source + length]:
+            length += 1
+        if length < MIN_COPY:
+            literal.extend(new[i:i + length])
+        else:
+            flush_literal()
+            out.extend(struct.pack('<BII', OP_COPY, source, length))
+        i += length
+
+    flush_literal()
+    out.append(OP_END)
+    return bytes(out)
+
+
+def apply(old, patch):
+    magic, source_size, target_size = struct.unpack_from('<III', patch, 0)
+    if magic != MAGIC or source_size > len(old):
+        raise ValueError('not a delta for this image')
+
+    out = bytearray()
+    pos = 12
+    while True:
+        op = patch[pos]
+        pos += 1
+        if op == OP_END:
+            break
+        if op == OP_COPY:
+            offset, length = struct.unpack_from('<II', patch, pos)
+            pos += 8
+            out.extend(old[offset:offset + length])
+        elif op == OP_DATA:
+            (length,) = struct.unpack_from('<I', patch, pos)
+            pos += 4
+            out.extend(patch[pos:pos + length])
+            pos += length
+        else:
+            raise ValueError('unknown operation %d' % op)
+
+    if len(out) != target_size:
+        raise ValueError('rebuilt %d bytes instead of %d' % (len(out), target_size))
+    return bytes(out)
+
+
+def main(argv):
+    if len(argv) != 5 or argv[1] not in ('make', 'apply'):
+        print(__doc__)
+        return 1
+
+    with open(argv[2], 'rb') as f:
+        old = f.read()
+    with open(argv[3], 'rb') as f:
+        second = f.read()
+
+    if argv[1] == 'make':
+        result = make(old, second)
+        if apply(old, result) != second:
+            raise RuntimeError('delta does not rebuild the new image')
+        print('%s: %d bytes for a %d bytes image, sha256 %s' % (
+            argv[4], len(result), len(second), hashlib.sha256(second).hexdigest()))
+    else:
+        result = apply(old, second)
+        print('%s: sha256 %s' % (argv[4], hashlib.sha256(result).hexdigest()))
+
+    with open(argv[4], 'wb') as f:
+        f.write(result)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
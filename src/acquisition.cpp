@@ -0,0 +1,80 @@
+#include "acquisition.h"
+
+AdaptiveRate::AdaptiveRate()
+  : config(defaults()), activations(0)
+{
+  reset();
+}
+
+AcquisitionConfig AdaptiveRate::defaults()
+{
+  AcquisitionConfig config;
+  config.minPeriodMs = 500;
+  config.maxPeriodMs = 30000;
+  config.activeBandUs = 60;   // outlierMinBand of the filter
+  // 2 cm a minute, a 10 minute refill is about 7: still for 30 s at least
+  config.activeRateUsPerMin = 120;
+  config.settleSamples = 4;
+  return config;
+}
+
+void AdaptiveRate::configure(const AcquisitionConfig &config)
+{
+  this->config = config;
+  if (periodMs < config.minPeriodMs) {
+    periodMs = config.minPeriodMs;
+  } else if (periodMs > config.maxPeriodMs) {
+    periodMs = config.maxPeriodMs;
+  }
+}
+
+void AdaptiveRate::reset()
+{
+  periodMs = config.minPeriodMs;
+  anchor = 0;
+  anchorMs = 0;
+  still = 0;
+  started = false;
+  probing = false;
+}
+
+static uint32_t distance(int32_t a, int32_t b)
+{
+  return a > b ? (uint32_t)(a - b) : (uint32_t)(b - a);
+}
+
+uint32_t AdaptiveRate::update(uint32_t nowMs, int32_t raw, int32_t estimate)
+{
+  bool moved = !started || distance(estimate, anchor) >= config.activeBandUs;
+  if (!moved && distance(raw, estimate) >= config.activeBandUs) {
+    // A spurious echo looks the same: check right away, act on the second one
+    if (!probing) {
+      probing = true;
+      return config.minPeriodMs;
+    }
+    moved = true;
+  }
+  probing = false;
+
+  if (moved) {
+    if (started && periodMs != config.minPeriodMs) {
+      activations++;
+    }
+    started = true;
+    periodMs = config.minPeriodMs;
+    anchor = estimate;
+    anchorMs = nowMs;
+    still = 0;
+    return periodMs;
+  }
+
+  // Slower than activeRateUsPerMin would not have crossed the band yet
+  uint32_t settleMs = config.activeRateUsPerMin ? config.activeBandUs * 60000 / config.activeRateUsPerMin : 0;
+  if (++still >= config.settleSamples && nowMs - anchorMs >= settleMs && periodMs < config.maxPeriodMs) {
+    periodMs = periodMs * 2 < config.maxPeriodMs ? periodMs * 2 : config.maxPeriodMs;
+    anchor = estimate;
+    anchorMs = nowMs;
+    still = 0;
+  }
+  return periodMs;
+}
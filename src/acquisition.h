@@ -0,0 +1,53 @@
+#ifndef ACQUISITION_H
+#define ACQUISITION_H
+
+#include <stdint.h>
+
+// Sampling period of the sonar following the level: the shortest while it
+// moves (refill, heavy draw), doubling toward the longest once it is still.
+
+struct AcquisitionConfig {
+  uint32_t minPeriodMs;
+  uint32_t maxPeriodMs;
+  uint32_t activeBandUs;   //!< echo change that counts as movement, ~1 cm is 58 us
+  uint32_t activeRateUsPerMin;  //!< slowest movement followed at the shortest period
+  uint8_t settleSamples;   //!< still samples before each doubling, at least
+};
+
+class AdaptiveRate {
+public:
+  AdaptiveRate();
+
+  void configure(const AcquisitionConfig &config);
+  const AcquisitionConfig &getConfig() const { return config; }
+  void reset();
+
+  /*
+   * One sample: raw is the echo just measured, estimate the filtered one.
+   * The level moves when the estimate drifts by the band, or when two raw
+   * echoes in a row land that far from it: the first hint of a step, which
+   * the filter only follows a few samples later. A single far echo only gets
+   * the next sample early. The level must stay still for band / rate, and
+   * settleSamples at least, before each doubling. Returns the period to use
+   * from now on.
+   */
+  uint32_t update(uint32_t nowMs, int32_t raw, int32_t estimate);
+
+  uint32_t getPeriodMs() const { return periodMs; }
+  // Times the level was seen moving and the period went back to the minimum
+  uint32_t getActivations() const { return activations; }
+
+  static AcquisitionConfig defaults();
+
+private:
+  AcquisitionConfig config;
+  uint32_t periodMs;
+  int32_t anchor;          //!< estimate when the level was last seen moving or the period changed
+  uint32_t anchorMs;
+  uint8_t still;           //!< samples without movement at this period
+  bool started;
+  bool probing;            //!< one raw echo was off, the next one confirms it
+  uint32_t activations;
+};
+
+#endif // ACQUISITION_H
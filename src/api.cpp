@@ -0,0 +1,99 @@
+#include "api.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include "telemetry.h"
+
+size_t apiLevel(char *buffer, size_t size, const TankConfig *configs, const TankContext *tanks, uint8_t count,
+                uint32_t nowMs, uint32_t epoch)
+{
+  TelemetryWriter payload(buffer, size, TELEMETRY_JSON);
+  payload.beginObject();
+  payload.addUInt("time", epoch);
+  payload.beginArray("tanks");
+  for (uint8_t i = 0; i < count; i++) {
+    const TankContext &tank = tanks[i];
+    payload.beginObject();
+    payload.addBool("measured", tank.levelMs != 0);
+    if (tank.levelMs != 0) {
+      payload.addInt("volume_in_liters", tank.level.volume);
+      payload.addInt("percent", tank.level.percent);
+      payload.addFixed("full_volume_in_liters", configs[i].fullVolumeMl, 3);
+      payload.addFixed("distance_in_cm", tank.level.distanceMm, 1);
+      payload.addFixed("stddev_in_cm", tank.level.distanceStddevMm, 1);
+      payload.addUInt("samples", tank.filter.getEstimate().samples);
+      payload.addUInt("age_s", (nowMs - tank.levelMs) / 1000);
+    }
+    payload.endObject();
+  }
+  payload.endArray();
+  payload.endObject();
+  return payload.length();
+}
+
+struct HistoryStream {
+  char *buffer;
+  size_t size;
+  size_t len;
+  ApiSendFn send;
+  void *ctx;
+  uint32_t limit;
+  uint32_t sent;
+  uint32_t lastTimestamp;
+  uint32_t next;       //!< 0 when everything in the range was sent
+};
+
+static void streamFlush(HistoryStream &stream)
+{
+  if (stream.len > 0) {
+    stream.send(stream.ctx, stream.buffer, stream.len);
+    stream.len = 0;
+  }
+}
+
+// Hands the buffer over when the text would not fit, every piece is far smaller than it
+static void streamPrint(HistoryStream &stream, const char *fmt, ...)
+{
+  for (uint8_t attempt = 0; attempt < 2; attempt++) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(stream.buffer + stream.len, stream.size - stream.len, fmt, args);
+    va_end(args);
+    if (n >= 0 && stream.len + n < stream.size) {
+      stream.len += n;
+      return;
+    }
+    streamFlush(stream);
+  }
+}
+
+static bool streamRecord(void *ctx, const TelemetryRecord &record)
+{
+  HistoryStream &stream = *(HistoryStream *)ctx;
+  // Past the limit, the samples of the same second still go so "next" never splits one
+  if (stream.sent >= stream.limit && record.timestamp != stream.lastTimestamp) {
+    stream.next = record.timestamp;
+    return false;
+  }
+  streamPrint(stream, "%s{\"time\":%lu,\"tank\":%u,\"volume_in_liters\":%ld,\"percent\":%d}",
+              stream.sent ? "," : "", (unsigned long)record.timestamp, record.flags, (long)record.volume,
+              record.percent);
+  stream.sent++;
+  stream.lastTimestamp = record.timestamp;
+  return true;
+}
+
+uint32_t apiHistory(History &history, uint32_t from, uint32_t to, uint32_t limit, char *buffer, size_t size,
+                    ApiSendFn send, void *ctx)
+{
+  HistoryStream stream = { buffer, size, 0, send, ctx, limit, 0, 0, 0 };
+  streamPrint(stream, "{\"from\":%lu,\"to\":%lu,\"samples\":[", (unsigned long)from, (unsigned long)to);
+  history.query(from, to, streamRecord, &stream);
+  streamPrint(stream, "],\"count\":%lu", (unsigned long)stream.sent);
+  if (stream.next) {
+    streamPrint(stream, ",\"next\":%lu", (unsigned long)stream.next);
+  }
+  streamPrint(stream, "}");
+  streamFlush(stream);
+  return stream.sent;
+}
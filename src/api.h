@@ -0,0 +1,33 @@
+#ifndef API_H
+#define API_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "history.h"
+#include "tank.h"
+
+#define API_CHUNK_SIZE           512    //!< response buffer, on the stack of the handler
+#define API_HISTORY_MAX_SAMPLES  1000   //!< per request, the answer says where to go on from
+
+// Bodies of the local REST API, the web server only moves the bytes
+
+typedef void (*ApiSendFn)(void *ctx, const char *data, size_t len);
+
+/*
+ * /api/level: the last levels computed, no sensor is triggered for it.
+ * nowMs is millis(), each tank says how old its level is. Returns the
+ * length, 0 when it does not fit.
+ */
+size_t apiLevel(char *buffer, size_t size, const TankConfig *configs, const TankContext *tanks, uint8_t count,
+                uint32_t nowMs, uint32_t epoch);
+
+/*
+ * /api/history: the stored levels between from and to, streamed through
+ * send one buffer at a time, so memory does not grow with the range. After
+ * limit samples (and the rest of that second) "next" is the from of the
+ * following request. Returns the samples sent.
+ */
+uint32_t apiHistory(History &history, uint32_t from, uint32_t to, uint32_t limit, char *buffer, size_t size,
+                    ApiSendFn send, void *ctx);
+
+#endif // API_H
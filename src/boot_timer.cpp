@@ -0,0 +1,82 @@
+#include "boot_timer.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static const char *const PHASE_NAMES[BOOT_PHASES] = {
+  "init",
+  "storage",
+  "sensors",
+  "measure",
+  "network",
+  "wifi",
+  "time_sync",
+  "mqtt",
+};
+
+BootTimer::BootTimer()
+  : publishMs(0)
+{
+  memset(endsMs, 0, sizeof(endsMs));
+}
+
+const char *BootTimer::phaseName(BootPhase phase)
+{
+  return phase < BOOT_PHASES ? PHASE_NAMES[phase] : "unknown";
+}
+
+void BootTimer::mark(BootPhase phase, uint32_t nowMs)
+{
+  if (finished() || phase >= BOOT_PHASES || endsMs[phase] != 0) {
+    return;
+  }
+  endsMs[phase] = nowMs ? nowMs : 1;
+}
+
+void BootTimer::finish(uint32_t nowMs)
+{
+  if (!finished()) {
+    publishMs = nowMs ? nowMs : 1;
+  }
+}
+
+uint32_t BootTimer::durationMs(BootPhase phase) const
+{
+  if (phase >= BOOT_PHASES || endsMs[phase] == 0) {
+    return 0;
+  }
+  for (int8_t i = phase - 1; i >= 0; i--) {
+    if (endsMs[i] != 0) {
+      return endsMs[phase] - endsMs[i];
+    }
+  }
+  return endsMs[phase];
+}
+
+void BootTimer::writeTelemetry(TelemetryWriter &writer, uint32_t nowMs) const
+{
+  writer.beginArray("boot_ms");
+  for (uint8_t i = 0; i < BOOT_PHASES; i++) {
+    writer.addUInt(nullptr, durationMs((BootPhase)i));
+  }
+  writer.addUInt(nullptr, nowMs);
+  writer.endArray();
+}
+
+size_t BootTimer::format(char *buffer, size_t size) const
+{
+  int length = snprintf(buffer, size, "Boot:");
+  for (uint8_t i = 0; i < BOOT_PHASES && length >= 0 && (size_t)length < size; i++) {
+    if (endsMs[i] != 0) {
+      length += snprintf(buffer + length, size - length, " %s %lu ms,", PHASE_NAMES[i],
+                         (unsigned long)durationMs((BootPhase)i));
+    }
+  }
+  if (length >= 0 && (size_t)length < size) {
+    length += snprintf(buffer + length, size - length, " first publish %lu ms", (unsigned long)publishMs);
+  }
+  if (length < 0) {
+    return 0;
+  }
+  return (size_t)length < size ? length : size - 1;
+}
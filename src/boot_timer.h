@@ -0,0 +1,54 @@
+#ifndef BOOT_TIMER_H
+#define BOOT_TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "telemetry.h"
+
+// In boot order, the connection ones in the order of ConnectionState
+enum BootPhase : uint8_t {
+  BOOT_INIT = 0,     //!< reset to the end of the serial and RTC setup
+  BOOT_STORAGE,      //!< file system, config, queue and history
+  BOOT_SENSORS,      //!< sonar pins and cycle
+  BOOT_MEASURE,      //!< first echoes of every tank
+  BOOT_NETWORK,      //!< WiFi started, HTTP server, TLS anchors, MQTT client
+  BOOT_WIFI,         //!< association, in the background from here on
+  BOOT_TIME_SYNC,    //!< NTP, nothing when the RTC kept the clock
+  BOOT_MQTT,         //!< TLS handshake and MQTT connect
+  BOOT_PHASES,
+};
+
+/*
+ * Durations of the steps from reset to the first publish. A phase ends
+ * where the previous one reached ended, the first one starts at reset, so
+ * they add up to the time to the first publish. Printed once and sent with
+ * the first telemetry message, a slow boot then shows in the cloud and not
+ * only on a serial console.
+ */
+class BootTimer {
+public:
+  BootTimer();
+
+  // Ends the phase, only the first time it is reached
+  void mark(BootPhase phase, uint32_t nowMs);
+  // The first message is out, nothing is recorded past it
+  void finish(uint32_t nowMs);
+
+  bool finished() const { return publishMs != 0; }
+  // 0 when the phase was not reached
+  uint32_t durationMs(BootPhase phase) const;
+  uint32_t firstPublishMs() const { return publishMs; }
+
+  static const char *phaseName(BootPhase phase);
+
+  // "boot_ms":[<phase>,...,nowMs], one per BootPhase then the total: fits next to the levels
+  void writeTelemetry(TelemetryWriter &writer, uint32_t nowMs) const;
+  // "Boot: <phase> ms, ..., first publish ms" with the phases reached, truncated to size
+  size_t format(char *buffer, size_t size) const;
+
+private:
+  uint32_t endsMs[BOOT_PHASES];   //!< 0 until reached
+  uint32_t publishMs;
+};
+
+#endif // BOOT_TIMER_H
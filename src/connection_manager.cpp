@@ -0,0 +1,135 @@
+#include "connection_manager.h"
+
+#include <string.h>
+
+ConnectionManager::ConnectionManager()
+  : state(CONN_WIFI), enteredMs(0), nextAttemptMs(0), attempts(0), reconnects(0), rng(1)
+{
+  memset(&hooks, 0, sizeof(hooks));
+  // WiFi.begin() restarts the association, give it time to finish
+  backoff[CONN_WIFI].minMs = 10000;
+  backoff[CONN_WIFI].maxMs = 120000;
+  backoff[CONN_TIME_SYNC].minMs = 2000;
+  backoff[CONN_TIME_SYNC].maxMs = 60000;
+  // https://cloud.google.com/iot/docs/requirements#managing_excessive_load
+  backoff[CONN_MQTT].minMs = 1000;
+  backoff[CONN_MQTT].maxMs = 120000;
+}
+
+const char *ConnectionManager::stateName(ConnectionState state)
+{
+  switch (state) {
+    case CONN_WIFI: return "wifi";
+    case CONN_TIME_SYNC: return "time_sync";
+    case CONN_MQTT: return "mqtt";
+    case CONN_CONNECTED: return "connected";
+  }
+  return "unknown";
+}
+
+void ConnectionManager::begin(const ConnectionHooks &hooks, uint32_t nowMs, uint32_t seed)
+{
+  this->hooks = hooks;
+  rng = seed ? seed : 1;
+  reconnects = 0;
+  enter(CONN_WIFI, nowMs);
+  // First attempt right away
+  nextAttemptMs = nowMs;
+}
+
+void ConnectionManager::setBackoff(ConnectionState state, const Backoff &backoff)
+{
+  if (state < CONN_CONNECTED) {
+    this->backoff[state] = backoff;
+  }
+}
+
+void ConnectionManager::deferAttempt(uint32_t nowMs, uint32_t delayMs)
+{
+  nextAttemptMs = nowMs + delayMs;
+}
+
+uint32_t ConnectionManager::nextRandom()
+{
+  // xorshift32, only used for jitter
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng;
+}
+
+void ConnectionManager::enter(ConnectionState next, uint32_t nowMs)
+{
+  state = next;
+  enteredMs = nowMs;
+  nextAttemptMs = nowMs;
+  attempts = 0;
+}
+
+void ConnectionManager::scheduleRetry(uint32_t nowMs)
+{
+  const Backoff &b = backoff[state];
+  uint32_t delay = b.minMs;
+  for (uint8_t i = 1; i < attempts && delay < b.maxMs; i++) {
+    delay *= 2;
+  }
+  if (delay > b.maxMs) {
+    delay = b.maxMs;
+  }
+  // Up to +50% jitter so a fleet rebooting together does not retry in lockstep
+  nextAttemptMs = nowMs + delay + nextRandom() % (delay / 2 + 1);
+}
+
+void ConnectionManager::tick(uint32_t nowMs)
+{
+  bool due = (int32_t)(nowMs - nextAttemptMs) >= 0;
+
+  switch (state) {
+    case CONN_WIFI:
+      if (hooks.wifiConnected(hooks.ctx)) {
+        enter(CONN_TIME_SYNC, nowMs);
+      } else if (due) {
+        hooks.wifiBegin(hooks.ctx);
+        attempts += attempts < UINT8_MAX;
+        scheduleRetry(nowMs);
+      }
+      break;
+
+    case CONN_TIME_SYNC:
+      if (!hooks.wifiConnected(hooks.ctx)) {
+        enter(CONN_WIFI, nowMs);
+      } else if (hooks.timeValid(hooks.ctx)) {
+        enter(CONN_MQTT, nowMs);
+      } else if (due) {
+        hooks.timeSyncBegin(hooks.ctx);
+        attempts += attempts < UINT8_MAX;
+        scheduleRetry(nowMs);
+      }
+      break;
+
+    case CONN_MQTT:
+      if (!hooks.wifiConnected(hooks.ctx)) {
+        enter(CONN_WIFI, nowMs);
+      } else if (hooks.mqttConnected(hooks.ctx)) {
+        enter(CONN_CONNECTED, nowMs);
+      } else if (due) {
+        attempts += attempts < UINT8_MAX;
+        if (hooks.mqttConnect(hooks.ctx)) {
+          enter(CONN_CONNECTED, nowMs);
+        } else {
+          scheduleRetry(nowMs);
+        }
+      }
+      break;
+
+    case CONN_CONNECTED:
+      if (!hooks.wifiConnected(hooks.ctx)) {
+        reconnects++;
+        enter(CONN_WIFI, nowMs);
+      } else if (!hooks.mqttConnected(hooks.ctx)) {
+        reconnects++;
+        enter(CONN_MQTT, nowMs);
+      }
+      break;
+  }
+}
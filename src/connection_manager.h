@@ -0,0 +1,72 @@
+#ifndef CONNECTION_MANAGER_H
+#define CONNECTION_MANAGER_H
+
+#include <stdint.h>
+
+enum ConnectionState : uint8_t {
+  CONN_WIFI = 0,     //!< waiting for the access point
+  CONN_TIME_SYNC,    //!< waiting for NTP, TLS and the JWT need the wall clock
+  CONN_MQTT,         //!< connecting to the Cloud IoT bridge
+  CONN_CONNECTED,
+};
+
+/*
+ * Board specific actions, all of them must return quickly. mqttConnect() is
+ * a single attempt, bounded by the MQTT client timeout.
+ */
+struct ConnectionHooks {
+  void *ctx;
+  bool (*wifiConnected)(void *ctx);
+  void (*wifiBegin)(void *ctx);
+  bool (*timeValid)(void *ctx);
+  void (*timeSyncBegin)(void *ctx);
+  bool (*mqttConnected)(void *ctx);
+  bool (*mqttConnect)(void *ctx);
+};
+
+struct Backoff {
+  uint32_t minMs;
+  uint32_t maxMs;
+};
+
+/*
+ * Brings up WiFi, then the clock, then MQTT, one tick() at a time from loop().
+ * Each step retries with exponential backoff plus jitter and a lost link
+ * drops back to the step that needs it. Nothing here waits, so loop()
+ * keeps running whatever the network does.
+ */
+class ConnectionManager {
+public:
+  ConnectionManager();
+
+  void begin(const ConnectionHooks &hooks, uint32_t nowMs, uint32_t seed = 1);
+  void setBackoff(ConnectionState state, const Backoff &backoff);
+  // An attempt started outside of the manager (fast WiFi reconnect) gets until nowMs + delayMs
+  void deferAttempt(uint32_t nowMs, uint32_t delayMs);
+  void tick(uint32_t nowMs);
+
+  ConnectionState getState() const { return state; }
+  const char *getStateName() const { return stateName(state); }
+  uint32_t timeInState(uint32_t nowMs) const { return nowMs - enteredMs; }
+  bool connected() const { return state == CONN_CONNECTED; }
+  uint8_t getAttempts() const { return attempts; }
+  uint32_t getReconnects() const { return reconnects; }
+
+  static const char *stateName(ConnectionState state);
+
+private:
+  void enter(ConnectionState next, uint32_t nowMs);
+  void scheduleRetry(uint32_t nowMs);
+  uint32_t nextRandom();
+
+  ConnectionHooks hooks;
+  Backoff backoff[CONN_CONNECTED];
+  ConnectionState state;
+  uint32_t enteredMs;
+  uint32_t nextAttemptMs;
+  uint8_t attempts;
+  uint32_t reconnects;
+  uint32_t rng;
+};
+
+#endif // CONNECTION_MANAGER_H
@@ -0,0 +1,151 @@
+#include "consumption.h"
+
+#include <string.h>
+
+#define SECONDS_PER_DAY 86400
+
+ConsumptionTracker::ConsumptionTracker()
+  : config(defaults())
+{
+  reset();
+}
+
+ConsumptionConfig ConsumptionTracker::defaults()
+{
+  ConsumptionConfig config;
+  config.tauS = 2 * SECONDS_PER_DAY;
+  config.warmupS = 6 * 3600;
+  config.maxGapS = 7 * SECONDS_PER_DAY;
+  // A few mm of ultrasonic jitter on a domestic tank is a few liters
+  config.noiseMl = 5000;
+  config.refillMinMl = 50000;
+  config.dropMinMl = 20000;
+  return config;
+}
+
+void ConsumptionTracker::configure(const ConsumptionConfig &config)
+{
+  this->config = config;
+}
+
+void ConsumptionTracker::reset()
+{
+  memset(&state, 0, sizeof(state));
+}
+
+// An episode that ends without an event was noise, it then feeds the rate
+// as a whole from the level before it, so the spike and its rebound cancel.
+void ConsumptionTracker::startEpisode(ConsumptionEpisode episode, uint32_t epoch, uint32_t volumeMl)
+{
+  if (state.episode == episode) {
+    return;
+  }
+  if (state.episode == EPISODE_NONE || state.reported) {
+    state.episodeEpoch = epoch;
+    state.episodeVolumeMl = volumeMl;
+  }
+  state.episode = episode;
+  state.reported = false;
+}
+
+int64_t ConsumptionTracker::expectedMl(uint32_t dt) const
+{
+  return state.rateMlPerDay > 0 ? (int64_t)state.rateMlPerDay * dt / SECONDS_PER_DAY : 0;
+}
+
+ConsumptionEvent ConsumptionTracker::update(uint32_t epoch, uint32_t volumeMl)
+{
+  if (state.lastEpoch == 0) {
+    state.lastEpoch = epoch;
+    state.lastVolumeMl = volumeMl;
+    return CONSUMPTION_NONE;
+  }
+  if (epoch <= state.lastEpoch) {
+    return CONSUMPTION_NONE;
+  }
+
+  uint32_t dt = epoch - state.lastEpoch;
+  int32_t delta = (int32_t)(volumeMl - state.lastVolumeMl);
+  uint32_t previousEpoch = state.lastEpoch;
+  uint32_t previousVolumeMl = state.lastVolumeMl;
+  state.lastEpoch = epoch;
+  state.lastVolumeMl = volumeMl;
+
+  ConsumptionEvent event = CONSUMPTION_NONE;
+  if (delta > (int32_t)config.noiseMl) {
+    // A delivery spans several levels when they are close together
+    startEpisode(EPISODE_RISING, previousEpoch, previousVolumeMl);
+    int32_t rise = (int32_t)(volumeMl - state.episodeVolumeMl);
+    state.episodeMl = rise > 0 ? rise : 0;
+    if (!state.reported && state.episodeMl >= config.refillMinMl) {
+      state.reported = true;
+      state.refills++;
+      state.lastRefillEpoch = epoch;
+      event = CONSUMPTION_REFILL;
+    }
+    if (state.reported) {
+      state.lastRefillMl = state.episodeMl;
+    }
+    return event;
+  }
+
+  if (-(int64_t)delta - expectedMl(dt) > (int64_t)config.noiseMl) {
+    // Kept out of the rate, a theft is not a burn
+    startEpisode(EPISODE_DROPPING, previousEpoch, previousVolumeMl);
+    int64_t excess = (int64_t)(int32_t)(state.episodeVolumeMl - volumeMl) - expectedMl(epoch - state.episodeEpoch);
+    state.episodeMl = excess > 0 ? (uint32_t)excess : 0;
+    if (!state.reported && state.episodeMl >= config.dropMinMl) {
+      state.reported = true;
+      state.drops++;
+      event = CONSUMPTION_DROP;
+    }
+    return event;
+  }
+
+  if (state.episode != EPISODE_NONE && !state.reported) {
+    delta = (int32_t)(volumeMl - state.episodeVolumeMl);
+    dt = epoch - state.episodeEpoch;
+  }
+  state.episode = EPISODE_NONE;
+  if (dt <= config.maxGapS) {
+    feedRate(-delta, dt);
+  }
+  return CONSUMPTION_NONE;
+}
+
+void ConsumptionTracker::feedRate(int32_t consumedMl, uint32_t dt)
+{
+  // Time weighted EWMA, alpha = dt / (span + dt). The span grows with the
+  // observation so the first hours are a plain average, not biased to 0.
+  int64_t sample = (int64_t)consumedMl * SECONDS_PER_DAY / dt;
+  uint32_t span = state.observedS < config.tauS ? state.observedS : config.tauS;
+  state.rateMlPerDay += (int32_t)((sample - state.rateMlPerDay) * dt / ((int64_t)span + dt));
+  state.observedS = span + dt < config.tauS ? span + dt : config.tauS;
+}
+
+int32_t ConsumptionTracker::daysUntilEmptyTenths() const
+{
+  if (!ready() || state.rateMlPerDay <= 0) {
+    return -1;
+  }
+  return (int32_t)((uint64_t)state.lastVolumeMl * 10 / state.rateMlPerDay);
+}
+
+void consumptionWriteTelemetry(TelemetryWriter &payload, const ConsumptionTracker &tracker)
+{
+  const ConsumptionState &state = tracker.getState();
+  payload.addUInt("refills", state.refills);
+  payload.addUInt("abnormal_drops", state.drops);
+  if (state.lastRefillEpoch) {
+    payload.addUInt("last_refill_time", state.lastRefillEpoch);
+    payload.addInt("last_refill_in_liters", (state.lastRefillMl + 500) / 1000);
+  }
+  if (!tracker.ready()) {
+    return;
+  }
+  payload.addFixed("burn_rate_in_liters_per_day", tracker.rateMlPerDay(), 3);
+  int32_t days = tracker.daysUntilEmptyTenths();
+  if (days >= 0) {
+    payload.addFixed("days_until_empty", days, 1);
+  }
+}
@@ -0,0 +1,90 @@
+#ifndef CONSUMPTION_H
+#define CONSUMPTION_H
+
+#include <stdint.h>
+#include "telemetry.h"
+
+// Integer only and O(1) per level: the history is folded into a time
+// weighted EWMA of the burn rate, a refill or a theft into one running episode.
+
+enum ConsumptionEvent : uint8_t {
+  CONSUMPTION_NONE = 0,
+  CONSUMPTION_REFILL,        //!< the level rose by more than refillMinMl
+  CONSUMPTION_DROP,          //!< fell faster than the burn rate explains (leak, theft)
+};
+
+struct ConsumptionConfig {
+  uint32_t tauS;             //!< time constant of the burn rate
+  uint32_t warmupS;          //!< observation needed before the rate is trusted
+  uint32_t maxGapS;          //!< longer gaps do not feed the rate
+  uint32_t noiseMl;          //!< level changes below this are measurement noise
+  uint32_t refillMinMl;
+  uint32_t dropMinMl;        //!< beyond the expected consumption
+};
+
+enum ConsumptionEpisode : uint8_t {
+  EPISODE_NONE = 0,
+  EPISODE_RISING,
+  EPISODE_DROPPING,
+};
+
+/*
+ * Everything the tracker knows, small enough for an RTC slot so deep sleep
+ * does not restart the learning. crc is only used by the RTC copy.
+ */
+struct ConsumptionState {
+  uint32_t crc;
+  uint32_t lastEpoch;        //!< 0 before the first level
+  uint32_t lastVolumeMl;
+  int32_t rateMlPerDay;      //!< positive when burning
+  uint32_t observedS;        //!< fed to the rate, capped at tauS
+  uint32_t episodeEpoch;     //!< last level before the running episode
+  uint32_t episodeVolumeMl;
+  uint32_t episodeMl;        //!< rise, or drop beyond the expected consumption, so far
+  uint32_t lastRefillEpoch;
+  uint32_t lastRefillMl;
+  uint16_t refills;
+  uint16_t drops;
+  ConsumptionEpisode episode;
+  bool reported;             //!< the event of the running episode was returned
+  uint8_t reserved[2];
+};
+
+class ConsumptionTracker {
+public:
+  ConsumptionTracker();
+
+  void configure(const ConsumptionConfig &config);
+  const ConsumptionConfig &getConfig() const { return config; }
+  void reset();
+
+  // epoch in seconds, levels older than the last one are ignored. Returns
+  // the event once per episode, when it crosses its threshold.
+  ConsumptionEvent update(uint32_t epoch, uint32_t volumeMl);
+
+  bool ready() const { return state.observedS >= config.warmupS; }
+  int32_t rateMlPerDay() const { return state.rateMlPerDay; }
+  // Tenths of a day left at the current rate, -1 while unknown or not burning
+  int32_t daysUntilEmptyTenths() const;
+  // Size of the episode that raised the last event
+  uint32_t episodeMl() const { return state.episodeMl; }
+
+  // Saved and restored as is, see RTC_SLOT_CONSUMPTION
+  ConsumptionState &getState() { return state; }
+  const ConsumptionState &getState() const { return state; }
+
+  static ConsumptionConfig defaults();
+
+private:
+  void feedRate(int32_t consumedMl, uint32_t dt);
+  void startEpisode(ConsumptionEpisode episode, uint32_t epoch, uint32_t volumeMl);
+  int64_t expectedMl(uint32_t dt) const;
+
+  ConsumptionConfig config;
+  ConsumptionState state;
+};
+
+// Consumption fields of the telemetry message, only once the rate is trusted
+void consumptionWriteTelemetry(TelemetryWriter &payload, const ConsumptionTracker &tracker);
+
+#endif // CONSUMPTION_H
@@ -0,0 +1,173 @@
+#include "filters.h"
+
+///////////////////////////////
+// MedianFilter
+///////////////////////////////
+void MedianFilter::setWindow(uint8_t window)
+{
+  if (window < 1) {
+    window = 1;
+  }
+  if (window > FILTER_MAX_MEDIAN) {
+    window = FILTER_MAX_MEDIAN;
+  }
+  this->window = window;
+  reset();
+}
+
+uint8_t MedianFilter::lowerBound(int32_t value, uint8_t n) const
+{
+  uint8_t lo = 0;
+  uint8_t hi = n;
+  while (lo < hi) {
+    uint8_t mid = (lo + hi) / 2;
+    if (sorted[mid] < value) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+void MedianFilter::removeSorted(int32_t value, uint8_t n)
+{
+  for (uint8_t i = lowerBound(value, n); i + 1 < n; i++) {
+    sorted[i] = sorted[i + 1];
+  }
+}
+
+void MedianFilter::insertSorted(int32_t value, uint8_t n)
+{
+  uint8_t pos = lowerBound(value, n);
+  for (uint8_t i = n; i > pos; i--) {
+    sorted[i] = sorted[i - 1];
+  }
+  sorted[pos] = value;
+}
+
+int32_t MedianFilter::push(int32_t value)
+{
+  if (window == 1) {
+    return value;
+  }
+
+  if (arrivals.size() >= window) {
+    int32_t oldest = 0;
+    arrivals.pop(oldest);
+    removeSorted(oldest, arrivals.size() + 1);
+  }
+
+  insertSorted(value, arrivals.size());
+  arrivals.push(value);
+
+  return sorted[arrivals.size() / 2];
+}
+
+///////////////////////////////
+// FilterChain
+///////////////////////////////
+FilterChain::FilterChain()
+{
+  configure(defaults());
+}
+
+FilterConfig FilterChain::defaults()
+{
+  FilterConfig config;
+  config.medianWindow = 5;
+  config.outlierSigma = 3;
+  config.outlierMaxRejects = 5;
+  config.outlierMinBand = 60;   // ~1 cm of echo time
+  config.smoothing = FILTER_EWMA;
+  config.ewmaShift = 3;
+  config.kalmanQ = 4;
+  config.kalmanR = 400;
+  return config;
+}
+
+void FilterChain::configure(const FilterConfig &config)
+{
+  this->config = config;
+  median.setWindow(config.medianWindow);
+  reset();
+}
+
+void FilterChain::reset()
+{
+  median.reset();
+  estimate.value = 0;
+  estimate.variance = 0;
+  estimate.samples = 0;
+  estimate.rejected = 0;
+  valueQ8 = 0;
+  consecutiveRejects = 0;
+}
+
+bool FilterChain::isOutlier(int32_t value) const
+{
+  if (config.outlierSigma == 0 || estimate.samples == 0) {
+    return false;
+  }
+
+  // Compare squares, no sqrt needed
+  int64_t delta = (int64_t)value - estimate.value;
+  uint64_t delta2 = (uint64_t)(delta * delta);
+  uint64_t band2 = (uint64_t)config.outlierMinBand * config.outlierMinBand;
+  uint64_t sigma2 = (uint64_t)config.outlierSigma * config.outlierSigma * estimate.variance;
+
+  return delta2 > (sigma2 > band2 ? sigma2 : band2);
+}
+
+void FilterChain::smooth(int32_t value)
+{
+  if (estimate.samples == 0 || config.smoothing == FILTER_NONE) {
+    valueQ8 = value * 256;
+    estimate.value = value;
+    estimate.samples++;
+    return;
+  }
+
+  int64_t residual = (int64_t)value - estimate.value;
+  uint64_t residual2 = (uint64_t)(residual * residual);
+  if (residual2 > UINT32_MAX) {
+    residual2 = UINT32_MAX;
+  }
+
+  if (config.smoothing == FILTER_EWMA) {
+    valueQ8 += (value * 256 - valueQ8) >> config.ewmaShift;
+    int64_t variance = estimate.variance;
+    variance += ((int64_t)residual2 - variance) >> config.ewmaShift;
+    estimate.variance = (uint32_t)variance;
+  } else {
+    // Scalar Kalman, P is kept in estimate.variance and the gain in Q16
+    uint64_t p = (uint64_t)estimate.variance + config.kalmanQ;
+    uint32_t gain = (uint32_t)((p << 16) / (p + config.kalmanR));
+    valueQ8 += (int32_t)(((int64_t)(value * 256 - valueQ8) * gain) >> 16);
+    p = (p * (65536 - gain)) >> 16;
+    estimate.variance = p > UINT32_MAX ? UINT32_MAX : (uint32_t)p;
+  }
+
+  estimate.value = (valueQ8 + 128) >> 8;
+  estimate.samples++;
+}
+
+bool FilterChain::push(int32_t value)
+{
+  int32_t filtered = median.push(value);
+
+  if (isOutlier(filtered)) {
+    estimate.rejected++;
+    if (++consecutiveRejects <= config.outlierMaxRejects) {
+      return false;
+    }
+    // The level really moved (refill), restart from the new value
+    uint32_t rejected = estimate.rejected;
+    reset();
+    estimate.rejected = rejected;
+  }
+
+  consecutiveRejects = 0;
+  smooth(filtered);
+  return true;
+}
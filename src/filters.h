@@ -0,0 +1,88 @@
+#ifndef FILTERS_H
+#define FILTERS_H
+
+#include <stdint.h>
+#include "ring_buffer.h"
+
+// Integer only, the ESP8266 has no FPU. Every stage is O(1) per sample except
+// the median (binary search plus a shift of at most FILTER_MAX_MEDIAN words).
+
+#define FILTER_MAX_MEDIAN 9   //!< largest median window
+
+enum FilterSmoothing : uint8_t {
+  FILTER_NONE = 0,
+  FILTER_EWMA,
+  FILTER_KALMAN,
+};
+
+struct FilterConfig {
+  uint8_t medianWindow;        //!< 1 disables the median stage
+  uint8_t outlierSigma;        //!< reject beyond this many std deviations, 0 disables
+  uint16_t outlierMaxRejects;  //!< accept anyway after that many rejects in a row (real step)
+  uint32_t outlierMinBand;     //!< never reject within this distance of the estimate
+  FilterSmoothing smoothing;
+  uint8_t ewmaShift;           //!< alpha = 1 / 2^shift
+  uint32_t kalmanQ;            //!< process noise, in value^2
+  uint32_t kalmanR;            //!< measurement noise, in value^2
+};
+
+struct FilterEstimate {
+  int32_t value;      //!< filtered value
+  uint32_t variance;  //!< spread of the accepted samples around the estimate, in value^2
+  uint32_t samples;   //!< samples accepted since reset
+  uint32_t rejected;  //!< samples rejected as outliers since reset
+};
+
+/*
+ * Running median over the last N samples.
+ * Keeps the window twice: in arrival order to know what to evict, and sorted.
+ */
+class MedianFilter {
+public:
+  MedianFilter() : window(1) {}
+
+  void setWindow(uint8_t window);
+  int32_t push(int32_t value);
+  void reset() { arrivals.clear(); }
+
+private:
+  void removeSorted(int32_t value, uint8_t n);
+  void insertSorted(int32_t value, uint8_t n);
+  uint8_t lowerBound(int32_t value, uint8_t n) const;
+
+  uint8_t window;
+  RingBuffer<int32_t, FILTER_MAX_MEDIAN> arrivals;
+  int32_t sorted[FILTER_MAX_MEDIAN];
+};
+
+/*
+ * Median -> outlier rejection -> EWMA or scalar Kalman.
+ */
+class FilterChain {
+public:
+  FilterChain();
+
+  void configure(const FilterConfig &config);
+  const FilterConfig &getConfig() const { return config; }
+  void reset();
+
+  // Returns false when the sample was rejected as an outlier.
+  bool push(int32_t value);
+
+  bool ready() const { return estimate.samples > 0; }
+  const FilterEstimate &getEstimate() const { return estimate; }
+
+  static FilterConfig defaults();
+
+private:
+  bool isOutlier(int32_t value) const;
+  void smooth(int32_t value);
+
+  FilterConfig config;
+  MedianFilter median;
+  FilterEstimate estimate;
+  int32_t valueQ8;           //!< estimate with 8 fractional bits, avoids truncation drift
+  uint16_t consecutiveRejects;
+};
+
+#endif // FILTERS_H
@@ -0,0 +1,113 @@
+#include "geometry.h"
+
+#include <math.h>
+#include <string.h>
+
+static const char *const SHAPE_NAMES[] = {
+  "rectangular",
+  "horizontal_cylinder",
+  "vertical_cylinder",
+  "table",
+};
+
+TankGeometry::TankGeometry()
+  : count(0)
+{
+  memset(points, 0, sizeof(points));
+}
+
+const char *TankGeometry::shapeName(TankShape shape)
+{
+  return shape <= TANK_STRAPPING ? SHAPE_NAMES[shape] : "unknown";
+}
+
+bool TankGeometry::parseShape(const char *name, TankShape &shape)
+{
+  for (uint8_t i = 0; i <= TANK_STRAPPING; i++) {
+    if (strcmp(name, SHAPE_NAMES[i]) == 0) {
+      shape = (TankShape)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Straight walls are exact with the two ends
+void TankGeometry::rectangular(uint32_t heightMm, uint32_t lengthMm, uint32_t widthMm)
+{
+  points[0].levelMm = 0;
+  points[0].volumeMl = 0;
+  points[1].levelMm = heightMm;
+  points[1].volumeMl = (uint64_t)heightMm * lengthMm * widthMm / 1000;
+  count = heightMm > 0 ? 2 : 0;
+}
+
+void TankGeometry::verticalCylinder(uint32_t diameterMm, uint32_t heightMm)
+{
+  points[0].levelMm = 0;
+  points[0].volumeMl = 0;
+  points[1].levelMm = heightMm;
+  points[1].volumeMl = M_PI * diameterMm * diameterMm / 4 * heightMm / 1000 + 0.5;
+  count = heightMm > 0 ? 2 : 0;
+}
+
+// Circular segment area times the length, sampled at even levels
+void TankGeometry::horizontalCylinder(uint32_t diameterMm, uint32_t lengthMm)
+{
+  if (diameterMm == 0) {
+    count = 0;
+    return;
+  }
+  double r = diameterMm / 2.0;
+  for (uint8_t i = 0; i < GEOMETRY_POINTS; i++) {
+    uint32_t level = (uint64_t)diameterMm * i / (GEOMETRY_POINTS - 1);
+    double h = level;
+    double area = r * r * acos((r - h) / r) - (r - h) * sqrt(2 * r * h - h * h);
+    points[i].levelMm = level;
+    points[i].volumeMl = area * lengthMm / 1000 + 0.5;
+  }
+  count = GEOMETRY_POINTS;
+}
+
+bool TankGeometry::strapping(const GeometryPoint *table, uint8_t n)
+{
+  count = 0;
+  if (n < 2 || n > GEOMETRY_POINTS) {
+    return false;
+  }
+  for (uint8_t i = 1; i < n; i++) {
+    if (table[i].levelMm <= table[i - 1].levelMm || table[i].volumeMl < table[i - 1].volumeMl) {
+      return false;
+    }
+  }
+  memcpy(points, table, n * sizeof(GeometryPoint));
+  count = n;
+  return true;
+}
+
+uint32_t TankGeometry::volumeMl(uint32_t levelMm) const
+{
+  if (count < 2 || levelMm <= points[0].levelMm) {
+    return count ? points[0].volumeMl : 0;
+  }
+  if (levelMm >= points[count - 1].levelMm) {
+    return points[count - 1].volumeMl;
+  }
+
+  // Last point at or below the level
+  uint8_t low = 0;
+  uint8_t high = count - 1;
+  while (high - low > 1) {
+    uint8_t mid = (low + high) / 2;
+    if (points[mid].levelMm <= levelMm) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+
+  const GeometryPoint &a = points[low];
+  const GeometryPoint &b = points[high];
+  return a.volumeMl + (uint32_t)((uint64_t)(b.volumeMl - a.volumeMl) * (levelMm - a.levelMm) /
+                                 (b.levelMm - a.levelMm));
+}
@@ -0,0 +1,55 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#include <stdint.h>
+
+// Built once per config, then every lookup is a binary search and one
+// integer interpolation: no float and no trig per sample.
+
+#define GEOMETRY_POINTS 65   //!< table size, enough for a cylinder within 0.1 %
+
+enum TankShape : uint8_t {
+  TANK_RECTANGULAR = 0,
+  TANK_HORIZONTAL_CYLINDER,
+  TANK_VERTICAL_CYLINDER,
+  TANK_STRAPPING,            //!< calibration table measured on the tank
+};
+
+struct GeometryPoint {
+  uint32_t levelMm;
+  uint32_t volumeMl;
+};
+
+/*
+ * Level to volume conversion table. Levels are strictly increasing and
+ * volumes never decrease, the volume is linear between two points.
+ */
+class TankGeometry {
+public:
+  TankGeometry();
+
+  void rectangular(uint32_t heightMm, uint32_t lengthMm, uint32_t widthMm);
+  void horizontalCylinder(uint32_t diameterMm, uint32_t lengthMm);
+  void verticalCylinder(uint32_t diameterMm, uint32_t heightMm);
+  // False when the points are not ordered, the table is then left empty
+  bool strapping(const GeometryPoint *points, uint8_t count);
+
+  // 0 below the first point, the capacity above the last one
+  uint32_t volumeMl(uint32_t levelMm) const;
+
+  bool empty() const { return count < 2; }
+  uint8_t size() const { return count; }
+  uint32_t heightMm() const { return count ? points[count - 1].levelMm : 0; }
+  uint32_t capacityMl() const { return count ? points[count - 1].volumeMl : 0; }
+  const GeometryPoint &point(uint8_t index) const { return points[index]; }
+
+  static const char *shapeName(TankShape shape);
+  // False for an unknown name
+  static bool parseShape(const char *name, TankShape &shape);
+
+private:
+  GeometryPoint points[GEOMETRY_POINTS];
+  uint8_t count;
+};
+
+#endif // GEOMETRY_H
@@ -26,6 +26,85 @@
 #endif
 
 // This file contains static methods for API requests using Wifi / MQTT
+
+///////////////////////////////
+// Connection caching shared by all boards
+///////////////////////////////
+#include <Arduino.h>
+#include <time.h>
+#include "../rtc_state.h"
+#include "../connection_manager.h"
+#include "../tls_profile.h"
+
+// Set to 0 to sign a JWT and run a full TLS handshake on every connect (A/B timing)
+#ifndef MQTT_CONNECT_CACHE
+#define MQTT_CONNECT_CACHE 1
+#endif
+
+// Sign a new JWT this long before the cached one expires
+#define JWT_REFRESH_MARGIN_SECS 300
+
+// Long-term service endpoint, its chain ends at primary_ca or backup_ca
+#define MQTT_LTS_HOST "mqtt.2030.ltsapis.goog"
+#define MQTT_LTS_PORT 8883
+
+struct MqttConnectStats {
+  uint32_t connects;       // MQTT connections opened
+  uint32_t tlsResumed;     // of which resumed a TLS session (ESP8266 only)
+  uint32_t jwtSigned;      // ECDSA signatures computed
+  uint32_t jwtReused;      // JWT served from the cache
+  uint32_t lastSignMs;     // CPU time of the last signature
+  uint32_t lastConnectMs;  // last connect latency, JWT and TLS handshake included
+  uint32_t lastHeapBytes;  // heap held by the last connection
+  uint16_t fragmentLength; // TLS fragment length negotiated, 0 = full 16 kB records
+};
+MqttConnectStats connectStats;
+
+// Kept in RTC memory so a deep sleep does not cost a new signature
+struct RtcJwt {
+  uint32_t crc;
+  uint32_t iat;
+  char token[RTC_MEMORY_SIZE - RTC_SLOT_JWT - 8];
+};
+
+bool jwtExpiring(time_t now, unsigned long iat, int expSecs) {
+  return now < (time_t)iat || now >= (time_t)(iat + expSecs - JWT_REFRESH_MARGIN_SECS);
+}
+
+bool jwtCacheValid(time_t now, unsigned long iat, int expSecs, const String &jwt) {
+  return MQTT_CONNECT_CACHE && jwt.length() > 0 && !jwtExpiring(now, iat, expSecs);
+}
+
+void jwtCacheSave(unsigned long iat, const String &jwt) {
+  RtcJwt saved;
+  if (jwt.length() >= sizeof(saved.token)) {
+    return;
+  }
+  saved.iat = iat;
+  memset(saved.token, 0, sizeof(saved.token));
+  memcpy(saved.token, jwt.c_str(), jwt.length());
+  rtcSave(RTC_SLOT_JWT, &saved, sizeof(saved));
+}
+
+void jwtCacheRestore(unsigned long &iat, String &jwt) {
+  RtcJwt saved;
+  if (MQTT_CONNECT_CACHE && rtcLoad(RTC_SLOT_JWT, &saved, sizeof(saved))) {
+    saved.token[sizeof(saved.token) - 1] = '\0';
+    iat = saved.iat;
+    jwt = saved.token;
+  }
+}
+
+// WiFi -> NTP -> MQTT, driven from loop() (ESP boards)
+ConnectionManager connection;
+void setupConnection();
+bool mqttConnectOnce();
+
+// The library builds these as Strings on every publish and connect, kept here once (ESP boards)
+char eventsTopic[64];
+char clientId[192];
+void setupTopics();
+
 #ifdef __MKR1000_MQTT_H__
 #include <WiFi101.h>
 #include <WiFiSSLClient.h>
@@ -48,15 +127,19 @@ String jwt;
 ///////////////////////////////
 // Helpers specific to this board
 ///////////////////////////////
-String getDefaultSensor() {
-  return  "Wifi: " + String(WiFi.RSSI()) + "db";
-}
-
 String getJwt() {
+  if (jwtCacheValid(WiFi.getTime(), iat, jwt_exp_secs, jwt)) {
+    connectStats.jwtReused++;
+    return jwt;
+  }
   // Disable software watchdog as these operations can take a while.
   Serial.println("Refreshing JWT");
   iat = WiFi.getTime();
+  unsigned long start = millis();
   jwt = device->createJWT(iat, jwt_exp_secs);
+  connectStats.lastSignMs = millis() - start;
+  connectStats.jwtSigned++;
+  jwtCacheSave(iat, jwt);
   return jwt;
 }
 
@@ -88,17 +171,30 @@ void connectWifi() {
 ///////////////////////////////
 void connect() {
   connectWifi();
+  unsigned long start = millis();
   mqtt->mqttConnect();
+  connectStats.lastConnectMs = millis() - start;
+  connectStats.connects++;
+  Serial.print("MQTT connect ms: ");
+  Serial.println(connectStats.lastConnectMs);
 }
 
 bool publishTelemetry(String data) {
   return mqtt->publishTelemetry(data);
 }
 
+bool publishTelemetry(const char* data, int length) {
+  return mqtt->publishTelemetry(data, length);
+}
+
 bool publishTelemetry(String subfolder, String data) {
   return mqtt->publishTelemetry(subfolder, data);
 }
 
+bool publishTelemetry(String subfolder, const char* data, int length) {
+  return mqtt->publishTelemetry(subfolder, data, length);
+}
+
 void setupCloudIoT() {
   device = new CloudIoTCoreDevice(
       project_id, location, registry_id, device_id,
@@ -107,6 +203,8 @@ void setupCloudIoT() {
   setupWifi();
   netClient = new WiFiSSLClient();
 
+  jwtCacheRestore(iat, jwt);
+
   mqttClient = new MQTTClient(512);
   mqttClient->setOptions(180, true, 1000); // keepAlive, cleanSession, timeout
   mqtt = new CloudIoTCoreMqtt(mqttClient, netClient, device);
@@ -127,7 +225,7 @@ void setupCloudIoT() {
 #include "ciotc_config.h" // Update this file with your configuration
 
 // Initialize WiFi and MQTT for this board
-Client *netClient;
+WiFiClientSecure *netClient;
 CloudIoTCoreDevice *device;
 CloudIoTCoreMqtt *mqtt;
 MQTTClient *mqttClient;
@@ -137,57 +235,47 @@ String jwt;
 ///////////////////////////////
 // Helpers specific to this board
 ///////////////////////////////
-String getDefaultSensor() {
-  return  "Wifi: " + String(WiFi.RSSI()) + "db";
-}
-
-String getJwt() {
+const char *getJwt() {
+  if (jwtCacheValid(time(nullptr), iat, jwt_exp_secs, jwt)) {
+    connectStats.jwtReused++;
+    return jwt.c_str();
+  }
   iat = time(nullptr);
   Serial.println("Refreshing JWT");
+  unsigned long start = millis();
   jwt = device->createJWT(iat, jwt_exp_secs);
-  return jwt;
+  connectStats.lastSignMs = millis() - start;
+  connectStats.jwtSigned++;
+  jwtCacheSave(iat, jwt);
+  return jwt.c_str();
 }
 
 void setupWifi() {
-  Serial.println("Starting wifi");
-
+  // The association and the time sync are then followed by the connection manager
   WiFi.mode(WIFI_STA);
   // WiFi.setSleep(false); // May help with disconnect? Seems to have been removed from WiFi
-  WiFi.begin(ssid, password);
-  Serial.println("Connecting to WiFi");
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(100);
-  }
-
   configTime(0, 0, ntp_primary, ntp_secondary);
-  Serial.println("Waiting on time sync...");
-  while (time(nullptr) < 1510644967) {
-    delay(10);
-  }
-}
-
-void connectWifi() {
-  Serial.print("checking wifi...");
-  while (WiFi.status() != WL_CONNECTED) {
-    Serial.print(".");
-    delay(1000);
-  }
 }
 
 ///////////////////////////////
 // Orchestrates various methods from preceeding code.
 ///////////////////////////////
-bool publishTelemetry(String data) {
-  return mqtt->publishTelemetry(data);
-}
-
-bool publishTelemetry(String subfolder, String data) {
-  return mqtt->publishTelemetry(subfolder, data);
-}
-
-void connect() {
-  connectWifi();
-  mqtt->mqttConnect();
+// A single attempt, retries are up to the connection manager
+bool connect() {
+  connectStats.fragmentLength = tlsConfigure(*netClient, TLS_MQTT, MQTT_LTS_HOST, MQTT_LTS_PORT);
+  uint32_t freeHeap = ESP.getFreeHeap();
+  unsigned long start = millis();
+  bool connected = mqttConnectOnce();
+  connectStats.lastConnectMs = millis() - start;
+  connectStats.connects += connected;
+  if (connected) {
+    // The heap can grow across the connect, never report that as a wrapped cost
+    uint32_t heapAfter = ESP.getFreeHeap();
+    connectStats.lastHeapBytes = freeHeap > heapAfter ? freeHeap - heapAfter : 0;
+  }
+  Serial.printf("MQTT connect: %lu ms, JWT signed %lu / reused %lu\n",
+      (unsigned long)connectStats.lastConnectMs, (unsigned long)connectStats.jwtSigned, (unsigned long)connectStats.jwtReused);
+  return connected;
 }
 
 void setupCloudIoT() {
@@ -197,10 +285,15 @@ void setupCloudIoT() {
 
   setupWifi();
   netClient = new WiFiClientSecure();
+  jwtCacheRestore(iat, jwt);
+
   mqttClient = new MQTTClient(512);
   mqttClient->setOptions(180, true, 1000); // keepAlive, cleanSession, timeout
   mqtt = new CloudIoTCoreMqtt(mqttClient, netClient, device);
+  mqtt->setUseLts(true); // the trust anchors are the LTS roots
   mqtt->startMQTT();
+  setupTopics();
+  setupConnection();
 }
 #endif //__ESP32_MQTT_H__
 
@@ -222,7 +315,7 @@ void setupCloudIoT() {
 // Initialize WiFi and MQTT for this board
 MQTTClient *mqttClient;
 BearSSL::WiFiClientSecure *netClient;
-BearSSL::X509List certList;
+BearSSL::Session tlsSession;
 CloudIoTCoreDevice *device;
 CloudIoTCoreMqtt *mqtt;
 unsigned long iat = 0;
@@ -231,73 +324,99 @@ String jwt;
 ///////////////////////////////
 // Helpers specific to this board
 ///////////////////////////////
-String getDefaultSensor() {
-  return  "Wifi: " + String(WiFi.RSSI()) + "db";
-}
-
-String getJwt() {
+const char *getJwt() {
+  if (jwtCacheValid(time(nullptr), iat, jwt_exp_secs, jwt)) {
+    connectStats.jwtReused++;
+    return jwt.c_str();
+  }
   // Disable software watchdog as these operations can take a while.
   ESP.wdtDisable();
   iat = time(nullptr);
   Serial.println("Refreshing JWT");
+  unsigned long start = millis();
   jwt = device->createJWT(iat, jwt_exp_secs);
+  connectStats.lastSignMs = millis() - start;
+  connectStats.jwtSigned++;
   ESP.wdtEnable(0);
-  return jwt;
+  jwtCacheSave(iat, jwt);
+  return jwt.c_str();
+}
+
+// TLS session kept in RTC memory, a resumed handshake skips the ECDHE and certificate checks.
+// Session only wraps the BearSSL parameters, behind a private accessor, so it is copied whole.
+struct RtcTlsSession {
+  uint32_t crc;
+  uint8_t session[(sizeof(BearSSL::Session) + 3) & ~3];
+};
+static_assert(RTC_SLOT_TLS + sizeof(RtcTlsSession) <= RTC_SLOT_JWT, "TLS session overflows its RTC slot");
+
+void tlsSessionRestore() {
+  RtcTlsSession saved;
+  if (MQTT_CONNECT_CACHE && rtcLoad(RTC_SLOT_TLS, &saved, sizeof(saved))) {
+    memcpy((void *)&tlsSession, saved.session, sizeof(tlsSession));
+  }
+}
+
+void tlsSessionSave() {
+  RtcTlsSession saved = {};
+  memcpy(saved.session, (const void *)&tlsSession, sizeof(tlsSession));
+  rtcSave(RTC_SLOT_TLS, &saved, sizeof(saved));
 }
 
 void setupCert() {
-  // Set CA cert on wifi client
-  // If using a static (pem) cert, uncomment in ciotc_config.h:
-  certList.append(primary_ca);
-  certList.append(backup_ca);
-  netClient->setTrustAnchors(&certList);
+  // Trust anchors and buffer sizes come from the shared TLS profile on each connect
+#if MQTT_CONNECT_CACHE
+  tlsSessionRestore();
+#endif
   return;
 }
 
 void setupWifi() {
+  // The association and the time sync are then followed by the connection manager
   WiFi.mode(WIFI_STA);
-  WiFi.begin(ssid, password);
-  Serial.println("Connecting to WiFi");
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(100);
-  }
-
   configTime(0, 0, ntp_primary, ntp_secondary);
-  Serial.println("Waiting on time sync...");
-  while (time(nullptr) < 1510644967) {
-    delay(10);
-  }
-}
-
-void connectWifi() {
-  Serial.print("checking wifi..."); // TODO: Necessary?
-  while (WiFi.status() != WL_CONNECTED) {
-    Serial.print(".");
-    delay(1000);
-  }
 }
 
 ///////////////////////////////
 // Orchestrates various methods from preceeding code.
 ///////////////////////////////
-bool publishTelemetry(String data) {
-  return mqtt->publishTelemetry(data);
-}
-
-bool publishTelemetry(const char* data, int length) {
-  return mqtt->publishTelemetry(data, length);
-}
-
-bool publishTelemetry(String subfolder, String data) {
-  return mqtt->publishTelemetry(subfolder, data);
-}
-
-bool publishTelemetry(String subfolder, const char* data, int length) {
-  return mqtt->publishTelemetry(subfolder, data, length);
-}
-
-void connect() {
-  mqtt->mqttConnect();
+// A single attempt, retries are up to the connection manager
+bool connect() {
+  // A full handshake gives the session a new id and master secret, a resumed one leaves it as it was
+  static const BearSSL::Session none;
+  uint8_t before[sizeof(BearSSL::Session)];
+  memcpy(before, (const void *)&tlsSession, sizeof(before));
+
+  // Fragment length probed earlier by tlsProbePending(), full records until then
+  connectStats.fragmentLength = tlsConfigure(*netClient, TLS_MQTT, MQTT_LTS_HOST, MQTT_LTS_PORT);
+#if MQTT_CONNECT_CACHE
+  // Kept across deep sleep, unlike the profile's own session
+  netClient->setSession(&tlsSession);
+#endif
+  uint32_t freeHeap = ESP.getFreeHeap();
+  unsigned long start = millis();
+  bool connected = mqttConnectOnce();
+  connectStats.lastConnectMs = millis() - start;
+  if (!connected) {
+    return false;
+  }
+  connectStats.connects++;
+  uint32_t heapAfter = ESP.getFreeHeap();
+  connectStats.lastHeapBytes = freeHeap > heapAfter ? freeHeap - heapAfter : 0;
+
+  bool resumed = MQTT_CONNECT_CACHE && memcmp(before, (const void *)&none, sizeof(before)) != 0 &&
+                 memcmp(before, (const void *)&tlsSession, sizeof(before)) == 0;
+  if (resumed) {
+    connectStats.tlsResumed++;
+  }
+#if MQTT_CONNECT_CACHE
+  tlsSessionSave();
+#endif
+  Serial.printf("MQTT connect: %lu ms, TLS %s, %u byte fragments, %lu bytes of heap, JWT signed %lu / reused %lu\n",
+      (unsigned long)connectStats.lastConnectMs, resumed ? "resumed" : "full handshake",
+      connectStats.fragmentLength ? connectStats.fragmentLength : 16384, (unsigned long)connectStats.lastHeapBytes,
+      (unsigned long)connectStats.jwtSigned, (unsigned long)connectStats.jwtReused);
+  return true;
 }
 
 // TODO: fix globals
@@ -313,11 +432,101 @@ void setupCloudIoT() {
 
   // ESP8266 WiFi secure initialization
   setupCert();
+  jwtCacheRestore(iat, jwt);
 
   mqttClient = new MQTTClient(512);
   mqttClient->setOptions(180, true, 1000); // keepAlive, cleanSession, timeout
   mqtt = new CloudIoTCoreMqtt(mqttClient, netClient, device);
   mqtt->setUseLts(true); // Long-term service for MQTT
-  mqtt->startMQTT(); // Opens connection
+  mqtt->startMQTT(); // Connection is opened from loop() by the connection manager
+  setupTopics();
+  setupConnection();
 }
 #endif //__ESP8266_MQTT_H__
+
+
+#if defined(__ESP8266_MQTT_H__) || defined(__ESP32_MQTT_H__)
+///////////////////////////////
+// Connection manager hooks
+///////////////////////////////
+bool mqttConnectOnce() {
+  // mqtt->mqttConnect() would retry in place with delay(), here one try is enough
+  mqttClient->connect(clientId, "unused", getJwt(), false);
+  if (!mqttClient->connected()) {
+    Serial.printf("MQTT connect failed, error %d, return code %d\n",
+        mqttClient->lastError(), mqttClient->returnCode());
+    return false;
+  }
+  mqtt->onConnect(); // config and commands subscriptions
+  return true;
+}
+
+void setupTopics() {
+  snprintf(eventsTopic, sizeof(eventsTopic), "%s", device->getEventsTopic().c_str());
+  snprintf(clientId, sizeof(clientId), "%s", device->getClientId().c_str());
+}
+
+///////////////////////////////
+// Publish from the topics above, no heap on the way to the MQTT client
+///////////////////////////////
+bool publishTelemetry(const char* data, int length) {
+  return mqttClient->publish(eventsTopic, data, length);
+}
+
+// subfolder starts with a slash, like the library's
+bool publishTelemetry(const char* subfolder, const char* data, int length) {
+  char topic[sizeof(eventsTopic) + 32];
+  snprintf(topic, sizeof(topic), "%s%s", eventsTopic, subfolder);
+  return mqttClient->publish(topic, data, length);
+}
+
+bool hookWifiConnected(void *) {
+  return WiFi.status() == WL_CONNECTED;
+}
+
+void hookWifiBegin(void *) {
+  Serial.println("Connecting to WiFi");
+  if (strlen(ssid) > 0) {
+    WiFi.begin(ssid, password);
+  } else {
+    WiFi.begin(); // credentials saved by WiFiManager
+  }
+}
+
+bool hookTimeValid(void *) {
+  return time(nullptr) > 1510644967;
+}
+
+void hookTimeSyncBegin(void *) {
+  Serial.println("Waiting on time sync...");
+  configTime(0, 0, ntp_primary, ntp_secondary);
+}
+
+bool hookMqttConnected(void *) {
+  return mqttClient->connected();
+}
+
+bool hookMqttConnect(void *) {
+  return connect();
+}
+
+void setupConnection() {
+  ConnectionHooks hooks = {
+    nullptr,
+    hookWifiConnected, hookWifiBegin,
+    hookTimeValid, hookTimeSyncBegin,
+    hookMqttConnected, hookMqttConnect,
+  };
+  connection.begin(hooks, millis(), ESP.getCycleCount());
+}
+
+// Use instead of mqtt->loop(): its JWT expiry check only knows tokens signed
+// during this boot, not the ones restored from the cache
+bool mqttLoop() {
+  if (mqttClient->connected() && jwtExpiring(time(nullptr), iat, jwt_exp_secs)) {
+    Serial.println("Reconnecting before JWT expiration");
+    mqttClient->disconnect();
+  }
+  return mqttClient->loop();
+}
+#endif
@@ -0,0 +1,41 @@
+#ifndef HAL_H
+#define HAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "storage.h"
+
+/*
+ * The few hardware services the firmware logic needs. hal_arduino.cpp backs
+ * them with the Arduino core, native/hal_native.cpp with fakes so the same
+ * code runs and gets benchmarked on the host (pio run -e native).
+ */
+
+// Clock
+uint32_t halMillis();
+uint32_t halMicros();
+void halDelayMicroseconds(uint32_t us);
+
+// GPIO
+void halPinOutput(uint8_t pin);
+void halPinInput(uint8_t pin);
+void halPinWrite(uint8_t pin, bool high);
+bool halPinRead(uint8_t pin);
+
+// Air temperature in 0.1 degree C, false without a sensor
+bool halTemperature(int16_t &deciC);
+
+// Heap: free bytes, largest free block and allocations counted since boot.
+// On the device the firmware links with --wrap=malloc,calloc,realloc.
+uint32_t halHeapFree();
+uint32_t halHeapLargestBlock();
+uint32_t halHeapAllocations();
+
+// Network, backed by the MQTT client in main.cpp on the device
+bool halNetworkConnected();
+bool halPublish(const char *subfolder, const char *data, size_t len);
+
+// Filesystem, mounted by the caller before first use
+Storage &halStorage();
+
+#endif // HAL_H
@@ -0,0 +1,149 @@
+#ifdef ARDUINO
+#include <Arduino.h>
+#include "hal.h"
+
+#if defined(ESP8266)
+#include <LittleFS.h>
+#define FILESYSTEM LittleFS
+#else
+#include <SPIFFS.h>
+#define FILESYSTEM SPIFFS
+#endif
+
+uint32_t halMillis()
+{
+  return millis();
+}
+
+uint32_t halMicros()
+{
+  return micros();
+}
+
+void halDelayMicroseconds(uint32_t us)
+{
+  delayMicroseconds(us);
+}
+
+void halPinOutput(uint8_t pin)
+{
+  pinMode(pin, OUTPUT);
+}
+
+void halPinInput(uint8_t pin)
+{
+  pinMode(pin, INPUT);
+}
+
+void IRAM_ATTR halPinWrite(uint8_t pin, bool high)
+{
+  digitalWrite(pin, high ? HIGH : LOW);
+}
+
+bool IRAM_ATTR halPinRead(uint8_t pin)
+{
+  return digitalRead(pin) == HIGH;
+}
+
+#ifdef TEMPERATURE_ADC_PIN
+// LM35 or TMP36 style sensor, 10 mV per degree on an ADC pin
+#ifndef TEMPERATURE_OFFSET_MV
+#define TEMPERATURE_OFFSET_MV 0      //!< 500 for a TMP36
+#endif
+#if defined(ESP8266)
+#define TEMPERATURE_ADC_MV    1000   //!< bare A0, boards with a divider use 3200
+#define TEMPERATURE_ADC_MAX   1023
+#else
+#define TEMPERATURE_ADC_MV    3300
+#define TEMPERATURE_ADC_MAX   4095
+#endif
+
+bool halTemperature(int16_t &deciC)
+{
+  uint32_t mv = (uint32_t)analogRead(TEMPERATURE_ADC_PIN) * TEMPERATURE_ADC_MV / TEMPERATURE_ADC_MAX;
+  deciC = (int16_t)((int32_t)mv - TEMPERATURE_OFFSET_MV);
+  return true;
+}
+#else
+bool halTemperature(int16_t &)
+{
+  return false;
+}
+#endif
+
+/*
+ * Allocation counter behind the linker wraps of platformio.ini. The ESP32
+ * runs WiFi and lwIP on tasks of their own, only loop() is counted there:
+ * its task is the one that reads the counter first.
+ */
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+}
+
+static volatile uint32_t heapAllocations = 0;
+#if defined(ESP32)
+static TaskHandle_t countedTask = nullptr;
+#define COUNTED_TASK() (xTaskGetCurrentTaskHandle() == countedTask)
+#else
+#define COUNTED_TASK() true
+#endif
+
+extern "C" void *IRAM_ATTR __wrap_malloc(size_t size)
+{
+  if (COUNTED_TASK()) {
+    heapAllocations++;
+  }
+  return __real_malloc(size);
+}
+
+extern "C" void *IRAM_ATTR __wrap_calloc(size_t count, size_t size)
+{
+  if (COUNTED_TASK()) {
+    heapAllocations++;
+  }
+  return __real_calloc(count, size);
+}
+
+extern "C" void *IRAM_ATTR __wrap_realloc(void *ptr, size_t size)
+{
+  if (COUNTED_TASK()) {
+    heapAllocations++;
+  }
+  return __real_realloc(ptr, size);
+}
+
+uint32_t halHeapFree()
+{
+  return ESP.getFreeHeap();
+}
+
+uint32_t halHeapLargestBlock()
+{
+#if defined(ESP8266)
+  return ESP.getMaxFreeBlockSize();
+#else
+  return ESP.getMaxAllocHeap();
+#endif
+}
+
+uint32_t halHeapAllocations()
+{
+#if defined(ESP32)
+  if (!countedTask) {
+    countedTask = xTaskGetCurrentTaskHandle();
+  }
+#endif
+  return heapAllocations;
+}
+
+// halNetworkConnected() and halPublish() live in main.cpp, next to the
+// MQTT client that universal-mqtt.h defines
+
+Storage &halStorage()
+{
+  static FlashStorage storage(FILESYSTEM);
+  return storage;
+}
+#endif
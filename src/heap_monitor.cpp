@@ -0,0 +1,106 @@
+#include "heap_monitor.h"
+
+#include <string.h>
+
+HeapMonitor::HeapMonitor()
+  : depth(0), count(0), violations(0), lowFree(UINT32_MAX), lowLargest(UINT32_MAX), sample(nullptr)
+{
+}
+
+void HeapMonitor::begin(SampleFn sample)
+{
+  this->sample = sample;
+}
+
+int8_t HeapMonitor::add(const char *name, bool hot)
+{
+  if (count >= HEAP_MONITOR_MAX) {
+    return -1;
+  }
+
+  HeapStats &stats = subsystems[count];
+  memset(&stats, 0, sizeof(stats));
+  stats.name = name;
+  stats.hot = hot;
+  stats.minFree = UINT32_MAX;
+  stats.minLargest = UINT32_MAX;
+  return count++;
+}
+
+void HeapMonitor::setHot(int8_t id, bool hot)
+{
+  if (id >= 0 && id < count) {
+    subsystems[id].hot = hot;
+  }
+}
+
+uint8_t HeapMonitor::fragmentation(uint32_t freeBytes, uint32_t largestBlock)
+{
+  if (freeBytes == 0 || largestBlock >= freeBytes) {
+    return 0;
+  }
+  return 100 - (uint64_t)largestBlock * 100 / freeBytes;
+}
+
+void HeapMonitor::record(HeapStats &stats, const HeapSample &sample)
+{
+  if (sample.freeBytes < stats.minFree) {
+    stats.minFree = sample.freeBytes;
+  }
+  if (sample.largestBlock < stats.minLargest) {
+    stats.minLargest = sample.largestBlock;
+  }
+  uint8_t fragmented = fragmentation(sample.freeBytes, sample.largestBlock);
+  if (fragmented > stats.maxFragmentation) {
+    stats.maxFragmentation = fragmented;
+  }
+  if (sample.freeBytes < lowFree) {
+    lowFree = sample.freeBytes;
+  }
+  if (sample.largestBlock < lowLargest) {
+    lowLargest = sample.largestBlock;
+  }
+}
+
+void HeapMonitor::enter(int8_t id)
+{
+  // Too deep: the run is charged to the enclosing one
+  if (id < 0 || id >= count || !sample || depth >= HEAP_MONITOR_DEPTH) {
+    return;
+  }
+  HeapSample now;
+  sample(now);
+  HeapStats &stats = subsystems[id];
+  record(stats, now);
+  stats.enterAllocations = now.allocations;
+  stats.nestedAllocations = 0;
+  stack[depth++] = id;
+}
+
+uint32_t HeapMonitor::leave(int8_t id)
+{
+  if (depth == 0 || stack[depth - 1] != id) {
+    return 0;
+  }
+  HeapSample now;
+  sample(now);
+  HeapStats &stats = subsystems[id];
+  record(stats, now);
+  depth--;
+
+  uint32_t total = now.allocations - stats.enterAllocations;
+  if (depth > 0) {
+    subsystems[stack[depth - 1]].nestedAllocations += total;
+  }
+  uint32_t own = total - stats.nestedAllocations;
+  stats.runs++;
+  if (own > 0) {
+    stats.allocations += own;
+    stats.allocatingRuns++;
+    if (stats.hot) {
+      stats.violations++;
+      violations++;
+    }
+  }
+  return own;
+}
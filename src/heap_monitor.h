@@ -0,0 +1,76 @@
+#ifndef HEAP_MONITOR_H
+#define HEAP_MONITOR_H
+
+#include <stdint.h>
+
+#define HEAP_MONITOR_MAX    12   //!< subsystems, the scheduler tasks and a few sections
+#define HEAP_MONITOR_DEPTH  4    //!< sections nested in a task
+
+struct HeapSample {
+  uint32_t allocations;    //!< malloc/calloc/realloc calls since boot
+  uint32_t freeBytes;
+  uint32_t largestBlock;   //!< largest allocation that would succeed
+};
+
+struct HeapStats {
+  const char *name;
+  bool hot;                  //!< steady state path, must not allocate
+  uint32_t runs;
+  uint32_t allocations;      //!< its own, nested sections excluded
+  uint32_t allocatingRuns;
+  uint32_t violations;       //!< runs that allocated while hot
+  uint32_t minFree;          //!< lowest free heap seen around its runs
+  uint32_t minLargest;
+  uint8_t maxFragmentation;
+  uint32_t enterAllocations;
+  uint32_t nestedAllocations;
+};
+
+/*
+ * Heap use per subsystem: each run is bracketed by enter() and leave(),
+ * which sample the allocation counter, the free heap and the largest free
+ * block. Runs nest, a section inside a task (flash, network) keeps its
+ * allocations to itself, so a hot task is only charged for its own code
+ * and any allocation there counts as a violation. No heap, no lock: it is
+ * only ever called from loop().
+ */
+class HeapMonitor {
+public:
+  typedef void (*SampleFn)(HeapSample &sample);
+
+  HeapMonitor();
+
+  void begin(SampleFn sample);
+
+  // Returns the subsystem id, -1 when the table is full
+  int8_t add(const char *name, bool hot);
+  void setHot(int8_t id, bool hot);
+
+  void enter(int8_t id);
+  // Returns the allocations of the run, nested sections excluded
+  uint32_t leave(int8_t id);
+
+  uint8_t size() const { return count; }
+  const HeapStats &stats(uint8_t id) const { return subsystems[id]; }
+  uint32_t getViolations() const { return violations; }
+  // Lowest of every sample since begin()
+  uint32_t minFree() const { return lowFree; }
+  uint32_t minLargest() const { return lowLargest; }
+
+  // 0 when the free heap is one block, 100 when it is dust
+  static uint8_t fragmentation(uint32_t freeBytes, uint32_t largestBlock);
+
+private:
+  void record(HeapStats &stats, const HeapSample &sample);
+
+  HeapStats subsystems[HEAP_MONITOR_MAX];
+  int8_t stack[HEAP_MONITOR_DEPTH];
+  uint8_t depth;
+  uint8_t count;
+  uint32_t violations;
+  uint32_t lowFree;
+  uint32_t lowLargest;
+  SampleFn sample;
+};
+
+#endif // HEAP_MONITOR_H
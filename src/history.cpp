@@ -0,0 +1,379 @@
+#include "history.h"
+
+#include <string.h>
+
+#define HISTORY_TIME_SAME_INTERVAL  0
+#define HISTORY_TIME_SAME_SECOND    1
+#define HISTORY_TIME_INTERVAL       2
+#define HISTORY_TIME_END            3
+#define HISTORY_VOLUME_BIT          0x04
+#define HISTORY_PERCENT_BIT         0x01
+#define HISTORY_PADDING             0xFF
+
+static uint8_t putVarint(uint8_t *out, uint32_t value)
+{
+  uint8_t n = 0;
+  while (value >= 0x80) {
+    out[n++] = (uint8_t)value | 0x80;
+    value >>= 7;
+  }
+  out[n++] = (uint8_t)value;
+  return n;
+}
+
+// Returns the bytes used, 0 when cut short
+static uint8_t getVarint(const uint8_t *in, size_t len, uint32_t &value)
+{
+  value = 0;
+  for (uint8_t n = 0; n < 5 && n < len; n++) {
+    value |= (uint32_t)(in[n] & 0x7F) << (7 * n);
+    if (!(in[n] & 0x80)) {
+      return n + 1;
+    }
+  }
+  return 0;
+}
+
+// Small changes of either sign in a byte
+static uint32_t zigzag(int32_t value)
+{
+  return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int32_t unzigzag(uint32_t value)
+{
+  return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+void HistoryCodec::reset(uint32_t timestamp)
+{
+  this->timestamp = timestamp;
+  interval = 0;
+  memset(volumes, 0, sizeof(volumes));
+  memset(percents, 0, sizeof(percents));
+}
+
+uint8_t HistoryCodec::encode(const TelemetryRecord &record, uint8_t *out)
+{
+  uint8_t tank = record.flags;
+  uint8_t control = tank << 6;
+  uint8_t n = 1;
+
+  if (record.timestamp == timestamp) {
+    // Another tank measured in the same second, the interval stays
+    control |= HISTORY_TIME_SAME_SECOND << 4;
+  } else {
+    uint32_t gap = record.timestamp - timestamp;
+    if (gap != interval) {
+      control |= HISTORY_TIME_INTERVAL << 4;
+      n += putVarint(out + n, zigzag((int32_t)(gap - interval)));
+      interval = gap;
+    }
+    timestamp = record.timestamp;
+  }
+
+  int32_t volume = (int32_t)((uint32_t)record.volume - (uint32_t)volumes[tank]);
+  if (volume != 0) {
+    control |= HISTORY_VOLUME_BIT;
+    n += putVarint(out + n, zigzag(volume));
+    volumes[tank] = record.volume;
+  }
+  int32_t percent = (int32_t)record.percent - percents[tank];
+  if (percent != 0) {
+    control |= HISTORY_PERCENT_BIT;
+    n += putVarint(out + n, zigzag(percent));
+    percents[tank] = record.percent;
+  }
+
+  out[0] = control;
+  return n;
+}
+
+uint8_t HistoryCodec::decode(const uint8_t *in, size_t len, TelemetryRecord &record)
+{
+  if (len == 0) {
+    return 0;
+  }
+  uint8_t control = in[0];
+  uint8_t time = (control >> 4) & 0x03;
+  if (time == HISTORY_TIME_END) {
+    return 0;
+  }
+  uint8_t tank = control >> 6;
+  uint8_t n = 1;
+  uint8_t used;
+  uint32_t value;
+
+  // Nothing changes until the whole record is there
+  uint32_t nextInterval = interval;
+  if (time == HISTORY_TIME_INTERVAL) {
+    if (!(used = getVarint(in + n, len - n, value))) {
+      return 0;
+    }
+    n += used;
+    nextInterval += unzigzag(value);
+  }
+  int32_t volume = volumes[tank];
+  if (control & HISTORY_VOLUME_BIT) {
+    if (!(used = getVarint(in + n, len - n, value))) {
+      return 0;
+    }
+    n += used;
+    volume = (int32_t)((uint32_t)volume + (uint32_t)unzigzag(value));
+  }
+  int16_t percent = percents[tank];
+  if (control & HISTORY_PERCENT_BIT) {
+    if (!(used = getVarint(in + n, len - n, value))) {
+      return 0;
+    }
+    n += used;
+    percent = (int16_t)(percent + unzigzag(value));
+  }
+
+  if (time != HISTORY_TIME_SAME_SECOND) {
+    interval = nextInterval;
+    timestamp += interval;
+  }
+  volumes[tank] = volume;
+  percents[tank] = percent;
+  record.timestamp = timestamp;
+  record.volume = volume;
+  record.percent = percent;
+  record.flags = tank;
+  return n;
+}
+
+History::History()
+  : storage(nullptr), head(0), headClosed(false), lastTimestamp(0)
+{
+  memset(firstTimestamps, 0, sizeof(firstTimestamps));
+  memset(sizes, 0, sizeof(sizes));
+  codec.reset(0);
+}
+
+void History::segmentPath(uint8_t slot, char *path) const
+{
+  path[0] = '/';
+  path[1] = 'h';
+  path[2] = slot < 10 ? '0' + slot : 'a' + slot - 10;
+  path[3] = '\0';
+}
+
+void History::begin(Storage *storage)
+{
+  this->storage = storage;
+  head = 0;
+  headClosed = false;
+  lastTimestamp = 0;
+  codec.reset(0);
+
+  // The head is the segment that started last
+  char path[4];
+  for (uint8_t slot = 0; slot < HISTORY_SEGMENTS; slot++) {
+    segmentPath(slot, path);
+    int32_t size = storage->size(path);
+    uint32_t first;
+    firstTimestamps[slot] = 0;
+    sizes[slot] = 0;
+    if (size >= HISTORY_HEADER_SIZE && storage->read(path, 0, &first, sizeof(first)) == sizeof(first)) {
+      firstTimestamps[slot] = first;
+      sizes[slot] = size < HISTORY_SEGMENT_SIZE ? size : HISTORY_SEGMENT_SIZE;
+    }
+    if (firstTimestamps[slot] > firstTimestamps[head]) {
+      head = slot;
+    }
+  }
+  if (sizes[head] == 0) {
+    return;
+  }
+
+  // Replays the last block of the head, appends carry on encoding against it
+  uint32_t offset = (sizes[head] - 1) / HISTORY_BLOCK_SIZE * HISTORY_BLOCK_SIZE;
+  if (sizes[head] - offset < HISTORY_HEADER_SIZE) {
+    headClosed = true;
+    offset -= HISTORY_BLOCK_SIZE;
+  }
+  uint8_t block[HISTORY_BLOCK_SIZE];
+  uint32_t first;
+  segmentPath(head, path);
+  size_t len = storage->read(path, offset, block, sizes[head] - offset < HISTORY_BLOCK_SIZE ?
+                                                   sizes[head] - offset : HISTORY_BLOCK_SIZE);
+  if (len < HISTORY_HEADER_SIZE) {
+    headClosed = true;
+    return;
+  }
+  memcpy(&first, block, sizeof(first));
+  codec.reset(first);
+  lastTimestamp = first;
+  TelemetryRecord record;
+  size_t pos = HISTORY_HEADER_SIZE;
+  uint8_t used;
+  while ((used = codec.decode(block + pos, len - pos, record)) > 0) {
+    pos += used;
+    lastTimestamp = record.timestamp;
+  }
+  // Stopped short of a partial block: a power cut tore a record or the padding
+  if (pos < len && len < HISTORY_BLOCK_SIZE) {
+    headClosed = true;
+  }
+}
+
+void History::rotate()
+{
+  char path[4];
+  head = (head + 1) % HISTORY_SEGMENTS;
+  segmentPath(head, path);
+  storage->remove(path);
+  firstTimestamps[head] = 0;
+  sizes[head] = 0;
+  headClosed = false;
+}
+
+bool History::append(const TelemetryRecord &record)
+{
+  if (!storage || record.timestamp == 0 || record.timestamp < lastTimestamp || record.flags >= HISTORY_TANKS) {
+    return false;
+  }
+
+  uint8_t bytes[HISTORY_HEADER_SIZE + HISTORY_RECORD_MAX];
+  HistoryCodec next = codec;
+  uint8_t len = next.encode(record, bytes);
+  uint16_t used = sizes[head] % HISTORY_BLOCK_SIZE;
+  if (used == 0 && sizes[head] > 0) {
+    used = HISTORY_BLOCK_SIZE;
+  }
+
+  char path[4];
+  if (headClosed || sizes[head] == 0 || used + len > HISTORY_BLOCK_SIZE) {
+    if (headClosed || sizes[head] + HISTORY_BLOCK_SIZE - used >= HISTORY_SEGMENT_SIZE) {
+      rotate();
+    } else if (sizes[head] > 0 && used < HISTORY_BLOCK_SIZE) {
+      // Pads the block, the next one starts at a known offset
+      uint8_t padding[32];
+      memset(padding, HISTORY_PADDING, sizeof(padding));
+      segmentPath(head, path);
+      for (uint16_t left = HISTORY_BLOCK_SIZE - used; left > 0;) {
+        uint16_t n = left < sizeof(padding) ? left : sizeof(padding);
+        if (!storage->append(path, padding, n)) {
+          headClosed = true;
+          return false;
+        }
+        sizes[head] += n;
+        left -= n;
+      }
+    }
+    // A new block: its header, then its first record encoded against nothing
+    next.reset(record.timestamp);
+    memcpy(bytes, &record.timestamp, HISTORY_HEADER_SIZE);
+    len = HISTORY_HEADER_SIZE + next.encode(record, bytes + HISTORY_HEADER_SIZE);
+  }
+
+  segmentPath(head, path);
+  if (!storage->append(path, bytes, len)) {
+    headClosed = true;
+    return false;
+  }
+  if (sizes[head] == 0) {
+    firstTimestamps[head] = record.timestamp;
+  }
+  sizes[head] += len;
+  codec = next;
+  lastTimestamp = record.timestamp;
+  return true;
+}
+
+uint8_t History::firstBlock(uint8_t slot, uint32_t from)
+{
+  char path[4];
+  segmentPath(slot, path);
+  // First block starting at or after from, earlier records of that second end the block before
+  uint8_t low = 0, high = (sizes[slot] + HISTORY_BLOCK_SIZE - 1) / HISTORY_BLOCK_SIZE;
+  while (low < high) {
+    uint8_t middle = (low + high) / 2;
+    uint32_t first;
+    if (storage->read(path, middle * HISTORY_BLOCK_SIZE, &first, sizeof(first)) != sizeof(first) || first >= from) {
+      high = middle;
+    } else {
+      low = middle + 1;
+    }
+  }
+  return low > 0 ? low - 1 : 0;
+}
+
+uint32_t History::query(uint32_t from, uint32_t to, VisitFn visit, void *ctx)
+{
+  if (!storage || from > to) {
+    return 0;
+  }
+
+  uint32_t visited = 0;
+  uint8_t block[HISTORY_BLOCK_SIZE];
+  char path[4];
+  bool started = false;
+  for (uint8_t i = 1; i <= HISTORY_SEGMENTS; i++) {
+    uint8_t slot = (head + i) % HISTORY_SEGMENTS;
+    if (sizes[slot] == 0) {
+      continue;
+    }
+    if (firstTimestamps[slot] > to) {
+      break;
+    }
+    // Entirely before from when the next segment already starts before it
+    uint8_t next = (slot + 1) % HISTORY_SEGMENTS;
+    if (slot != head && sizes[next] > 0 && firstTimestamps[next] < from) {
+      continue;
+    }
+
+    uint32_t offset = started ? 0 : firstBlock(slot, from) * HISTORY_BLOCK_SIZE;
+    started = true;
+    segmentPath(slot, path);
+    for (; offset < sizes[slot]; offset += HISTORY_BLOCK_SIZE) {
+      size_t len = storage->read(path, offset, block, sizes[slot] - offset < HISTORY_BLOCK_SIZE ?
+                                                      sizes[slot] - offset : HISTORY_BLOCK_SIZE);
+      if (len < HISTORY_HEADER_SIZE) {
+        break;
+      }
+      HistoryCodec reader;
+      uint32_t first;
+      memcpy(&first, block, sizeof(first));
+      reader.reset(first);
+      TelemetryRecord record;
+      size_t pos = HISTORY_HEADER_SIZE;
+      uint8_t used;
+      while ((used = reader.decode(block + pos, len - pos, record)) > 0) {
+        pos += used;
+        if (record.timestamp < from) {
+          continue;
+        }
+        if (record.timestamp > to) {
+          return visited;
+        }
+        visited++;
+        if (!visit(ctx, record)) {
+          return visited;
+        }
+      }
+    }
+  }
+  return visited;
+}
+
+uint32_t History::bytes() const
+{
+  uint32_t total = 0;
+  for (uint8_t slot = 0; slot < HISTORY_SEGMENTS; slot++) {
+    total += sizes[slot];
+  }
+  return total;
+}
+
+uint32_t History::oldest() const
+{
+  for (uint8_t i = 1; i <= HISTORY_SEGMENTS; i++) {
+    uint8_t slot = (head + i) % HISTORY_SEGMENTS;
+    if (sizes[slot] > 0) {
+      return firstTimestamps[slot];
+    }
+  }
+  return 0;
+}
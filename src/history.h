@@ -0,0 +1,99 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "storage.h"
+#include "telemetry_queue.h"
+
+#define HISTORY_SEGMENTS            16    //!< segment files used as a ring
+#define HISTORY_BLOCKS_PER_SEGMENT  16    //!< a segment is one 4 kB flash sector
+#define HISTORY_BLOCK_SIZE          256   //!< decoded on its own, read in one go on the stack
+#define HISTORY_HEADER_SIZE         4     //!< timestamp of the first record of a block
+#define HISTORY_RECORD_MAX          16    //!< longest encoded record
+#define HISTORY_TANKS               4     //!< tank indexes the encoding has room for
+#define HISTORY_SEGMENT_SIZE        (HISTORY_BLOCKS_PER_SEGMENT * HISTORY_BLOCK_SIZE)
+#define HISTORY_BYTES               (HISTORY_SEGMENTS * HISTORY_SEGMENT_SIZE)   //!< 64 kB of flash
+
+/*
+ * Record encoding of a block, each one against the previous record of the
+ * block. A control byte
+ *
+ *   bits 7-6  tank
+ *   bits 5-4  timestamp: 0 same interval as before, 1 same second,
+ *             2 change of interval follows, 3 end of block (0xFF padding)
+ *   bit  2    volume change follows
+ *   bit  0    percent change follows
+ *
+ * then the changes as zigzag varints. A level a minute that did not move is
+ * the control byte alone, a liter or two of jitter adds one byte.
+ */
+struct HistoryCodec {
+  uint32_t timestamp;
+  uint32_t interval;                 //!< between the last two distinct timestamps
+  int32_t volumes[HISTORY_TANKS];
+  int16_t percents[HISTORY_TANKS];
+
+  // Start of a block: its first record is encoded against nothing
+  void reset(uint32_t timestamp);
+  // Returns the bytes written to out, at most HISTORY_RECORD_MAX
+  uint8_t encode(const TelemetryRecord &record, uint8_t *out);
+  // Returns the bytes used, 0 at the end of the block or when the record is cut short
+  uint8_t decode(const uint8_t *in, size_t len, TelemetryRecord &record);
+};
+
+/*
+ * Levels kept on the device for the local API, whether they were published
+ * or not, compressed so that weeks of a level a minute fit in 64 kB.
+ *
+ * Segment files /h0../hf are used as a ring and a full ring drops its oldest
+ * segment: each one is written from start to end and erased as a whole, so
+ * every sector of the partition wears at the same pace. A segment is made of
+ * fixed size blocks, each starting with the timestamp of its first record
+ * and decoded on its own. The first timestamp of each segment is kept in
+ * RAM, a range query skips the segments outside of it and binary searches
+ * the block headers of the first one, so its cost does not depend on how
+ * much history there is. Records are appended one at a time, the last one
+ * is in flash as soon as append() returns.
+ */
+class History {
+public:
+  // Returns false to stop the query
+  typedef bool (*VisitFn)(void *ctx, const TelemetryRecord &record);
+
+  History();
+
+  // Recovers the ring left in flash by a previous boot
+  void begin(Storage *storage);
+
+  // False when the timestamp goes back, the history stays ordered
+  bool append(const TelemetryRecord &record);
+
+  /*
+   * Records with from <= timestamp <= to, oldest first, until visit
+   * returns false. Returns the records visited.
+   */
+  uint32_t query(uint32_t from, uint32_t to, VisitFn visit, void *ctx);
+
+  // Flash used, out of HISTORY_BYTES
+  uint32_t bytes() const;
+  uint32_t oldest() const;
+  uint32_t newest() const { return lastTimestamp; }
+
+private:
+  void segmentPath(uint8_t slot, char *path) const;
+  // Block of the segment holding the first record at or after from
+  uint8_t firstBlock(uint8_t slot, uint32_t from);
+  // Starts the next segment of the ring, the oldest one
+  void rotate();
+
+  Storage *storage;
+  uint32_t firstTimestamps[HISTORY_SEGMENTS];   //!< of each segment, 0 when empty
+  uint16_t sizes[HISTORY_SEGMENTS];             //!< bytes of each segment
+  uint8_t head;                                 //!< segment appended to
+  bool headClosed;                              //!< a power cut tore its last record
+  HistoryCodec codec;                           //!< state of the last block of the head
+  uint32_t lastTimestamp;
+};
+
+#endif // HISTORY_H
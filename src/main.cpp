@@ -6,23 +6,60 @@
 #include <ESP8266WebServer.h>
 #include <ESP8266WiFi.h>
 #include <ESP8266HTTPClient.h>
+#include <LittleFS.h>
+extern "C" {
+#include <user_interface.h>
+}
+#ifndef VARIANT
 #define VARIANT "esp8266"
+#endif
+#define FILESYSTEM LittleFS
 #else
 #include <WebServer.h>
 #include <WiFi.h>
 #include <HTTPClient.h>
 #include <Update.h>
+#include <SPIFFS.h>
+#include <esp_wifi.h>
+#include <esp_ota_ops.h>
+#ifndef VARIANT
 #define VARIANT "esp32"
 #endif
+#define FILESYSTEM SPIFFS
+#endif
 
 #include <WiFiManager.h>
 #include "google-cloud-iot-arduino/universal-mqtt.h"
 #include <UniversalTelegramBot.h>
+#include "sonar.h"
+#include "filters.h"
+#include "telemetry.h"
+#include "storage.h"
+#include "telemetry_queue.h"
+#include "rtc_state.h"
+#include "scheduler.h"
+#include "metrics.h"
+#include "hal.h"
+#include "tank.h"
+#include "ota.h"
+#include "notifier.h"
+#include "tls_profile.h"
+#include "gts_roots.h"
+#include "consumption.h"
+#include "report.h"
+#include "acquisition.h"
+#include "sonar_cycle.h"
+#include "history.h"
+#include "api.h"
+#include "boot_timer.h"
+#include "heap_monitor.h"
 
 #define USE_SERIAL Serial
 
 #define CURRENT_VERSION VERSION
 #define CLOUD_FUNCTION_URL "https://us-central1-oil-tank-298920.cloudfunctions.net/getDownloadUrl"
+#define OTA_MANIFEST_SIZE 1024   //!< url, sha256 and image kind, a signed url alone is several hundred bytes
+char otaManifest[OTA_MANIFEST_SIZE];   //!< reserved at link time, a check never touches the heap
 
 WiFiClient client;
 #if defined(ESP8266)
@@ -32,69 +69,293 @@ WebServer server(80);
 #endif
 
 // Périodes
-#define PERIODE_ACQUISITION 500     //!< période d'acquisition en millisecondes pour la sonde
-#define PERIODE_ENVOI       60000    //!< période d'envoi des données en millisecondes pour MQTT
-unsigned long lastMillis = 0;
+#define PERIODE_ENVOI       60000    //!< période d'évaluation du niveau, publié selon la bande morte et le heartbeat (tankConfig.report)
+#define PERIODE_MQTT        50       //!< période de service de la connexion et du client MQTT
+#define PERIODE_HTTP        50       //!< période de service du serveur web
+#define PERIODE_NOTIFICATION 500     //!< période de service de la file des notifications
+#define PERIODE_VEILLE_MAX  1000     //!< sommeil max entre deux passages dans loop()
+#define PERIODE_OTA         60000    //!< période du test d'échéance de la vérification OTA
+#ifndef OTA_CHECK_INTERVAL
+#define OTA_CHECK_INTERVAL  21600    //!< secondes entre deux vérifications OTA, même après un reboot
+#endif
+#ifndef PERIODE_METRIQUES
+#define PERIODE_METRIQUES   0        //!< période d'envoi des métriques sur le sous-dossier /metrics, 0 = désactivé
+#endif
+
+// Cycle mesure / envoi / deep sleep, 0 = toujours allumé
+#ifndef DUTY_CYCLE_SECONDS
+#define DUTY_CYCLE_SECONDS  0
+#endif
+#define DUTY_CYCLE_SAMPLES  5        //!< échos filtrés avant chaque envoi en mode deep sleep
+#define DUTY_CYCLE_MAX_AWAKE 30000   //!< durée max d'éveil en millisecondes, même sans réseau
+#define FAST_WIFI_TIMEOUT   5000     //!< délai de reconnexion rapide avant de repasser par DHCP et un scan
+
+// Démarrage: une mesure avant le réseau, le premier envoi dès la connexion
+#ifndef BOOT_SERIAL_DELAY
+#define BOOT_SERIAL_DELAY   0        //!< attente d'un moniteur série au démarrage à froid en millisecondes, pour le debug
+#endif
+#define BOOT_SAMPLES        DUTY_CYCLE_SAMPLES  //!< échos par sonde avant de démarrer le réseau
+#define BOOT_SAMPLE_PERIODE 60       //!< période d'acquisition de la mesure de démarrage, le cycle conseillé du HC-SR04
+#define BOOT_MEASURE_MAX    2000     //!< durée max de la mesure de démarrage, sondes muettes comprises
+#define BOOT_PUBLISH_WAIT   30000    //!< attente max de la connexion avant le premier envoi, sinon il part dans la file
+
 int ledState = LOW;
 
-float TANK_HEIGHT_IN_CM = 0;
-float TANK_LENGTH_IN_CM = 0;
-float TANK_WIDTH_IN_CM = 0;
-float FULL_VOLUME_IN_LITERS = 1;
-String UNIT;
+Scheduler scheduler;
+int8_t sensorTask = -1;
+int8_t mqttTask = -1;
+int8_t telemetryTask = -1;
+int8_t notificationTask = -1;
+int8_t httpTask = -1;
+
+// Performance metrics, served on /metrics
+#define METRICS_BUFFER_SIZE 512
+Histogram loopTimeUs(METRICS_BOUNDS_US, METRICS_BOUNDS_US_COUNT);
+Histogram acquisitionTimeUs(METRICS_BOUNDS_US, METRICS_BOUNDS_US_COUNT);
+Histogram publishLatencyMs(METRICS_BOUNDS_MS, METRICS_BOUNDS_MS_COUNT);
+Histogram tlsConnectMs(METRICS_BOUNDS_MS, METRICS_BOUNDS_MS_COUNT);
+Histogram otaDurationMs(METRICS_BOUNDS_MS, METRICS_BOUNDS_MS_COUNT);
+Histogram apiLatencyMs(METRICS_BOUNDS_MS, METRICS_BOUNDS_MS_COUNT);
+uint32_t minFreeHeap = UINT32_MAX;
+
+// Heap use per scheduler task and per section, the hot ones must not allocate
+HeapMonitor heapMonitor;
+int8_t flashSection = -1;     //!< file system calls of the hot tasks
+int8_t publishSection = -1;   //!< MQTT publishes, lwIP takes its buffers from the heap
+
+#define OTA_READ_TIMEOUT 10000   //!< silence after which a download is resumed with a Range request
+
+struct OtaStats {
+  uint32_t bytesReceived;
+  uint32_t resumes;
+  uint32_t lastThroughput;   //!< bytes per second
+  OtaResult lastResult;
+};
+OtaStats otaStats;
+OtaCheckState otaCheck;
+
+TankConfigState tankConfigState;   //!< restored from flash before the first sample
+TankConfig &tankConfig = tankConfigState.tanks[0];   //!< first tank and the device settings
+TankContext tanks[TANK_SENSORS];   //!< one per sensor, in the order of TANK_TRIG_PINS
+ConsumptionTracker consumption;    //!< burn rate and refills, from the levels of the first tank
+Reporter reporter;                 //!< deadband and heartbeat of the telemetry, from tankConfig.report
+static_assert(RTC_SLOT_CONSUMPTION + sizeof(ConsumptionState) <= RTC_SLOT_JWT, "ConsumptionState overflows its RTC slot");
+
+#define TELEMETRY_BUFFER_SIZE 480   //!< payload + topic must stay below the MQTTClient buffer (512)
+#define TELEMETRY_BATCH_SIZE  5     //!< queued samples replayed per publish, ~90 JSON bytes each
+char telemetryBuffer[TELEMETRY_BUFFER_SIZE];
+
+TelemetryQueue telemetryQueue;
+History history;   //!< every level, served on /api/history
+BootTimer bootTimer;   //!< phases up to the first publish, sent with it
+uint32_t fastWifiMs = 0;   //!< start of the fast WiFi reconnect, 0 when none is pending
+bool measuringAtBoot = false;   //!< the sensor periods are BOOT_SAMPLE_PERIODE, not adapted
+bool dimensionsSent = false;    //!< the "tank" message matches the current config
 
 void getTankLevel();
+bool drainTelemetryQueue();
+void publishDimensions();
+void sensorTaskRun(void *);
+void onEcho(void *, uint8_t index, const SonarSample &sample);
+void configureTanks();
+void mqttTaskRun(void *);
+void telemetryTaskRun(void *);
+void dutyCycleTaskRun(void *);
+void otaTaskRun(void *);
+void notificationTaskRun(void *);
+void httpTaskRun(void *);
+void metricsTaskRun(void *);
+void handleMetrics();
+void handleApiLevel();
+void handleApiHistory();
+bool publishTimed(const char *data, size_t length);
+void sampleHeap(HeapSample &sample);
+void heapHook(void *, uint8_t id, bool done);
 
 // Initialize Telegram BOT
 #define BOTtoken "1475527759:AAEuQSvWrhafu8dNrzGzaHmBpQx-80TqT34"  // your Bot Token (Get from Botfather)
 
-// Use @myidbot to find out the chat ID of an individual or a group
-// Also note that you need to click "start" on a bot before it can
-// message you
-String CHAT_ID = "";
-
 WiFiClientSecure clientSecure;
 UniversalTelegramBot bot(BOTtoken, clientSecure);
 
-bool telegramNotificationTankFullSent = false;
-bool telegramNotificationTankEmptySent = false;
+// One short-lived TLS client at a time next to MQTT, see tls_profile.h
+TlsGate tlsGate;
+WiFiClientSecure otaClient;
 
-void messageReceived(String &topic, String &payload) 
+// Alerts only get queued on the measurement path, the notification task sends them
+Notifier notifier;
+
+// -D NOTIFY_WEBHOOK_URL="http://192.168.1.10:8080/notify" posts them to a local stand-in instead
+#ifdef NOTIFY_WEBHOOK_URL
+HTTPClient notifyHttp;
+
+NotifyResult sendWebhook(void *, const char *text)
 {
-  USE_SERIAL.println("<- " + topic + " - " + payload);
-  
-  if(topic == "/devices/" + String(device_id) + "/config") {
-    DynamicJsonDocument doc(1024);
-    deserializeJson(doc, payload);
-    JsonObject obj = doc.as<JsonObject>();
+  if (WiFi.status() != WL_CONNECTED) {
+    return NOTIFY_NOT_READY;
+  }
+  char body[NOTIFY_MESSAGE_SIZE + 64];
+  StaticJsonDocument<JSON_OBJECT_SIZE(2)> doc;
+  doc["chat_id"] = (const char *)tankConfig.chatId;
+  doc["text"] = text;
+  size_t length = serializeJson(doc, body, sizeof(body));
 
-    FULL_VOLUME_IN_LITERS = obj["full_volume_in_liters"];
-    TANK_HEIGHT_IN_CM = obj["tank_height_in_cm"];
-    TANK_LENGTH_IN_CM = obj["tank_lenght_in_cm"];
-    TANK_WIDTH_IN_CM = obj["tank_width_in_cm"];
-    UNIT = (const char*)obj["unit"];
+  notifyHttp.setReuse(true);
+  if (!notifyHttp.begin(client, NOTIFY_WEBHOOK_URL)) {
+    return NOTIFY_FAILED;
+  }
+  notifyHttp.addHeader("Content-Type", "application/json");
+  int code = notifyHttp.POST((uint8_t *)body, length);
+  // With reuse on, end() leaves a keep-alive connection open for the next message
+  notifyHttp.end();
+  return code >= 200 && code < 300 ? NOTIFY_SENT : NOTIFY_FAILED;
+}
 
-    CHAT_ID = (const char*)obj["telegram_chat_id"];
+void closeWebhook(void *)
+{
+  client.stop();
+}
+#else
+NotifyResult sendTelegram(void *, const char *text)
+{
+  // Before the first config there is nowhere to send, keep it queued
+  if (WiFi.status() != WL_CONNECTED || tankConfig.chatId[0] == '\0') {
+    return NOTIFY_NOT_READY;
+  }
+  if (!clientSecure.connected()) {
+    tlsGate.acquire(TLS_NOTIFY, ESP.getFreeHeap());
+    tlsGate.setFragmentLength(TLS_NOTIFY, tlsConfigure(clientSecure, TLS_NOTIFY, TELEGRAM_HOST, TELEGRAM_SSL_PORT));
   }
+  bool sent = bot.sendMessage(tankConfig.chatId, text, "");
+  tlsGate.sample(ESP.getFreeHeap());
+  return sent ? NOTIFY_SENT : NOTIFY_FAILED;
 }
 
+void closeTelegram(void *)
+{
+  clientSecure.stop();
+  tlsGate.release(TLS_NOTIFY, ESP.getFreeHeap());
+}
+#endif
+
+RtcState rtcState;
+bool warmWake = false;
+
+char configTopic[64];   //!< built once in setup()
+
 /* 
- * Check if needs to update the device and returns the download url.
+ * Registered with onMessageAdvanced() in setup(): topic and payload stay in
+ * the MQTT client buffer, no String per message.
+ */
+void onMqttMessage(MQTTClient *, char topic[], char bytes[], int length)
+{
+  USE_SERIAL.printf("<- %s - ", topic);
+  USE_SERIAL.write((const uint8_t *)bytes, length);
+  USE_SERIAL.println();
+
+  if (strcmp(topic, configTopic) == 0) {
+    // Use @myidbot to find out the telegram_chat_id of an individual or a group
+    // Also note that you need to click "start" on a bot before it can message you
+    // The payload is parsed in place, it is not used afterwards
+    switch (tankConfigUpdate(tankConfigState, bytes, length)) {
+      case TANK_CONFIG_UPDATED:
+        configureTanks();
+        dimensionsSent = false;
+        if (!tankConfigSave(halStorage(), tankConfigState)) {
+          USE_SERIAL.println("Config applied but not saved");
+        }
+        break;
+      case TANK_CONFIG_UNCHANGED:
+        break;
+      case TANK_CONFIG_INVALID:
+        USE_SERIAL.println("Invalid config ignored");
+        break;
+    }
+  }
+}
+
+// CloudIoTCoreMqtt::startMQTT() registers this one, setup() replaces it
+void messageReceived(String &topic, String &payload)
+{
+  onMqttMessage(mqttClient, (char *)topic.c_str(), payload.begin(), payload.length());
+}
+
+/*
+ * Stream over a caller buffer, HTTPClient::writeToStream() decodes a chunked
+ * answer into it where getString() would grow a String.
  */
-String getDownloadUrl()
+class BufferStream : public Stream {
+public:
+  BufferStream(char *buf, size_t size) : buf(buf), size(size), len(0), overflow(false) { buf[0] = '\0'; }
+
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *data, size_t n) override
+  {
+    if (len + n >= size) {
+      overflow = true;
+      n = size - 1 - len;
+    }
+    memcpy(buf + len, data, n);
+    len += n;
+    buf[len] = '\0';
+    return n;
+  }
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+
+  bool overflowed() const { return overflow; }
+
+private:
+  char *buf;
+  size_t size;
+  size_t len;
+  bool overflow;
+};
+
+// Leading and trailing whitespace out, in place
+char *trimText(char *text)
+{
+  while (isspace((unsigned char)*text)) {
+    text++;
+  }
+  size_t length = strlen(text);
+  while (length > 0 && isspace((unsigned char)text[length - 1])) {
+    text[--length] = '\0';
+  }
+  return text;
+}
+
+/* 
+ * Check if needs to update the device, the manifest of the update goes to
+ * the buffer. The tag of the last "up to date" answer is sent back, an
+ * unchanged manifest then costs the server a 304 from its cache.
+ */
+bool getDownloadUrl(char *manifest, size_t size)
 {
   HTTPClient http;
-  String downloadUrl;
+  bool update = false;
   USE_SERIAL.print("[HTTP] begin...\n");
 
-  String url = CLOUD_FUNCTION_URL;
-  url += String("?version=") + CURRENT_VERSION;
-  url += String("&variant=") + VARIANT;
-  http.begin(url);
+  // url, sha256 and image kind, one per line
+  static const char url[] = CLOUD_FUNCTION_URL "?version=" CURRENT_VERSION "&variant=" VARIANT "&ota=2";
+  char host[48];
+  uint16_t port;
+  tlsGate.acquire(TLS_OTA, ESP.getFreeHeap());
+  if (tlsParseUrl(CLOUD_FUNCTION_URL, host, sizeof(host), port)) {
+    tlsGate.setFragmentLength(TLS_OTA, tlsConfigure(otaClient, TLS_OTA, host, port));
+  }
+  http.begin(otaClient, url);
+  const char *headers[] = { "ETag" };
+  http.collectHeaders(headers, 1);
+  if (otaCheck.etag[0] != '\0' && strcmp(otaCheck.version, CURRENT_VERSION) == 0) {
+    http.addHeader("If-None-Match", otaCheck.etag);
+  }
 
   USE_SERIAL.print("[HTTP] GET...\n");
   // start connection and send HTTP header
   int httpCode = http.GET();
+  tlsGate.sample(ESP.getFreeHeap());
 
   // httpCode will be negative on error
   if (httpCode > 0)
@@ -105,11 +366,20 @@ String getDownloadUrl()
     // file found at server
     if (httpCode == HTTP_CODE_OK)
     {
-      String payload = http.getString();
-      USE_SERIAL.println(payload);
-      downloadUrl = payload;
+      BufferStream body(manifest, size);
+      update = http.writeToStream(&body) > 0 && !body.overflowed();
+      USE_SERIAL.println(update ? manifest : "[HTTP] manifest too large");
+      otaCheck.etag[0] = '\0';
+    } else if (httpCode == HTTP_CODE_NOT_MODIFIED) {
+      USE_SERIAL.println("Device is up to date! (manifest unchanged)");
     } else {
       USE_SERIAL.println("Device is up to date!");
+      // The header API only has Strings, once per check
+      String etag = http.header("ETag");
+      if (etag.length() < sizeof(otaCheck.etag) && strlen(CURRENT_VERSION) < sizeof(otaCheck.version)) {
+        memcpy(otaCheck.etag, etag.c_str(), etag.length() + 1);
+        strcpy(otaCheck.version, CURRENT_VERSION);
+      }
     }
   }
   else
@@ -118,241 +388,1250 @@ String getDownloadUrl()
   }
 
   http.end();
+  otaClient.stop();
+  tlsGate.release(TLS_OTA, ESP.getFreeHeap());
+
+  return update;
+}
+
+///////////////////////////////
+// OTA hooks, one Range request per resume
+///////////////////////////////
+HTTPClient otaHttp;
+
+int32_t otaOpen(void *, const char *url, uint32_t offset)
+{
+  // The bucket may not be the host of the cloud function
+  char host[48];
+  uint16_t port;
+  if (!tlsParseUrl(url, host, sizeof(host), port)) {
+    return -1;
+  }
+  tlsGate.setFragmentLength(TLS_OTA, tlsConfigure(otaClient, TLS_OTA, host, port));
+  otaHttp.begin(otaClient, url);
+  otaHttp.setTimeout(OTA_READ_TIMEOUT);
+  const char *headers[] = { "Content-Range" };
+  otaHttp.collectHeaders(headers, 1);
+  if (offset > 0) {
+    char range[24];
+    snprintf(range, sizeof(range), "bytes=%lu-", (unsigned long)offset);
+    otaHttp.addHeader("Range", range);
+  }
+
+  int httpCode = otaHttp.GET();
+  tlsGate.sample(ESP.getFreeHeap());
+  if (offset == 0 && httpCode == HTTP_CODE_OK) {
+    return otaHttp.getSize();
+  }
+  // "bytes 1000-4999/5000", a 200 here would restart from zero
+  if (offset > 0 && httpCode == HTTP_CODE_PARTIAL_CONTENT) {
+    int slash = otaHttp.header("Content-Range").lastIndexOf('/');
+    return slash < 0 ? -1 : otaHttp.header("Content-Range").substring(slash + 1).toInt();
+  }
+  USE_SERIAL.printf("[OTA] GET from %lu failed, code: %d\n", (unsigned long)offset, httpCode);
+  return -1;
+}
+
+int32_t otaRead(void *, uint8_t *buf, size_t len)
+{
+  WiFiClient *stream = otaHttp.getStreamPtr();
+  unsigned long start = millis();
+  while (stream && (stream->connected() || stream->available())) {
+    size_t available = stream->available();
+    if (available > 0) {
+      return stream->readBytes(buf, available < len ? available : len);
+    }
+    if (millis() - start > OTA_READ_TIMEOUT) {
+      break;
+    }
+    delay(1);
+  }
+  return 0;
+}
 
-  return downloadUrl;
+void otaClose(void *)
+{
+  otaHttp.end();
+}
+
+bool otaBegin(void *, uint32_t size)
+{
+  if (!Update.begin(size)) {
+    USE_SERIAL.println("Not enough space to begin OTA");
+    return false;
+  }
+  return true;
+}
+
+bool otaWrite(void *, const uint8_t *data, size_t len)
+{
+  return Update.write((uint8_t *)data, len) == len;
+}
+
+bool otaEnd(void *)
+{
+  if (!Update.end() || !Update.isFinished()) {
+    USE_SERIAL.printf("Error Occurred. Error #: %u\n", (unsigned)Update.getError());
+    return false;
+  }
+  return true;
+}
+
+void otaAbort(void *)
+{
+#if defined(ESP32)
+  Update.abort();
+#endif
+  // On the ESP8266 the image only becomes bootable in Update.end()
+}
+
+uint32_t otaCurrentSize(void *)
+{
+  return ESP.getSketchSize();
+}
+
+bool otaReadCurrent(void *, uint32_t offset, uint8_t *buf, size_t len)
+{
+#if defined(ESP8266)
+  // The sketch starts at flash address 0, reads must be word aligned. Static: it would be
+  // half a kB more of the loop() stack, under the updater's own frames
+  static uint32_t words[OTA_CHUNK_SIZE / 4 + 2];
+  uint32_t start = offset & ~3u;
+  size_t span = (offset - start + len + 3) & ~3u;
+  if (span > sizeof(words) || !ESP.flashRead(start, words, span)) {
+    return false;
+  }
+  memcpy(buf, (uint8_t *)words + (offset - start), len);
+  return true;
+#else
+  return esp_partition_read(esp_ota_get_running_partition(), offset, buf, len) == ESP_OK;
+#endif
+}
+
+void otaProgress(void *, const OtaProgress &progress)
+{
+  tlsGate.sample(ESP.getFreeHeap());
+  USE_SERIAL.printf("[OTA] %lu / %lu bytes, %lu written, %u resumes, %lu ms\n",
+      (unsigned long)progress.received, (unsigned long)progress.total, (unsigned long)progress.written,
+      progress.resumes, (unsigned long)progress.elapsedMs);
 }
 
 /* 
- * Download binary image and use Update library to update the device.
+ * Stream the image announced by getDownloadUrl() into the update partition
+ * and reboot on it. The answer is the url, then optionally its SHA-256 and
+ * "delta" when the file is a patch against the running version.
  */
-bool downloadUpdate(String url)
+bool downloadUpdate(char *manifest)
 {
-  HTTPClient http;
-  USE_SERIAL.print("[HTTP] Download begin...\n");
+  // Split in place, one line each
+  char *lines[3] = { manifest, nullptr, nullptr };
+  for (uint8_t i = 1; i < 3 && lines[i - 1]; i++) {
+    char *end = strchr(lines[i - 1], '\n');
+    if (end) {
+      *end = '\0';
+      lines[i] = end + 1;
+    }
+  }
+  const char *url = trimText(lines[0]);
+  const char *sha256 = lines[1] ? trimText(lines[1]) : "";
+  bool delta = lines[2] && strncmp(lines[2], "delta", 5) == 0;
 
-  http.begin(url);
+  uint8_t expected[SHA256_SIZE];
+  bool verify = Sha256::parseHex(sha256, expected);
+  if (!verify) {
+    USE_SERIAL.println("[OTA] No SHA-256 from the server, the image is only checked for its size");
+  }
 
-  USE_SERIAL.print("[HTTP] GET...\n");
-  // start connection and send HTTP header
-  int httpCode = http.GET();
-  if (httpCode > 0)
-  {
-    // HTTP header has been send and Server response header has been handled
-    USE_SERIAL.printf("[HTTP] GET... code: %d\n", httpCode);
+  OtaHooks hooks = {
+    nullptr,
+    otaOpen, otaRead, otaClose,
+    otaBegin, otaWrite, otaEnd, otaAbort,
+    otaCurrentSize, otaReadCurrent,
+    otaProgress,
+  };
+  // Over 1 kB of buffers: static, otaTaskRun() runs from loop() and its 4 kB stack on the ESP8266
+  static OtaUpdater updater;
+  updater.begin(hooks, halMillis);
 
-    // file found at server
-    if (httpCode == HTTP_CODE_OK)
-    {
+  USE_SERIAL.print(delta ? "[OTA] Delta image from " : "[OTA] Full image from ");
+  USE_SERIAL.println(url);
+  tlsGate.acquire(TLS_OTA, ESP.getFreeHeap());
+  OtaResult result = updater.run(url, verify ? expected : nullptr, delta);
+  otaClient.stop();
+  tlsGate.release(TLS_OTA, ESP.getFreeHeap());
 
-      int contentLength = http.getSize();
-      USE_SERIAL.println("contentLength : " + String(contentLength));
-
-      if (contentLength > 0)
-      {
-        bool canBegin = Update.begin(contentLength);
-        if (canBegin)
-        {
-          WiFiClient stream = http.getStream();
-          USE_SERIAL.println("Begin OTA. This may take 2 - 5 mins to complete. Things might be quite for a while.. Patience!");
-          size_t written = Update.writeStream(stream);
-
-          if (written == contentLength)
-          {
-            USE_SERIAL.println("Written : " + String(written) + " successfully");
-          }
-          else
-          {
-            USE_SERIAL.println("Written only : " + String(written) + "/" + String(contentLength) + ". Retry?");
-          }
-
-          if (Update.end())
-          {
-            USE_SERIAL.println("OTA done!");
-            if (Update.isFinished())
-            {
-              USE_SERIAL.println("Update successfully completed. Rebooting.");
-              ESP.restart();
-              return true;
-            }
-            else
-            {
-              USE_SERIAL.println("Update not finished? Something went wrong!");
-              return false;
-            }
-          }
-          else
-          {
-            USE_SERIAL.println("Error Occurred. Error #: " + String(Update.getError()));
-            return false;
-          }
-        }
-        else
-        {
-          USE_SERIAL.println("Not enough space to begin OTA");
-          client.flush();
-          return false;
-        }
-      }
-      else
-      {
-        USE_SERIAL.println("There was no content in the response");
-        client.flush();
-        return false;
-      }
-    }
-    else
-    {
-      return false;
-    }
+  const OtaProgress &progress = updater.getProgress();
+  otaStats.bytesReceived += progress.received;
+  otaStats.resumes += progress.resumes;
+  otaStats.lastThroughput = updater.throughput();
+  otaStats.lastResult = result;
+
+  if (result != OTA_OK) {
+    USE_SERIAL.printf("[OTA] Failed: %s\n", OtaUpdater::resultName(result));
+    return false;
   }
-  else
+  USE_SERIAL.printf("[OTA] Done, %lu bytes/s. Rebooting.\n", (unsigned long)otaStats.lastThroughput);
+  ESP.restart();
+  return true;
+}
+
+/* 
+ * Version check once the clock is set and the first level is out, at most
+ * every OTA_CHECK_INTERVAL.
+ */
+void otaTaskRun(void *)
+{
+  uint32_t now = time(nullptr);
+  if (!connection.connected() || !bootTimer.finished() || !otaCheckDue(otaCheck, now, OTA_CHECK_INTERVAL)) {
+    return;
+  }
+
+  // A successful update reboots, so only checks and failed updates get recorded
+  unsigned long otaStart = millis();
+  bool update = getDownloadUrl(otaManifest, sizeof(otaManifest));
+  otaCheck.checkedAt = now;
+  otaCheckSave(halStorage(), otaCheck);
+  if (update && !downloadUpdate(otaManifest))
   {
+    USE_SERIAL.println("Error updating device");
+  }
+  otaDurationMs.record(millis() - otaStart);
+}
+
+#ifndef TRIG_PIN
+#define TRIG_PIN 16
+#endif
+// One sensor per tank, e.g. -D TANK_SENSORS=2 -D TANK_TRIG_PINS=16,18 -D TANK_ECHO_PINS=17,19
+#ifndef TANK_TRIG_PINS
+#define TANK_TRIG_PINS TRIG_PIN
+#endif
+#ifndef TANK_ECHO_PINS
+#define TANK_ECHO_PINS 17
+#endif
+// Sensors that hear each other share a group and fire in turn, all in group 0 by default
+#ifndef TANK_SONAR_GROUPS
+#define TANK_SONAR_GROUPS 0
+#endif
+const uint8_t trigPins[] = { TANK_TRIG_PINS };   // trigger pins
+const uint8_t echoPins[] = { TANK_ECHO_PINS };   // echo pins
+const uint8_t sonarGroups[TANK_SENSORS] = { TANK_SONAR_GROUPS };
+static_assert(sizeof(trigPins) == TANK_SENSORS && sizeof(echoPins) == TANK_SENSORS, "one trigger and one echo pin per tank");
+
+SonarCycle sonarCycle;   //!< triggers of the sensors, each on the period of its tank
+#define SONAR_TIMEOUT_US    SONAR_DEFAULT_TIMEOUT_US  //!< délai max d'attente de l'écho en microsecondes
+
+/* 
+ * Fire the 10us trigger pulse of one tank, the echo is captured by echoInterrupt().
+ */
+void triggerSonar(void *ctx)
+{
+  uint8_t trigPin = ((TankContext *)ctx)->sensor.trigPin;
+  // Clear the trigPin by setting it LOW:
+  halPinWrite(trigPin, false);
+
+  // wait 2ms to make sure the trigPin is LOW
+  halDelayMicroseconds(2);
+
+  // Trigger the sensor by setting the trigPin high for 10 microseconds:
+  halPinWrite(trigPin, true);
+  halDelayMicroseconds(10);
+  halPinWrite(trigPin, false);
+}
+
+void IRAM_ATTR echoInterrupt(void *ctx)
+{
+  TankContext *tank = (TankContext *)ctx;
+  tank->sonar.onEchoEdge(halPinRead(tank->sensor.echoPin), halMicros());
+}
+
+/* 
+ * Restore what the previous wake left in RTC memory: alert flags, last
+ * reading and wall clock, so NTP does not have to be waited for.
+ */
+void restoreFromRtc()
+{
+  // Only the first tank is kept, the others start over on each wake
+  TankContext &tank = tanks[0];
+  tank.alerts.fullSent = rtcState.flags & RTC_FLAG_TANK_FULL_SENT;
+  tank.alerts.emptySent = rtcState.flags & RTC_FLAG_TANK_EMPTY_SENT;
+  dimensionsSent = rtcState.flags & RTC_FLAG_DIMENSIONS_SENT;
+  tank.level.volume = rtcState.lastVolume;
+  tank.level.volumeMl = rtcState.lastVolume * 1000;
+  tank.level.percent = rtcState.lastPercent;
+  if (!rtcLoad(RTC_SLOT_CONSUMPTION, &consumption.getState(), sizeof(ConsumptionState))) {
+    consumption.reset();
+  }
+  ReportState &report = reporter.getState();
+  report.lastS = rtcState.lastReportEpoch;
+  report.lastVolumeMl = rtcState.lastReportVolumeMl;
+  report.suppressed = rtcState.suppressedReports;
+
+  if (rtcState.epochAtSleep > 1510644967) {
+    timeval now = { (time_t)(rtcState.epochAtSleep + rtcState.sleepSeconds + millis() / 1000), 0 };
+    settimeofday(&now, nullptr);
+  }
+}
+
+/* 
+ * Start joining the access point remembered in RTC memory: known BSSID and
+ * channel (no scan) and the previous lease as static IP (no DHCP). Nothing
+ * waits for it, checkFastWifi() falls back to DHCP when it does not answer.
+ */
+bool fastConnectWifi()
+{
+  if (!(rtcState.flags & RTC_FLAG_NETWORK_VALID)) {
     return false;
   }
+
+  WiFi.mode(WIFI_STA);
+  WiFi.config(IPAddress(rtcState.ip), IPAddress(rtcState.gateway), IPAddress(rtcState.subnet), IPAddress(rtcState.dns));
+#if defined(ESP8266)
+  // Credentials saved by WiFiManager in the SDK config
+  WiFi.begin(WiFi.SSID().c_str(), WiFi.psk().c_str(), rtcState.channel, rtcState.bssid);
+#else
+  wifi_config_t config;
+  esp_wifi_get_config(WIFI_IF_STA, &config);
+  WiFi.begin((const char*)config.sta.ssid, (const char*)config.sta.password, rtcState.channel, rtcState.bssid);
+#endif
+
+  fastWifiMs = millis() ? millis() : 1;
+  return true;
 }
 
-const int trigPin = 16;   // trigger pin
-const int echoPin = 17;   // echo pin
+/* 
+ * The connection manager leaves FAST_WIFI_TIMEOUT to the fast reconnect,
+ * then scans with the saved credentials: back to DHCP before it does.
+ */
+void checkFastWifi()
+{
+  if (fastWifiMs == 0) {
+    return;
+  }
+  if (WiFi.status() == WL_CONNECTED) {
+    fastWifiMs = 0;
+  } else if (millis() - fastWifiMs > FAST_WIFI_TIMEOUT) {
+    USE_SERIAL.println("Fast WiFi reconnect failed");
+    rtcState.flags &= ~RTC_FLAG_NETWORK_VALID;
+    WiFi.config(IPAddress((uint32_t)0), IPAddress((uint32_t)0), IPAddress((uint32_t)0)); // back to DHCP
+    fastWifiMs = 0;
+  }
+}
 
-float duration;           // variable to store the duration as float
-int waterFilllevel = 0;
-float distance;           // variable to store the distance as float
-int tank_volume = 0;
-int tank_percent = 0;
+/* 
+ * Credentials in ciotc_config.h or saved by WiFiManager, the portal is only
+ * needed without them.
+ */
+bool wifiProvisioned()
+{
+  if (strlen(ssid) > 0) {
+    return true;
+  }
+#if defined(ESP8266)
+  station_config config;
+  wifi_station_get_config(&config);
+  return config.ssid[0] != '\0';
+#else
+  WiFi.mode(WIFI_STA);
+  wifi_config_t config;
+  esp_wifi_get_config(WIFI_IF_STA, &config);
+  return config.sta.ssid[0] != '\0';
+#endif
+}
+
+/* 
+ * Save everything the next wake needs in RTC memory and deep sleep.
+ */
+void goToSleep()
+{
+  uint8_t flags = 0;
+  if (tanks[0].alerts.fullSent) {
+    flags |= RTC_FLAG_TANK_FULL_SENT;
+  }
+  if (tanks[0].alerts.emptySent) {
+    flags |= RTC_FLAG_TANK_EMPTY_SENT;
+  }
+  if (dimensionsSent) {
+    flags |= RTC_FLAG_DIMENSIONS_SENT;
+  }
+
+  if (WiFi.status() == WL_CONNECTED) {
+    flags |= RTC_FLAG_NETWORK_VALID;
+    rtcState.channel = WiFi.channel();
+    memcpy(rtcState.bssid, WiFi.BSSID(), sizeof(rtcState.bssid));
+    rtcState.ip = (uint32_t)WiFi.localIP();
+    rtcState.gateway = (uint32_t)WiFi.gatewayIP();
+    rtcState.subnet = (uint32_t)WiFi.subnetMask();
+    rtcState.dns = (uint32_t)WiFi.dnsIP();
+  }
+
+  rtcState.flags = flags;
+  rtcState.lastVolume = tanks[0].level.volume;
+  rtcState.lastPercent = tanks[0].level.percent;
+  rtcState.epochAtSleep = time(nullptr);
+  rtcState.sleepSeconds = DUTY_CYCLE_SECONDS;
+  rtcState.lastReportEpoch = reporter.getState().lastS;
+  rtcState.lastReportVolumeMl = reporter.getState().lastVolumeMl;
+  rtcState.suppressedReports = reporter.getState().suppressed;
+  rtcStateSave(rtcState);
+  rtcSave(RTC_SLOT_CONSUMPTION, &consumption.getState(), sizeof(ConsumptionState));
+
+  USE_SERIAL.printf("Deep sleep for %d s after %lu ms awake\n", DUTY_CYCLE_SECONDS, millis());
+  mqttClient->disconnect();
+  ESP.deepSleep(DUTY_CYCLE_SECONDS * 1000000UL);
+}
 
 /* 
  * Show current device version
  */
 void handleRoot() {  
-  server.send(200, "text/plain", "v" + String(CURRENT_VERSION));
+  server.send_P(200, "text/plain", "v" CURRENT_VERSION);
 }
 
+/* 
+ * A few echoes of every tank before the radio starts, the first message
+ * goes out as soon as the connection is up instead of waiting for them.
+ */
+void measureAtBoot()
+{
+  measuringAtBoot = true;
+  for (uint8_t i = 0; i < TANK_SENSORS; i++) {
+    sonarCycle.setPeriod(i, BOOT_SAMPLE_PERIODE);
+  }
+  unsigned long start = millis();
+  bool measured = false;
+  while (!measured && millis() - start < BOOT_MEASURE_MAX) {
+    uint32_t wait = sonarCycle.service(micros(), millis());
+    measured = true;
+    for (uint8_t i = 0; i < TANK_SENSORS; i++) {
+      measured = measured && tanks[i].filter.getEstimate().samples + tanks[i].failures >= BOOT_SAMPLES;
+    }
+    if (!measured && wait > 0) {
+      delay(wait);
+    }
+  }
+  for (uint8_t i = 0; i < TANK_SENSORS; i++) {
+    sonarCycle.setPeriod(i, tanks[i].rate.getPeriodMs());
+  }
+  measuringAtBoot = false;
+}
+
+/* 
+ * Boot sequence, each phase timed by bootTimer: storage, sensors and a
+ * first measurement, then the network, which comes up in the background
+ * from the connection manager. Only an unprovisioned board waits here, on
+ * the WiFiManager portal. The OTA check waits for the first publish.
+ */
 void setup() {
+  tankConfigDefaults(tankConfig);
+  snprintf(configTopic, sizeof(configTopic), "/devices/%s/config", device_id);
   USE_SERIAL.begin(115200);
   USE_SERIAL.setDebugOutput(true);  
   pinMode(LED_BUILTIN, OUTPUT);
-  
-  delay(3000);
-  USE_SERIAL.println("\n Starting");
-  // Setup Wifi Manager
-  String version = String("<p>Current Version - v") + String(CURRENT_VERSION) + String("</p>");
-  USE_SERIAL.println(version);
-  
-  WiFiManager wm;
-  WiFiManagerParameter versionText(version.c_str());
-  wm.addParameter(&versionText);    
-    
-  if (!wm.autoConnect()) {
-    USE_SERIAL.println("failed to connect and hit timeout");
-    //reset and try again, or maybe put it to deep sleep
-    ESP.restart();
-    delay(1000);
+
+#if DUTY_CYCLE_SECONDS > 0
+  warmWake = rtcStateLoad(rtcState);
+  rtcState.wakeCount++;
+  if (warmWake) {
+    restoreFromRtc();
   }
- 
-  // Check if we need to download a new version
-  String downloadUrl = getDownloadUrl();
-  if (downloadUrl.length() > 0)
-  {
-    bool success = downloadUpdate(downloadUrl);
-    if (!success)
-    {
-      USE_SERIAL.println("Error updating device");
+#endif
+
+#if BOOT_SERIAL_DELAY > 0
+  if (!warmWake) {
+    delay(BOOT_SERIAL_DELAY);
+  }
+#endif
+  USE_SERIAL.println("\n Starting");
+  bootTimer.mark(BOOT_INIT, millis());
+
+  if (FILESYSTEM.begin() || (FILESYSTEM.format() && FILESYSTEM.begin())) {
+    telemetryQueue.begin(&halStorage());
+    history.begin(&halStorage());
+    otaCheckLoad(halStorage(), otaCheck);
+    if (tankConfigLoad(halStorage(), tankConfigState)) {
+      configureTanks();
+      for (uint8_t i = 0; i < TANK_SENSORS; i++) {
+        const TankConfig &config = tankConfigState.tanks[i];
+        USE_SERIAL.printf("Tank %u config restored: %s, %lu mm, %lu liters\n", i, TankGeometry::shapeName(config.shape),
+            (unsigned long)config.heightMm, (unsigned long)(tanks[i].geometry.capacityMl() / 1000));
+      }
     }
+    USE_SERIAL.printf("Telemetry queue: %u samples waiting\n", telemetryQueue.size());
+  } else {
+    USE_SERIAL.println("Filesystem unavailable, offline samples will be lost");
+  }
+  bootTimer.mark(BOOT_STORAGE, millis());
+
+  sonarCycle.begin(onEcho, nullptr);
+  for (uint8_t i = 0; i < TANK_SENSORS; i++) {
+    TankContext &tank = tanks[i];
+    tank.sensor.trigPin = trigPins[i];
+    tank.sensor.echoPin = echoPins[i];
+    tank.sensor.group = sonarGroups[i];
+    halPinOutput(tank.sensor.trigPin);
+    halPinInput(tank.sensor.echoPin);
+    tank.sonar.begin(triggerSonar, &tank, SONAR_TIMEOUT_US);
+    attachInterruptArg(digitalPinToInterrupt(tank.sensor.echoPin), echoInterrupt, &tank, CHANGE);
+    sonarCycle.add(&tank.sonar, tank.sensor.group, tank.rate.getPeriodMs());
   }
+  bootTimer.mark(BOOT_SENSORS, millis());
+
+  measureAtBoot();
+  bootTimer.mark(BOOT_MEASURE, millis());
+
+  bool fastWifi = warmWake && fastConnectWifi();
+  if (!fastWifi && !wifiProvisioned()) {
+    // Setup Wifi Manager
+    static const char version[] = "<p>Current Version - v" CURRENT_VERSION "</p>";
+    USE_SERIAL.println(version);
+
+    WiFiManager wm;
+    WiFiManagerParameter versionText(version);
+    wm.addParameter(&versionText);
 
+    if (!wm.autoConnect()) {
+      USE_SERIAL.println("failed to connect and hit timeout");
+      //reset and try again, or maybe put it to deep sleep
+      ESP.restart();
+      delay(1000);
+    }
+  }
+ 
   server.on("/", handleRoot);
+  server.on("/metrics", handleMetrics);
+  server.on("/api/level", handleApiLevel);
+  server.on("/api/history", handleApiHistory);
   server.begin();
   USE_SERIAL.println("HTTP server started");
 
-  USE_SERIAL.print("IP address: ");
-  USE_SERIAL.println(WiFi.localIP());
-
+  // Parsed once for the MQTT, OTA and Telegram clients
+  const char *trustAnchors[] = { primary_ca, backup_ca, TELEGRAM_CERTIFICATE_ROOT, GTS_ROOT_R1, GTS_ROOT_R4 };
+  tlsBegin(trustAnchors, sizeof(trustAnchors) / sizeof(trustAnchors[0]));
+#ifndef NOTIFY_WEBHOOK_URL
+  tlsGate.setClose(TLS_NOTIFY, closeTelegram, nullptr);
+#endif
   setupCloudIoT();
+  mqttClient->onMessageAdvanced(onMqttMessage);
+  if (fastWifi) {
+    connection.deferAttempt(millis(), FAST_WIFI_TIMEOUT);
+  }
+  bootTimer.mark(BOOT_NETWORK, millis());
+
+  // Highest priority first
+  scheduler.begin(halMillis, halMicros);
+  sensorTask = scheduler.add("sensor", sensorTaskRun, nullptr, SONAR_CYCLE_POLL_MS, 20);
+  mqttTask = scheduler.add("mqtt", mqttTaskRun, nullptr, PERIODE_MQTT);
+  // Waits for the first publish, a duty cycle wake checks after it, before it sleeps
+  scheduler.add("ota", otaTaskRun, nullptr, PERIODE_OTA, 120000);
+#if DUTY_CYCLE_SECONDS > 0
+  telemetryTask = scheduler.add("telemetry", dutyCycleTaskRun, nullptr, 100);
+#else
+  telemetryTask = scheduler.add("telemetry", telemetryTaskRun, nullptr, PERIODE_ENVOI, 5000);
+#endif
+#ifdef NOTIFY_WEBHOOK_URL
+  notifier.begin({nullptr, sendWebhook, closeWebhook}, millis(), ESP.getCycleCount());
+#else
+  notifier.begin({nullptr, sendTelegram, closeTelegram}, millis(), ESP.getCycleCount());
+#endif
+  notificationTask = scheduler.add("notification", notificationTaskRun, nullptr, PERIODE_NOTIFICATION, 10000);
+  httpTask = scheduler.add("http", httpTaskRun, nullptr, PERIODE_HTTP);
+#if PERIODE_METRIQUES > 0
+  scheduler.add("metrics", metricsTaskRun, nullptr, PERIODE_METRIQUES);
+#endif
 
-  pinMode(trigPin, OUTPUT); // set the trigger pin as output
-  pinMode(echoPin, INPUT);  // set the echo pin as input
+  // A subsystem per task with the same id, then the sections the hot ones call into
+  heapMonitor.begin(sampleHeap);
+  for (uint8_t i = 0; i < scheduler.size(); i++) {
+    // A duty cycle wake does everything from the telemetry task, it is not a steady state
+    heapMonitor.add(scheduler.task(i).name, i == sensorTask || (DUTY_CYCLE_SECONDS == 0 && i == telemetryTask));
+  }
+  flashSection = heapMonitor.add("flash", false);
+  publishSection = heapMonitor.add("publish", false);
+  scheduler.setHook(heapHook, nullptr);
 }
 
 
 
 void loop() {
-  mqtt->loop();
-  delay(10);  // <- fixes some issues with WiFi stability
-  if (!mqttClient->connected()) {
-    connect();
+  uint32_t start = micros();
+  uint32_t idle = scheduler.run();
+  loopTimeUs.record(micros() - start);
+#if defined(ESP8266)
+  // The ESP8266 core keeps no low-water mark, sample it here
+  uint32_t freeHeap = ESP.getFreeHeap();
+  if (freeHeap < minFreeHeap) {
+    minFreeHeap = freeHeap;
   }
+#endif
 
-  if (millis() - lastMillis > PERIODE_ENVOI)
-  {
-    lastMillis = millis();
-    ledState = ledState == LOW ? HIGH : LOW;
-    digitalWrite( BUILTIN_LED, ledState );
+  // Sleep until the next task is due, delay() also lets the WiFi stack run
+  if (idle > 0) {
+    delay(idle < PERIODE_VEILLE_MAX ? idle : PERIODE_VEILLE_MAX);
+  } else {
+    yield();
+  }
+}
+
+///////////////////////////////
+// Tasks
+///////////////////////////////
+void sampleHeap(HeapSample &sample)
+{
+  sample.allocations = halHeapAllocations();
+  sample.freeBytes = halHeapFree();
+  sample.largestBlock = halHeapLargestBlock();
+}
+
+/*
+ * Around every task run. An allocation in a hot task is logged once per
+ * task, the count keeps going up on /metrics.
+ */
+void heapHook(void *, uint8_t id, bool done)
+{
+  if (!done) {
+    heapMonitor.enter(id);
+    return;
+  }
+  uint32_t allocations = heapMonitor.leave(id);
+  const HeapStats &stats = heapMonitor.stats(id);
+  if (allocations > 0 && stats.hot && stats.violations == 1) {
+    USE_SERIAL.printf("Heap: %lu allocations in the %s task\n", (unsigned long)allocations, stats.name);
+  }
+}
+
+/*
+ * Level tables and bounds of the adaptive sensor periods from the tank
+ * configs, as configured: a longer shortest period saves power.
+ */
+void configureTanks()
+{
+  for (uint8_t i = 0; i < TANK_SENSORS; i++) {
+    const TankConfig &config = tankConfigState.tanks[i];
+    TankContext &tank = tanks[i];
+    tankGeometryBuild(config, tank.geometry);
+    AcquisitionConfig acquisition = AdaptiveRate::defaults();
+    acquisition.minPeriodMs = config.acquisitionMinMs;
+    acquisition.maxPeriodMs = config.acquisitionMaxMs > config.acquisitionMinMs ? config.acquisitionMaxMs : config.acquisitionMinMs;
+    tank.rate.configure(acquisition);
+    sonarCycle.setPeriod(i, tank.rate.getPeriodMs());
+  }
+  reporter.configure(tankConfig.report);
+}
 
-    getTankLevel();    
+/* 
+ * An echo ended or timed out: filter it and adapt the period of its tank.
+ */
+void onEcho(void *, uint8_t index, const SonarSample &sample)
+{
+  TankContext &tank = tanks[index];
+  if (sample.status != SONAR_OK) {
+    tank.failures++;
+    return;
   }
+  tank.filter.push(sample.durationUs);
+#if DUTY_CYCLE_SECONDS == 0
+  // A wake samples in a burst, only the always-on device adapts, after its first measurement
+  if (measuringAtBoot) {
+    return;
+  }
+  sonarCycle.setPeriod(index, tank.rate.update(millis(), sample.durationUs, tank.filter.getEstimate().value));
+#endif
+}
 
-  // Just chill
+/* 
+ * Collect the echoes that ended and fire the sensors that are due, then
+ * sleep until the cycle needs the next look.
+ */
+void sensorTaskRun(void *)
+{
+  uint32_t start = micros();
+  scheduler.setPeriod(sensorTask, sonarCycle.service(micros(), millis()));
+  acquisitionTimeUs.record(micros() - start);
+}
+
+/* 
+ * Connection state machine, MQTT keepalive and replay of the offline queue.
+ */
+void mqttTaskRun(void *)
+{
+  // Never blocks: each call makes at most one connection attempt
+  checkFastWifi();
+  ConnectionState previousState = connection.getState();
+  uint32_t timeInPreviousState = connection.timeInState(millis());
+  uint32_t connects = connectStats.connects;
+  connection.tick(millis());
+  if (connectStats.connects != connects) {
+    tlsConnectMs.record(connectStats.lastConnectMs);
+    tlsGate.record(TLS_MQTT, connectStats.lastHeapBytes);
+    tlsGate.setFragmentLength(TLS_MQTT, connectStats.fragmentLength);
+  }
+  if (connection.getState() != previousState) {
+    USE_SERIAL.printf("Connection: %s -> %s after %lu ms\n", ConnectionManager::stateName(previousState),
+        connection.getStateName(), (unsigned long)timeInPreviousState);
+    if (previousState == CONN_WIFI) {
+      USE_SERIAL.print("IP address: ");
+      USE_SERIAL.println(WiFi.localIP());
+    }
+    bootTimer.mark((BootPhase)(BOOT_WIFI + previousState), millis());
+  }
+
+  if (connection.connected()) {
+    mqttLoop();
+    if (!telemetryQueue.empty()) {
+      drainTelemetryQueue();
+    } else if (DUTY_CYCLE_SECONDS == 0 && bootTimer.finished()) {
+      // Idle, the servers met so far learn their fragment length, one per run.
+      // Not in duty cycle: the next wake would have forgotten the answers.
+      tlsProbePending();
+    }
+  }
+}
+
+void telemetryTaskRun(void *)
+{
+  // The first level as soon as the connection is up, then every PERIODE_ENVOI
+  if (!bootTimer.finished()) {
+    if (!connection.connected() && millis() < BOOT_PUBLISH_WAIT) {
+      scheduler.setPeriod(telemetryTask, PERIODE_MQTT);
+      return;
+    }
+    scheduler.setPeriod(telemetryTask, PERIODE_ENVOI);
+  }
+
+  ledState = ledState == LOW ? HIGH : LOW;
+  digitalWrite( BUILTIN_LED, ledState );
+
+  getTankLevel();
+}
+
+/* 
+ * One publish per wake, then deep sleep.
+ */
+void dutyCycleTaskRun(void *)
+{
+#if DUTY_CYCLE_SECONDS > 0
+  bool measured = true;
+  for (uint8_t i = 0; i < TANK_SENSORS; i++) {
+    measured = measured && tanks[i].filter.getEstimate().samples + tanks[i].failures >= DUTY_CYCLE_SAMPLES;
+  }
+  if (measured && (mqttClient->connected() || millis() > DUTY_CYCLE_MAX_AWAKE))
+  {
+    getTankLevel();
+    // A refused publish leaves the rest for the next wake instead of retrying until the deadline
+    while (mqttClient->connected() && millis() < DUTY_CYCLE_MAX_AWAKE && drainTelemetryQueue()) {
+      yield();
+    }
+    // The notification task would not get another chance before the sleep
+    while (!notifier.empty() && millis() < DUTY_CYCLE_MAX_AWAKE && notifier.tick(millis())) {
+    }
+    otaTaskRun(nullptr);
+    goToSleep();
+  }
+#endif
+}
+
+/* 
+ * At most one message per run, the rate limit and retry delays live in the notifier.
+ */
+void notificationTaskRun(void *)
+{
+  notifier.tick(millis());
+}
+
+void httpTaskRun(void *)
+{
   server.handleClient();
 }
 
+/*
+ * Burn rate, refills and abnormal drops, once the clock and the tank are set.
+ */
+void trackConsumption()
+{
+  time_t now = time(nullptr);
+  if (now < 1510644967 || !tankConfigured(tankConfig) || !tanks[0].filter.ready()) {
+    return;
+  }
+
+  char text[NOTIFY_MESSAGE_SIZE];
+  switch (consumption.update((uint32_t)now, tanks[0].level.volumeMl)) {
+    case CONSUMPTION_REFILL:
+      snprintf(text, sizeof(text), "La citerne a été remplie (+%lu litres)",
+               (unsigned long)((consumption.episodeMl() + 500) / 1000));
+      break;
+    case CONSUMPTION_DROP:
+      snprintf(text, sizeof(text), "Baisse anormale du niveau (-%lu litres), fuite ou vol?",
+               (unsigned long)((consumption.episodeMl() + 500) / 1000));
+      break;
+    default:
+      return;
+  }
+  if (!notifier.enqueue(text, millis())) {
+    USE_SERIAL.print("Notification not queued: ");
+    USE_SERIAL.println(text);
+  }
+}
+
+/*
+ * Alerts of a tank, named after it when the device has several.
+ */
+void notifyTank(uint8_t index, const char *alert)
+{
+  char text[NOTIFY_MESSAGE_SIZE];
+  if (TANK_SENSORS > 1) {
+    snprintf(text, sizeof(text), "Citerne %u: %s", index + 1, alert);
+    alert = text;
+  }
+  if (!notifier.enqueue(alert, millis())) {
+    USE_SERIAL.print("Notification not queued: ");
+    USE_SERIAL.println(alert);
+  }
+}
+
+/*
+ * The first level is out, queued or did not need to be: the boot is over.
+ */
+void bootFinished()
+{
+  if (bootTimer.finished()) {
+    return;
+  }
+  bootTimer.finish(millis());
+  char line[160];
+  bootTimer.format(line, sizeof(line));
+  USE_SERIAL.println(line);
+}
+
+/*
+ * The telemetry message of the levels, with the boot phases in the first one.
+ */
+void writeLevels(TelemetryWriter &payload, bool boot)
+{
+  payload.beginObject();
+  // payload.addUInt("timestamp", time(nullptr));
+#if TANK_SENSORS > 1
+  tankWriteBatchTelemetry(payload, tanks, TANK_SENSORS);
+#else
+  tankWriteTelemetry(payload, tanks[0].level, tanks[0].filter.getEstimate());
+  payload.addUInt("acquisition_period_ms", tanks[0].rate.getPeriodMs());
+#endif
+  consumptionWriteTelemetry(payload, consumption);
+  payload.addUInt("suppressed_reports", reporter.getSkipped());
+#if DUTY_CYCLE_SECONDS > 0
+  rtcState.lastWakeToPublishMs = millis();
+  payload.addUInt("wake_to_publish_ms", rtcState.lastWakeToPublishMs);
+  payload.addUInt("wake_count", rtcState.wakeCount);
+#endif
+  if (boot) {
+    bootTimer.writeTelemetry(payload, millis());
+  }
+  payload.endObject();
+}
+
+/*
+ * Levels of every tank with a valid echo, then one message for them all.
+ */
 void getTankLevel()
 {
-  // Clear the trigPin by setting it LOW:
-  digitalWrite(trigPin, LOW);
+  // Filtered width of the echo pulse in microseconds, the sensor temperature wins over the configured one
+  int16_t temperature;
+  if (!halTemperature(temperature)) {
+    temperature = TANK_NO_TEMPERATURE;
+  }
+  uint32_t volumesMl[TANK_SENSORS];
+  uint32_t fullVolumesMl[TANK_SENSORS];
+  bool measured = false;
+  for (uint8_t i = 0; i < TANK_SENSORS; i++) {
+    const TankConfig &config = tankConfigState.tanks[i];
+    TankContext &tank = tanks[i];
+    volumesMl[i] = tank.level.volumeMl;
+    fullVolumesMl[i] = config.fullVolumeMl;
+    if (!tank.filter.ready()) {
+      USE_SERIAL.printf("Sonar %u: no valid echo (%lu failures)\n", i, (unsigned long)tank.failures);
+      continue;
+    }
+    const char *alert = tankUpdate(config, tank.geometry, tank.filter.getEstimate(), temperature, tank.level, tank.alerts);
+    if (alert) {
+      notifyTank(i, alert);
+    }
+    USE_SERIAL.printf("Distance %u: %lu mm at %lu mm/s\n", i, (unsigned long)tank.level.distanceMm,
+        (unsigned long)tank.level.soundSpeedMmS);
+    USE_SERIAL.printf("Calcul %u: %ld liter\n", i, (long)tank.level.volume);
+    volumesMl[i] = tank.level.volumeMl;
+    tank.levelMs = millis() ? millis() : 1;
+    measured = true;
+    // Kept whether it gets published or not, once the clock is set
+    TelemetryRecord record = { (uint32_t)time(nullptr), tank.level.volume, tank.level.percent, i };
+    if (record.timestamp > 1510644967) {
+      heapMonitor.enter(flashSection);
+      history.append(record);
+      heapMonitor.leave(flashSection);
+    }
+  }
+  if (!measured) {
+    return;
+  }
+  trackConsumption();
 
-  // wait 2ms to make sure the trigPin is LOW
-  delayMicroseconds(2);
+  // Wall clock across deep sleep, millis() is enough when always on
+#if DUTY_CYCLE_SECONDS > 0
+  uint32_t reportClock = time(nullptr);
+#else
+  uint32_t reportClock = millis() / 1000;
+#endif
+  ReportReason reason = reporter.decide(reportClock, volumesMl, fullVolumesMl, TANK_SENSORS);
+  if (reason == REPORT_SUPPRESSED) {
+    USE_SERIAL.printf("publishTelemetry -> suppressed (%u since the last one)\n", reporter.getState().suppressed);
+    bootFinished();
+    return;
+  }
 
-  // Trigger the sensor by setting the trigPin high for 10 microseconds:
-  digitalWrite(trigPin, HIGH);
-  delayMicroseconds(10);
-  digitalWrite(trigPin, LOW);
+  TelemetryWriter payload(telemetryBuffer, sizeof(telemetryBuffer), tankConfig.telemetryFormat);
+  writeLevels(payload, !bootTimer.finished());
+  if (payload.overflowed() && !bootTimer.finished()) {
+    // Several tanks can leave no room for the boot phases, the serial console still gets them
+    payload = TelemetryWriter(telemetryBuffer, sizeof(telemetryBuffer), tankConfig.telemetryFormat);
+    writeLevels(payload, false);
+  }
+
+  // The level still goes out, as a queued record without the other fields
+  if (payload.overflowed()) {
+    USE_SERIAL.println("publishTelemetry: payload too large, level queued");
+  }
+
+  // Keep the order: while a backlog exists new samples go behind it
+  if (payload.overflowed() || !telemetryQueue.empty() || !halNetworkConnected() ||
+      !publishTimed(payload.data(), payload.length())) {
+    heapMonitor.enter(flashSection);
+    for (uint8_t i = 0; i < TANK_SENSORS; i++) {
+      TelemetryRecord record = { (uint32_t)time(nullptr), tanks[i].level.volume, tanks[i].level.percent, i };
+      telemetryQueue.push(record);
+    }
+    heapMonitor.leave(flashSection);
+    USE_SERIAL.printf("publishTelemetry -> queued (%u waiting)\n", telemetryQueue.size());
+    // Stored for the replay, which carries no boot phases
+    bootFinished();
+    return;
+  }
+
+  if (tankConfig.telemetryFormat == TELEMETRY_JSON) {
+    // printf() allocates past 64 characters
+    USE_SERIAL.print("publishTelemetry -> ");
+    USE_SERIAL.write((const uint8_t *)payload.data(), payload.length());
+    USE_SERIAL.println();
+  } else {
+    USE_SERIAL.printf("publishTelemetry -> %u bytes of CBOR\n", (unsigned)payload.length());
+  }
+  bootFinished();
+  publishDimensions();
+}
+
+/*
+ * Dimensions of each tank on the "tank" telemetry subfolder, after the first
+ * level and after each new config rather than in every level message. One
+ * message per tank: four of them at their largest would not fit one buffer.
+ */
+void publishDimensions()
+{
+  if (dimensionsSent) {
+    return;
+  }
+
+  for (uint8_t i = 0; i < TANK_SENSORS; i++) {
+    TelemetryWriter payload(telemetryBuffer, sizeof(telemetryBuffer), tankConfig.telemetryFormat);
+    payload.beginObject();
+#if TANK_SENSORS > 1
+    payload.addUInt("tank", i);
+#endif
+    tankWriteDimensions(payload, tankConfigState.tanks[i]);
+    payload.endObject();
+    // Sent again in full next time when one is missing
+    if (payload.overflowed() || !halPublish("/tank", payload.data(), payload.length())) {
+      return;
+    }
+  }
+  dimensionsSent = true;
+}
+
+/* 
+ * Replay samples stored while offline, up to TELEMETRY_BATCH_SIZE per message,
+ * fewer when they do not all fit in telemetryBuffer. False when nothing left
+ * the queue: it is empty or the publish failed.
+ */
+bool drainTelemetryQueue()
+{
+  TelemetryRecord records[TELEMETRY_BATCH_SIZE];
+  uint16_t count = telemetryQueue.peek(records, TELEMETRY_BATCH_SIZE);
+  if (count == 0) {
+    return false;
+  }
+
+  size_t length;
+  count = telemetryWriteBatch(telemetryBuffer, sizeof(telemetryBuffer), tankConfig.telemetryFormat, records, count,
+                              TANK_SENSORS > 1, length);
+  if (count == 0) {
+    // Cannot happen with a sane buffer, but a record stuck at the head would block the queue for good
+    USE_SERIAL.println("drainTelemetryQueue: record too large, dropped");
+    telemetryQueue.pop(1);
+    return true;
+  }
+
+  if (!publishTimed(telemetryBuffer, length)) {
+    return false;
+  }
+  telemetryQueue.pop(count);
+  USE_SERIAL.printf("publishTelemetry -> %u queued samples, %u left\n", count, telemetryQueue.size());
+  return true;
+}
+
+///////////////////////////////
+// HAL network, the MQTT client only exists in this translation unit
+///////////////////////////////
+bool halNetworkConnected()
+{
+  return mqttClient->connected();
+}
+
+bool halPublish(const char *subfolder, const char *data, size_t len)
+{
+  if (subfolder) {
+    return publishTelemetry(subfolder, data, len);
+  }
+  return publishTelemetry(data, len);
+}
+
+bool publishTimed(const char *data, size_t length)
+{
+  unsigned long start = millis();
+  heapMonitor.enter(publishSection);
+  bool published = halPublish(nullptr, data, length);
+  heapMonitor.leave(publishSection);
+  publishLatencyMs.record(millis() - start);
+  return published;
+}
+
+///////////////////////////////
+// Metrics
+///////////////////////////////
+uint32_t heapFree()
+{
+  return halHeapFree();
+}
+
+uint32_t heapMinFree()
+{
+#if defined(ESP8266)
+  return minFreeHeap == UINT32_MAX ? ESP.getFreeHeap() : minFreeHeap;
+#else
+  return ESP.getMinFreeHeap();
+#endif
+}
+
+// 0 when the free heap is one block, 100 when it is dust
+uint8_t heapFragmentation()
+{
+#if defined(ESP8266)
+  return ESP.getHeapFragmentation();
+#else
+  return HeapMonitor::fragmentation(halHeapFree(), halHeapLargestBlock());
+#endif
+}
 
-  // Read the echoPin. pulseIn() returns the duration (length of the pulse) in microseconds:
-  duration = pulseIn(echoPin, HIGH);
-  distance = (duration * 0.0343) / 2;  // calculate the distance based on the speed of sound
-                                       // we need to divide by 2 since the sound travelled the distance twice
+void sendChunk(void *, const char *data, size_t len)
+{
+  server.sendContent(data, len);
+}
 
-  USE_SERIAL.println("Distance #: " + String(distance) + "cm");
+void handleMetrics()
+{
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "text/plain; version=0.0.4", "");
 
-  waterFilllevel = TANK_HEIGHT_IN_CM - distance;
+  char buffer[METRICS_BUFFER_SIZE];
+  PrometheusWriter metrics(buffer, sizeof(buffer), sendChunk);
+  metrics.histogram("oiltank_loop_duration_us", "Time spent in one loop() iteration.", loopTimeUs);
+  metrics.histogram("oiltank_acquisition_duration_us", "Time spent collecting and filtering one sonar echo.", acquisitionTimeUs);
+  metrics.histogram("oiltank_publish_latency_ms", "MQTT publish latency.", publishLatencyMs);
+  metrics.histogram("oiltank_tls_connect_ms", "Successful MQTT connect time, JWT and TLS handshake included.", tlsConnectMs);
+  metrics.histogram("oiltank_ota_duration_ms", "OTA check and download time.", otaDurationMs);
+  metrics.histogram("oiltank_api_duration_ms", "Local API response time.", apiLatencyMs);
+  metrics.gauge("oiltank_history_bytes", "Flash used by the levels kept for /api/history.", history.bytes());
+  metrics.counter("oiltank_ota_bytes_total", "Firmware bytes downloaded.", otaStats.bytesReceived);
+  metrics.counter("oiltank_ota_resumes_total", "OTA downloads resumed with a Range request.", otaStats.resumes);
+  metrics.gauge("oiltank_ota_throughput_bytes_per_second", "Download rate of the last OTA.", otaStats.lastThroughput);
+  metrics.gauge("oiltank_ota_last_result", "Result of the last OTA, 0 is success.", otaStats.lastResult);
 
-  USE_SERIAL.println("Calcul #: " + String((TANK_LENGTH_IN_CM * TANK_WIDTH_IN_CM * waterFilllevel) / 1000) + "liter");
+  metrics.gauge("oiltank_heap_free_bytes", "Free heap.", heapFree());
+  metrics.gauge("oiltank_heap_min_free_bytes", "Lowest free heap since boot.", heapMinFree());
+  metrics.gauge("oiltank_heap_fragmentation_percent", "Heap fragmentation.", heapFragmentation());
+  metrics.gauge("oiltank_heap_largest_block_bytes", "Largest free heap block.", halHeapLargestBlock());
+  metrics.gauge("oiltank_heap_min_largest_block_bytes", "Smallest largest free block seen around a task run.", heapMonitor.minLargest());
+  metrics.counter("oiltank_heap_allocations_total", "Heap allocations from loop().", halHeapAllocations());
+  metrics.counter("oiltank_heap_hot_allocations_total", "Runs of a hot task that allocated, 0 in a steady state.", heapMonitor.getViolations());
+  metrics.gauge("oiltank_wifi_rssi_dbm", "WiFi signal strength.", WiFi.RSSI());
+  metrics.gauge("oiltank_uptime_ms", "Time since boot.", millis());
+  metrics.gauge("oiltank_boot_first_publish_ms", "Reset to the first level published, 0 until then.", bootTimer.firstPublishMs());
+  metrics.counter("oiltank_reconnects_total", "Connections lost after being established.", connection.getReconnects());
+  metrics.counter("oiltank_mqtt_connects_total", "MQTT connections opened.", connectStats.connects);
+  metrics.counter("oiltank_tls_resumed_total", "MQTT connections that resumed a TLS session.", connectStats.tlsResumed);
+  metrics.counter("oiltank_jwt_signed_total", "JWT signatures computed.", connectStats.jwtSigned);
+  metrics.counter("oiltank_sonar_measurements_total", "Sonar acquisitions, every tank.", sonarCycle.getMeasurements());
+  metrics.counter("oiltank_sonar_deferred_total", "Triggers put off while a sensor of the same group was busy.", sonarCycle.getDeferred());
+  metrics.gauge("oiltank_queue_samples", "Samples waiting in the offline queue.", telemetryQueue.size());
+  metrics.gauge("oiltank_notifications_queued", "Notifications waiting to be sent.", notifier.size());
+  metrics.counter("oiltank_notifications_sent_total", "Notifications delivered.", notifier.getSent());
+  metrics.counter("oiltank_notification_failures_total", "Failed notification sends, retries included.", notifier.getFailures());
+  metrics.counter("oiltank_notifications_dropped_total", "Notifications lost to a full queue or too many retries.", notifier.getDropped());
+  metrics.counter("oiltank_notifications_deduplicated_total", "Notifications skipped as duplicates.", notifier.getDuplicates());
+  metrics.gauge("oiltank_burn_rate_ml_per_day", "Consumption rate, 0 until learned.", consumption.ready() ? consumption.rateMlPerDay() : 0);
+  metrics.counter("oiltank_reports_suppressed_total", "Levels not published, within the deadband.", reporter.getSuppressed());
+  metrics.counter("oiltank_refills_total", "Refills detected.", consumption.getState().refills);
+  metrics.counter("oiltank_abnormal_drops_total", "Drops faster than the burn rate (leak, theft).", consumption.getState().drops);
 
-  if (distance >= TANK_HEIGHT_IN_CM) {
-    tank_volume = 0;
-    tank_percent = 0;
+  metrics.family("oiltank_tls_connections_total", "counter", "TLS connections opened.");
+  for (uint8_t i = 0; i < TLS_CLIENT_COUNT; i++) {
+    metrics.sample("oiltank_tls_connections_total", tlsGate.usage((TlsClientKind)i).connects, "client", tlsProfiles[i].name);
+  }
+  metrics.family("oiltank_tls_peak_heap_bytes", "gauge", "Largest heap use of one TLS connection.");
+  for (uint8_t i = 0; i < TLS_CLIENT_COUNT; i++) {
+    metrics.sample("oiltank_tls_peak_heap_bytes", tlsGate.usage((TlsClientKind)i).peakBytes, "client", tlsProfiles[i].name);
+  }
+  metrics.family("oiltank_tls_fragment_length_bytes", "gauge", "Negotiated TLS fragment length, 0 for full 16 kB records.");
+  for (uint8_t i = 0; i < TLS_CLIENT_COUNT; i++) {
+    metrics.sample("oiltank_tls_fragment_length_bytes", tlsGate.usage((TlsClientKind)i).fragmentLength, "client", tlsProfiles[i].name);
   }
 
-  if (distance < 10 && distance > 0 && !telegramNotificationTankFullSent) {
-    tank_volume = FULL_VOLUME_IN_LITERS;
-    tank_percent = 100;
+  static const char *const tankLabels[] = { "0", "1", "2", "3" };
+  static_assert(sizeof(tankLabels) / sizeof(tankLabels[0]) >= TANK_SENSORS, "a label per tank");
+  metrics.family("oiltank_sonar_failures_total", "counter", "Sonar acquisitions without a valid echo.");
+  for (uint8_t i = 0; i < TANK_SENSORS; i++) {
+    metrics.sample("oiltank_sonar_failures_total", tanks[i].failures, "tank", tankLabels[i]);
+  }
+  metrics.family("oiltank_acquisition_period_ms", "gauge", "Current sensor sampling period.");
+  for (uint8_t i = 0; i < TANK_SENSORS; i++) {
+    metrics.sample("oiltank_acquisition_period_ms", tanks[i].rate.getPeriodMs(), "tank", tankLabels[i]);
+  }
+  metrics.family("oiltank_acquisition_activations_total", "counter", "Times the level moved and sampling went back to the fastest rate.");
+  for (uint8_t i = 0; i < TANK_SENSORS; i++) {
+    metrics.sample("oiltank_acquisition_activations_total", tanks[i].rate.getActivations(), "tank", tankLabels[i]);
+  }
 
-    bot.sendMessage(CHAT_ID, "La citerne est pleine!", "");
-    telegramNotificationTankFullSent = true;
-    telegramNotificationTankEmptySent = false;
+  metrics.family("oiltank_task_runs_total", "counter", "Scheduler task runs.");
+  for (uint8_t i = 0; i < scheduler.size(); i++) {
+    metrics.sample("oiltank_task_runs_total", scheduler.task(i).stats.runs, "task", scheduler.task(i).name);
+  }
+  metrics.family("oiltank_task_overruns_total", "counter", "Scheduler task runs that missed their deadline.");
+  for (uint8_t i = 0; i < scheduler.size(); i++) {
+    metrics.sample("oiltank_task_overruns_total", scheduler.task(i).stats.overruns, "task", scheduler.task(i).name);
+  }
+  metrics.family("oiltank_task_max_jitter_ms", "gauge", "Largest start delay of a scheduler task.");
+  for (uint8_t i = 0; i < scheduler.size(); i++) {
+    metrics.sample("oiltank_task_max_jitter_ms", scheduler.task(i).stats.maxJitterMs, "task", scheduler.task(i).name);
+  }
+  metrics.family("oiltank_task_max_duration_us", "gauge", "Longest run of a scheduler task.");
+  for (uint8_t i = 0; i < scheduler.size(); i++) {
+    metrics.sample("oiltank_task_max_duration_us", scheduler.task(i).stats.maxDurationUs, "task", scheduler.task(i).name);
   }
 
-  if (distance >= 10 && distance <= TANK_HEIGHT_IN_CM) {
-    tank_volume = (TANK_LENGTH_IN_CM * TANK_WIDTH_IN_CM * waterFilllevel) / 1000;
-    tank_percent = (((float)tank_volume / FULL_VOLUME_IN_LITERS) * 100);
+  // Tasks and the sections they call into
+  metrics.family("oiltank_subsystem_allocations_total", "counter", "Heap allocations of a subsystem, its nested sections excluded.");
+  for (uint8_t i = 0; i < heapMonitor.size(); i++) {
+    metrics.sample("oiltank_subsystem_allocations_total", heapMonitor.stats(i).allocations, "subsystem", heapMonitor.stats(i).name);
+  }
+  metrics.family("oiltank_subsystem_hot_allocations_total", "counter", "Runs of a hot subsystem that allocated.");
+  for (uint8_t i = 0; i < heapMonitor.size(); i++) {
+    metrics.sample("oiltank_subsystem_hot_allocations_total", heapMonitor.stats(i).violations, "subsystem", heapMonitor.stats(i).name);
+  }
+  metrics.family("oiltank_subsystem_min_free_bytes", "gauge", "Lowest free heap around the runs of a subsystem.");
+  for (uint8_t i = 0; i < heapMonitor.size(); i++) {
+    metrics.sample("oiltank_subsystem_min_free_bytes", heapMonitor.stats(i).minFree, "subsystem", heapMonitor.stats(i).name);
+  }
+  metrics.family("oiltank_subsystem_min_largest_block_bytes", "gauge", "Smallest largest free block around the runs of a subsystem.");
+  for (uint8_t i = 0; i < heapMonitor.size(); i++) {
+    metrics.sample("oiltank_subsystem_min_largest_block_bytes", heapMonitor.stats(i).minLargest, "subsystem", heapMonitor.stats(i).name);
   }
+  metrics.family("oiltank_subsystem_max_fragmentation_percent", "gauge", "Highest heap fragmentation around the runs of a subsystem.");
+  for (uint8_t i = 0; i < heapMonitor.size(); i++) {
+    metrics.sample("oiltank_subsystem_max_fragmentation_percent", heapMonitor.stats(i).maxFragmentation, "subsystem", heapMonitor.stats(i).name);
+  }
+  metrics.finish();
+  server.sendContent("");
+}
 
-  if(tank_percent < 20 && !telegramNotificationTankEmptySent) {
-    bot.sendMessage(CHAT_ID, "La citerne est vide!!!", "");
-    telegramNotificationTankFullSent = false;
-    telegramNotificationTankEmptySent = true;
+///////////////////////////////
+// Local REST API, from what the tasks already computed: a request never triggers a sensor
+///////////////////////////////
+uint32_t argUInt(const char *name, uint32_t fallback)
+{
+  return server.hasArg(name) ? strtoul(server.arg(name).c_str(), nullptr, 10) : fallback;
+}
+
+void handleApiLevel()
+{
+  unsigned long start = millis();
+  char body[API_CHUNK_SIZE];
+  size_t length = apiLevel(body, sizeof(body), tankConfigState.tanks, tanks, TANK_SENSORS, millis(), time(nullptr));
+  if (length == 0) {
+    server.send(500, "text/plain", "Level too large");
+    return;
   }
+  server.setContentLength(length);
+  server.send(200, "application/json", "");
+  server.sendContent(body, length);
+  apiLatencyMs.record(millis() - start);
+}
 
-  String payload = /*String("{\"timestamp\":") + time(nullptr) +*/
-                     String("{\"current_volume_in_liters\":") + tank_volume +
-                     String(",\"current_volume_in_percent\":") + tank_percent +
-                     String(",\"full_volume_in_liters\":") + FULL_VOLUME_IN_LITERS +
-                     String(",\"on\":") + "true" +
-                     String(",\"tank_height_in_cm\":") + TANK_HEIGHT_IN_CM +
-                     String(",\"tank_lenght_in_cm\":") + TANK_LENGTH_IN_CM +
-                     String(",\"tank_width_in_cm\":") + TANK_WIDTH_IN_CM +
-                     String("}");
-  publishTelemetry(payload);
-  USE_SERIAL.println("publishTelemetry -> " + payload);
+/* 
+ * /api/history?from=&to=&limit= in epoch seconds, chunked straight from
+ * flash. A full answer ends with "next", the from of the following page.
+ */
+void handleApiHistory()
+{
+  unsigned long start = millis();
+  uint32_t from = argUInt("from", 0);
+  uint32_t to = argUInt("to", UINT32_MAX);
+  uint32_t limit = argUInt("limit", API_HISTORY_MAX_SAMPLES);
+  if (from > to || limit == 0) {
+    server.send(400, "text/plain", "Expected from <= to and limit > 0");
+    return;
+  }
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "application/json", "");
+  char buffer[API_CHUNK_SIZE];
+  apiHistory(history, from, to, limit < API_HISTORY_MAX_SAMPLES ? limit : API_HISTORY_MAX_SAMPLES,
+             buffer, sizeof(buffer), sendChunk, nullptr);
+  server.sendContent("");
+  apiLatencyMs.record(millis() - start);
+}
+
+/* 
+ * Compact summary of the metrics on the "metrics" telemetry subfolder.
+ */
+void metricsTaskRun(void *)
+{
+  if (!halNetworkConnected()) {
+    return;
+  }
+
+  TelemetryWriter payload(telemetryBuffer, sizeof(telemetryBuffer), tankConfig.telemetryFormat);
+  payload.beginObject();
+  payload.addUInt("uptime_ms", millis());
+  payload.addUInt("heap_free", heapFree());
+  payload.addUInt("heap_min_free", heapMinFree());
+  payload.addUInt("heap_fragmentation", heapFragmentation());
+  payload.addUInt("heap_min_largest_block", heapMonitor.minLargest());
+  payload.addUInt("heap_hot_allocations", heapMonitor.getViolations());
+  payload.addInt("rssi", WiFi.RSSI());
+  payload.addUInt("reconnects", connection.getReconnects());
+  payload.addUInt("loop_p95_us", loopTimeUs.percentile(95));
+  payload.addUInt("loop_max_us", loopTimeUs.max());
+  payload.addUInt("acquisition_p95_us", acquisitionTimeUs.percentile(95));
+  payload.addUInt("publish_p95_ms", publishLatencyMs.percentile(95));
+  payload.addUInt("tls_connect_p95_ms", tlsConnectMs.percentile(95));
+  payload.addUInt("ota_max_ms", otaDurationMs.max());
+  payload.endObject();
+
+  if (!payload.overflowed()) {
+    halPublish("/metrics", payload.data(), payload.length());
+  }
 }
@@ -0,0 +1,169 @@
+#include "metrics.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+const uint32_t METRICS_BOUNDS_US[] = {
+  100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000
+};
+const uint8_t METRICS_BOUNDS_US_COUNT = sizeof(METRICS_BOUNDS_US) / sizeof(METRICS_BOUNDS_US[0]);
+
+const uint32_t METRICS_BOUNDS_MS[] = {
+  10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000, 120000
+};
+const uint8_t METRICS_BOUNDS_MS_COUNT = sizeof(METRICS_BOUNDS_MS) / sizeof(METRICS_BOUNDS_MS[0]);
+
+Histogram::Histogram(const uint32_t *bounds, uint8_t count)
+  : bounds(bounds), boundCount(count > METRICS_MAX_BUCKETS ? METRICS_MAX_BUCKETS : count)
+{
+  reset();
+}
+
+void Histogram::reset()
+{
+  memset(counts, 0, sizeof(counts));
+  total = 0;
+  sumValues = 0;
+  maxValue = 0;
+}
+
+void Histogram::record(uint32_t value)
+{
+  uint8_t i = 0;
+  while (i < boundCount && value > bounds[i]) {
+    i++;
+  }
+  counts[i]++;
+  total++;
+  sumValues += value;
+  if (value > maxValue) {
+    maxValue = value;
+  }
+}
+
+uint32_t Histogram::percentile(uint8_t percent) const
+{
+  if (total == 0) {
+    return 0;
+  }
+  uint32_t rank = (uint32_t)(((uint64_t)total * percent + 99) / 100);
+  uint32_t seen = 0;
+  for (uint8_t i = 0; i < boundCount; i++) {
+    seen += counts[i];
+    if (seen >= rank) {
+      return bounds[i];
+    }
+  }
+  return maxValue;
+}
+
+// printf on the ESP8266 does not reliably handle 64-bit integers
+static const char *formatInt64(char *out, int64_t value)
+{
+  char digits[21];
+  uint8_t n = 0;
+  uint64_t magnitude = value < 0 ? (uint64_t)0 - (uint64_t)value : (uint64_t)value;
+  do {
+    digits[n++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude > 0);
+
+  char *p = out;
+  if (value < 0) {
+    *p++ = '-';
+  }
+  while (n > 0) {
+    *p++ = digits[--n];
+  }
+  *p = '\0';
+  return out;
+}
+
+PrometheusWriter::PrometheusWriter(char *buf, size_t cap, FlushFn flush, void *ctx)
+  : buf(buf), cap(cap), len(0), overflow(false), flush(flush), ctx(ctx)
+{
+  if (cap > 0) {
+    buf[0] = '\0';
+  }
+}
+
+void PrometheusWriter::line(const char *fmt, ...)
+{
+  if (overflow) {
+    return;
+  }
+
+  for (uint8_t attempt = 0; attempt < 2; attempt++) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf + len, cap - len, fmt, args);
+    va_end(args);
+
+    if (n >= 0 && len + n < cap) {
+      len += n;
+      return;
+    }
+    buf[len] = '\0';
+    if (!flush || len == 0) {
+      break;
+    }
+    // Hand over the complete lines and retry in the emptied buffer
+    flush(ctx, buf, len);
+    len = 0;
+  }
+  overflow = true;
+}
+
+void PrometheusWriter::family(const char *name, const char *type, const char *help)
+{
+  line("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void PrometheusWriter::sample(const char *name, int64_t value, const char *labelName, const char *labelValue)
+{
+  char number[21];
+  formatInt64(number, value);
+  if (labelName) {
+    line("%s{%s=\"%s\"} %s\n", name, labelName, labelValue, number);
+  } else {
+    line("%s %s\n", name, number);
+  }
+}
+
+void PrometheusWriter::gauge(const char *name, const char *help, int64_t value)
+{
+  family(name, "gauge", help);
+  sample(name, value);
+}
+
+void PrometheusWriter::counter(const char *name, const char *help, uint64_t value)
+{
+  family(name, "counter", help);
+  sample(name, (int64_t)value);
+}
+
+void PrometheusWriter::histogram(const char *name, const char *help, const Histogram &histogram)
+{
+  family(name, "histogram", help);
+
+  uint32_t cumulative = 0;
+  for (uint8_t i = 0; i < histogram.buckets(); i++) {
+    cumulative += histogram.bucket(i);
+    line("%s_bucket{le=\"%lu\"} %lu\n", name, (unsigned long)histogram.bound(i), (unsigned long)cumulative);
+  }
+  line("%s_bucket{le=\"+Inf\"} %lu\n", name, (unsigned long)histogram.count());
+
+  char number[21];
+  line("%s_sum %s\n", name, formatInt64(number, (int64_t)histogram.sum()));
+  line("%s_count %lu\n", name, (unsigned long)histogram.count());
+}
+
+void PrometheusWriter::finish()
+{
+  if (flush && !overflow && len > 0) {
+    flush(ctx, buf, len);
+    len = 0;
+    buf[0] = '\0';
+  }
+}
@@ -0,0 +1,85 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define METRICS_MAX_BUCKETS 12
+#define METRICS_LINE_MAX    128   //!< longest line PrometheusWriter emits
+
+// Bucket upper bounds shared by the firmware histograms
+extern const uint32_t METRICS_BOUNDS_US[];   //!< 100 us .. 1 s
+extern const uint8_t METRICS_BOUNDS_US_COUNT;
+extern const uint32_t METRICS_BOUNDS_MS[];   //!< 10 ms .. 2 min
+extern const uint8_t METRICS_BOUNDS_MS_COUNT;
+
+/*
+ * Fixed-bucket histogram. record() is a bounded search and two increments,
+ * no heap and no lock: it is only ever called from loop().
+ */
+class Histogram {
+public:
+  Histogram(const uint32_t *bounds, uint8_t count);
+
+  void record(uint32_t value);
+  void reset();
+
+  uint8_t buckets() const { return boundCount; }
+  uint32_t bound(uint8_t i) const { return bounds[i]; }
+  // Not cumulative, bucket(buckets()) holds what is above the last bound
+  uint32_t bucket(uint8_t i) const { return counts[i]; }
+  uint32_t count() const { return total; }
+  uint64_t sum() const { return sumValues; }
+  uint32_t max() const { return maxValue; }
+
+  // Upper bound of the bucket holding the given percentile, max() past the last bound
+  uint32_t percentile(uint8_t percent) const;
+
+private:
+  const uint32_t *bounds;
+  uint8_t boundCount;
+  uint32_t counts[METRICS_MAX_BUCKETS + 1];
+  uint32_t total;
+  uint64_t sumValues;
+  uint32_t maxValue;
+};
+
+/*
+ * Prometheus text exposition format (version 0.0.4) written into a caller
+ * buffer. With a flush function the buffer is handed over whenever the next
+ * line would not fit, so a small buffer can stream any number of metrics.
+ */
+class PrometheusWriter {
+public:
+  typedef void (*FlushFn)(void *ctx, const char *data, size_t len);
+
+  PrometheusWriter(char *buf, size_t cap, FlushFn flush = nullptr, void *ctx = nullptr);
+
+  // # HELP and # TYPE lines, once per metric name
+  void family(const char *name, const char *type, const char *help);
+  // One sample, labels are optional
+  void sample(const char *name, int64_t value, const char *labelName = nullptr, const char *labelValue = nullptr);
+
+  void gauge(const char *name, const char *help, int64_t value);
+  void counter(const char *name, const char *help, uint64_t value);
+  void histogram(const char *name, const char *help, const Histogram &histogram);
+
+  // Hands what is left to the flush function
+  void finish();
+
+  const char *data() const { return buf; }
+  size_t length() const { return overflow ? 0 : len; }
+  bool overflowed() const { return overflow; }
+
+private:
+  void line(const char *fmt, ...);
+
+  char *buf;
+  size_t cap;
+  size_t len;
+  bool overflow;
+  FlushFn flush;
+  void *ctx;
+};
+
+#endif // METRICS_H
@@ -0,0 +1,49 @@
+#ifndef ARDUINO
+#include "alloc_count.h"
+
+#include <stdlib.h>
+#include <new>
+
+static size_t allocations = 0;
+static size_t allocatedBytes = 0;
+
+size_t allocCount()
+{
+  return allocations;
+}
+
+size_t allocBytes()
+{
+  return allocatedBytes;
+}
+
+// ArduinoJson allocates with malloc(), see -Wl,--wrap in platformio.ini
+extern "C" void *__real_malloc(size_t size);
+extern "C" void *__wrap_malloc(size_t size)
+{
+  allocations++;
+  allocatedBytes += size;
+  return __real_malloc(size);
+}
+
+void *operator new(size_t size)
+{
+  allocations++;
+  allocatedBytes += size;
+  void *p = __real_malloc(size ? size : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+  free(p);
+}
+#endif
@@ -0,0 +1,14 @@
+#ifndef ALLOC_COUNT_H
+#define ALLOC_COUNT_H
+
+#include <stddef.h>
+
+/*
+ * Heap allocations of the host process: malloc() through -Wl,--wrap (see
+ * platformio.ini) and every operator new. Only ever grows, callers take
+ * the difference around the code they measure.
+ */
+size_t allocCount();
+size_t allocBytes();
+
+#endif // ALLOC_COUNT_H
@@ -0,0 +1,584 @@
+#if !defined(ARDUINO) && !defined(PIO_UNIT_TESTING)
+/*
+ * Micro-benchmarks of the firmware logic, run on the host:
+ *
+ *   pio run -e native -t exec                         prints the table
+ *   .pio/build/native/program bench.csv               also writes it as CSV
+ *   .pio/build/native/program bench.csv base.csv      and compares with a previous run
+ *
+ * Keep the CSV of a reference commit around to spot regressions, time is
+ * machine dependent but allocations per operation are not. The numbers are
+ * only meaningful once pio test -e native passes, see test/.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "alloc_count.h"
+#include "fixtures.h"
+#include "hal_native.h"
+#include "mem_storage.h"
+#include "notify_sink.h"
+#include "sonar_field.h"
+#include "../acquisition.h"
+#include "../api.h"
+#include "../consumption.h"
+#include "../metrics.h"
+#include "../notifier.h"
+#include "../report.h"
+#include "../scheduler.h"
+#include "../telemetry.h"
+#include "../telemetry_queue.h"
+
+///////////////////////////////
+// Runner
+///////////////////////////////
+#define BENCH_MAX_RESULTS 32
+#define BENCH_MIN_US      200000   //!< keep doubling the iterations until a run lasts this long
+#define BENCH_REPEATS     3        //!< best of, the host is never idle
+
+struct BenchResult {
+  const char *name;
+  uint32_t iterations;
+  double nsPerOp;
+  double allocsPerOp;
+  double bytesPerOp;
+};
+
+static BenchResult results[BENCH_MAX_RESULTS];
+static uint8_t resultCount = 0;
+
+// Keeps the optimizer from dropping the work
+static volatile uint32_t sink;
+
+static void bench(const char *name, void (*fn)(uint32_t iterations))
+{
+  fn(1);  // warm up, first-use allocations do not count
+
+  uint32_t iterations = 16;
+  uint64_t elapsed = 0;
+  size_t allocs = 0;
+  size_t bytes = 0;
+  for (;;) {
+    size_t allocsBefore = allocCount();
+    size_t bytesBefore = allocBytes();
+    uint32_t start = halMicros();
+    fn(iterations);
+    elapsed = halMicros() - start;
+    allocs = allocCount() - allocsBefore;
+    bytes = allocBytes() - bytesBefore;
+    if (elapsed >= BENCH_MIN_US || iterations >= (1u << 30)) {
+      break;
+    }
+    iterations *= 2;
+  }
+
+  for (uint8_t repeat = 1; repeat < BENCH_REPEATS; repeat++) {
+    uint32_t start = halMicros();
+    fn(iterations);
+    uint64_t again = halMicros() - start;
+    if (again < elapsed) {
+      elapsed = again;
+    }
+  }
+
+  if (resultCount < BENCH_MAX_RESULTS) {
+    BenchResult &r = results[resultCount++];
+    r.name = name;
+    r.iterations = iterations;
+    r.nsPerOp = elapsed * 1000.0 / iterations;
+    r.allocsPerOp = (double)allocs / iterations;
+    r.bytesPerOp = (double)bytes / iterations;
+  }
+}
+
+///////////////////////////////
+// Benchmarks
+///////////////////////////////
+// Echo widths around 60 cm with +-30 us of noise, a spurious echo every 16 when spikes
+static int32_t filterSample(uint32_t i, bool spikes = false)
+{
+  int32_t value = 3500 + (int32_t)(i * 7919 % 61) - 30;
+  return spikes && i % 16 == 15 ? value - 2000 : value;
+}
+
+// The whole default chain: median of 5, 3 sigma rejection, EWMA
+static void benchFilterPush(uint32_t n)
+{
+  FilterChain chain;
+  for (uint32_t i = 0; i < n; i++) {
+    chain.push(filterSample(i));
+  }
+  sink = chain.getEstimate().value;
+}
+
+/*
+ * One stage at a time, ns/op is per sample. The chain ones keep a median
+ * of 1, which costs a ring buffer push.
+ */
+static void benchMedian(uint32_t n, uint8_t window)
+{
+  MedianFilter median;
+  median.setWindow(window);
+  int32_t value = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    value = median.push(filterSample(i, true));
+  }
+  sink = value;
+}
+
+static void benchMedian5(uint32_t n)
+{
+  benchMedian(n, 5);
+}
+
+static void benchMedian9(uint32_t n)
+{
+  benchMedian(n, FILTER_MAX_MEDIAN);
+}
+
+static void benchFilterStage(uint32_t n, uint8_t outlierSigma, FilterSmoothing smoothing)
+{
+  FilterConfig config = FilterChain::defaults();
+  config.medianWindow = 1;
+  config.outlierSigma = outlierSigma;
+  config.smoothing = smoothing;
+  FilterChain chain;
+  chain.configure(config);
+  for (uint32_t i = 0; i < n; i++) {
+    chain.push(filterSample(i, outlierSigma > 0));
+  }
+  sink = chain.getEstimate().value + chain.getEstimate().rejected;
+}
+
+static void benchOutlier(uint32_t n)
+{
+  benchFilterStage(n, FilterChain::defaults().outlierSigma, FILTER_NONE);
+}
+
+static void benchEwma(uint32_t n)
+{
+  benchFilterStage(n, 0, FILTER_EWMA);
+}
+
+static void benchKalman(uint32_t n)
+{
+  benchFilterStage(n, 0, FILTER_KALMAN);
+}
+
+static void benchConfigParse(uint32_t n)
+{
+  TankConfig config;
+  for (uint32_t i = 0; i < n; i++) {
+    parseConfig(CONFIG_JSON, config);
+  }
+  sink = config.heightMm;
+}
+
+static void benchTankUpdate(uint32_t n)
+{
+  TankConfig config = fixtureConfig();
+  TankGeometry geometry;
+  tankGeometryBuild(config, geometry);
+  FilterEstimate estimate = fixtureEstimate();
+  TankLevel level = {};
+  TankAlerts alerts = {};
+  for (uint32_t i = 0; i < n; i++) {
+    estimate.value = 600 + i % 6000;
+    tankUpdate(config, geometry, estimate, TANK_NO_TEMPERATURE, level, alerts);
+  }
+  sink = level.volume;
+}
+
+static void benchLevelFloat(uint32_t n)
+{
+  TankConfig config = fixtureConfig();
+  TankGeometry geometry;
+  tankGeometryBuild(config, geometry);
+  FilterEstimate estimate = fixtureEstimate();
+  LegacyLevel level = {};
+  for (uint32_t i = 0; i < n; i++) {
+    estimate.value = 600 + i % 6000;
+    legacyLevel(config.heightMm / 10.0f, config.fullVolumeMl / 1000.0f, geometry, estimate, level);
+  }
+  sink = level.volume;
+}
+
+// Fixed point with the speed of sound interpolated for 12.5 degrees
+static void benchLevelFixed(uint32_t n)
+{
+  TankConfig config = fixtureConfig();
+  TankGeometry geometry;
+  tankGeometryBuild(config, geometry);
+  FilterEstimate estimate = fixtureEstimate();
+  TankLevel level = {};
+  TankAlerts alerts = {};
+  for (uint32_t i = 0; i < n; i++) {
+    estimate.value = 600 + i % 6000;
+    tankUpdate(config, geometry, estimate, 125, level, alerts);
+  }
+  sink = level.volume;
+}
+
+// A level every 10 minutes with a little jitter, no event
+static void benchConsumption(uint32_t n)
+{
+  ConsumptionTracker tracker;
+  for (uint32_t i = 0; i < n; i++) {
+    tracker.update(1700000000 + i * 600, 1200000 - (i * 125) % 900000 + (i * 7919 % 3000));
+  }
+  sink = tracker.rateMlPerDay();
+}
+
+static void benchAdaptiveRate(uint32_t n)
+{
+  AdaptiveRate rate;
+  uint32_t now = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    now += rate.update(now, 3500 + (int32_t)(i * 7919 % 21) - 10, 3500);
+  }
+  sink = rate.getPeriodMs();
+}
+
+static void benchReportDecide(uint32_t n)
+{
+  Reporter reporter;
+  for (uint32_t i = 0; i < n; i++) {
+    reporter.decide(1700000000 + i * 60, 1200000 - i * 12, 1500000);
+  }
+  sink = reporter.getSuppressed();
+}
+
+// The worst case table, 65 points
+static void benchGeometryLookup(uint32_t n)
+{
+  TankGeometry geometry;
+  geometry.horizontalCylinder(1200, 1800);
+  uint32_t total = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    total += geometry.volumeMl(i * 7919 % 1300);
+  }
+  sink = total;
+}
+
+static void benchTelemetry(uint32_t n, TelemetryFormat format)
+{
+  TankConfig config = fixtureConfig();
+  TankGeometry geometry;
+  tankGeometryBuild(config, geometry);
+  FilterEstimate estimate = fixtureEstimate();
+  TankLevel level = {};
+  TankAlerts alerts = {};
+  tankUpdate(config, geometry, estimate, TANK_NO_TEMPERATURE, level, alerts);
+
+  char buffer[480];
+  for (uint32_t i = 0; i < n; i++) {
+    TelemetryWriter payload(buffer, sizeof(buffer), format);
+    payload.beginObject();
+    tankWriteTelemetry(payload, level, estimate);
+    payload.endObject();
+    sink = payload.length();
+  }
+}
+
+static void benchTelemetryJson(uint32_t n)
+{
+  benchTelemetry(n, TELEMETRY_JSON);
+}
+
+static void benchTelemetryCbor(uint32_t n)
+{
+  benchTelemetry(n, TELEMETRY_CBOR);
+}
+
+// Level computation, serialization and publish, as getTankLevel() does
+static void benchTelemetryPath(uint32_t n)
+{
+  TankConfig config = fixtureConfig();
+  TankGeometry geometry;
+  tankGeometryBuild(config, geometry);
+  FilterEstimate estimate = fixtureEstimate();
+  TankLevel level = {};
+  TankAlerts alerts = {};
+
+  char buffer[480];
+  for (uint32_t i = 0; i < n; i++) {
+    tankUpdate(config, geometry, estimate, TANK_NO_TEMPERATURE, level, alerts);
+    TelemetryWriter payload(buffer, sizeof(buffer), config.telemetryFormat);
+    payload.beginObject();
+    tankWriteTelemetry(payload, level, estimate);
+    payload.endObject();
+    if (halNetworkConnected()) {
+      halPublish(nullptr, payload.data(), payload.length());
+    }
+  }
+  sink = halNativeNetwork().publishes;
+}
+
+// Includes the std::map lookups of MemStorage, LittleFS costs far more anyway
+static void benchQueuePushPop(uint32_t n)
+{
+  MemStorage storage;
+  TelemetryQueue queue;
+  queue.begin(&storage);
+
+  TelemetryRecord batch[5];
+  for (uint32_t i = 0; i < n; i++) {
+    TelemetryRecord record = { i, 1000, 50, 0 };
+    queue.push(record);
+    if (queue.size() >= 5) {
+      queue.pop(queue.peek(batch, 5));
+    }
+  }
+  sink = queue.size();
+}
+
+static void benchHistogramRecord(uint32_t n)
+{
+  Histogram histogram(METRICS_BOUNDS_US, METRICS_BOUNDS_US_COUNT);
+  for (uint32_t i = 0; i < n; i++) {
+    histogram.record(i * 2654435761u >> 12);
+  }
+  sink = histogram.count();
+}
+
+static void benchTask(void *ctx)
+{
+  (*(uint32_t *)ctx)++;
+}
+
+// The last hour out of n minutes of history, the cost must not follow n
+static void benchHistoryLastHour(uint32_t n, uint32_t minutes)
+{
+  static MemStorage storage;
+  static History history;
+  static uint32_t filled = 0;
+  if (filled != minutes) {
+    storage.files.clear();
+    history.begin(&storage);
+    historyFill(history, 1700000000, minutes);
+    filled = minutes;
+  }
+  char buffer[API_CHUNK_SIZE];
+  size_t bytes = 0;
+  uint32_t to = 1700000000 + (minutes - 1) * 60;
+  for (uint32_t i = 0; i < n; i++) {
+    apiHistory(history, to - 3600, to, API_HISTORY_MAX_SAMPLES, buffer, sizeof(buffer), discardChunk, &bytes);
+  }
+  sink = bytes;
+}
+
+static void benchHistoryHour1h(uint32_t n)
+{
+  benchHistoryLastHour(n, 60);
+}
+
+static void benchHistoryHour3w(uint32_t n)
+{
+  benchHistoryLastHour(n, 21 * 1440);
+}
+
+// A level a minute into a ring that keeps wrapping
+static void benchHistoryAppend(uint32_t n)
+{
+  static MemStorage storage;
+  static History history;
+  static uint32_t minute = 0;
+  static uint32_t seed = 1;
+  if (minute == 0) {
+    history.begin(&storage);
+  }
+  for (uint32_t i = 0; i < n; i++, minute++) {
+    int32_t liters = traceLiters(minute * 60, seed);
+    TelemetryRecord record = { 1700000000 + minute * 60, liters, (int16_t)(liters * 100 / 1500), 0 };
+    history.append(record);
+  }
+  sink = history.newest();
+}
+
+// Four sensors in one group as fast as they go, n services of the cycle
+static void benchSonarCycle(uint32_t n)
+{
+  SonarFieldFake field;
+  SonarCycle cycle;
+  cycle.begin(nullptr, nullptr);
+  for (uint8_t i = 0; i < 4; i++) {
+    cycle.add(&field.sensors[field.add(5800, 0)].sonar, 0, 1);
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    field.run(cycle, field.nowUs + SONAR_CYCLE_POLL_MS * 1000);
+  }
+  sink = cycle.getMeasurements();
+}
+
+static void benchSchedulerRun(uint32_t n)
+{
+  uint32_t runs = 0;
+  halNativeSetClock(0);
+  Scheduler scheduler;
+  scheduler.begin(halMillis, halMicros);
+  scheduler.add("a", benchTask, &runs, 1);
+  scheduler.add("b", benchTask, &runs, 10);
+  scheduler.add("c", benchTask, &runs, 50);
+  for (uint32_t i = 0; i < n; i++) {
+    halNativeAdvance(1);
+    scheduler.run();
+  }
+  halNativeReleaseClock();
+  sink = runs;
+}
+
+static OtaFixture ota;
+
+// Transfers are cut every dropEvery bytes, so each run also resumes a few times
+static void benchOta(uint32_t n, const char *url, bool delta, uint32_t dropEvery)
+{
+  ota.server.dropEvery = dropEvery;
+  for (uint32_t i = 0; i < n; i++) {
+    sink = ota.run(url, ota.sha, delta);
+  }
+  ota.server.dropEvery = 0;
+}
+
+static void benchOtaFull(uint32_t n)
+{
+  benchOta(n, "/firmware.bin", false, 50000);
+}
+
+static void benchOtaDelta(uint32_t n)
+{
+  benchOta(n, "/firmware.delta", true, 2000);
+}
+
+// Enqueue from the measurement path and drain, without rate limit
+static void benchNotify(uint32_t n)
+{
+  static const char *const alerts[] = { "Tank level low", "Tank is full", "Tank is empty" };
+  NotifySinkFake fake;
+  Notifier notifier;
+  NotifierConfig config = Notifier::defaults();
+  config.burst = 255;
+  config.refillMs = 1;
+  config.dedupWindowMs = 0;
+  notifier.configure(config);
+  notifier.begin(fake.sink(), 0);
+  fake.delivered.reserve(n);
+  for (uint32_t i = 0; i < n; i++) {
+    notifier.enqueue(alerts[i % 3], i);
+    notifier.tick(i);
+  }
+  sink = notifier.getSent();
+}
+
+///////////////////////////////
+// Report
+///////////////////////////////
+static bool loadBaseline(const char *path, const char *name, BenchResult &baseline)
+{
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return false;
+  }
+  char line[160];
+  bool found = false;
+  while (!found && fgets(line, sizeof(line), f)) {
+    char benchName[48];
+    if (sscanf(line, "%47[^,],%u,%lf,%lf,%lf", benchName, &baseline.iterations, &baseline.nsPerOp,
+               &baseline.allocsPerOp, &baseline.bytesPerOp) == 5 && strcmp(benchName, name) == 0) {
+      found = true;
+    }
+  }
+  fclose(f);
+  return found;
+}
+
+int main(int argc, char **argv)
+{
+  ota.build();
+
+  bench("filter_push", benchFilterPush);
+  bench("filter_median5", benchMedian5);
+  bench("filter_median9", benchMedian9);
+  bench("filter_outlier", benchOutlier);
+  bench("filter_ewma", benchEwma);
+  bench("filter_kalman", benchKalman);
+  bench("config_parse", benchConfigParse);
+  bench("tank_update", benchTankUpdate);
+  bench("level_float", benchLevelFloat);
+  bench("level_fixed", benchLevelFixed);
+  bench("geometry_lookup", benchGeometryLookup);
+  bench("consumption_update", benchConsumption);
+  bench("report_decide", benchReportDecide);
+  bench("adaptive_rate", benchAdaptiveRate);
+  bench("telemetry_json", benchTelemetryJson);
+  bench("telemetry_cbor", benchTelemetryCbor);
+  bench("telemetry_path", benchTelemetryPath);
+  bench("queue_push_pop", benchQueuePushPop);
+  bench("histogram_record", benchHistogramRecord);
+  bench("scheduler_run", benchSchedulerRun);
+  bench("sonar_cycle", benchSonarCycle);
+  bench("history_1h_of_1h", benchHistoryHour1h);
+  bench("history_1h_of_3w", benchHistoryHour3w);
+  bench("history_append", benchHistoryAppend);
+  bench("ota_full_256k", benchOtaFull);
+  bench("ota_delta_256k", benchOtaDelta);
+  bench("notify_enqueue", benchNotify);
+
+  const char *basePath = argc > 2 ? argv[2] : nullptr;
+  printf("%-18s %12s %10s %10s %s\n", "benchmark", "ns/op", "allocs/op", "bytes/op", basePath ? "  vs base" : "");
+  for (uint8_t i = 0; i < resultCount; i++) {
+    const BenchResult &r = results[i];
+    printf("%-18s %12.1f %10.2f %10.1f", r.name, r.nsPerOp, r.allocsPerOp, r.bytesPerOp);
+    BenchResult base;
+    if (basePath && loadBaseline(basePath, r.name, base) && base.nsPerOp > 0) {
+      printf("  %+6.1f%% time %+6.2f allocs", (r.nsPerOp / base.nsPerOp - 1) * 100, r.allocsPerOp - base.allocsPerOp);
+    }
+    printf("\n");
+  }
+
+  // Simulated time, independent of the host
+  printf("\n%-18s %12s %12s\n", "sonar sensors", "shared/s", "separate/s");
+  for (uint8_t n = 1; n <= SONAR_CYCLE_MAX; n++) {
+    uint32_t crosstalk;
+    printf("%-18u %12.1f %12.1f\n", n, sonarThroughput(n, true, crosstalk), sonarThroughput(n, false, crosstalk));
+  }
+
+  // Recorded levels, 12 bytes a sample before compression
+  printf("\n%-18s %10s %10s %8s %10s %10s %10s\n", "history", "samples", "B/sample", "ratio", "days/64kB",
+         "append ns", "scan M/s");
+  static const struct {
+    const char *name;
+    uint8_t tanks;
+    bool adaptive;
+  } traces[] = { { "trace_1_tank", 1, false }, { "trace_2_tanks", 2, false }, { "trace_adaptive", 1, true } };
+  for (uint8_t i = 0; i < sizeof(traces) / sizeof(traces[0]); i++) {
+    MemStorage storage;
+    History history;
+    history.begin(&storage);
+    uint32_t start = halMicros();
+    uint32_t samples = historyReplay(history, 1700000000, 14, traces[i].tanks, traces[i].adaptive);
+    uint32_t appendUs = halMicros() - start;
+    uint32_t visited = 0;
+    start = halMicros();
+    history.query(0, UINT32_MAX, countRecord, &visited);
+    uint32_t scanUs = halMicros() - start;
+    double perSample = (double)history.bytes() / visited;
+    printf("%-18s %10u %10.2f %8.1f %10.1f %10.1f %10.1f\n", traces[i].name, samples, perSample,
+           sizeof(TelemetryRecord) / perSample, HISTORY_BYTES / perSample * 14 / samples,
+           appendUs * 1000.0 / samples, visited / (scanUs ? scanUs : 1.0));
+  }
+
+  if (argc > 1) {
+    FILE *f = fopen(argv[1], "w");
+    if (!f) {
+      fprintf(stderr, "cannot write %s\n", argv[1]);
+      return 1;
+    }
+    for (uint8_t i = 0; i < resultCount; i++) {
+      const BenchResult &r = results[i];
+      fprintf(f, "%s,%u,%.1f,%.3f,%.1f\n", r.name, r.iterations, r.nsPerOp, r.allocsPerOp, r.bytesPerOp);
+    }
+    fclose(f);
+  }
+  return 0;
+}
+#endif
@@ -0,0 +1,164 @@
+#ifndef ARDUINO
+#include "fixtures.h"
+
+#include <math.h>
+#include <string.h>
+
+#include "hal_native.h"
+#include "level_traces.h"
+#include "sonar_field.h"
+
+bool parseConfig(const char *json, TankConfig *configs, uint8_t count)
+{
+  char buffer[512];
+  size_t len = strlen(json);
+  memcpy(buffer, json, len + 1);
+  return tankConfigParse(buffer, len, configs, count);
+}
+
+bool parseConfig(const char *json, TankConfig &config)
+{
+  return parseConfig(json, &config, 1);
+}
+
+TankConfig fixtureConfig()
+{
+  TankConfig config;
+  tankConfigDefaults(config);
+  parseConfig(CONFIG_JSON, config);
+  return config;
+}
+
+FilterEstimate fixtureEstimate()
+{
+  FilterEstimate estimate = { 3500, 900, 12, 1 };  // ~60 cm
+  return estimate;
+}
+
+void legacyLevel(float heightCm, float fullVolumeLiters, const TankGeometry &geometry,
+                 const FilterEstimate &estimate, LegacyLevel &level)
+{
+  float distance = (estimate.value * 0.0343) / 2;
+  level.distanceCm = distance;
+  level.distanceStddevCm = (sqrtf(estimate.variance) * 0.0343) / 2;
+  if (distance >= 10 && distance <= heightCm) {
+    uint32_t levelMm = (uint32_t)((heightCm - distance) * 10 + 0.5f);
+    level.volume = (geometry.volumeMl(levelMm) + 500) / 1000;
+    level.percent = (((float)level.volume / fullVolumeLiters) * 100);
+  }
+}
+
+void historyFill(History &history, uint32_t epoch, uint32_t minutes)
+{
+  for (uint32_t i = 0; i < minutes; i++) {
+    TelemetryRecord record = { epoch + i * 60, (int32_t)(1200 - i / 60), (int16_t)(80 - i / 1440), 0 };
+    history.append(record);
+  }
+}
+
+int32_t traceLiters(uint32_t offsetS, uint32_t &seed)
+{
+  const uint32_t count = sizeof(TRACE_REFILL_THEFT) / sizeof(TRACE_REFILL_THEFT[0]);
+  offsetS %= TRACE_REFILL_THEFT[count - 1].offsetS;
+  uint32_t i = 1;
+  while (TRACE_REFILL_THEFT[i].offsetS <= offsetS) {
+    i++;
+  }
+  const LevelTraceSample &a = TRACE_REFILL_THEFT[i - 1];
+  const LevelTraceSample &b = TRACE_REFILL_THEFT[i];
+  int64_t ml = a.volumeMl + ((int64_t)b.volumeMl - a.volumeMl) * (offsetS - a.offsetS) / (b.offsetS - a.offsetS);
+  seed = seed * 1103515245 + 12345;
+  return (int32_t)(ml / 1000) + (int32_t)((seed >> 16) % 3) - 1;
+}
+
+uint32_t historyReplay(History &history, uint32_t epoch, uint32_t days, uint8_t tanks, bool adaptive)
+{
+  uint32_t seed = 1;
+  uint32_t samples = 0;
+  for (uint32_t t = 0; t < days * 86400;) {
+    for (uint8_t tank = 0; tank < tanks; tank++) {
+      int32_t liters = traceLiters(t + tank * 36000, seed);
+      TelemetryRecord record = { epoch + t, liters, (int16_t)(liters * 100 / 1500), tank };
+      samples += history.append(record);
+    }
+    seed = seed * 1103515245 + 12345;
+    t += adaptive ? 60 * (1 + (seed >> 16) % 10) : 60;
+  }
+  return samples;
+}
+
+bool countRecord(void *ctx, const TelemetryRecord &)
+{
+  (*(uint32_t *)ctx)++;
+  return true;
+}
+
+void discardChunk(void *ctx, const char *, size_t len)
+{
+  *(size_t *)ctx += len;
+}
+
+double sonarThroughput(uint8_t n, bool shared, uint32_t &crosstalk)
+{
+  SonarFieldFake field;
+  SonarCycle cycle;
+  cycle.begin(nullptr, nullptr);
+  for (uint8_t i = 0; i < n; i++) {
+    uint8_t index = field.add(5800 + i * 300, shared ? 0 : i);
+    cycle.add(&field.sensors[index].sonar, field.sensors[index].group, 1);
+  }
+  field.run(cycle, 10000000);
+  crosstalk = field.crosstalk;
+  return cycle.getMeasurements() / 10.0;
+}
+
+static void putLe32(std::vector<uint8_t> &out, uint32_t value)
+{
+  for (uint8_t i = 0; i < 4; i++) {
+    out.push_back(value >> (i * 8));
+  }
+}
+
+void OtaFixture::build()
+{
+  uint32_t rng = 1;
+  server.running.clear();
+  for (uint32_t i = 0; i < 256 * 1024; i++) {
+    rng = rng * 1103515245 + 12345;
+    server.running.push_back(rng >> 16);
+  }
+  std::vector<uint8_t> inserted(5000, 0xA5);
+
+  target.assign(server.running.begin(), server.running.begin() + 100000);
+  target.insert(target.end(), inserted.begin(), inserted.end());
+  target.insert(target.end(), server.running.begin() + 100000, server.running.end());
+
+  std::vector<uint8_t> &delta = server.files["/firmware.delta"];
+  delta.clear();
+  putLe32(delta, OTA_DELTA_MAGIC);
+  putLe32(delta, server.running.size());
+  putLe32(delta, target.size());
+  delta.push_back(OTA_OP_COPY);
+  putLe32(delta, 0);
+  putLe32(delta, 100000);
+  delta.push_back(OTA_OP_DATA);
+  putLe32(delta, inserted.size());
+  delta.insert(delta.end(), inserted.begin(), inserted.end());
+  delta.push_back(OTA_OP_COPY);
+  putLe32(delta, 100000);
+  putLe32(delta, server.running.size() - 100000);
+  delta.push_back(OTA_OP_END);
+
+  server.files["/firmware.bin"] = target;
+  Sha256 sha256;
+  sha256.update(target.data(), target.size());
+  sha256.finish(sha);
+}
+
+OtaResult OtaFixture::run(const char *url, const uint8_t *expected, bool delta)
+{
+  OtaUpdater updater;
+  updater.begin(server.hooks(), halMillis);
+  return updater.run(url, expected, delta);
+}
+#endif
@@ -0,0 +1,75 @@
+#ifndef FIXTURES_H
+#define FIXTURES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "ota_server.h"
+#include "../filters.h"
+#include "../geometry.h"
+#include "../history.h"
+#include "../sha256.h"
+#include "../tank.h"
+
+/*
+ * Inputs shared by the benchmarks of bench.cpp and the test suites of
+ * test/, so both measure and check the same thing.
+ */
+// The keys a rectangular tank needs, for configs that only add to them
+#define CONFIG_DIMENSIONS \
+  "\"full_volume_in_liters\":1500,\"tank_height_in_cm\":120,\"tank_lenght_in_cm\":180,\"tank_width_in_cm\":70"
+static const char CONFIG_JSON[] =
+  "{" CONFIG_DIMENSIONS ",\"unit\":\"L\",\"telegram_chat_id\":\"123456789\",\"telemetry_format\":\"json\"}";
+
+// The parser works in place, like on the MQTT payload
+bool parseConfig(const char *json, TankConfig *configs, uint8_t count);
+bool parseConfig(const char *json, TankConfig &config);
+
+// CONFIG_JSON parsed: a 1500 l, 120 x 180 x 70 cm rectangular tank
+TankConfig fixtureConfig();
+FilterEstimate fixtureEstimate();
+
+// The float chain tankUpdate() used before, kept as the reference for
+// level_float and the level test. An x86 FPU hides most of the gap, the
+// ESP8266 emulates every float operation in software.
+struct LegacyLevel {
+  float distanceCm;
+  float distanceStddevCm;
+  int32_t volume;
+  int16_t percent;
+};
+
+void legacyLevel(float heightCm, float fullVolumeLiters, const TankGeometry &geometry,
+                 const FilterEstimate &estimate, LegacyLevel &level);
+
+// One level a minute from epoch on
+void historyFill(History &history, uint32_t epoch, uint32_t minutes);
+// TRACE_REFILL_THEFT looped, interpolated at offsetS with a liter of filter jitter
+int32_t traceLiters(uint32_t offsetS, uint32_t &seed);
+/*
+ * Recorded levels as the firmware stores them: every tank in the same
+ * second, a minute apart, or 1 to 10 minutes apart when adaptive.
+ */
+uint32_t historyReplay(History &history, uint32_t epoch, uint32_t days, uint8_t tanks, bool adaptive);
+
+// Callbacks of History::query() and apiHistory(), ctx counts
+bool countRecord(void *ctx, const TelemetryRecord &record);
+void discardChunk(void *ctx, const char *data, size_t len);
+
+// Measurements per second of n sensors about 1 m away, in one group or each in its own
+double sonarThroughput(uint8_t n, bool shared, uint32_t &crosstalk);
+
+/*
+ * Running image, its successor as a full image and as a delta against it.
+ */
+struct OtaFixture {
+  OtaServerFake server;
+  std::vector<uint8_t> target;
+  uint8_t sha[SHA256_SIZE];
+
+  void build();
+  OtaResult run(const char *url, const uint8_t *expected, bool delta);
+};
+
+#endif // FIXTURES_H
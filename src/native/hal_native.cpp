@@ -0,0 +1,154 @@
+#ifndef ARDUINO
+#include "hal_native.h"
+
+#include <string.h>
+#include <chrono>
+
+static bool clockFrozen = false;
+static uint64_t frozenUs = 0;
+static bool pins[HAL_NATIVE_PINS];
+static int16_t temperature = INT16_MIN;
+static HalNativeNetwork network = { true, false, 0, 0, "", 0 };
+static HalNativeHeap heap = { 50000, 50000, 0 };
+
+static uint64_t nowUs()
+{
+  if (clockFrozen) {
+    return frozenUs;
+  }
+  static const std::chrono::steady_clock::time_point boot = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - boot).count();
+}
+
+uint32_t halMillis()
+{
+  return nowUs() / 1000;
+}
+
+uint32_t halMicros()
+{
+  return (uint32_t)nowUs();
+}
+
+void halDelayMicroseconds(uint32_t us)
+{
+  if (clockFrozen) {
+    frozenUs += us;
+    return;
+  }
+  uint64_t end = nowUs() + us;
+  while (nowUs() < end) {
+  }
+}
+
+void halPinOutput(uint8_t)
+{
+}
+
+void halPinInput(uint8_t)
+{
+}
+
+void halPinWrite(uint8_t pin, bool high)
+{
+  if (pin < HAL_NATIVE_PINS) {
+    pins[pin] = high;
+  }
+}
+
+bool halPinRead(uint8_t pin)
+{
+  return pin < HAL_NATIVE_PINS && pins[pin];
+}
+
+bool halTemperature(int16_t &deciC)
+{
+  deciC = temperature;
+  return temperature != INT16_MIN;
+}
+
+uint32_t halHeapFree()
+{
+  return heap.freeBytes;
+}
+
+uint32_t halHeapLargestBlock()
+{
+  return heap.largestBlock;
+}
+
+uint32_t halHeapAllocations()
+{
+  return heap.allocations;
+}
+
+bool halNetworkConnected()
+{
+  return network.connected;
+}
+
+bool halPublish(const char *subfolder, const char *data, size_t len)
+{
+  (void)data;
+  if (!network.connected || network.failPublish) {
+    return false;
+  }
+  network.publishes++;
+  network.publishedBytes += len;
+  network.lastLength = len;
+  strncpy(network.lastSubfolder, subfolder ? subfolder : "", sizeof(network.lastSubfolder) - 1);
+  return true;
+}
+
+Storage &halStorage()
+{
+  return halNativeStorage();
+}
+
+void halNativeSetClock(uint32_t nowMs)
+{
+  clockFrozen = true;
+  frozenUs = (uint64_t)nowMs * 1000;
+}
+
+void halNativeAdvance(uint32_t ms)
+{
+  frozenUs += (uint64_t)ms * 1000;
+}
+
+void halNativeReleaseClock()
+{
+  clockFrozen = false;
+}
+
+bool halNativePin(uint8_t pin)
+{
+  return halPinRead(pin);
+}
+
+void halNativeSetPin(uint8_t pin, bool high)
+{
+  halPinWrite(pin, high);
+}
+
+void halNativeSetTemperature(int16_t deciC)
+{
+  temperature = deciC;
+}
+
+HalNativeNetwork &halNativeNetwork()
+{
+  return network;
+}
+
+HalNativeHeap &halNativeHeap()
+{
+  return heap;
+}
+
+MemStorage &halNativeStorage()
+{
+  static MemStorage storage;
+  return storage;
+}
+#endif
@@ -0,0 +1,48 @@
+#ifndef HAL_NATIVE_H
+#define HAL_NATIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../hal.h"
+#include "mem_storage.h"
+
+/*
+ * Controls for the host fakes behind hal.h. The clock is the real monotonic
+ * clock unless halNativeSetClock() freezes it, GPIO is a plain pin array and
+ * publishes are counted and the last one kept. The heap figures are
+ * set by the caller.
+ */
+#define HAL_NATIVE_PINS 40
+
+struct HalNativeNetwork {
+  bool connected;
+  bool failPublish;        //!< make halPublish() return false
+  uint32_t publishes;
+  uint32_t publishedBytes;
+  char lastSubfolder[32];
+  size_t lastLength;
+};
+
+// What halHeap*() report, the host heap is not the device one
+struct HalNativeHeap {
+  uint32_t freeBytes;
+  uint32_t largestBlock;
+  uint32_t allocations;
+};
+
+// Frozen clock for deterministic runs, halNativeReleaseClock() goes back to real time
+void halNativeSetClock(uint32_t nowMs);
+void halNativeAdvance(uint32_t ms);
+void halNativeReleaseClock();
+
+bool halNativePin(uint8_t pin);
+void halNativeSetPin(uint8_t pin, bool high);
+
+// TANK_NO_TEMPERATURE (INT16_MIN) removes the sensor, the default
+void halNativeSetTemperature(int16_t deciC);
+
+HalNativeNetwork &halNativeNetwork();
+HalNativeHeap &halNativeHeap();
+MemStorage &halNativeStorage();
+
+#endif // HAL_NATIVE_H
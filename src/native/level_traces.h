@@ -0,0 +1,37 @@
+#ifndef LEVEL_TRACES_H
+#define LEVEL_TRACES_H
+
+#include <stdint.h>
+
+/*
+ * Level traces replayed by the consumption checks of bench.cpp, volumes as
+ * tankUpdate() reports them (ml, a few liters of jitter).
+ */
+struct LevelTraceSample {
+  uint32_t offsetS;
+  uint32_t volumeMl;
+};
+
+// 1500 l tank burning about 18 l a day, hourly levels. A 900 l delivery at
+// hour 40 seen every 5 minutes, 40 l siphoned in 20 minutes at hour 70.
+static const LevelTraceSample TRACE_REFILL_THEFT[] = {
+  { 0, 611616 }, { 3600, 612017 }, { 7200, 610161 }, { 10800, 609277 }, { 14400, 607605 }, { 18000, 607930 },
+  { 21600, 609168 }, { 25200, 607386 }, { 28800, 607555 }, { 32400, 605623 }, { 36000, 605092 }, { 39600, 604028 },
+  { 43200, 600501 }, { 46800, 603533 }, { 50400, 602260 }, { 54000, 601498 }, { 57600, 597463 }, { 61200, 596634 },
+  { 64800, 597166 }, { 68400, 597048 }, { 72000, 597458 }, { 75600, 596181 }, { 79200, 596281 }, { 82800, 593787 },
+  { 86400, 594463 }, { 90000, 593841 }, { 93600, 591508 }, { 97200, 594326 }, { 100800, 591835 }, { 104400, 592046 },
+  { 108000, 588570 }, { 111600, 587641 }, { 115200, 587484 }, { 118800, 587090 }, { 122400, 587448 }, { 126000, 586123 },
+  { 129600, 584329 }, { 133200, 582815 }, { 136800, 582719 }, { 140400, 584581 }, { 144300, 805788 }, { 144600, 1032367 },
+  { 144900, 1257640 }, { 145200, 1479765 }, { 147600, 1481573 }, { 151200, 1482709 }, { 154800, 1476978 }, { 158400, 1478768 },
+  { 162000, 1478341 }, { 165600, 1476524 }, { 169200, 1477746 }, { 172800, 1476157 }, { 176400, 1473303 }, { 180000, 1475992 },
+  { 183600, 1475004 }, { 187200, 1474669 }, { 190800, 1474661 }, { 194400, 1472293 }, { 198000, 1471179 }, { 201600, 1468301 },
+  { 205200, 1470423 }, { 208800, 1467832 }, { 212400, 1467321 }, { 216000, 1465353 }, { 219600, 1465049 }, { 223200, 1464953 },
+  { 226800, 1466933 }, { 230400, 1461202 }, { 234000, 1461313 }, { 237600, 1463109 }, { 241200, 1464165 }, { 244800, 1462118 },
+  { 248400, 1457650 }, { 252600, 1435973 }, { 253200, 1420286 }, { 255600, 1417896 }, { 259200, 1416570 }, { 262800, 1418966 },
+  { 266400, 1418403 }, { 270000, 1416236 }, { 273600, 1415619 }, { 277200, 1415152 }, { 280800, 1416141 }, { 284400, 1413929 },
+  { 288000, 1413028 }, { 291600, 1412322 }, { 295200, 1408398 }, { 298800, 1411923 }, { 302400, 1410683 }, { 306000, 1409294 },
+  { 309600, 1404789 }, { 313200, 1406049 }, { 316800, 1407513 }, { 320400, 1402783 }, { 324000, 1404474 }, { 327600, 1405529 },
+  { 331200, 1401283 }, { 334800, 1404915 }, { 338400, 1402578 }, { 342000, 1400775 },
+};
+
+#endif // LEVEL_TRACES_H
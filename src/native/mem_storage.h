@@ -0,0 +1,68 @@
+#ifndef MEM_STORAGE_H
+#define MEM_STORAGE_H
+
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../storage.h"
+
+/*
+ * Host stand-in for LittleFS. Counts bytes written so flash wear can be
+ * checked, and reads so the cost of a lookup can.
+ */
+class MemStorage : public Storage {
+public:
+  MemStorage() : bytesWritten(0), writes(0), reads(0) {}
+
+  int32_t size(const char *path) override
+  {
+    auto it = files.find(path);
+    return it == files.end() ? -1 : (int32_t)it->second.size();
+  }
+
+  size_t read(const char *path, uint32_t offset, void *data, size_t len) override
+  {
+    reads++;
+    auto it = files.find(path);
+    if (it == files.end() || offset >= it->second.size()) {
+      return 0;
+    }
+    size_t n = it->second.size() - offset;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(data, it->second.data() + offset, n);
+    return n;
+  }
+
+  bool append(const char *path, const void *data, size_t len) override
+  {
+    std::vector<uint8_t> &file = files[path];
+    file.insert(file.end(), (const uint8_t *)data, (const uint8_t *)data + len);
+    bytesWritten += len;
+    writes++;
+    return true;
+  }
+
+  bool write(const char *path, const void *data, size_t len) override
+  {
+    files[path].assign((const uint8_t *)data, (const uint8_t *)data + len);
+    bytesWritten += len;
+    writes++;
+    return true;
+  }
+
+  bool remove(const char *path) override
+  {
+    return files.erase(path) > 0;
+  }
+
+  std::map<std::string, std::vector<uint8_t>> files;
+  size_t bytesWritten;
+  size_t writes;
+  size_t reads;
+};
+
+#endif // MEM_STORAGE_H
@@ -0,0 +1,61 @@
+#ifndef NOTIFY_SINK_H
+#define NOTIFY_SINK_H
+
+#include <string>
+#include <vector>
+
+#include "../notifier.h"
+
+/*
+ * Host stand-in for Telegram behind NotificationSink. Records the delivered
+ * messages and the connections a real client would have opened, and can
+ * fail the next sends to exercise the retries.
+ */
+class NotifySinkFake {
+public:
+  NotifySinkFake() : failNext(0), ready(true), attempts(0), connections(0), connected(false) {}
+
+  NotificationSink sink()
+  {
+    NotificationSink sink = { this, send, close };
+    return sink;
+  }
+
+  std::vector<std::string> delivered;
+  uint32_t failNext;
+  bool ready;             //!< false as a device without WiFi or chat id
+  uint32_t attempts;
+  uint32_t connections;   //!< TLS handshakes a real client would have done
+
+private:
+  static NotifySinkFake &self(void *ctx) { return *(NotifySinkFake *)ctx; }
+
+  static NotifyResult send(void *ctx, const char *text)
+  {
+    NotifySinkFake &fake = self(ctx);
+    if (!fake.ready) {
+      return NOTIFY_NOT_READY;
+    }
+    fake.attempts++;
+    if (!fake.connected) {
+      fake.connections++;
+      fake.connected = true;
+    }
+    if (fake.failNext > 0) {
+      fake.failNext--;
+      fake.connected = false;
+      return NOTIFY_FAILED;
+    }
+    fake.delivered.push_back(text);
+    return NOTIFY_SENT;
+  }
+
+  static void close(void *ctx)
+  {
+    self(ctx).connected = false;
+  }
+
+  bool connected;
+};
+
+#endif // NOTIFY_SINK_H
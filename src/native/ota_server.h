@@ -0,0 +1,132 @@
+#ifndef OTA_SERVER_H
+#define OTA_SERVER_H
+
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../ota.h"
+
+/*
+ * Host stand-in for the firmware bucket and the update partition, behind
+ * OtaHooks. Serves files with Range support and can cut every response
+ * after dropEvery bytes to exercise the resume path.
+ */
+class OtaServerFake {
+public:
+  OtaServerFake() : committed(false), dropEvery(0), requests(0), url(nullptr), offset(0), sent(0) {}
+
+  OtaHooks hooks()
+  {
+    OtaHooks hooks = {
+      this,
+      open, read, close,
+      begin, write, end, abort,
+      currentSize, readCurrent,
+      nullptr,
+    };
+    return hooks;
+  }
+
+  std::map<std::string, std::vector<uint8_t>> files;
+  std::vector<uint8_t> running;   //!< image the device runs, delta source
+  std::vector<uint8_t> flashed;   //!< update partition
+  bool committed;
+  uint32_t dropEvery;
+  uint32_t requests;
+
+private:
+  static OtaServerFake &self(void *ctx) { return *(OtaServerFake *)ctx; }
+
+  static int32_t open(void *ctx, const char *url, uint32_t offset)
+  {
+    OtaServerFake &s = self(ctx);
+    s.requests++;
+    auto it = s.files.find(url);
+    if (it == s.files.end() || offset > it->second.size()) {
+      return -1;
+    }
+    s.url = &it->second;
+    s.offset = offset;
+    s.sent = 0;
+    return it->second.size();
+  }
+
+  static int32_t read(void *ctx, uint8_t *buf, size_t len)
+  {
+    OtaServerFake &s = self(ctx);
+    if (!s.url) {
+      return -1;
+    }
+    size_t n = s.url->size() - s.offset;
+    if (s.dropEvery > 0) {
+      if (s.sent >= s.dropEvery) {
+        return 0;
+      }
+      if (n > s.dropEvery - s.sent) {
+        n = s.dropEvery - s.sent;
+      }
+    }
+    if (n > len) {
+      n = len;
+    }
+    memcpy(buf, s.url->data() + s.offset, n);
+    s.offset += n;
+    s.sent += n;
+    return n;
+  }
+
+  static void close(void *ctx)
+  {
+    self(ctx).url = nullptr;
+  }
+
+  static bool begin(void *ctx, uint32_t size)
+  {
+    OtaServerFake &s = self(ctx);
+    s.flashed.clear();
+    s.flashed.reserve(size);
+    s.committed = false;
+    return true;
+  }
+
+  static bool write(void *ctx, const uint8_t *data, size_t len)
+  {
+    OtaServerFake &s = self(ctx);
+    s.flashed.insert(s.flashed.end(), data, data + len);
+    return true;
+  }
+
+  static bool end(void *ctx)
+  {
+    self(ctx).committed = true;
+    return true;
+  }
+
+  static void abort(void *ctx)
+  {
+    self(ctx).flashed.clear();
+  }
+
+  static uint32_t currentSize(void *ctx)
+  {
+    return self(ctx).running.size();
+  }
+
+  static bool readCurrent(void *ctx, uint32_t offset, uint8_t *buf, size_t len)
+  {
+    OtaServerFake &s = self(ctx);
+    if (offset + len > s.running.size()) {
+      return false;
+    }
+    memcpy(buf, s.running.data() + offset, len);
+    return true;
+  }
+
+  const std::vector<uint8_t> *url;
+  uint32_t offset;
+  uint32_t sent;
+};
+
+#endif // OTA_SERVER_H
@@ -0,0 +1,114 @@
+#ifndef SONAR_FIELD_H
+#define SONAR_FIELD_H
+
+#include <stdint.h>
+
+#include "../sonar_cycle.h"
+
+#define SONAR_FIELD_RISE_US 450   //!< HC-SR04: the echo line goes high ~450 us after the trigger
+
+/*
+ * Host stand-in for several ultrasonic sensors sharing the air, driven in
+ * simulated microseconds. Each trigger schedules the echo edges of its
+ * sensor, and counts crosstalk when another sensor of the same group was
+ * still listening or ringing, within guardUs of the end of its echo.
+ */
+class SonarFieldFake {
+public:
+  struct Sensor {
+    SonarFieldFake *field;
+    Sonar sonar;
+    uint32_t echoUs;     //!< 0 never answers
+    uint8_t group;
+    bool pending;        //!< edges still to deliver
+    bool high;
+    uint32_t firedUs;
+    uint32_t endUs;      //!< end of the last echo, or of its timeout
+    uint32_t triggers;
+  };
+
+  SonarFieldFake() : nowUs(0), guardUs(SONAR_CYCLE_GUARD_US), count(0), crosstalk(0) {}
+
+  uint8_t add(uint32_t echoUs, uint8_t group)
+  {
+    Sensor &sensor = sensors[count];
+    sensor.field = this;
+    sensor.echoUs = echoUs;
+    sensor.group = group;
+    sensor.pending = false;
+    sensor.high = false;
+    sensor.firedUs = 0;
+    sensor.endUs = 0;
+    sensor.triggers = 0;
+    sensor.sonar.begin(trigger, &sensor);
+    return count++;
+  }
+
+  // Services the cycle when it asks to and delivers the edges in between
+  void run(SonarCycle &cycle, uint32_t untilUs)
+  {
+    uint32_t serviceUs = nowUs;
+    while (nowUs < untilUs) {
+      uint32_t next = serviceUs;
+      for (uint8_t i = 0; i < count; i++) {
+        if (sensors[i].pending && edgeUs(sensors[i]) < next) {
+          next = edgeUs(sensors[i]);
+        }
+      }
+      nowUs = next;
+      for (uint8_t i = 0; i < count; i++) {
+        Sensor &sensor = sensors[i];
+        if (sensor.pending && edgeUs(sensor) == nowUs) {
+          sensor.high = !sensor.high;
+          sensor.pending = sensor.high;
+          if (!sensor.high) {
+            sensor.endUs = nowUs;
+          }
+          sensor.sonar.onEchoEdge(sensor.high, nowUs);
+        }
+      }
+      if (nowUs >= serviceUs) {
+        serviceUs = nowUs + cycle.service(nowUs, nowUs / 1000) * 1000;
+      }
+    }
+  }
+
+  Sensor sensors[SONAR_CYCLE_MAX];
+  uint32_t nowUs;
+  uint32_t guardUs;
+  uint8_t count;
+  uint32_t crosstalk;
+
+private:
+  static uint32_t edgeUs(const Sensor &sensor)
+  {
+    uint32_t rise = sensor.firedUs + SONAR_FIELD_RISE_US;
+    return sensor.high ? rise + sensor.echoUs : rise;
+  }
+
+  static void trigger(void *ctx)
+  {
+    Sensor &sensor = *(Sensor *)ctx;
+    SonarFieldFake &field = *sensor.field;
+    for (uint8_t i = 0; i < field.count; i++) {
+      const Sensor &other = field.sensors[i];
+      if (&other == &sensor || other.group != sensor.group || other.triggers == 0) {
+        continue;
+      }
+      // Still waiting for its echo, or its echo still rings
+      uint32_t end = other.echoUs ? other.endUs : other.firedUs + other.sonar.getTimeout();
+      if (other.pending || (int32_t)(field.nowUs - end) < (int32_t)field.guardUs) {
+        field.crosstalk++;
+      }
+    }
+    sensor.firedUs = field.nowUs;
+    sensor.triggers++;
+    sensor.pending = sensor.echoUs > 0;
+    sensor.high = false;
+    if (!sensor.pending) {
+      sensor.endUs = field.nowUs + sensor.sonar.getTimeout();
+    }
+  }
+};
+
+#endif // SONAR_FIELD_H
@@ -0,0 +1,169 @@
+#include "notifier.h"
+
+#include <string.h>
+
+Notifier::Notifier()
+  : config(defaults()), count(0), recentNext(0), tokens(0), refillAtMs(0), lastTrafficMs(0), open(false),
+    rng(1), sent(0), failures(0), dropped(0), duplicates(0)
+{
+  memset(&sink, 0, sizeof(sink));
+  memset(recent, 0, sizeof(recent));
+}
+
+NotifierConfig Notifier::defaults()
+{
+  NotifierConfig config;
+  config.retryMinMs = 5000;
+  config.retryMaxMs = 300000;
+  config.maxAttempts = 8;
+  // Telegram allows about one message per second in a chat, stay well below
+  config.burst = 3;
+  config.refillMs = 5000;
+  config.dedupWindowMs = 3600000;
+  config.idleCloseMs = 15000;
+  return config;
+}
+
+void Notifier::begin(const NotificationSink &sink, uint32_t nowMs, uint32_t seed)
+{
+  this->sink = sink;
+  rng = seed ? seed : 1;
+  tokens = config.burst;
+  refillAtMs = nowMs + config.refillMs;
+  lastTrafficMs = nowMs;
+}
+
+uint32_t Notifier::hashText(const char *text)
+{
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  while (*text) {
+    hash = (hash ^ (uint8_t)*text++) * 16777619u;
+  }
+  return hash;
+}
+
+uint32_t Notifier::nextRandom()
+{
+  // xorshift32, only used for jitter
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng;
+}
+
+bool Notifier::isDuplicate(uint32_t hash, uint32_t nowMs) const
+{
+  for (uint8_t i = 0; i < count; i++) {
+    if (queue[i].hash == hash) {
+      return true;
+    }
+  }
+  for (uint8_t i = 0; i < NOTIFY_RECENT; i++) {
+    if (recent[i].hash == hash && nowMs - recent[i].sentMs < config.dedupWindowMs) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Notifier::enqueue(const char *text, uint32_t nowMs)
+{
+  uint32_t hash = hashText(text);
+  if (isDuplicate(hash, nowMs)) {
+    duplicates++;
+    return false;
+  }
+  if (count >= NOTIFY_QUEUE_SIZE) {
+    dropped++;
+    return false;
+  }
+
+  Entry &entry = queue[count++];
+  strncpy(entry.text, text, sizeof(entry.text) - 1);
+  entry.text[sizeof(entry.text) - 1] = '\0';
+  entry.hash = hash;
+  entry.nextMs = nowMs;
+  entry.attempts = 0;
+  return true;
+}
+
+void Notifier::refill(uint32_t nowMs)
+{
+  while (tokens < config.burst && (int32_t)(nowMs - refillAtMs) >= 0) {
+    tokens++;
+    refillAtMs += config.refillMs;
+  }
+  if (tokens >= config.burst) {
+    refillAtMs = nowMs + config.refillMs;
+  }
+}
+
+void Notifier::removeAt(uint8_t index)
+{
+  memmove(&queue[index], &queue[index + 1], (count - index - 1) * sizeof(Entry));
+  count--;
+}
+
+bool Notifier::tick(uint32_t nowMs)
+{
+  refill(nowMs);
+
+  if (open && count == 0 && nowMs - lastTrafficMs >= config.idleCloseMs) {
+    if (sink.close) {
+      sink.close(sink.ctx);
+    }
+    open = false;
+  }
+
+  if (tokens == 0) {
+    return false;
+  }
+
+  // Oldest message whose retry delay is over
+  uint8_t index = 0;
+  while (index < count && (int32_t)(nowMs - queue[index].nextMs) < 0) {
+    index++;
+  }
+  if (index == count) {
+    return false;
+  }
+
+  Entry &entry = queue[index];
+  NotifyResult result = sink.send(sink.ctx, entry.text);
+  if (result == NOTIFY_NOT_READY) {
+    // Neither an attempt nor traffic: the message waits for the network or the config, however long
+    entry.nextMs = nowMs + config.retryMinMs;
+    return false;
+  }
+  tokens--;
+  entry.attempts++;
+  open = true;
+  lastTrafficMs = nowMs;
+
+  if (result == NOTIFY_SENT) {
+    sent++;
+    recent[recentNext].hash = entry.hash;
+    recent[recentNext].sentMs = nowMs;
+    recentNext = (recentNext + 1) % NOTIFY_RECENT;
+    removeAt(index);
+    return true;
+  }
+
+  failures++;
+  if (entry.attempts >= config.maxAttempts) {
+    dropped++;
+    removeAt(index);
+    return true;
+  }
+
+  uint32_t delay = config.retryMinMs;
+  for (uint8_t i = 1; i < entry.attempts && delay < config.retryMaxMs; i++) {
+    delay *= 2;
+  }
+  if (delay > config.retryMaxMs) {
+    delay = config.retryMaxMs;
+  }
+  entry.nextMs = nowMs + delay + nextRandom() % (delay / 2 + 1);
+  return true;
+}
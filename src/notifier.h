@@ -0,0 +1,99 @@
+#ifndef NOTIFIER_H
+#define NOTIFIER_H
+
+#include <stdint.h>
+
+#define NOTIFY_QUEUE_SIZE    8
+#define NOTIFY_MESSAGE_SIZE  96
+#define NOTIFY_RECENT        4     //!< sent messages remembered for deduplication
+
+enum NotifyResult : uint8_t {
+  NOTIFY_SENT = 0,
+  NOTIFY_FAILED,      //!< counts as an attempt, retried with backoff
+  NOTIFY_NOT_READY,   //!< nowhere to send yet (no network, no chat), retried without counting
+};
+
+/*
+ * Where messages go: Telegram on the device, a webhook or a fake elsewhere.
+ * send() may block on the network, close() drops an idle connection.
+ */
+struct NotificationSink {
+  void *ctx;
+  NotifyResult (*send)(void *ctx, const char *text);
+  void (*close)(void *ctx);   //!< optional
+};
+
+struct NotifierConfig {
+  uint32_t retryMinMs;      //!< first retry delay, doubled on each failure, also the wait while not ready
+  uint32_t retryMaxMs;
+  uint8_t maxAttempts;      //!< then the message is dropped
+  uint8_t burst;            //!< messages that may go out back to back
+  uint32_t refillMs;        //!< one more message allowed every refillMs
+  uint32_t dedupWindowMs;   //!< identical text within this window is sent once
+  uint32_t idleCloseMs;     //!< close the connection after this long without traffic
+};
+
+/*
+ * Bounded outbound queue between the measurement path, which only calls
+ * enqueue(), and its own task, which calls tick(). Failed sends are retried
+ * with exponential backoff plus jitter and the output is rate limited with a
+ * token bucket. The connection stays open while messages keep coming.
+ */
+class Notifier {
+public:
+  Notifier();
+
+  void begin(const NotificationSink &sink, uint32_t nowMs, uint32_t seed = 1);
+  void configure(const NotifierConfig &config) { this->config = config; }
+  static NotifierConfig defaults();
+
+  // False when the message is a duplicate or the queue is full
+  bool enqueue(const char *text, uint32_t nowMs);
+  // Sends at most one message, returns true when one was attempted and the sink was ready
+  bool tick(uint32_t nowMs);
+
+  uint8_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  uint32_t getSent() const { return sent; }
+  uint32_t getFailures() const { return failures; }
+  uint32_t getDropped() const { return dropped; }
+  uint32_t getDuplicates() const { return duplicates; }
+
+private:
+  struct Entry {
+    char text[NOTIFY_MESSAGE_SIZE];
+    uint32_t hash;
+    uint32_t nextMs;
+    uint8_t attempts;
+  };
+
+  struct Recent {
+    uint32_t hash;
+    uint32_t sentMs;
+  };
+
+  static uint32_t hashText(const char *text);
+  bool isDuplicate(uint32_t hash, uint32_t nowMs) const;
+  void refill(uint32_t nowMs);
+  void removeAt(uint8_t index);
+  uint32_t nextRandom();
+
+  NotificationSink sink;
+  NotifierConfig config;
+  Entry queue[NOTIFY_QUEUE_SIZE];   //!< oldest first
+  uint8_t count;
+  Recent recent[NOTIFY_RECENT];
+  uint8_t recentNext;
+  uint8_t tokens;
+  uint32_t refillAtMs;
+  uint32_t lastTrafficMs;
+  bool open;
+  uint32_t rng;
+
+  uint32_t sent;
+  uint32_t failures;
+  uint32_t dropped;
+  uint32_t duplicates;
+};
+
+#endif // NOTIFIER_H
@@ -0,0 +1,268 @@
+#include "ota.h"
+
+#include <string.h>
+#include "rtc_state.h"
+
+static uint32_t readLe32(const uint8_t *p)
+{
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+OtaUpdater::OtaUpdater()
+  : clockMs(nullptr), startMs(0), delta(false), started(false), patchState(PATCH_HEADER),
+    pendingLen(0), sourceSize(0), dataLeft(0)
+{
+  memset(&hooks, 0, sizeof(hooks));
+  memset(&progress, 0, sizeof(progress));
+}
+
+void OtaUpdater::begin(const OtaHooks &hooks, ClockFn clockMs)
+{
+  this->hooks = hooks;
+  this->clockMs = clockMs;
+}
+
+const char *OtaUpdater::resultName(OtaResult result)
+{
+  switch (result) {
+    case OTA_OK: return "ok";
+    case OTA_ERROR_CONNECT: return "connect";
+    case OTA_ERROR_STALLED: return "stalled";
+    case OTA_ERROR_SIZE: return "size";
+    case OTA_ERROR_BEGIN: return "begin";
+    case OTA_ERROR_WRITE: return "write";
+    case OTA_ERROR_PATCH: return "patch";
+    case OTA_ERROR_HASH: return "hash";
+  }
+  return "unknown";
+}
+
+uint32_t OtaUpdater::throughput() const
+{
+  return progress.elapsedMs ? (uint64_t)progress.received * 1000 / progress.elapsedMs : 0;
+}
+
+OtaResult OtaUpdater::fail(OtaResult result)
+{
+  if (started && hooks.abort) {
+    hooks.abort(hooks.ctx);
+  }
+  started = false;
+  progress.elapsedMs = clockMs() - startMs;
+  return result;
+}
+
+bool OtaUpdater::startImage(uint32_t size)
+{
+  progress.imageSize = size;
+  started = hooks.begin(hooks.ctx, size);
+  return started;
+}
+
+bool OtaUpdater::emit(const uint8_t *data, size_t len)
+{
+  if (progress.written + len > progress.imageSize) {
+    return false;
+  }
+  sha.update(data, len);
+  progress.written += len;
+  return hooks.write(hooks.ctx, data, len);
+}
+
+bool OtaUpdater::copyCurrent(uint32_t offset, uint32_t len)
+{
+  if (offset > sourceSize || len > sourceSize - offset) {
+    return false;
+  }
+  while (len > 0) {
+    uint32_t n = len < sizeof(chunk) ? len : sizeof(chunk);
+    if (!hooks.readCurrent(hooks.ctx, offset, chunk, n) || !emit(chunk, n)) {
+      return false;
+    }
+    offset += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool OtaUpdater::consumeDelta(const uint8_t *data, size_t len)
+{
+  while (len > 0) {
+    if (patchState == PATCH_DONE) {
+      return false;  // trailing garbage
+    }
+
+    if (patchState == PATCH_DATA) {
+      uint32_t n = len < dataLeft ? len : dataLeft;
+      if (!emit(data, n)) {
+        return false;
+      }
+      data += n;
+      len -= n;
+      dataLeft -= n;
+      if (dataLeft == 0) {
+        patchState = PATCH_OP;
+      }
+      continue;
+    }
+
+    // Header and operations may straddle two reads, assemble them first
+    uint8_t needed = 12;
+    if (patchState == PATCH_OP) {
+      pending[0] = pendingLen ? pending[0] : *data;
+      needed = pending[0] == OTA_OP_COPY ? 9 : pending[0] == OTA_OP_DATA ? 5 : 1;
+    }
+    while (pendingLen < needed && len > 0) {
+      pending[pendingLen++] = *data++;
+      len--;
+    }
+    if (pendingLen < needed) {
+      return true;
+    }
+    pendingLen = 0;
+
+    if (patchState == PATCH_HEADER) {
+      sourceSize = readLe32(pending + 4);
+      if (readLe32(pending) != OTA_DELTA_MAGIC || sourceSize > hooks.currentSize(hooks.ctx)) {
+        return false;
+      }
+      if (!startImage(readLe32(pending + 8))) {
+        return false;
+      }
+      patchState = PATCH_OP;
+      continue;
+    }
+
+    switch (pending[0]) {
+      case OTA_OP_END:
+        patchState = PATCH_DONE;
+        break;
+      case OTA_OP_COPY:
+        if (!copyCurrent(readLe32(pending + 1), readLe32(pending + 5))) {
+          return false;
+        }
+        break;
+      case OTA_OP_DATA:
+        dataLeft = readLe32(pending + 1);
+        patchState = dataLeft > 0 ? PATCH_DATA : PATCH_OP;
+        break;
+      default:
+        return false;
+    }
+  }
+  return true;
+}
+
+bool OtaUpdater::consume(const uint8_t *data, size_t len)
+{
+  return delta ? consumeDelta(data, len) : emit(data, len);
+}
+
+OtaResult OtaUpdater::run(const char *url, const uint8_t *expected, bool delta)
+{
+  memset(&progress, 0, sizeof(progress));
+  startMs = clockMs();
+  sha.reset();
+  this->delta = delta;
+  started = false;
+  patchState = PATCH_HEADER;
+  pendingLen = 0;
+
+  int32_t total = -1;
+  uint32_t nextProgress = OTA_PROGRESS_STEP;
+  for (;;) {
+    int32_t size = hooks.open(hooks.ctx, url, progress.received);
+    if (size < 0) {
+      hooks.close(hooks.ctx);
+      if (++progress.resumes > OTA_MAX_RESUMES) {
+        return fail(total < 0 ? OTA_ERROR_CONNECT : OTA_ERROR_STALLED);
+      }
+      continue;
+    }
+
+    if (total < 0) {
+      total = size;
+      progress.total = total;
+      // A full image is written as is, a delta announces the size in its header
+      if (!delta && !startImage(total)) {
+        hooks.close(hooks.ctx);
+        return fail(OTA_ERROR_BEGIN);
+      }
+    } else if (size != total) {
+      hooks.close(hooks.ctx);
+      return fail(OTA_ERROR_SIZE);
+    }
+
+    while (progress.received < (uint32_t)total) {
+      int32_t n = hooks.read(hooks.ctx, input, sizeof(input));
+      if (n <= 0) {
+        break;
+      }
+      if (progress.received + n > (uint32_t)total) {
+        n = total - progress.received;
+      }
+      if (!consume(input, n)) {
+        hooks.close(hooks.ctx);
+        return fail(delta ? OTA_ERROR_PATCH : OTA_ERROR_WRITE);
+      }
+      progress.received += n;
+      if (progress.received >= nextProgress && hooks.progress) {
+        progress.elapsedMs = clockMs() - startMs;
+        hooks.progress(hooks.ctx, progress);
+        nextProgress += OTA_PROGRESS_STEP;
+      }
+    }
+    hooks.close(hooks.ctx);
+
+    if (progress.received >= (uint32_t)total) {
+      break;
+    }
+    if (++progress.resumes > OTA_MAX_RESUMES) {
+      return fail(OTA_ERROR_STALLED);
+    }
+  }
+
+  if (!started || (delta && patchState != PATCH_DONE) || progress.written != progress.imageSize) {
+    return fail(delta ? OTA_ERROR_PATCH : OTA_ERROR_SIZE);
+  }
+
+  uint8_t digest[SHA256_SIZE];
+  sha.finish(digest);
+  if (expected && memcmp(digest, expected, SHA256_SIZE) != 0) {
+    return fail(OTA_ERROR_HASH);
+  }
+
+  progress.elapsedMs = clockMs() - startMs;
+  if (hooks.progress) {
+    hooks.progress(hooks.ctx, progress);
+  }
+  if (!hooks.end(hooks.ctx)) {
+    return fail(OTA_ERROR_WRITE);
+  }
+  started = false;
+  return OTA_OK;
+}
+
+bool otaCheckLoad(Storage &storage, OtaCheckState &state)
+{
+  if (storage.read(OTA_CHECK_PATH, 0, &state, sizeof(state)) == sizeof(state) &&
+      state.crc == crc32Ieee((uint8_t *)&state + 4, sizeof(state) - 4)) {
+    state.etag[OTA_ETAG_SIZE - 1] = '\0';
+    state.version[OTA_VERSION_SIZE - 1] = '\0';
+    return true;
+  }
+  memset(&state, 0, sizeof(state));
+  return false;
+}
+
+void otaCheckSave(Storage &storage, OtaCheckState &state)
+{
+  state.crc = crc32Ieee((uint8_t *)&state + 4, sizeof(state) - 4);
+  storage.write(OTA_CHECK_PATH, &state, sizeof(state));
+}
+
+bool otaCheckDue(const OtaCheckState &state, uint32_t now, uint32_t interval)
+{
+  // A clock that went backwards means the saved time cannot be trusted
+  return state.checkedAt == 0 || now < state.checkedAt || now - state.checkedAt >= interval;
+}
@@ -0,0 +1,139 @@
+#ifndef OTA_H
+#define OTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sha256.h"
+#include "storage.h"
+
+#define OTA_CHUNK_SIZE      512          //!< network read and flash write granularity
+#define OTA_MAX_RESUMES     8            //!< Range requests after a dropped transfer
+#define OTA_PROGRESS_STEP   (32 * 1024)  //!< progress() every that many downloaded bytes
+
+// Delta image: header then operations, all integers little endian.
+//   "OTD1" u32 sourceSize u32 targetSize
+//   0x01 u32 offset u32 length   copy from the running image
+//   0x02 u32 length bytes...     literal bytes
+//   0x00                         end
+// Written by ota_delta.py. The SHA-256 checked is the one of the rebuilt target.
+#define OTA_DELTA_MAGIC     0x3144544F
+#define OTA_OP_END          0x00
+#define OTA_OP_COPY         0x01
+#define OTA_OP_DATA         0x02
+
+enum OtaResult : uint8_t {
+  OTA_OK = 0,
+  OTA_ERROR_CONNECT,   //!< no response, even after the resumes
+  OTA_ERROR_STALLED,   //!< the transfer kept breaking
+  OTA_ERROR_SIZE,      //!< the file changed between two requests or is too large
+  OTA_ERROR_BEGIN,     //!< no room for the image
+  OTA_ERROR_WRITE,
+  OTA_ERROR_PATCH,     //!< invalid delta or one made for another running image
+  OTA_ERROR_HASH,      //!< SHA-256 mismatch, nothing was committed
+};
+
+struct OtaProgress {
+  uint32_t received;    //!< downloaded bytes
+  uint32_t total;       //!< download size
+  uint32_t written;     //!< image bytes written to flash
+  uint32_t imageSize;
+  uint8_t resumes;
+  uint32_t elapsedMs;
+};
+
+/*
+ * Board specific actions. open() issues a GET with "Range: bytes=offset-" and
+ * must fail if the server ignored the range.
+ */
+struct OtaHooks {
+  void *ctx;
+  // Total size of the file, -1 on failure
+  int32_t (*open)(void *ctx, const char *url, uint32_t offset);
+  // Up to len bytes, 0 once the response ended or stalled, -1 on error
+  int32_t (*read)(void *ctx, uint8_t *buf, size_t len);
+  void (*close)(void *ctx);
+
+  bool (*begin)(void *ctx, uint32_t size);
+  bool (*write)(void *ctx, const uint8_t *data, size_t len);
+  // Activates the new image, only called once its hash matched
+  bool (*end)(void *ctx);
+  void (*abort)(void *ctx);
+
+  // Running image, the source of the delta copies
+  uint32_t (*currentSize)(void *ctx);
+  bool (*readCurrent)(void *ctx, uint32_t offset, uint8_t *buf, size_t len);
+
+  void (*progress)(void *ctx, const OtaProgress &progress);  //!< optional
+};
+
+/*
+ * Streams a full or delta image into the update partition. A broken transfer
+ * resumes where it stopped with a Range request, the image is hashed while
+ * it is written and only activated when the SHA-256 matches.
+ */
+class OtaUpdater {
+public:
+  typedef uint32_t (*ClockFn)();
+
+  OtaUpdater();
+
+  void begin(const OtaHooks &hooks, ClockFn clockMs);
+  // Blocking. expected may be nullptr to skip the check (older servers).
+  OtaResult run(const char *url, const uint8_t *expected, bool delta);
+
+  const OtaProgress &getProgress() const { return progress; }
+  // Download rate of the last run, bytes per second
+  uint32_t throughput() const;
+
+  static const char *resultName(OtaResult result);
+
+private:
+  enum PatchState : uint8_t {
+    PATCH_HEADER,
+    PATCH_OP,
+    PATCH_DATA,
+    PATCH_DONE,
+  };
+
+  bool consume(const uint8_t *data, size_t len);
+  bool consumeDelta(const uint8_t *data, size_t len);
+  bool startImage(uint32_t size);
+  bool emit(const uint8_t *data, size_t len);
+  bool copyCurrent(uint32_t offset, uint32_t len);
+  OtaResult fail(OtaResult result);
+
+  OtaHooks hooks;
+  ClockFn clockMs;
+  OtaProgress progress;
+  uint32_t startMs;
+  Sha256 sha;
+  bool delta;
+  bool started;
+
+  PatchState patchState;
+  uint8_t pending[12];      //!< header or operation being assembled
+  uint8_t pendingLen;
+  uint32_t sourceSize;
+  uint32_t dataLeft;
+  uint8_t input[OTA_CHUNK_SIZE];   //!< as received, members rather than locals of run() to stay off the stack
+  uint8_t chunk[OTA_CHUNK_SIZE];   //!< source bytes of a delta copy
+};
+
+#define OTA_ETAG_SIZE   48
+#define OTA_VERSION_SIZE 16
+#define OTA_CHECK_PATH  "/ota.state"
+
+// Last version check, kept in flash so reboots and deep sleep do not repeat it
+struct OtaCheckState {
+  uint32_t crc;
+  uint32_t checkedAt;          //!< epoch seconds, 0 = never
+  char etag[OTA_ETAG_SIZE];    //!< manifest tag of the last "up to date" answer
+  char version[OTA_VERSION_SIZE];  //!< firmware that got it, a reflashed device must ask again
+};
+
+// Cleared state when the file is missing or corrupted
+bool otaCheckLoad(Storage &storage, OtaCheckState &state);
+void otaCheckSave(Storage &storage, OtaCheckState &state);
+bool otaCheckDue(const OtaCheckState &state, uint32_t now, uint32_t interval);
+
+#endif // OTA_H
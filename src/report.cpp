@@ -0,0 +1,105 @@
+#include "report.h"
+
+#include <string.h>
+
+static const char *const REASON_NAMES[] = {
+  "suppressed",
+  "first",
+  "change",
+  "heartbeat",
+};
+
+Reporter::Reporter()
+  : config(defaults()), knownChannels(0), suppressedTotal(0), skipped(0)
+{
+  memset(&state, 0, sizeof(state));
+  memset(referencesMl, 0, sizeof(referencesMl));
+}
+
+ReportConfig Reporter::defaults()
+{
+  ReportConfig config;
+  config.deadbandMl = 0;
+  config.deadbandPercent = 1;
+  // A refill moves the level every minute, one point every 5 is plenty
+  config.minIntervalS = 300;
+  config.heartbeatS = 3600;
+  return config;
+}
+
+const char *Reporter::reasonName(ReportReason reason)
+{
+  return reason <= REPORT_HEARTBEAT ? REASON_NAMES[reason] : "unknown";
+}
+
+void Reporter::configure(const ReportConfig &config)
+{
+  this->config = config;
+}
+
+bool Reporter::changed(uint32_t volumeMl, uint32_t fullVolumeMl, uint32_t referenceMl) const
+{
+  uint32_t delta = volumeMl > referenceMl ? volumeMl - referenceMl : referenceMl - volumeMl;
+  if (config.deadbandMl && delta >= config.deadbandMl) {
+    return true;
+  }
+  if (config.deadbandPercent && fullVolumeMl &&
+      (uint64_t)delta * 100 >= (uint64_t)config.deadbandPercent * fullVolumeMl) {
+    return true;
+  }
+  return !config.deadbandMl && !config.deadbandPercent;
+}
+
+ReportReason Reporter::decide(uint32_t nowS, uint32_t volumeMl, uint32_t fullVolumeMl)
+{
+  return decide(nowS, &volumeMl, &fullVolumeMl, 1);
+}
+
+ReportReason Reporter::decide(uint32_t nowS, const uint32_t *volumesMl, const uint32_t *fullVolumesMl, uint8_t count)
+{
+  if (count > REPORT_MAX_CHANNELS) {
+    count = REPORT_MAX_CHANNELS;
+  }
+  for (uint8_t i = 1; i < count; i++) {
+    if (!(knownChannels & (1 << i))) {
+      referencesMl[i - 1] = volumesMl[i];
+      knownChannels |= 1 << i;
+    }
+  }
+  bool anyChanged = false;
+  for (uint8_t i = 0; i < count && !anyChanged; i++) {
+    anyChanged = changed(volumesMl[i], fullVolumesMl[i], i == 0 ? state.lastVolumeMl : referencesMl[i - 1]);
+  }
+
+  ReportReason reason = REPORT_SUPPRESSED;
+  uint32_t elapsed = nowS - state.lastS;
+  if (state.lastS == 0) {
+    reason = REPORT_FIRST;
+  } else if (nowS < state.lastS) {
+    // The clock went back (millis() wrap, NTP correction), start over from here
+    reason = REPORT_FIRST;
+  } else if (elapsed < config.minIntervalS) {
+    reason = REPORT_SUPPRESSED;
+  } else if (anyChanged) {
+    reason = REPORT_CHANGE;
+  } else if (config.heartbeatS == 0 || elapsed >= config.heartbeatS) {
+    reason = REPORT_HEARTBEAT;
+  }
+
+  if (reason == REPORT_SUPPRESSED) {
+    suppressedTotal++;
+    if (state.suppressed < UINT16_MAX) {
+      state.suppressed++;
+    }
+    return reason;
+  }
+
+  state.lastS = nowS ? nowS : 1;
+  state.lastVolumeMl = volumesMl[0];
+  for (uint8_t i = 1; i < count; i++) {
+    referencesMl[i - 1] = volumesMl[i];
+  }
+  skipped = state.suppressed;
+  state.suppressed = 0;
+  return reason;
+}
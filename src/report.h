@@ -0,0 +1,75 @@
+#ifndef REPORT_H
+#define REPORT_H
+
+#include <stdint.h>
+
+#define REPORT_MAX_CHANNELS 4        //!< tanks published together by one device
+
+// A heating-oil level barely moves for hours: publish when it changed by
+// more than the deadband, or when the heartbeat is due, never faster than
+// the minimum interval.
+
+struct ReportConfig {
+  uint32_t deadbandMl;       //!< 0 disables the volume deadband
+  uint32_t deadbandPercent;  //!< of the full volume, 0 disables it. No padding, TankConfig is CRC'd
+  uint32_t minIntervalS;     //!< between two publishes, even on change
+  uint32_t heartbeatS;       //!< longest silence, 0 publishes every level
+};
+
+enum ReportReason : uint8_t {
+  REPORT_SUPPRESSED = 0,
+  REPORT_FIRST,              //!< nothing published yet
+  REPORT_CHANGE,
+  REPORT_HEARTBEAT,
+};
+
+// What the next decision depends on, kept in RtcState across deep sleep
+struct ReportState {
+  uint32_t lastS;            //!< 0 before the first publish
+  uint32_t lastVolumeMl;
+  uint16_t suppressed;       //!< since the last publish, saturates
+};
+
+class Reporter {
+public:
+  Reporter();
+
+  void configure(const ReportConfig &config);
+  const ReportConfig &getConfig() const { return config; }
+
+  /*
+   * nowS is any clock in seconds that keeps running across deep sleep.
+   * A reason other than REPORT_SUPPRESSED means publish now: the level is
+   * then taken as the reference for the next decisions.
+   */
+  ReportReason decide(uint32_t nowS, uint32_t volumeMl, uint32_t fullVolumeMl);
+  /*
+   * Several tanks in one message: a change of any of them publishes them
+   * all. Only the first one is in ReportState, the others take their first
+   * level as reference so a wake from deep sleep does not look like a change.
+   */
+  ReportReason decide(uint32_t nowS, const uint32_t *volumesMl, const uint32_t *fullVolumesMl, uint8_t count);
+
+  // Publishes skipped since boot
+  uint32_t getSuppressed() const { return suppressedTotal; }
+  // Skipped between the previous publish and the one just decided
+  uint16_t getSkipped() const { return skipped; }
+
+  ReportState &getState() { return state; }
+  const ReportState &getState() const { return state; }
+
+  static ReportConfig defaults();
+  static const char *reasonName(ReportReason reason);
+
+private:
+  bool changed(uint32_t volumeMl, uint32_t fullVolumeMl, uint32_t referenceMl) const;
+
+  ReportConfig config;
+  ReportState state;
+  uint32_t referencesMl[REPORT_MAX_CHANNELS - 1];   //!< last published level of the other channels
+  uint8_t knownChannels;                            //!< one bit per channel with a reference
+  uint32_t suppressedTotal;
+  uint16_t skipped;
+};
+
+#endif // REPORT_H
@@ -0,0 +1,55 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <stdint.h>
+
+/*
+ * Fixed capacity FIFO living inside its owner, no heap.
+ * When full, push() overwrites the oldest entry.
+ */
+template <typename T, uint16_t N>
+class RingBuffer {
+public:
+  RingBuffer() : head(0), count(0) {}
+
+  // Returns false when the oldest entry had to be dropped.
+  bool push(const T &item)
+  {
+    items[(head + count) % N] = item;
+    if (count < N) {
+      count++;
+      return true;
+    }
+    head = (head + 1) % N;
+    return false;
+  }
+
+  bool pop(T &item)
+  {
+    if (count == 0) {
+      return false;
+    }
+    item = items[head];
+    head = (head + 1) % N;
+    count--;
+    return true;
+  }
+
+  // Oldest first
+  const T &operator[](uint16_t i) const { return items[(head + i) % N]; }
+  const T &front() const { return items[head]; }
+  const T &back() const { return items[(head + count + N - 1) % N]; }
+
+  uint16_t size() const { return count; }
+  uint16_t capacity() const { return N; }
+  bool empty() const { return count == 0; }
+  bool full() const { return count == N; }
+  void clear() { head = 0; count = 0; }
+
+private:
+  T items[N];
+  uint16_t head;
+  uint16_t count;
+};
+
+#endif // RING_BUFFER_H
@@ -0,0 +1,77 @@
+#include "rtc_state.h"
+
+#include <string.h>
+
+#if defined(ESP8266)
+#include <Arduino.h>
+#elif defined(ESP32)
+#include <Arduino.h>
+RTC_DATA_ATTR static uint32_t rtcMemory[RTC_MEMORY_SIZE / 4];
+#else
+static uint32_t rtcMemory[RTC_MEMORY_SIZE / 4];
+#endif
+
+static_assert(sizeof(RtcState) <= RTC_SLOT_TLS, "RtcState overflows its RTC slot");
+
+uint32_t crc32Ieee(const void *data, size_t len, uint32_t crc)
+{
+  // Bitwise CRC-32 (IEEE), small and fast enough for a few hundred bytes
+  const uint8_t *bytes = (const uint8_t *)data;
+  crc = ~crc;
+  while (len--) {
+    crc ^= *bytes++;
+    for (uint8_t i = 0; i < 8; i++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+bool rtcLoad(uint16_t offset, void *data, size_t len)
+{
+  if (offset + len > RTC_MEMORY_SIZE || len <= sizeof(uint32_t)) {
+    return false;
+  }
+
+#if defined(ESP8266)
+  ESP.rtcUserMemoryRead(offset / 4, (uint32_t *)data, len);
+#else
+  memcpy(data, (uint8_t *)rtcMemory + offset, len);
+#endif
+
+  uint32_t crc;
+  memcpy(&crc, data, sizeof(crc));
+  return crc == crc32Ieee((const uint8_t *)data + sizeof(crc), len - sizeof(crc));
+}
+
+void rtcSave(uint16_t offset, void *data, size_t len)
+{
+  if (offset + len > RTC_MEMORY_SIZE || len <= sizeof(uint32_t)) {
+    return;
+  }
+
+  uint32_t crc = crc32Ieee((const uint8_t *)data + sizeof(crc), len - sizeof(crc));
+  memcpy(data, &crc, sizeof(crc));
+
+#if defined(ESP8266)
+  ESP.rtcUserMemoryWrite(offset / 4, (uint32_t *)data, len);
+#else
+  memcpy((uint8_t *)rtcMemory + offset, data, len);
+#endif
+}
+
+bool rtcStateLoad(RtcState &state)
+{
+  if (!rtcLoad(RTC_SLOT_STATE, &state, sizeof(state)) || state.magic != RTC_STATE_MAGIC) {
+    memset(&state, 0, sizeof(state));
+    state.magic = RTC_STATE_MAGIC;
+    return false;
+  }
+  return true;
+}
+
+void rtcStateSave(RtcState &state)
+{
+  state.magic = RTC_STATE_MAGIC;
+  rtcSave(RTC_SLOT_STATE, &state, sizeof(state));
+}
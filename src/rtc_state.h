@@ -0,0 +1,58 @@
+#ifndef RTC_STATE_H
+#define RTC_STATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RTC_STATE_MAGIC 0x4F494C01
+
+// Layout of the RTC user memory, every slot starts with its own CRC
+#define RTC_MEMORY_SIZE   512
+#define RTC_SLOT_STATE    0     //!< RtcState
+#define RTC_SLOT_TLS      64    //!< TLS session parameters, see universal-mqtt.h
+#define RTC_SLOT_CONSUMPTION 160  //!< ConsumptionState, see consumption.h
+#define RTC_SLOT_JWT      208   //!< cached Cloud IoT JWT, an ES256 one is about 250 chars
+
+#define RTC_FLAG_TANK_FULL_SENT   0x01
+#define RTC_FLAG_TANK_EMPTY_SENT  0x02
+#define RTC_FLAG_NETWORK_VALID    0x04   //!< bssid/channel/ip below can be reused
+#define RTC_FLAG_DIMENSIONS_SENT  0x08   //!< the tank dimensions of the current config were published
+
+/*
+ * State carried across deep sleep in RTC memory (512 bytes on the ESP8266).
+ * Protected by a CRC, anything else in RTC memory after a cold boot is ignored.
+ */
+struct RtcState {
+  uint32_t crc;
+  uint32_t magic;
+  uint32_t wakeCount;
+  uint32_t epochAtSleep;        //!< time(nullptr) right before sleeping
+  uint32_t sleepSeconds;        //!< how long we asked to sleep
+  uint32_t lastWakeToPublishMs;
+  int32_t lastVolume;
+  int16_t lastPercent;
+  uint8_t flags;
+  uint8_t channel;
+  uint8_t bssid[6];
+  uint16_t suppressedReports;   //!< publishes skipped since the last one
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+  uint32_t lastReportEpoch;     //!< ReportState of the Reporter in main.cpp
+  uint32_t lastReportVolumeMl;
+};
+
+// CRC-32 (IEEE 802.3), named so it does not clash with the core's own crc32()
+uint32_t crc32Ieee(const void *data, size_t len, uint32_t crc = 0);
+
+// Raw slot access, data starts with a uint32_t CRC of the rest.
+// Offsets and sizes must be multiples of 4. False when the CRC does not match.
+bool rtcLoad(uint16_t offset, void *data, size_t len);
+void rtcSave(uint16_t offset, void *data, size_t len);
+
+// False after a cold boot or when the content is corrupted
+bool rtcStateLoad(RtcState &state);
+void rtcStateSave(RtcState &state);
+
+#endif // RTC_STATE_H
@@ -0,0 +1,130 @@
+#include "scheduler.h"
+
+#include <string.h>
+
+Scheduler::Scheduler()
+  : count(0), current(-1), clockMs(nullptr), clockUs(nullptr), hook(nullptr), hookCtx(nullptr)
+{
+}
+
+void Scheduler::begin(ClockFn clockMs, ClockFn clockUs)
+{
+  this->clockMs = clockMs;
+  this->clockUs = clockUs;
+}
+
+void Scheduler::setHook(HookFn hook, void *ctx)
+{
+  this->hook = hook;
+  hookCtx = ctx;
+}
+
+int8_t Scheduler::add(const char *name, void (*fn)(void *ctx), void *ctx, uint32_t periodMs, uint32_t deadlineMs)
+{
+  if (count >= SCHEDULER_MAX_TASKS) {
+    return -1;
+  }
+
+  Task &task = tasks[count];
+  memset(&task, 0, sizeof(task));
+  task.name = name;
+  task.fn = fn;
+  task.ctx = ctx;
+  task.periodMs = periodMs;
+  task.deadlineMs = deadlineMs ? deadlineMs : periodMs;
+  task.nextRunMs = clockMs ? clockMs() : 0;
+  task.enabled = true;
+  return count++;
+}
+
+void Scheduler::setPeriod(int8_t id, uint32_t periodMs)
+{
+  if (id < 0 || id >= count || tasks[id].periodMs == periodMs) {
+    return;
+  }
+  Task &task = tasks[id];
+  // Keep the phase: the next run moves with the new period. From its own
+  // run a task is not rescheduled yet, run() then adds the new period.
+  if (id != current) {
+    task.nextRunMs = task.nextRunMs - task.periodMs + periodMs;
+  }
+  task.periodMs = periodMs;
+}
+
+void Scheduler::setEnabled(int8_t id, bool enabled)
+{
+  if (id < 0 || id >= count) {
+    return;
+  }
+  if (enabled && !tasks[id].enabled) {
+    tasks[id].nextRunMs = clockMs();
+  }
+  tasks[id].enabled = enabled;
+}
+
+void Scheduler::wake(int8_t id)
+{
+  if (id >= 0 && id < count) {
+    tasks[id].nextRunMs = clockMs();
+  }
+}
+
+uint32_t Scheduler::run()
+{
+  for (uint8_t i = 0; i < count; i++) {
+    Task &task = tasks[i];
+    uint32_t now = clockMs();
+    int32_t late = (int32_t)(now - task.nextRunMs);
+    if (!task.enabled || late < 0) {
+      continue;
+    }
+
+    if (hook) {
+      hook(hookCtx, i, false);
+    }
+    uint32_t start = clockUs();
+    current = i;
+    task.fn(task.ctx);
+    current = -1;
+    uint32_t duration = clockUs() - start;
+    if (hook) {
+      hook(hookCtx, i, true);
+    }
+
+    TaskStats &stats = task.stats;
+    stats.runs++;
+    stats.lastJitterMs = late;
+    if ((uint32_t)late > stats.maxJitterMs) {
+      stats.maxJitterMs = late;
+    }
+    stats.lastDurationUs = duration;
+    if (duration > stats.maxDurationUs) {
+      stats.maxDurationUs = duration;
+    }
+    if (clockMs() - task.nextRunMs > task.deadlineMs) {
+      stats.overruns++;
+    }
+
+    // Stay on the period grid, unless a whole period was missed
+    task.nextRunMs += task.periodMs;
+    if ((int32_t)(clockMs() - task.nextRunMs) >= 0) {
+      task.nextRunMs = clockMs() + task.periodMs;
+    }
+  }
+
+  uint32_t now = clockMs();
+  uint32_t sleep = UINT32_MAX;
+  for (uint8_t i = 0; i < count; i++) {
+    if (!tasks[i].enabled) {
+      continue;
+    }
+    int32_t wait = (int32_t)(tasks[i].nextRunMs - now);
+    if (wait <= 0) {
+      return 0;
+    }
+    if ((uint32_t)wait < sleep) {
+      sleep = wait;
+    }
+  }
+  return sleep;
+}
@@ -0,0 +1,68 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+#define SCHEDULER_MAX_TASKS 8
+
+struct TaskStats {
+  uint32_t runs;
+  uint32_t overruns;       //!< finished after their deadline
+  uint32_t lastJitterMs;   //!< how late the last run started
+  uint32_t maxJitterMs;
+  uint32_t lastDurationUs;
+  uint32_t maxDurationUs;
+};
+
+struct Task {
+  const char *name;
+  void (*fn)(void *ctx);
+  void *ctx;
+  uint32_t periodMs;
+  uint32_t deadlineMs;     //!< from the due time to the end of the run
+  uint32_t nextRunMs;
+  bool enabled;
+  TaskStats stats;
+};
+
+/*
+ * Cooperative periodic scheduler, tasks live in a fixed table (no heap).
+ * Due tasks run in the order they were added, which is their priority.
+ * run() returns how long loop() may sleep before the next one is due.
+ */
+class Scheduler {
+public:
+  typedef uint32_t (*ClockFn)();
+  // Called around each task run, done false before it and true after it
+  typedef void (*HookFn)(void *ctx, uint8_t id, bool done);
+
+  Scheduler();
+
+  void begin(ClockFn clockMs, ClockFn clockUs);
+  // Outside of the task duration, nullptr removes it
+  void setHook(HookFn hook, void *ctx);
+
+  // Returns the task id, -1 when the table is full. deadlineMs 0 means one period.
+  int8_t add(const char *name, void (*fn)(void *ctx), void *ctx, uint32_t periodMs, uint32_t deadlineMs = 0);
+
+  void setPeriod(int8_t id, uint32_t periodMs);
+  void setEnabled(int8_t id, bool enabled);
+  // Next run as soon as possible
+  void wake(int8_t id);
+
+  uint32_t run();
+
+  uint8_t size() const { return count; }
+  const Task &task(uint8_t id) const { return tasks[id]; }
+
+private:
+  Task tasks[SCHEDULER_MAX_TASKS];
+  uint8_t count;
+  int8_t current;          //!< task being run, -1 outside of run()
+  ClockFn clockMs;
+  ClockFn clockUs;
+  HookFn hook;
+  void *hookCtx;
+};
+
+#endif // SCHEDULER_H
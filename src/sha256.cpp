@@ -0,0 +1,137 @@
+#include "sha256.h"
+
+#include <string.h>
+
+static const uint32_t K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t ror(uint32_t x, uint8_t n)
+{
+  return (x >> n) | (x << (32 - n));
+}
+
+void Sha256::reset()
+{
+  state[0] = 0x6a09e667;
+  state[1] = 0xbb67ae85;
+  state[2] = 0x3c6ef372;
+  state[3] = 0xa54ff53a;
+  state[4] = 0x510e527f;
+  state[5] = 0x9b05688c;
+  state[6] = 0x1f83d9ab;
+  state[7] = 0x5be0cd19;
+  length = 0;
+}
+
+void Sha256::block(const uint8_t *data)
+{
+  uint32_t w[64];
+  for (uint8_t i = 0; i < 16; i++) {
+    w[i] = (uint32_t)data[i * 4] << 24 | (uint32_t)data[i * 4 + 1] << 16 |
+           (uint32_t)data[i * 4 + 2] << 8 | data[i * 4 + 3];
+  }
+  for (uint8_t i = 16; i < 64; i++) {
+    uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+  for (uint8_t i = 0; i < 64; i++) {
+    uint32_t t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+    uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+void Sha256::update(const void *data, size_t len)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  uint8_t used = length % 64;
+  length += len;
+
+  if (used > 0) {
+    size_t n = (size_t)(64 - used) < len ? 64 - used : len;
+    memcpy(buffer + used, p, n);
+    p += n;
+    len -= n;
+    if (used + n < 64) {
+      return;
+    }
+    block(buffer);
+  }
+  while (len >= 64) {
+    block(p);
+    p += 64;
+    len -= 64;
+  }
+  memcpy(buffer, p, len);
+}
+
+void Sha256::finish(uint8_t digest[SHA256_SIZE])
+{
+  uint64_t bits = length * 8;
+  uint8_t pad[72] = { 0x80 };
+  uint8_t used = length % 64;
+  size_t padLen = (used < 56 ? 56 : 120) - used;
+  for (uint8_t i = 0; i < 8; i++) {
+    pad[padLen + i] = bits >> (56 - i * 8);
+  }
+  update(pad, padLen + 8);
+
+  for (uint8_t i = 0; i < 8; i++) {
+    digest[i * 4] = state[i] >> 24;
+    digest[i * 4 + 1] = state[i] >> 16;
+    digest[i * 4 + 2] = state[i] >> 8;
+    digest[i * 4 + 3] = state[i];
+  }
+}
+
+static int8_t hexValue(char c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+bool Sha256::parseHex(const char *hex, uint8_t digest[SHA256_SIZE])
+{
+  if (!hex) {
+    return false;
+  }
+  for (uint8_t i = 0; i < SHA256_SIZE; i++) {
+    int8_t hi = hexValue(hex[i * 2]);
+    int8_t lo = hi < 0 ? -1 : hexValue(hex[i * 2 + 1]);
+    if (lo < 0) {
+      return false;
+    }
+    digest[i] = hi << 4 | lo;
+  }
+  return hex[SHA256_SIZE * 2] == '\0' || hex[SHA256_SIZE * 2] == '\n' || hex[SHA256_SIZE * 2] == '\r';
+}
@@ -0,0 +1,32 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_SIZE 32
+
+/*
+ * Incremental SHA-256 (FIPS 180-4), so an image can be hashed while it
+ * streams in. The context is 108 bytes and can be copied to resume.
+ */
+class Sha256 {
+public:
+  Sha256() { reset(); }
+
+  void reset();
+  void update(const void *data, size_t len);
+  void finish(uint8_t digest[SHA256_SIZE]);
+
+  // 64 hex digits, false when the text is anything else
+  static bool parseHex(const char *hex, uint8_t digest[SHA256_SIZE]);
+
+private:
+  void block(const uint8_t *data);
+
+  uint32_t state[8];
+  uint64_t length;
+  uint8_t buffer[64];
+};
+
+#endif // SHA256_H
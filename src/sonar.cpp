@@ -0,0 +1,85 @@
+#include "sonar.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#endif
+
+#ifndef IRAM_ATTR
+#define IRAM_ATTR
+#endif
+
+Sonar::Sonar()
+  : state(IDLE), riseUs(0), fallUs(0), triggerUs(0), triggerMs(0),
+    timeoutUs(SONAR_DEFAULT_TIMEOUT_US), trigger(nullptr), triggerCtx(nullptr)
+{
+}
+
+void Sonar::begin(TriggerFn trigger, void *ctx, uint32_t timeoutUs)
+{
+  this->trigger = trigger;
+  this->triggerCtx = ctx;
+  this->timeoutUs = timeoutUs;
+  state = IDLE;
+}
+
+bool Sonar::start(uint32_t nowUs, uint32_t nowMs)
+{
+  if (state != IDLE) {
+    return false;
+  }
+
+  triggerUs = nowUs;
+  triggerMs = nowMs;
+  riseUs = 0;
+  fallUs = 0;
+  // Armed before the pulse so an early echo cannot be missed
+  state = WAIT_RISE;
+
+  if (trigger) {
+    trigger(triggerCtx);
+  }
+  return true;
+}
+
+void IRAM_ATTR Sonar::onEchoEdge(bool high, uint32_t nowUs)
+{
+  if (high && state == WAIT_RISE) {
+    riseUs = nowUs;
+    state = WAIT_FALL;
+  } else if (!high && state == WAIT_FALL) {
+    fallUs = nowUs;
+    state = DONE;
+  }
+}
+
+bool Sonar::poll(uint32_t nowUs, SonarSample &sample)
+{
+  uint8_t current = state;
+
+  if (current == IDLE) {
+    return false;
+  }
+
+  sample.timestampMs = triggerMs;
+  sample.durationUs = 0;
+
+  if (current == DONE) {
+    // Unsigned subtraction keeps this right across the micros() wrap
+    uint32_t width = fallUs - riseUs;
+    if (width > timeoutUs) {
+      sample.status = SONAR_OUT_OF_RANGE;
+    } else {
+      sample.status = SONAR_OK;
+      sample.durationUs = width;
+    }
+  } else if (current == WAIT_RISE && nowUs - triggerUs > timeoutUs) {
+    sample.status = SONAR_NO_ECHO;
+  } else if (current == WAIT_FALL && nowUs - riseUs > timeoutUs) {
+    sample.status = SONAR_OUT_OF_RANGE;
+  } else {
+    return false;
+  }
+
+  state = IDLE;
+  return true;
+}
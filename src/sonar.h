@@ -0,0 +1,65 @@
+#ifndef SONAR_H
+#define SONAR_H
+
+#include <stdint.h>
+
+#define SONAR_DEFAULT_TIMEOUT_US 30000  //!< ~5 m round trip, well under the 38 ms "no obstacle" pulse
+
+enum SonarStatus : uint8_t {
+  SONAR_OK = 0,
+  SONAR_NO_ECHO,        //!< the echo line never went high before the timeout
+  SONAR_OUT_OF_RANGE,   //!< the echo started but did not end before the timeout
+};
+
+struct SonarSample {
+  uint32_t timestampMs;  //!< millis() when the trigger pulse was fired
+  uint32_t durationUs;   //!< echo pulse width, only meaningful when status == SONAR_OK
+  SonarStatus status;
+};
+
+/*
+ * Non-blocking ultrasonic acquisition (HC-SR04 style sensors).
+ *
+ * start() fires the trigger pulse, onEchoEdge() is called from the echo pin
+ * CHANGE interrupt and poll() hands the finished sample back to loop().
+ * The clock values and the trigger pulse are supplied by the caller so the
+ * state machine does not depend on Arduino and can be driven by a fake pin
+ * and timer on the host.
+ */
+class Sonar {
+public:
+  typedef void (*TriggerFn)(void *ctx);
+
+  Sonar();
+
+  void begin(TriggerFn trigger, void *ctx, uint32_t timeoutUs = SONAR_DEFAULT_TIMEOUT_US);
+  void setTimeout(uint32_t timeoutUs) { this->timeoutUs = timeoutUs; }
+  uint32_t getTimeout() const { return timeoutUs; }
+
+  // Fires the trigger, returns false if a measurement is already in flight.
+  bool start(uint32_t nowUs, uint32_t nowMs);
+
+  // Echo pin edge, to be called from the interrupt handler.
+  void onEchoEdge(bool high, uint32_t nowUs);
+
+  // Returns true once per measurement, when the echo ended or timed out.
+  bool poll(uint32_t nowUs, SonarSample &sample);
+
+  bool busy() const { return state != IDLE; }
+
+private:
+  enum State : uint8_t { IDLE, WAIT_RISE, WAIT_FALL, DONE };
+
+  volatile uint8_t state;
+  volatile uint32_t riseUs;
+  volatile uint32_t fallUs;
+
+  uint32_t triggerUs;
+  uint32_t triggerMs;
+  uint32_t timeoutUs;
+
+  TriggerFn trigger;
+  void *triggerCtx;
+};
+
+#endif // SONAR_H
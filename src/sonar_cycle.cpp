@@ -0,0 +1,123 @@
+#include "sonar_cycle.h"
+
+#include <string.h>
+
+SonarCycle::SonarCycle()
+  : busyGroups(0), guardGroups(0), count(0), guardUs(SONAR_CYCLE_GUARD_US), measurements(0), deferred(0),
+    onSample(nullptr), ctx(nullptr)
+{
+  memset(slots, 0, sizeof(slots));
+  memset(quietUs, 0, sizeof(quietUs));
+}
+
+void SonarCycle::begin(SampleFn onSample, void *ctx, uint32_t guardUs)
+{
+  this->onSample = onSample;
+  this->ctx = ctx;
+  this->guardUs = guardUs;
+}
+
+int8_t SonarCycle::add(Sonar *sonar, uint8_t group, uint32_t periodMs)
+{
+  if (count >= SONAR_CYCLE_MAX || !sonar) {
+    return -1;
+  }
+  Slot &slot = slots[count];
+  slot.sonar = sonar;
+  slot.periodMs = periodMs;
+  slot.dueMs = 0;
+  slot.group = group < SONAR_CYCLE_MAX ? group : SONAR_CYCLE_MAX - 1;
+  slot.started = false;
+  slot.waited = false;
+  return count++;
+}
+
+void SonarCycle::setPeriod(uint8_t index, uint32_t periodMs)
+{
+  if (index >= count) {
+    return;
+  }
+  // Keep the phase: the next trigger moves with the new period
+  slots[index].dueMs = slots[index].dueMs - slots[index].periodMs + periodMs;
+  slots[index].periodMs = periodMs;
+}
+
+bool SonarCycle::groupQuiet(uint8_t group, uint32_t nowUs) const
+{
+  uint8_t bit = 1 << group;
+  if (busyGroups & bit) {
+    return false;
+  }
+  return !(guardGroups & bit) || nowUs - quietUs[group] >= guardUs;
+}
+
+uint32_t SonarCycle::service(uint32_t nowUs, uint32_t nowMs)
+{
+  // Collect first, a finished echo frees its group for this very call
+  busyGroups = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    Slot &slot = slots[i];
+    SonarSample sample;
+    if (slot.sonar->poll(nowUs, sample)) {
+      quietUs[slot.group] = nowUs;
+      guardGroups |= 1 << slot.group;
+      measurements++;
+      if (onSample) {
+        onSample(ctx, i, sample);
+      }
+    }
+    if (slot.sonar->busy()) {
+      busyGroups |= 1 << slot.group;
+    }
+  }
+
+  // At most one trigger per quiet group, the most overdue sensor first
+  for (;;) {
+    int8_t best = -1;
+    int32_t bestLate = 0;
+    for (uint8_t i = 0; i < count; i++) {
+      const Slot &slot = slots[i];
+      int32_t late = slot.started ? (int32_t)(nowMs - slot.dueMs) : INT32_MAX;
+      if (late < 0 || slot.sonar->busy()) {
+        continue;
+      }
+      if (!groupQuiet(slot.group, nowUs)) {
+        slots[i].waited = true;
+        continue;
+      }
+      if (best < 0 || late > bestLate) {
+        best = i;
+        bestLate = late;
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    Slot &slot = slots[best];
+    if (slot.waited) {
+      deferred++;
+      slot.waited = false;
+    }
+    slot.started = true;
+    slot.dueMs = nowMs + slot.periodMs;
+    slot.sonar->start(nowUs, nowMs);
+    busyGroups |= 1 << slot.group;
+  }
+
+  // Poll while an echo is in flight, otherwise sleep until a guard ends or a sensor is due
+  if (busyGroups) {
+    return SONAR_CYCLE_POLL_MS;
+  }
+  uint32_t wait = UINT32_MAX;
+  for (uint8_t i = 0; i < count; i++) {
+    const Slot &slot = slots[i];
+    uint32_t next = (int32_t)(slot.dueMs - nowMs) > 0 ? slot.dueMs - nowMs : 0;
+    uint32_t elapsed = nowUs - quietUs[slot.group];
+    if ((guardGroups & (1 << slot.group)) && elapsed < guardUs) {
+      uint32_t guard = (guardUs - elapsed + 999) / 1000;
+      next = next > guard ? next : guard;
+    }
+    wait = next < wait ? next : wait;
+  }
+  return wait;
+}
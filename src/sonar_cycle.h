@@ -0,0 +1,68 @@
+#ifndef SONAR_CYCLE_H
+#define SONAR_CYCLE_H
+
+#include <stdint.h>
+#include "sonar.h"
+
+#define SONAR_CYCLE_MAX       4       //!< sensors driven by one cycle
+#define SONAR_CYCLE_GUARD_US  10000   //!< after an echo, before the next trigger of the same group
+#define SONAR_CYCLE_POLL_MS   2       //!< service period while an echo is in flight
+
+/*
+ * Trigger scheduling of several sonars sharing the air.
+ *
+ * Sensors of the same group hear each other: only one of them fires at a
+ * time, and the next one waits for the echo to end plus a guard time for
+ * the reverberation. Sensors of different groups (other tanks, other rooms)
+ * fire together. The next trigger follows the end of the previous echo, not
+ * a slot sized for the worst case, so the cycle is as short as the echoes.
+ * Each sensor has its own period, the most overdue one of a group goes first.
+ */
+class SonarCycle {
+public:
+  typedef void (*SampleFn)(void *ctx, uint8_t index, const SonarSample &sample);
+
+  SonarCycle();
+
+  void begin(SampleFn onSample, void *ctx, uint32_t guardUs = SONAR_CYCLE_GUARD_US);
+  // Returns the index of the sensor, or -1 when the cycle is full
+  int8_t add(Sonar *sonar, uint8_t group, uint32_t periodMs);
+  void setPeriod(uint8_t index, uint32_t periodMs);
+  uint32_t getPeriod(uint8_t index) const { return slots[index].periodMs; }
+
+  /*
+   * Hands the finished echoes to onSample, then fires what is due and
+   * allowed to. Returns the milliseconds until the next call is needed.
+   */
+  uint32_t service(uint32_t nowUs, uint32_t nowMs);
+
+  uint8_t size() const { return count; }
+  uint32_t getMeasurements() const { return measurements; }
+  // Triggers put off because a sensor of the same group was busy
+  uint32_t getDeferred() const { return deferred; }
+
+private:
+  struct Slot {
+    Sonar *sonar;
+    uint32_t periodMs;
+    uint32_t dueMs;
+    uint8_t group;
+    bool started;     //!< due at once until the first trigger
+    bool waited;      //!< was due while its group was busy
+  };
+
+  bool groupQuiet(uint8_t group, uint32_t nowUs) const;
+
+  Slot slots[SONAR_CYCLE_MAX];
+  uint32_t quietUs[SONAR_CYCLE_MAX];   //!< per group, end of the last echo
+  uint8_t busyGroups;                  //!< one bit per group with an echo in flight
+  uint8_t guardGroups;                 //!< one bit per group within its guard time
+  uint8_t count;
+  uint32_t guardUs;
+  uint32_t measurements;
+  uint32_t deferred;
+  SampleFn onSample;
+  void *ctx;
+};
+
+#endif // SONAR_CYCLE_H
@@ -0,0 +1,58 @@
+#ifdef ARDUINO
+#include "storage.h"
+
+int32_t FlashStorage::size(const char *path)
+{
+  if (!fs.exists(path)) {
+    return -1;
+  }
+  File file = fs.open(path, "r");
+  if (!file) {
+    return -1;
+  }
+  int32_t size = file.size();
+  file.close();
+  return size;
+}
+
+size_t FlashStorage::read(const char *path, uint32_t offset, void *data, size_t len)
+{
+  File file = fs.open(path, "r");
+  if (!file) {
+    return 0;
+  }
+  size_t n = 0;
+  if (file.seek(offset)) {
+    n = file.read((uint8_t *)data, len);
+  }
+  file.close();
+  return n;
+}
+
+bool FlashStorage::append(const char *path, const void *data, size_t len)
+{
+  File file = fs.open(path, "a");
+  if (!file) {
+    return false;
+  }
+  size_t n = file.write((const uint8_t *)data, len);
+  file.close();
+  return n == len;
+}
+
+bool FlashStorage::write(const char *path, const void *data, size_t len)
+{
+  File file = fs.open(path, "w");
+  if (!file) {
+    return false;
+  }
+  size_t n = file.write((const uint8_t *)data, len);
+  file.close();
+  return n == len;
+}
+
+bool FlashStorage::remove(const char *path)
+{
+  return fs.remove(path);
+}
+#endif // ARDUINO
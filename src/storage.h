@@ -0,0 +1,44 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Minimal file access used by the persistent modules, so they can run
+ * against LittleFS/SPIFFS on the device and an in-memory fake on the host.
+ */
+class Storage {
+public:
+  virtual ~Storage() {}
+
+  // Size in bytes, -1 when the file does not exist
+  virtual int32_t size(const char *path) = 0;
+  virtual size_t read(const char *path, uint32_t offset, void *data, size_t len) = 0;
+  virtual bool append(const char *path, const void *data, size_t len) = 0;
+  // Replaces the whole file
+  virtual bool write(const char *path, const void *data, size_t len) = 0;
+  virtual bool remove(const char *path) = 0;
+
+  bool exists(const char *path) { return size(path) >= 0; }
+};
+
+#ifdef ARDUINO
+#include <FS.h>
+
+class FlashStorage : public Storage {
+public:
+  explicit FlashStorage(fs::FS &fs) : fs(fs) {}
+
+  int32_t size(const char *path) override;
+  size_t read(const char *path, uint32_t offset, void *data, size_t len) override;
+  bool append(const char *path, const void *data, size_t len) override;
+  bool write(const char *path, const void *data, size_t len) override;
+  bool remove(const char *path) override;
+
+private:
+  fs::FS &fs;
+};
+#endif
+
+#endif // STORAGE_H
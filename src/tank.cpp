@@ -0,0 +1,510 @@
+#include "tank.h"
+
+#include <string.h>
+#include <ArduinoJson.h>
+#include "rtc_state.h"
+
+// The strapping arrays are the bulk of it. Static to keep the 1.3 kB per tank off the stack.
+#define TANK_ENTRY_DOC_SIZE  (JSON_OBJECT_SIZE(12) + 2 * JSON_ARRAY_SIZE(TANK_STRAPPING_POINTS))
+#define TANK_CONFIG_DOC_SIZE (JSON_OBJECT_SIZE(20) + 2 * JSON_ARRAY_SIZE(TANK_STRAPPING_POINTS) + \
+                              JSON_ARRAY_SIZE(TANK_SENSORS - 1) + (TANK_SENSORS - 1) * TANK_ENTRY_DOC_SIZE)
+
+static void copyString(char *dst, size_t size, const char *src)
+{
+  if (!src) {
+    src = "";
+  }
+  size_t n = strlen(src);
+  if (n >= size) {
+    n = size - 1;
+  }
+  memcpy(dst, src, n);
+  dst[n] = '\0';
+}
+
+void tankConfigDefaults(TankConfig &config)
+{
+  memset(&config, 0, sizeof(config));
+  config.fullVolumeMl = 1000;
+  config.telemetryFormat = TELEMETRY_JSON;
+  config.temperatureDeciC = TANK_NO_TEMPERATURE;
+  config.report = Reporter::defaults();
+  AcquisitionConfig acquisition = AdaptiveRate::defaults();
+  config.acquisitionMinMs = acquisition.minPeriodMs;
+  config.acquisitionMaxMs = acquisition.maxPeriodMs;
+}
+
+bool tankConfigured(const TankConfig &config)
+{
+  return config.heightMm > 0 && config.fullVolumeMl > 0;
+}
+
+// Floats only while parsing, once per config
+static uint32_t cmToMm(float value)
+{
+  return (uint32_t)(value * 10 + 0.5f);
+}
+
+static uint32_t litersToMl(float value)
+{
+  return (uint32_t)(value * 1000 + 0.5f);
+}
+
+static bool readNumber(JsonObjectConst obj, const char *key, float max, float &value)
+{
+  JsonVariantConst variant = obj[key];
+  if (!variant.is<float>()) {
+    return false;
+  }
+  value = variant.as<float>();
+  return value > 0 && value <= max;
+}
+
+static bool readMm(JsonObjectConst obj, const char *key, float maxCm, uint32_t &mm)
+{
+  float cm;
+  if (!readNumber(obj, key, maxCm, cm)) {
+    return false;
+  }
+  mm = cmToMm(cm);
+  return true;
+}
+
+// Optional, within the range of the speed of sound table
+static bool readTemperature(JsonObjectConst obj, int16_t &deciC)
+{
+  JsonVariantConst variant = obj["temperature_in_c"];
+  if (variant.isNull()) {
+    return true;
+  }
+  if (!variant.is<float>()) {
+    return false;
+  }
+  float celsius = variant.as<float>();
+  if (celsius * 10 < TANK_TEMPERATURE_MIN_DC || celsius * 10 > TANK_TEMPERATURE_MAX_DC) {
+    return false;
+  }
+  deciC = (int16_t)(celsius * 10 + (celsius < 0 ? -0.5f : 0.5f));
+  return true;
+}
+
+// Optional, the default stays when the key is missing. 0 is accepted.
+static bool readUnsigned(JsonObjectConst obj, const char *key, uint32_t max, uint32_t &value)
+{
+  JsonVariantConst variant = obj[key];
+  if (variant.isNull()) {
+    return true;
+  }
+  if (!variant.is<float>() || variant.as<float>() < 0 || variant.as<float>() > max) {
+    return false;
+  }
+  value = (uint32_t)(variant.as<float>() + 0.5f);
+  return true;
+}
+
+static bool readReport(JsonObjectConst obj, ReportConfig &report)
+{
+  uint32_t deadbandLiters = (report.deadbandMl + 500) / 1000;
+  if (!readUnsigned(obj, "report_deadband_liters", TANK_MAX_LITERS, deadbandLiters) ||
+      !readUnsigned(obj, "report_deadband_percent", 100, report.deadbandPercent) ||
+      !readUnsigned(obj, "report_min_interval_s", 86400, report.minIntervalS) ||
+      !readUnsigned(obj, "report_heartbeat_s", 7 * 86400, report.heartbeatS)) {
+    return false;
+  }
+  report.deadbandMl = deadbandLiters * 1000;
+  // A heartbeat shorter than the minimum interval could never be honoured
+  return report.heartbeatS == 0 || report.heartbeatS >= report.minIntervalS;
+}
+
+// Faster than the echo timeout would cut echoes short
+static bool readAcquisition(JsonObjectConst obj, TankConfig &config)
+{
+  return readUnsigned(obj, "acquisition_min_period_ms", 60000, config.acquisitionMinMs) &&
+         readUnsigned(obj, "acquisition_max_period_ms", 3600000, config.acquisitionMaxMs) &&
+         config.acquisitionMinMs >= 100 && config.acquisitionMaxMs >= config.acquisitionMinMs;
+}
+
+// Optional, but a string that fits when present
+static bool readString(JsonObjectConst obj, const char *key, char *dst, size_t size)
+{
+  JsonVariantConst variant = obj[key];
+  if (variant.isNull()) {
+    dst[0] = '\0';
+    return true;
+  }
+  if (!variant.is<const char *>() || strlen(variant.as<const char *>()) >= size) {
+    return false;
+  }
+  copyString(dst, size, variant.as<const char *>());
+  return true;
+}
+
+// Two arrays of the same length, levels strictly increasing, volumes never decreasing
+static bool readStrapping(JsonObjectConst obj, TankConfig &config)
+{
+  JsonArrayConst levels = obj["strapping_levels_in_cm"].as<JsonArrayConst>();
+  JsonArrayConst liters = obj["strapping_liters"].as<JsonArrayConst>();
+  if (levels.isNull() || liters.isNull() || levels.size() != liters.size() || levels.size() < 2 ||
+      levels.size() > TANK_STRAPPING_POINTS) {
+    return false;
+  }
+
+  for (uint8_t i = 0; i < levels.size(); i++) {
+    if (!levels[i].is<float>() || !liters[i].is<float>()) {
+      return false;
+    }
+    float level = levels[i].as<float>();
+    float volume = liters[i].as<float>();
+    if (level < 0 || level > TANK_MAX_CM || volume < 0 || volume > TANK_MAX_LITERS) {
+      return false;
+    }
+    GeometryPoint &point = config.strapping[i];
+    point.levelMm = cmToMm(level);
+    point.volumeMl = litersToMl(volume);
+    if (i > 0 && (point.levelMm <= config.strapping[i - 1].levelMm ||
+                  point.volumeMl < config.strapping[i - 1].volumeMl)) {
+      return false;
+    }
+  }
+  config.strappingCount = levels.size();
+  return true;
+}
+
+// What each shape needs on top of the height
+static bool readShape(JsonObjectConst obj, TankConfig &config)
+{
+  if (!TankGeometry::parseShape(obj["tank_shape"] | "rectangular", config.shape)) {
+    return false;
+  }
+  switch (config.shape) {
+    case TANK_RECTANGULAR:
+      return readMm(obj, "tank_lenght_in_cm", TANK_MAX_CM, config.lengthMm) &&
+             readMm(obj, "tank_width_in_cm", TANK_MAX_CM, config.widthMm);
+    case TANK_HORIZONTAL_CYLINDER:
+      // Lying on its side the diameter is the height, unless the sensor sits higher
+      config.diameterMm = config.heightMm;
+      return readMm(obj, "tank_lenght_in_cm", TANK_MAX_CM, config.lengthMm) &&
+             (obj["tank_diameter_in_cm"].isNull() ||
+              readMm(obj, "tank_diameter_in_cm", config.heightMm / 10.0f, config.diameterMm));
+    case TANK_VERTICAL_CYLINDER:
+      return readMm(obj, "tank_diameter_in_cm", TANK_MAX_CM, config.diameterMm);
+    case TANK_STRAPPING:
+      return readStrapping(obj, config);
+  }
+  return false;
+}
+
+// Another tank of the device: its settings, the dimensions and the defaults for the rest
+static TankConfig &tankFrom(const TankConfig &device, TankConfig &tank)
+{
+  tankConfigDefaults(tank);
+  memcpy(tank.unit, device.unit, sizeof(tank.unit));
+  memcpy(tank.chatId, device.chatId, sizeof(tank.chatId));
+  tank.telemetryFormat = device.telemetryFormat;
+  tank.report = device.report;
+  tank.temperatureDeciC = device.temperatureDeciC;
+  tank.acquisitionMinMs = device.acquisitionMinMs;
+  tank.acquisitionMaxMs = device.acquisitionMaxMs;
+  return tank;
+}
+
+// The keys each tank has, the device settings apart
+static bool readTank(JsonObjectConst obj, TankConfig &config)
+{
+  float fullVolumeLiters;
+  if (!readNumber(obj, "full_volume_in_liters", TANK_MAX_LITERS, fullVolumeLiters) ||
+      !readMm(obj, "tank_height_in_cm", TANK_MAX_CM, config.heightMm) ||
+      !readShape(obj, config) ||
+      !readTemperature(obj, config.temperatureDeciC) ||
+      !readAcquisition(obj, config)) {
+    return false;
+  }
+  config.fullVolumeMl = litersToMl(fullVolumeLiters);
+  return true;
+}
+
+bool tankConfigParse(char *json, size_t len, TankConfig *configs, uint8_t count)
+{
+  static StaticJsonDocument<TANK_CONFIG_DOC_SIZE> doc;
+  if (count == 0 || deserializeJson(doc, json, len) || !doc.is<JsonObject>()) {
+    return false;
+  }
+  JsonObjectConst obj = doc.as<JsonObjectConst>();
+
+  TankConfig parsed;
+  tankConfigDefaults(parsed);
+  if (!readTank(obj, parsed) ||
+      !readReport(obj, parsed.report) ||
+      !readString(obj, "unit", parsed.unit, sizeof(parsed.unit)) ||
+      !readString(obj, "telegram_chat_id", parsed.chatId, sizeof(parsed.chatId))) {
+    return false;
+  }
+
+  const char *format = obj["telemetry_format"] | "json";
+  if (strcmp(format, "cbor") == 0) {
+    parsed.telemetryFormat = TELEMETRY_CBOR;
+  } else if (strcmp(format, "json") != 0) {
+    return false;
+  }
+
+  // Checked whole before anything is copied, one bad tank rejects the document
+  JsonVariantConst others = obj["tanks"];
+  if (!others.isNull() && !others.is<JsonArrayConst>()) {
+    return false;
+  }
+  JsonArrayConst entries = others.as<JsonArrayConst>();
+  for (uint8_t i = 0; i + 1 < count && i < entries.size(); i++) {
+    TankConfig tank;
+    if (!entries[i].is<JsonObjectConst>() || !readTank(entries[i].as<JsonObjectConst>(), tankFrom(parsed, tank))) {
+      return false;
+    }
+  }
+
+  // memcpy keeps the zeroed padding, the CRC of the saved state covers it
+  memcpy(&configs[0], &parsed, sizeof(parsed));
+  for (uint8_t i = 1; i < count; i++) {
+    // Without an entry the defaults leave it unconfigured: no level, no alert
+    TankConfig &tank = tankFrom(parsed, configs[i]);
+    if (i <= entries.size()) {
+      readTank(entries[i - 1].as<JsonObjectConst>(), tank);
+    }
+  }
+  return true;
+}
+
+static uint32_t stateCrc(const TankConfigState &state)
+{
+  return crc32Ieee((const uint8_t *)&state + 4, sizeof(state) - 4);
+}
+
+bool tankConfigLoad(Storage &storage, TankConfigState &state)
+{
+  if (storage.read(TANK_CONFIG_PATH, 0, &state, sizeof(state)) == sizeof(state) &&
+      state.version == TANK_CONFIG_VERSION && state.size == sizeof(state) && state.crc == stateCrc(state)) {
+    for (uint8_t i = 0; i < TANK_SENSORS; i++) {
+      state.tanks[i].unit[TANK_UNIT_SIZE - 1] = '\0';
+      state.tanks[i].chatId[TANK_CHAT_ID_SIZE - 1] = '\0';
+    }
+    return true;
+  }
+  memset(&state, 0, sizeof(state));
+  state.version = TANK_CONFIG_VERSION;
+  state.size = sizeof(state);
+  for (uint8_t i = 0; i < TANK_SENSORS; i++) {
+    tankConfigDefaults(state.tanks[i]);
+  }
+  return false;
+}
+
+bool tankConfigSave(Storage &storage, TankConfigState &state)
+{
+  state.version = TANK_CONFIG_VERSION;
+  state.size = sizeof(state);
+  state.crc = stateCrc(state);
+  return storage.write(TANK_CONFIG_PATH, &state, sizeof(state));
+}
+
+TankConfigResult tankConfigUpdate(TankConfigState &state, char *json, size_t len)
+{
+  // Before parsing, which rewrites the strings in place
+  uint32_t sourceCrc = crc32Ieee((const uint8_t *)json, len);
+  if (sourceCrc == state.sourceCrc) {
+    return TANK_CONFIG_UNCHANGED;
+  }
+  if (!tankConfigParse(json, len, state.tanks, TANK_SENSORS)) {
+    return TANK_CONFIG_INVALID;
+  }
+  state.sourceCrc = sourceCrc;
+  return TANK_CONFIG_UPDATED;
+}
+
+void tankGeometryBuild(const TankConfig &config, TankGeometry &geometry)
+{
+  switch (config.shape) {
+    case TANK_RECTANGULAR:
+      geometry.rectangular(config.heightMm, config.lengthMm, config.widthMm);
+      break;
+    case TANK_HORIZONTAL_CYLINDER:
+      geometry.horizontalCylinder(config.diameterMm, config.lengthMm);
+      break;
+    case TANK_VERTICAL_CYLINDER:
+      geometry.verticalCylinder(config.diameterMm, config.heightMm);
+      break;
+    case TANK_STRAPPING:
+      geometry.strapping(config.strapping, config.strappingCount);
+      break;
+  }
+}
+
+// 331.3 m/s * sqrt(1 + T / 273.15) every 5 degrees from -40 to +60, in mm/s.
+// Linear in between, within 5 mm/s of the formula.
+static const uint32_t SOUND_SPEED_MM_S[] = {
+  306083, 309347, 312578, 315775, 318941, 322075, 325179, 328254, 331300, 334318, 337310,
+  340275, 343215, 346129, 349019, 351886, 354729, 357550, 360349, 363126, 365882,
+};
+#define SOUND_SPEED_STEP_DC 50
+
+uint32_t tankSoundSpeed(int16_t temperatureDeciC)
+{
+  if (temperatureDeciC == TANK_NO_TEMPERATURE) {
+    return TANK_SOUND_SPEED_MM_S;
+  }
+  int32_t t = temperatureDeciC;
+  t = t < TANK_TEMPERATURE_MIN_DC ? TANK_TEMPERATURE_MIN_DC : t > TANK_TEMPERATURE_MAX_DC ? TANK_TEMPERATURE_MAX_DC : t;
+  uint32_t offset = t - TANK_TEMPERATURE_MIN_DC;
+  uint8_t index = offset / SOUND_SPEED_STEP_DC;
+  if (index >= sizeof(SOUND_SPEED_MM_S) / sizeof(SOUND_SPEED_MM_S[0]) - 1) {
+    return SOUND_SPEED_MM_S[index];
+  }
+  uint32_t fraction = offset % SOUND_SPEED_STEP_DC;
+  return SOUND_SPEED_MM_S[index] +
+         (SOUND_SPEED_MM_S[index + 1] - SOUND_SPEED_MM_S[index]) * fraction / SOUND_SPEED_STEP_DC;
+}
+
+// mm per us of echo in Q24: the sound travelled the distance twice, so mm/s / 2e6.
+// The 64 bit division is a libgcc call on the ESP8266, it only runs when the
+// temperature changes, the conversions are then a multiply and a shift.
+static uint32_t echoScale(uint32_t soundSpeedMmS)
+{
+  static uint32_t lastSpeed = 0;
+  static uint32_t lastScale = 0;
+  if (soundSpeedMmS != lastSpeed) {
+    lastSpeed = soundSpeedMmS;
+    lastScale = (((uint64_t)soundSpeedMmS << 24) + 1000000) / 2000000;
+  }
+  return lastScale;
+}
+
+static uint32_t echoToMm(uint32_t echoUs, uint32_t scale)
+{
+  return ((uint64_t)echoUs * scale + (1UL << 23)) >> 24;
+}
+
+// 1/256 mm, so the volume does not inherit the rounding of the distance
+static uint32_t echoToFineMm(uint32_t echoUs, uint32_t scale)
+{
+  return ((uint64_t)echoUs * scale + (1UL << 15)) >> 16;
+}
+
+uint32_t tankEchoToMm(uint32_t echoUs, uint32_t soundSpeedMmS)
+{
+  return echoToMm(echoUs, echoScale(soundSpeedMmS));
+}
+
+static uint32_t volumeAt(const TankGeometry &geometry, uint32_t levelFineMm)
+{
+  uint32_t levelMm = levelFineMm >> 8;
+  uint32_t low = geometry.volumeMl(levelMm);
+  uint32_t high = geometry.volumeMl(levelMm + 1);
+  return low + (uint32_t)((uint64_t)(high - low) * (levelFineMm & 0xFF) >> 8);
+}
+
+static uint32_t isqrt(uint32_t value)
+{
+  uint32_t root = 0;
+  uint32_t bit = 1UL << 30;
+  while (bit > value) {
+    bit >>= 2;
+  }
+  while (bit) {
+    if (value >= root + bit) {
+      value -= root + bit;
+      root = (root >> 1) + bit;
+    } else {
+      root >>= 1;
+    }
+    bit >>= 2;
+  }
+  return root;
+}
+
+const char *tankUpdate(const TankConfig &config, const TankGeometry &geometry, const FilterEstimate &estimate,
+                       int16_t temperatureDeciC, TankLevel &level, TankAlerts &alerts)
+{
+  const char *alert = nullptr;
+
+  if (temperatureDeciC == TANK_NO_TEMPERATURE) {
+    temperatureDeciC = config.temperatureDeciC;
+  }
+  level.soundSpeedMmS = tankSoundSpeed(temperatureDeciC);
+  uint32_t scale = echoScale(level.soundSpeedMmS);
+  uint32_t echo = estimate.value > 0 ? estimate.value : 0;
+  uint32_t fineDistance = echoToFineMm(echo, scale);
+  uint32_t distance = echoToMm(echo, scale);
+  level.distanceMm = distance;
+  level.distanceStddevMm = echoToMm(isqrt(estimate.variance), scale);
+
+  // No level and above all no "empty" alert before the first config
+  if (!tankConfigured(config)) {
+    level.volumeMl = 0;
+    level.volume = 0;
+    level.percent = 0;
+    return nullptr;
+  }
+
+  if (distance >= config.heightMm) {
+    level.volumeMl = 0;
+    level.volume = 0;
+    level.percent = 0;
+  }
+
+  if (distance < 100 && distance > 0 && !alerts.fullSent) {
+    level.volumeMl = config.fullVolumeMl;
+    level.volume = (config.fullVolumeMl + 500) / 1000;
+    level.percent = 100;
+
+    alert = "La citerne est pleine!";
+    alerts.fullSent = true;
+    alerts.emptySent = false;
+  }
+
+  if (distance >= 100 && distance <= config.heightMm) {
+    uint32_t height = config.heightMm << 8;
+    level.volumeMl = fineDistance < height ? volumeAt(geometry, height - fineDistance) : 0;
+    level.volume = (level.volumeMl + 500) / 1000;
+    level.percent = ((uint64_t)level.volumeMl * 100 + config.fullVolumeMl / 2) / config.fullVolumeMl;
+  }
+
+  if (level.percent < 20 && !alerts.emptySent) {
+    alert = "La citerne est vide!!!";
+    alerts.fullSent = false;
+    alerts.emptySent = true;
+  }
+
+  return alert;
+}
+
+void tankWriteTelemetry(TelemetryWriter &payload, const TankLevel &level, const FilterEstimate &estimate)
+{
+  payload.addInt("current_volume_in_liters", level.volume);
+  payload.addInt("current_volume_in_percent", level.percent);
+  payload.addBool("on", true);
+  payload.addFixed("distance_stddev_in_cm", level.distanceStddevMm, 1);
+  payload.addUInt("samples", estimate.samples);
+  payload.addUInt("rejected_samples", estimate.rejected);
+}
+
+void tankWriteDimensions(TelemetryWriter &payload, const TankConfig &config)
+{
+  payload.addFixed("full_volume_in_liters", config.fullVolumeMl, 3);
+  payload.addFixed("tank_height_in_cm", config.heightMm, 1);
+  payload.addFixed("tank_lenght_in_cm", config.lengthMm, 1);
+  payload.addFixed("tank_width_in_cm", config.widthMm, 1);
+}
+
+void tankWriteBatchTelemetry(TelemetryWriter &payload, const TankContext *tanks, uint8_t count)
+{
+  payload.beginArray("tanks");
+  for (uint8_t i = 0; i < count; i++) {
+    const TankContext &tank = tanks[i];
+    const FilterEstimate &estimate = tank.filter.getEstimate();
+    payload.beginObject();
+    payload.addInt("volume_in_liters", tank.level.volume);
+    payload.addInt("percent", tank.level.percent);
+    payload.addFixed("stddev_in_cm", tank.level.distanceStddevMm, 1);
+    payload.addUInt("samples", estimate.samples);
+    payload.addUInt("failures", tank.failures);
+    payload.endObject();
+  }
+  payload.endArray();
+}
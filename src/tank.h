@@ -0,0 +1,159 @@
+#ifndef TANK_H
+#define TANK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "acquisition.h"
+#include "filters.h"
+#include "geometry.h"
+#include "report.h"
+#include "sonar.h"
+#include "storage.h"
+#include "telemetry.h"
+
+#define TANK_UNIT_SIZE     8
+#define TANK_CHAT_ID_SIZE  24
+#define TANK_MAX_CM        10000    //!< larger dimensions are rejected as typos
+#define TANK_MAX_LITERS    1000000
+#define TANK_STRAPPING_POINTS 32    //!< calibration table points accepted from the config
+
+// Tanks measured by one device, see TANK_TRIG_PINS and TANK_ECHO_PINS in main.cpp
+#ifndef TANK_SENSORS
+#define TANK_SENSORS       1
+#endif
+#define TANK_MAX_SENSORS   REPORT_MAX_CHANNELS
+static_assert(TANK_SENSORS >= 1 && TANK_SENSORS <= TANK_MAX_SENSORS, "TANK_SENSORS out of range");
+
+#define TANK_CONFIG_PATH     "/tank.cfg"
+#define TANK_CONFIG_VERSION  5        //!< bump when TankConfig changes
+
+// Speed of sound, integer only: the ESP8266 has no FPU
+#define TANK_NO_TEMPERATURE      INT16_MIN
+#define TANK_SOUND_SPEED_MM_S    343000   //!< without a temperature, as the original 0.0343 cm/us
+#define TANK_TEMPERATURE_MIN_DC  -400     //!< deci degrees Celsius covered by the table
+#define TANK_TEMPERATURE_MAX_DC  600
+
+// Pushed by Cloud IoT on the config topic, converted to integer units once
+struct TankConfig {
+  uint32_t heightMm;
+  uint32_t lengthMm;
+  uint32_t widthMm;
+  uint32_t fullVolumeMl;
+  char unit[TANK_UNIT_SIZE];
+  char chatId[TANK_CHAT_ID_SIZE];   //!< Telegram chat, empty disables the alerts
+  TelemetryFormat telemetryFormat;
+  TankShape shape;
+  int16_t temperatureDeciC;         //!< air in the tank when there is no sensor, or TANK_NO_TEMPERATURE
+  uint32_t diameterMm;              //!< cylinders only
+  uint8_t strappingCount;
+  GeometryPoint strapping[TANK_STRAPPING_POINTS];  //!< TANK_STRAPPING only
+  ReportConfig report;              //!< when a level is worth publishing
+  uint32_t acquisitionMinMs;        //!< bounds of the adaptive sonar period
+  uint32_t acquisitionMaxMs;
+};
+
+struct TankLevel {
+  uint32_t distanceMm;
+  uint32_t distanceStddevMm;
+  uint32_t soundSpeedMmS;  //!< used for this level
+  uint32_t volumeMl;
+  int32_t volume;          //!< liters, rounded
+  int16_t percent;
+};
+
+// One alert per crossing, kept across deep sleep in RtcState::flags
+struct TankAlerts {
+  bool fullSent;
+  bool emptySent;
+};
+
+// Last config received, kept in flash so the first sample after boot is right
+struct TankConfigState {
+  uint32_t crc;
+  uint16_t version;     //!< TANK_CONFIG_VERSION of the firmware that wrote it
+  uint16_t size;        //!< changes with TANK_SENSORS too
+  uint32_t sourceCrc;   //!< CRC-32 of the JSON it came from, 0 for the defaults
+  TankConfig tanks[TANK_SENSORS];   //!< the first one also carries the device settings
+};
+
+struct TankSensor {
+  uint8_t trigPin;
+  uint8_t echoPin;
+  uint8_t group;        //!< sensors of one group hear each other, see SonarCycle
+};
+
+/*
+ * Run time state of one tank, its config is in TankConfigState. Repeated
+ * per sensor, so the largest members first and the bytes packed at the end.
+ */
+struct TankContext {
+  TankGeometry geometry;   //!< level to volume table of its config
+  FilterChain filter;
+  AdaptiveRate rate;       //!< sampling period of its sonar
+  Sonar sonar;
+  TankLevel level;
+  uint32_t failures;       //!< acquisitions without a valid echo
+  uint32_t levelMs;        //!< millis() when level was computed, 0 before the first
+  TankSensor sensor;
+  TankAlerts alerts;
+};
+
+enum TankConfigResult : uint8_t {
+  TANK_CONFIG_UPDATED = 0,
+  TANK_CONFIG_UNCHANGED,   //!< same document as the current one, not parsed again
+  TANK_CONFIG_INVALID,
+};
+
+void tankConfigDefaults(TankConfig &config);
+// Without dimensions there is no level, only a distance
+bool tankConfigured(const TankConfig &config);
+
+/*
+ * Parses json in place: strings point into it instead of being copied, so
+ * it gets modified. The dimensions the shape needs are required and bounded,
+ * the strings must fit and a calibration table must be ordered. False when
+ * anything is off, the configs are then left untouched.
+ *
+ * The top level object is the first tank. The others, when count > 1, come
+ * from the optional "tanks" array: the same dimension, shape, temperature
+ * and acquisition keys, the device settings (unit, chat, format, report)
+ * only at the top. Tanks missing from the array stay unconfigured, entries
+ * beyond count are ignored.
+ */
+bool tankConfigParse(char *json, size_t len, TankConfig *configs, uint8_t count);
+inline bool tankConfigParse(char *json, size_t len, TankConfig &config)
+{
+  return tankConfigParse(json, len, &config, 1);
+}
+
+// Defaults when the file is missing, corrupted or from another layout
+bool tankConfigLoad(Storage &storage, TankConfigState &state);
+bool tankConfigSave(Storage &storage, TankConfigState &state);
+// The caller saves the state when the config was updated
+TankConfigResult tankConfigUpdate(TankConfigState &state, char *json, size_t len);
+
+// Level to volume table of the configured shape, rebuilt on each new config
+void tankGeometryBuild(const TankConfig &config, TankGeometry &geometry);
+
+// mm/s in air at that temperature, TANK_SOUND_SPEED_MM_S for TANK_NO_TEMPERATURE
+uint32_t tankSoundSpeed(int16_t temperatureDeciC);
+// Half the round trip of an echo, rounded to the mm
+uint32_t tankEchoToMm(uint32_t echoUs, uint32_t soundSpeedMmS);
+
+/*
+ * Turns the filtered echo width (us) into a level, all in integers.
+ * temperatureDeciC comes from a sensor, TANK_NO_TEMPERATURE falls back on
+ * the configured one. Returns the alert message to send, nullptr when there
+ * is none.
+ */
+const char *tankUpdate(const TankConfig &config, const TankGeometry &geometry, const FilterEstimate &estimate,
+                       int16_t temperatureDeciC, TankLevel &level, TankAlerts &alerts);
+
+// Level fields of the telemetry message, the caller opens and closes the object
+void tankWriteTelemetry(TelemetryWriter &payload, const TankLevel &level, const FilterEstimate &estimate);
+// Fields of the config the level depends on, they only change with it so they go in their own message
+void tankWriteDimensions(TelemetryWriter &payload, const TankConfig &config);
+// Every tank in one "tanks" array, in sensor order, a few short fields each to fit one message
+void tankWriteBatchTelemetry(TelemetryWriter &payload, const TankContext *tanks, uint8_t count);
+
+#endif // TANK_H
@@ -0,0 +1,293 @@
+#include "telemetry.h"
+
+#include <string.h>
+
+TelemetryWriter::TelemetryWriter(char *buffer, size_t capacity, TelemetryFormat format)
+  : buffer(buffer), capacity(capacity), used(0), format(format), overflow(capacity == 0),
+    depth(0), inArray(0), notFirst(0)
+{
+  if (capacity > 0) {
+    buffer[0] = '\0';
+  }
+}
+
+///////////////////////////////
+// Raw output
+///////////////////////////////
+void TelemetryWriter::put(const char *data, size_t len)
+{
+  // Keep one byte for the JSON terminator
+  if (overflow || used + len >= capacity) {
+    overflow = true;
+    return;
+  }
+  memcpy(buffer + used, data, len);
+  used += len;
+  buffer[used] = '\0';
+}
+
+void TelemetryWriter::put(char c)
+{
+  put(&c, 1);
+}
+
+void TelemetryWriter::putUnsigned(uint32_t value)
+{
+  char digits[10];
+  uint8_t n = 0;
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+
+  char out[10];
+  for (uint8_t i = 0; i < n; i++) {
+    out[i] = digits[n - 1 - i];
+  }
+  put(out, n);
+}
+
+void TelemetryWriter::putString(const char *str)
+{
+  size_t len = strlen(str);
+
+  if (format == TELEMETRY_CBOR) {
+    cborHead(3, len);
+    put(str, len);
+    return;
+  }
+
+  put('"');
+  for (size_t i = 0; i < len; i++) {
+    char c = str[i];
+    if (c == '"' || c == '\\') {
+      put('\\');
+      put(c);
+    } else if ((uint8_t)c < 0x20) {
+      put(' ');
+    } else {
+      put(c);
+    }
+  }
+  put('"');
+}
+
+void TelemetryWriter::cborHead(uint8_t major, uint32_t value)
+{
+  char head[5];
+  major <<= 5;
+  if (value < 24) {
+    head[0] = major | value;
+    put(head, 1);
+  } else if (value <= 0xFF) {
+    head[0] = major | 24;
+    head[1] = value;
+    put(head, 2);
+  } else if (value <= 0xFFFF) {
+    head[0] = major | 25;
+    head[1] = value >> 8;
+    head[2] = value;
+    put(head, 3);
+  } else {
+    head[0] = major | 26;
+    head[1] = value >> 24;
+    head[2] = value >> 16;
+    head[3] = value >> 8;
+    head[4] = value;
+    put(head, 5);
+  }
+}
+
+///////////////////////////////
+// Structure
+///////////////////////////////
+void TelemetryWriter::key(const char *key)
+{
+  if (depth > 0 && (notFirst & (1 << depth)) && format == TELEMETRY_JSON) {
+    put(',');
+  }
+  notFirst |= 1 << depth;
+
+  if (depth == 0 || (inArray & (1 << depth))) {
+    return;
+  }
+
+  putString(key ? key : "");
+  if (format == TELEMETRY_JSON) {
+    put(':');
+  }
+}
+
+void TelemetryWriter::open(const char *key, char json, uint8_t cbor)
+{
+  if (depth + 1 >= TELEMETRY_MAX_DEPTH) {
+    overflow = true;
+    return;
+  }
+
+  this->key(key);
+  if (format == TELEMETRY_JSON) {
+    put(json);
+  } else {
+    put((char)cbor);
+  }
+
+  depth++;
+  notFirst &= ~(1 << depth);
+  if (json == '[') {
+    inArray |= 1 << depth;
+  } else {
+    inArray &= ~(1 << depth);
+  }
+}
+
+void TelemetryWriter::close(char json)
+{
+  if (depth == 0) {
+    overflow = true;
+    return;
+  }
+  put(format == TELEMETRY_JSON ? json : (char)0xFF);
+  depth--;
+}
+
+void TelemetryWriter::beginObject(const char *key)
+{
+  open(key, '{', 0xBF);
+}
+
+void TelemetryWriter::endObject()
+{
+  close('}');
+}
+
+void TelemetryWriter::beginArray(const char *key)
+{
+  open(key, '[', 0x9F);
+}
+
+void TelemetryWriter::endArray()
+{
+  close(']');
+}
+
+///////////////////////////////
+// Values
+///////////////////////////////
+void TelemetryWriter::addUInt(const char *key, uint32_t value)
+{
+  this->key(key);
+  if (format == TELEMETRY_CBOR) {
+    cborHead(0, value);
+  } else {
+    putUnsigned(value);
+  }
+}
+
+void TelemetryWriter::addInt(const char *key, int32_t value)
+{
+  if (value >= 0) {
+    addUInt(key, (uint32_t)value);
+    return;
+  }
+
+  this->key(key);
+  // -(value + 1) cannot overflow, even for INT32_MIN
+  uint32_t magnitude = (uint32_t)(-(value + 1));
+  if (format == TELEMETRY_CBOR) {
+    cborHead(1, magnitude);
+  } else {
+    put('-');
+    putUnsigned(magnitude + 1);
+  }
+}
+
+void TelemetryWriter::addBool(const char *key, bool value)
+{
+  this->key(key);
+  if (format == TELEMETRY_CBOR) {
+    put(value ? (char)0xF5 : (char)0xF4);
+  } else if (value) {
+    put("true", 4);
+  } else {
+    put("false", 5);
+  }
+}
+
+void TelemetryWriter::addFloat(const char *key, float value, uint8_t decimals)
+{
+  this->key(key);
+
+  if (format == TELEMETRY_CBOR) {
+    // Single precision float, big endian
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    char out[5] = { (char)0xFA, (char)(bits >> 24), (char)(bits >> 16), (char)(bits >> 8), (char)bits };
+    put(out, 5);
+    return;
+  }
+
+  if (value != value || value > 4e9f || value < -4e9f) {
+    put("null", 4);
+    return;
+  }
+
+  if (value < 0) {
+    put('-');
+    value = -value;
+  }
+
+  uint32_t scale = 1;
+  for (uint8_t i = 0; i < decimals; i++) {
+    scale *= 10;
+  }
+
+  // Round once on the scaled value so 9.999 prints as 10.00
+  uint64_t scaled = (uint64_t)(value * scale + 0.5f);
+  putUnsigned((uint32_t)(scaled / scale));
+  if (decimals == 0) {
+    return;
+  }
+
+  put('.');
+  uint32_t fraction = (uint32_t)(scaled % scale);
+  for (uint32_t digit = scale / 10; digit > 0; digit /= 10) {
+    put('0' + (fraction / digit) % 10);
+  }
+}
+
+void TelemetryWriter::addFixed(const char *key, int32_t value, uint8_t decimals)
+{
+  uint32_t scale = 1;
+  for (uint8_t i = 0; i < decimals; i++) {
+    scale *= 10;
+  }
+
+  if (format == TELEMETRY_CBOR) {
+    // Same single precision float as addFloat, decoders expect a number
+    addFloat(key, (float)value / scale, decimals);
+    return;
+  }
+
+  this->key(key);
+  uint32_t magnitude = value < 0 ? (uint32_t)(-(value + 1)) + 1 : (uint32_t)value;
+  if (value < 0) {
+    put('-');
+  }
+  putUnsigned(magnitude / scale);
+  if (decimals == 0) {
+    return;
+  }
+
+  put('.');
+  uint32_t fraction = magnitude % scale;
+  for (uint32_t digit = scale / 10; digit > 0; digit /= 10) {
+    put('0' + (fraction / digit) % 10);
+  }
+}
+
+void TelemetryWriter::addString(const char *key, const char *value)
+{
+  this->key(key);
+  putString(value ? value : "");
+}
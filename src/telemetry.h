@@ -0,0 +1,62 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TELEMETRY_MAX_DEPTH 8
+
+enum TelemetryFormat : uint8_t {
+  TELEMETRY_JSON = 0,
+  TELEMETRY_CBOR,       //!< RFC 7049, maps and arrays use indefinite lengths
+};
+
+/*
+ * Streams a telemetry document into a caller provided buffer, no heap.
+ * The same calls produce either JSON or CBOR. Keys are ignored inside arrays.
+ * Once the buffer is full the writer stops and overflowed() turns true.
+ */
+class TelemetryWriter {
+public:
+  TelemetryWriter(char *buffer, size_t capacity, TelemetryFormat format = TELEMETRY_JSON);
+
+  void beginObject(const char *key = nullptr);
+  void endObject();
+  void beginArray(const char *key = nullptr);
+  void endArray();
+
+  void addInt(const char *key, int32_t value);
+  void addUInt(const char *key, uint32_t value);
+  void addBool(const char *key, bool value);
+  void addFloat(const char *key, float value, uint8_t decimals = 2);
+  // value / 10^decimals, exact in JSON without touching a float
+  void addFixed(const char *key, int32_t value, uint8_t decimals);
+  void addString(const char *key, const char *value);
+
+  const char *data() const { return buffer; }
+  // Bytes to publish, without the JSON NUL terminator
+  size_t length() const { return overflow ? 0 : used; }
+  bool overflowed() const { return overflow; }
+  TelemetryFormat getFormat() const { return format; }
+
+private:
+  void key(const char *key);
+  void put(char c);
+  void put(const char *data, size_t len);
+  void putString(const char *str);
+  void putUnsigned(uint32_t value);
+  void cborHead(uint8_t major, uint32_t value);
+  void open(const char *key, char json, uint8_t cbor);
+  void close(char json);
+
+  char *buffer;
+  size_t capacity;
+  size_t used;
+  TelemetryFormat format;
+  bool overflow;
+  uint8_t depth;
+  uint8_t inArray;   //!< bit n set when level n is an array
+  uint8_t notFirst;  //!< bit n set once level n holds an element (JSON commas)
+};
+
+#endif // TELEMETRY_H
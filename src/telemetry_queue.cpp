@@ -0,0 +1,195 @@
+#include "telemetry_queue.h"
+
+#define TQ_MAGIC 0x54510001
+
+TelemetryQueue::TelemetryQueue()
+  : storage(nullptr), head(0), tail(0), tailOffset(0), count(0), droppedCount(0)
+{
+}
+
+void TelemetryQueue::segmentPath(uint8_t slot, char *path) const
+{
+  path[0] = '/';
+  path[1] = 't';
+  path[2] = 'q';
+  path[3] = '0' + slot;
+  path[4] = '\0';
+}
+
+int32_t TelemetryQueue::segmentRecords(uint8_t slot, bool &closed) const
+{
+  char path[5];
+  segmentPath(slot, path);
+  int32_t size = storage->size(path);
+  if (size < 0) {
+    closed = false;
+    return -1;
+  }
+  // A torn record from a power cut closes the segment, the next append goes to a fresh one
+  int32_t records = size / sizeof(TelemetryRecord);
+  closed = records >= TQ_RECORDS_PER_SEGMENT || size % sizeof(TelemetryRecord) != 0;
+  return records;
+}
+
+void TelemetryQueue::begin(Storage *storage)
+{
+  this->storage = storage;
+  head = tail = 0;
+  tailOffset = 0;
+  count = 0;
+
+  Meta meta;
+  if (storage->read(TQ_META_PATH, 0, &meta, sizeof(meta)) == sizeof(meta) &&
+      meta.magic == TQ_MAGIC && meta.tail < TQ_SEGMENTS) {
+    tail = meta.tail;
+    tailOffset = meta.tailOffset;
+  }
+
+  // Walk the ring from the tail, the head is the first segment still open
+  head = tail;
+  uint8_t slot = tail;
+  for (uint8_t i = 0; i < TQ_SEGMENTS; i++) {
+    bool closed;
+    int32_t records = segmentRecords(slot, closed);
+    if (records < 0) {
+      break;
+    }
+    head = slot;
+    count += records;
+    if (!closed) {
+      break;
+    }
+    slot = (slot + 1) % TQ_SEGMENTS;
+  }
+
+  if (count > tailOffset) {
+    count -= tailOffset;
+  } else {
+    count = 0;
+    tailOffset = 0;
+  }
+}
+
+void TelemetryQueue::saveMeta()
+{
+  Meta meta = { TQ_MAGIC, tail, 0, tailOffset };
+  storage->write(TQ_META_PATH, &meta, sizeof(meta));
+}
+
+void TelemetryQueue::dropOldest()
+{
+  bool closed;
+  int32_t records = segmentRecords(tail, closed);
+  if (records > tailOffset) {
+    droppedCount += records - tailOffset;
+    count -= records - tailOffset;
+  }
+
+  char path[5];
+  segmentPath(tail, path);
+  storage->remove(path);
+  tail = (tail + 1) % TQ_SEGMENTS;
+  tailOffset = 0;
+  saveMeta();
+}
+
+bool TelemetryQueue::push(const TelemetryRecord &record)
+{
+  if (!storage) {
+    return false;
+  }
+
+  bool closed;
+  segmentRecords(head, closed);
+  if (closed) {
+    uint8_t next = (head + 1) % TQ_SEGMENTS;
+    if (next == tail) {
+      dropOldest();
+    }
+    head = next;
+  }
+
+  char path[5];
+  segmentPath(head, path);
+  if (!storage->append(path, &record, sizeof(record))) {
+    return false;
+  }
+  count++;
+  return true;
+}
+
+uint16_t TelemetryQueue::peek(TelemetryRecord *records, uint16_t max)
+{
+  if (!storage || count == 0) {
+    return 0;
+  }
+
+  bool closed;
+  int32_t available = segmentRecords(tail, closed) - tailOffset;
+  if (available <= 0) {
+    return 0;
+  }
+  if (available < max) {
+    max = available;
+  }
+
+  char path[5];
+  segmentPath(tail, path);
+  size_t n = storage->read(path, tailOffset * sizeof(TelemetryRecord), records, max * sizeof(TelemetryRecord));
+  return n / sizeof(TelemetryRecord);
+}
+
+void TelemetryQueue::pop(uint16_t popped)
+{
+  if (!storage || popped == 0) {
+    return;
+  }
+  if (popped > count) {
+    popped = count;
+  }
+  count -= popped;
+  tailOffset += popped;
+
+  bool closed;
+  int32_t records = segmentRecords(tail, closed);
+  if (tailOffset >= records) {
+    // Segment fully sent, it can go
+    char path[5];
+    segmentPath(tail, path);
+    storage->remove(path);
+    if (tail != head) {
+      tail = (tail + 1) % TQ_SEGMENTS;
+    }
+    tailOffset = 0;
+  }
+  saveMeta();
+}
+
+uint16_t telemetryWriteBatch(char *buffer, size_t capacity, TelemetryFormat format, const TelemetryRecord *records,
+                             uint16_t count, bool withTank, size_t &length)
+{
+  // A handful of records: writing again with one less is simpler than rolling the writer back
+  for (; count > 0; count--) {
+    TelemetryWriter payload(buffer, capacity, format);
+    payload.beginObject();
+    payload.beginArray("batch");
+    for (uint16_t i = 0; i < count; i++) {
+      payload.beginObject();
+      payload.addUInt("timestamp", records[i].timestamp);
+      payload.addInt("current_volume_in_liters", records[i].volume);
+      payload.addInt("current_volume_in_percent", records[i].percent);
+      if (withTank) {
+        payload.addUInt("tank", records[i].flags);
+      }
+      payload.endObject();
+    }
+    payload.endArray();
+    payload.endObject();
+    if (!payload.overflowed()) {
+      length = payload.length();
+      return count;
+    }
+  }
+  length = 0;
+  return 0;
+}
@@ -0,0 +1,76 @@
+#ifndef TELEMETRY_QUEUE_H
+#define TELEMETRY_QUEUE_H
+
+#include <stdint.h>
+#include "storage.h"
+#include "telemetry.h"
+
+#define TQ_SEGMENTS             8    //!< segment files used as a ring
+#define TQ_RECORDS_PER_SEGMENT  64   //!< 8 x 64 samples = 8 h of outage at one sample a minute
+#define TQ_META_PATH            "/tq.meta"
+
+struct TelemetryRecord {
+  uint32_t timestamp;   //!< epoch seconds
+  int32_t volume;       //!< liters
+  int16_t percent;
+  uint16_t flags;       //!< index of the tank on a device with several
+};
+
+/*
+ * Store-and-forward queue of telemetry samples kept in flash.
+ *
+ * Records are appended to segment files /tq0../tq7 used as a ring. A full
+ * ring drops its oldest segment. Each record is written once and the only
+ * rewritten file is the 8 byte read cursor, once per acknowledged batch, so
+ * flash traffic is 12 bytes per sample plus 8 bytes per batch. RAM use is a
+ * handful of counters whatever the backlog.
+ */
+class TelemetryQueue {
+public:
+  TelemetryQueue();
+
+  // Recovers the queue left in flash by a previous boot
+  void begin(Storage *storage);
+
+  bool push(const TelemetryRecord &record);
+
+  // Oldest records first, never more than what is left in the oldest segment
+  uint16_t peek(TelemetryRecord *records, uint16_t max);
+  // Acknowledges the first count records returned by peek()
+  void pop(uint16_t count);
+
+  uint32_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  uint32_t dropped() const { return droppedCount; }
+
+private:
+  struct Meta {
+    uint32_t magic;
+    uint8_t tail;
+    uint8_t reserved;
+    uint16_t tailOffset;
+  };
+
+  void segmentPath(uint8_t slot, char *path) const;
+  // Records in a segment, -1 when missing. closed is set when no more appends may go there.
+  int32_t segmentRecords(uint8_t slot, bool &closed) const;
+  void dropOldest();
+  void saveMeta();
+
+  Storage *storage;
+  uint8_t head;
+  uint8_t tail;
+  uint16_t tailOffset;
+  uint32_t count;
+  uint32_t droppedCount;
+};
+
+/*
+ * {"batch":[...]} of the first records, as many as fit in capacity with the
+ * tank index when withTank. Returns how many went in, the ones to pop once
+ * published, 0 when not even one fits. length is the size to publish.
+ */
+uint16_t telemetryWriteBatch(char *buffer, size_t capacity, TelemetryFormat format, const TelemetryRecord *records,
+                             uint16_t count, bool withTank, size_t &length);
+
+#endif // TELEMETRY_QUEUE_H
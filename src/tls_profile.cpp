@@ -0,0 +1,216 @@
+#include "tls_profile.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// MQTT packets are capped at 512 bytes by the client, the JWT in CONNECT
+// included. OTA trades some memory for fewer records per chunk. The cloud
+// function and the bucket are checked against the GTS roots (gts_roots.h):
+// the SHA-256 of the image comes with the manifest, it only proves the
+// download is intact when the manifest itself is authenticated.
+const TlsProfile tlsProfiles[TLS_CLIENT_COUNT] = {
+  { "mqtt", 1024, 1024, true },
+  { "ota", 4096, 1024, true },
+  { "notify", 1024, 1024, true },
+};
+
+bool tlsParseUrl(const char *url, char *host, uint8_t size, uint16_t &port)
+{
+  port = 443;
+  const char *start = strstr(url, "://");
+  if (start) {
+    if (strncmp(url, "http:", 5) == 0) {
+      port = 80;
+    }
+    start += 3;
+  } else {
+    start = url;
+  }
+
+  size_t length = strcspn(start, ":/?");
+  if (length == 0 || length >= size) {
+    return false;
+  }
+  memcpy(host, start, length);
+  host[length] = '\0';
+  if (start[length] == ':') {
+    port = atoi(start + length + 1);
+  }
+  return true;
+}
+
+TlsGate::TlsGate()
+  : holder(TLS_CLIENT_COUNT), baseline(0), lowest(0)
+{
+  memset(closers, 0, sizeof(closers));
+  memset(usages, 0, sizeof(usages));
+}
+
+void TlsGate::setClose(TlsClientKind kind, CloseFn close, void *ctx)
+{
+  closers[kind].close = close;
+  closers[kind].ctx = ctx;
+}
+
+void TlsGate::acquire(TlsClientKind kind, uint32_t freeHeap)
+{
+  if (holder == kind) {
+    sample(freeHeap);
+    return;
+  }
+  if (held()) {
+    TlsClientKind previous = holder;
+    if (closers[previous].close) {
+      closers[previous].close(closers[previous].ctx);
+    }
+    // The close hook normally released it already
+    if (holder == previous) {
+      release(previous, freeHeap);
+    }
+  }
+  holder = kind;
+  baseline = freeHeap;
+  lowest = freeHeap;
+  usages[kind].connects++;
+}
+
+void TlsGate::sample(uint32_t freeHeap)
+{
+  if (held() && freeHeap < lowest) {
+    lowest = freeHeap;
+  }
+}
+
+void TlsGate::release(TlsClientKind kind, uint32_t freeHeap)
+{
+  if (holder != kind) {
+    return;
+  }
+  sample(freeHeap);
+  holder = TLS_CLIENT_COUNT;
+  account(kind, baseline - lowest);
+}
+
+void TlsGate::record(TlsClientKind kind, uint32_t bytes)
+{
+  usages[kind].connects++;
+  account(kind, bytes);
+}
+
+void TlsGate::account(TlsClientKind kind, uint32_t bytes)
+{
+  usages[kind].lastBytes = bytes;
+  if (bytes > usages[kind].peakBytes) {
+    usages[kind].peakBytes = bytes;
+  }
+}
+
+void TlsGate::setFragmentLength(TlsClientKind kind, uint16_t fragmentLength)
+{
+  usages[kind].fragmentLength = fragmentLength;
+}
+
+#ifdef ARDUINO
+#include <Arduino.h>
+
+#if defined(ESP8266)
+static BearSSL::X509List *trustAnchors = nullptr;
+static BearSSL::Session sessions[TLS_CLIENT_COUNT];
+
+// probeMaxFragmentLength() costs a connection, ask each server once and never while connecting
+struct FragmentProbe {
+  char host[48];
+  uint16_t port;
+  uint16_t requested;
+  uint16_t accepted;
+  bool probed;      //!< false until tlsProbePending() got to it, full records meanwhile
+};
+static FragmentProbe probes[4];   //!< MQTT, Telegram, the cloud function and the bucket
+static uint8_t nextProbe = 0;
+
+// Answer of an earlier probe, 0 when there is none yet: the server is then queued for tlsProbePending()
+static uint16_t probedFragmentLength(const char *host, uint16_t port, uint16_t length)
+{
+  for (uint8_t i = 0; i < sizeof(probes) / sizeof(probes[0]); i++) {
+    FragmentProbe &probe = probes[i];
+    if (probe.port == port && probe.requested == length && strncmp(probe.host, host, sizeof(probe.host)) == 0) {
+      return probe.accepted;
+    }
+  }
+
+  FragmentProbe &probe = probes[nextProbe];
+  nextProbe = (nextProbe + 1) % (sizeof(probes) / sizeof(probes[0]));
+  strncpy(probe.host, host, sizeof(probe.host) - 1);
+  probe.host[sizeof(probe.host) - 1] = '\0';
+  probe.port = port;
+  probe.requested = length;
+  probe.accepted = 0;
+  probe.probed = false;
+  return 0;
+}
+#else
+static String trustAnchors;
+#endif
+
+void tlsBegin(const char *const *pems, uint8_t count)
+{
+#if defined(ESP8266)
+  if (trustAnchors) {
+    return;
+  }
+  trustAnchors = new BearSSL::X509List();
+  for (uint8_t i = 0; i < count; i++) {
+    trustAnchors->append(pems[i]);
+  }
+#else
+  if (trustAnchors.length() > 0) {
+    return;
+  }
+  // mbedTLS takes a bundle of concatenated PEM blocks
+  for (uint8_t i = 0; i < count; i++) {
+    trustAnchors += pems[i];
+  }
+#endif
+}
+
+uint16_t tlsConfigure(WiFiClientSecure &client, TlsClientKind kind, const char *host, uint16_t port)
+{
+  const TlsProfile &profile = tlsProfiles[kind];
+#if defined(ESP8266)
+  if (profile.authenticated && trustAnchors) {
+    client.setTrustAnchors(trustAnchors);
+  } else {
+    client.setInsecure();
+  }
+  client.setSession(&sessions[kind]);
+
+  uint16_t fragmentLength = probedFragmentLength(host, port, profile.fragmentLength);
+  client.setBufferSizes(fragmentLength ? fragmentLength : TLS_RECORD_SIZE, profile.txBufferSize);
+  return fragmentLength;
+#else
+  // The ESP32 core sizes its mbedTLS buffers at build time, only the anchors apply
+  if (profile.authenticated && trustAnchors.length() > 0) {
+    client.setCACert(trustAnchors.c_str());
+  } else {
+    client.setInsecure();
+  }
+  return 0;
+#endif
+}
+
+bool tlsProbePending()
+{
+#if defined(ESP8266)
+  for (uint8_t i = 0; i < sizeof(probes) / sizeof(probes[0]); i++) {
+    FragmentProbe &probe = probes[i];
+    if (probe.port != 0 && !probe.probed) {
+      probe.accepted = BearSSL::WiFiClientSecure::probeMaxFragmentLength(probe.host, probe.port, probe.requested)
+                       ? probe.requested : 0;
+      probe.probed = true;
+      return true;
+    }
+  }
+#endif
+  return false;
+}
+#endif // ARDUINO
@@ -0,0 +1,103 @@
+#ifndef TLS_PROFILE_H
+#define TLS_PROFILE_H
+
+#include <stdint.h>
+
+#define TLS_RECORD_SIZE  (16384 + 325)  //!< receive buffer needed without Maximum Fragment Length
+
+enum TlsClientKind : uint8_t {
+  TLS_MQTT = 0,     //!< long lived, outside the gate
+  TLS_OTA,
+  TLS_NOTIFY,
+  TLS_CLIENT_COUNT,
+};
+
+/*
+ * Buffer sizes of one kind of client. The receive buffer shrinks to
+ * fragmentLength when the server accepts that Maximum Fragment Length,
+ * otherwise it has to hold a full TLS record.
+ */
+struct TlsProfile {
+  const char *name;
+  uint16_t fragmentLength;  //!< 512, 1024, 2048 or 4096
+  uint16_t txBufferSize;
+  bool authenticated;       //!< checked against the shared trust anchors
+};
+
+extern const TlsProfile tlsProfiles[TLS_CLIENT_COUNT];
+
+// "https://host:port/path" to host and port, false when host does not fit
+bool tlsParseUrl(const char *url, char *host, uint8_t size, uint16_t &port);
+
+struct TlsUsage {
+  uint32_t connects;
+  uint32_t peakBytes;     //!< largest heap drop seen while the client was open
+  uint32_t lastBytes;
+  uint16_t fragmentLength;  //!< negotiated for the last connection, 0 = full records
+};
+
+/*
+ * Lets a single short-lived client (OTA, notifications) hold a TLS
+ * connection at a time, next to the MQTT one, so the peak TLS memory is
+ * bounded by two connections. Tasks are cooperative, so the holder is always
+ * between two requests when another one asks: it is closed through its
+ * close hook. Heap samples taken while a client is open give its peak use.
+ */
+class TlsGate {
+public:
+  typedef void (*CloseFn)(void *ctx);
+
+  TlsGate();
+
+  void setClose(TlsClientKind kind, CloseFn close, void *ctx);
+
+  // freeHeap is the free heap before the connection
+  void acquire(TlsClientKind kind, uint32_t freeHeap);
+  void sample(uint32_t freeHeap);
+  void release(TlsClientKind kind, uint32_t freeHeap);
+
+  // The MQTT client is not gated, its connections are measured by the caller
+  void record(TlsClientKind kind, uint32_t bytes);
+  void setFragmentLength(TlsClientKind kind, uint16_t fragmentLength);
+
+  bool held() const { return holder != TLS_CLIENT_COUNT; }
+  TlsClientKind getHolder() const { return holder; }
+  const TlsUsage &usage(TlsClientKind kind) const { return usages[kind]; }
+
+private:
+  void account(TlsClientKind kind, uint32_t bytes);
+
+  struct Closer {
+    CloseFn close;
+    void *ctx;
+  };
+
+  Closer closers[TLS_CLIENT_COUNT];
+  TlsUsage usages[TLS_CLIENT_COUNT];
+  TlsClientKind holder;
+  uint32_t baseline;
+  uint32_t lowest;
+};
+
+#ifdef ARDUINO
+#include <WiFiClientSecure.h>
+
+// Parses the PEM roots once, every client then shares them
+void tlsBegin(const char *const *pems, uint8_t count);
+
+/*
+ * Trust anchors, session cache and buffer sizes of kind for a connection to
+ * host. Returns the negotiated fragment length, 0 when full records are used.
+ * Never probes the server: until tlsProbePending() has, full records it is.
+ */
+uint16_t tlsConfigure(WiFiClientSecure &client, TlsClientKind kind, const char *host, uint16_t port);
+
+/*
+ * Asks one server met by tlsConfigure() which fragment length it accepts,
+ * for its next connections. A blocking round trip: call it once connected
+ * and idle, never from a connect path. False when there was none to ask.
+ */
+bool tlsProbePending();
+#endif
+
+#endif // TLS_PROFILE_H
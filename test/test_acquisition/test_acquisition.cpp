@@ -0,0 +1,114 @@
+#include <unity.h>
+
+#include "../../src/native/fixtures.h"
+#include "../../src/acquisition.h"
+
+#define MINUTE     60000
+#define STILL_US   3500   //!< 60 cm from the sensor
+
+// Runs the sensor task against a level in echo us, as the scheduler would
+struct AcquisitionRun {
+  AdaptiveRate rate;
+  FilterChain filter;
+  uint32_t nowMs;
+  uint32_t samples;
+
+  AcquisitionRun() : nowMs(0), samples(0) {}
+
+  // Until untilMs, echo(t) gives the raw echo
+  template <typename Echo> void run(uint32_t untilMs, Echo echo)
+  {
+    while (nowMs < untilMs) {
+      int32_t raw = echo(nowMs);
+      filter.push(raw);
+      nowMs += rate.update(nowMs, raw, filter.getEstimate().value);
+      samples++;
+    }
+  }
+};
+
+static AcquisitionRun run;
+
+void setUp()
+{
+  run = AcquisitionRun();
+}
+
+void tearDown()
+{
+}
+
+// A few mm of noise on a still level
+static int32_t jitter(uint32_t t)
+{
+  return (int32_t)(t / 500 * 7919 % 21) - 10;
+}
+
+// A still tank until untilMs
+static void still(uint32_t untilMs)
+{
+  run.run(untilMs, [](uint32_t t) { return STILL_US + jitter(t); });
+}
+
+static void test_acquisition_idle()
+{
+  // Idle period within 5 minutes, then 2 samples a minute
+  still(5 * MINUTE);
+  TEST_ASSERT_EQUAL_UINT32(30000, run.rate.getPeriodMs());
+  uint32_t settled = run.samples;
+  still(65 * MINUTE);
+  TEST_ASSERT_EQUAL_UINT32(120, run.samples - settled);
+  TEST_ASSERT_EQUAL_UINT32(0, run.rate.getActivations());
+}
+
+static void test_acquisition_spike()
+{
+  // A lone spurious echo only brings the next sample forward
+  still(5 * MINUTE);
+  uint32_t spike = run.nowMs;
+  run.run(10 * MINUTE, [spike](uint32_t t) { return t == spike ? 2000 : STILL_US + jitter(t); });
+  TEST_ASSERT_EQUAL_UINT32(30000, run.rate.getPeriodMs());
+  TEST_ASSERT_EQUAL_UINT32(0, run.rate.getActivations());
+}
+
+static void test_acquisition_refill()
+{
+  // 10 minute refill, 7 cm a minute closer: fastest rate within 2 samples, and kept
+  still(5 * MINUTE);
+  uint32_t start = run.nowMs;
+  uint32_t before = run.samples;
+  run.run(start + 1, [](uint32_t) { return STILL_US; });
+  run.run(start + 10 * MINUTE, [start](uint32_t t) { return STILL_US - (int32_t)((t - start) * 7 / 1000); });
+  TEST_ASSERT_EQUAL_UINT32(1, run.rate.getActivations());
+  TEST_ASSERT_EQUAL_UINT32(500, run.rate.getPeriodMs());
+  TEST_ASSERT_GREATER_THAN_UINT32(1000, run.samples - before);
+
+  // Back to idle once the level is still again
+  int32_t level = STILL_US - 10 * MINUTE * 7 / 1000;
+  run.run(start + 20 * MINUTE, [level](uint32_t t) { return level + jitter(t); });
+  TEST_ASSERT_EQUAL_UINT32(30000, run.rate.getPeriodMs());
+  TEST_ASSERT_EQUAL_UINT32(1, run.rate.getActivations());
+}
+
+static void test_acquisition_config()
+{
+  TankConfig tank;
+  tankConfigDefaults(tank);
+  TEST_ASSERT_TRUE(parseConfig("{" CONFIG_DIMENSIONS ",\"acquisition_min_period_ms\":250,"
+                               "\"acquisition_max_period_ms\":120000}", tank));
+  TEST_ASSERT_EQUAL_UINT32(250, tank.acquisitionMinMs);
+  TEST_ASSERT_EQUAL_UINT32(120000, tank.acquisitionMaxMs);
+  TEST_ASSERT_FALSE(parseConfig("{" CONFIG_DIMENSIONS ",\"acquisition_min_period_ms\":5000,"
+                                "\"acquisition_max_period_ms\":1000}", tank));
+  TEST_ASSERT_EQUAL_UINT32(250, tank.acquisitionMinMs);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_acquisition_idle);
+  RUN_TEST(test_acquisition_spike);
+  RUN_TEST(test_acquisition_refill);
+  RUN_TEST(test_acquisition_config);
+  return UNITY_END();
+}
@@ -0,0 +1,189 @@
+#include <unity.h>
+
+#include <string.h>
+
+#include "../../src/native/fixtures.h"
+#include "../../src/boot_timer.h"
+#include "../../src/connection_manager.h"
+#include "../../src/consumption.h"
+#include "../../src/telemetry.h"
+
+#define TEST_BUFFER_SIZE 480   //!< TELEMETRY_BUFFER_SIZE of main.cpp
+
+static BootTimer boot;
+static ConsumptionTracker tracker;
+static char buffer[TEST_BUFFER_SIZE];
+static uint32_t bootBegins;
+
+void setUp()
+{
+  boot = BootTimer();
+  tracker = ConsumptionTracker();
+  memset(buffer, 0, sizeof(buffer));
+  bootBegins = 0;
+}
+
+void tearDown()
+{
+}
+
+static bool bootNever(void *)
+{
+  return false;
+}
+
+static void bootBegin(void *)
+{
+  bootBegins++;
+}
+
+// A warm wake with the clock kept: no time sync, wifi retried once
+static void warmWake()
+{
+  boot.mark(BOOT_INIT, 40);
+  boot.mark(BOOT_STORAGE, 65);
+  boot.mark(BOOT_MEASURE, 400);
+  boot.mark(BOOT_WIFI, 900);
+  boot.mark(BOOT_WIFI, 950);
+  boot.mark(BOOT_MQTT, 1150);
+}
+
+// A trusted burn rate and a refill, every field consumptionWriteTelemetry() has
+static void consumptionWarm()
+{
+  ConsumptionState &state = tracker.getState();
+  state.observedS = tracker.getConfig().warmupS;
+  state.lastVolumeMl = 1000000;
+  state.rateMlPerDay = 12345;
+  state.lastRefillEpoch = 1700000000;
+  state.lastRefillMl = 1500000;
+  state.refills = 99;
+  state.drops = 99;
+}
+
+// What writeLevels() of main.cpp sends for one tank in duty cycle, counters as large as given
+static size_t writeLevel(uint32_t counter, bool withBoot)
+{
+  TankLevel level = { 10000000, 9999999, TANK_SOUND_SPEED_MM_S, 1000000000, 1000000, 100 };
+  FilterEstimate estimate = fixtureEstimate();
+  estimate.samples = counter;
+  estimate.rejected = counter;
+  TelemetryWriter payload(buffer, sizeof(buffer), TELEMETRY_JSON);
+  payload.beginObject();
+  tankWriteTelemetry(payload, level, estimate);
+  payload.addUInt("acquisition_period_ms", counter);
+  consumptionWriteTelemetry(payload, tracker);
+  payload.addUInt("suppressed_reports", UINT16_MAX);
+  payload.addUInt("wake_to_publish_ms", counter);
+  payload.addUInt("wake_count", counter);
+  if (withBoot) {
+    boot.writeTelemetry(payload, counter);
+  }
+  payload.endObject();
+  return payload.length();
+}
+
+static void test_boot_phases()
+{
+  warmWake();
+  TEST_ASSERT_EQUAL_UINT32(40, boot.durationMs(BOOT_INIT));
+  TEST_ASSERT_EQUAL_UINT32(335, boot.durationMs(BOOT_MEASURE));
+  TEST_ASSERT_EQUAL_UINT32(0, boot.durationMs(BOOT_SENSORS));
+  // From the end of the previous phase to the last mark of this one
+  TEST_ASSERT_EQUAL_UINT32(500, boot.durationMs(BOOT_WIFI));
+  TEST_ASSERT_EQUAL_UINT32(250, boot.durationMs(BOOT_MQTT));
+
+  TelemetryWriter payload(buffer, sizeof(buffer), TELEMETRY_JSON);
+  payload.beginObject();
+  boot.writeTelemetry(payload, 1200);
+  payload.endObject();
+  TEST_ASSERT_EQUAL_STRING("{\"boot_ms\":[40,25,0,335,0,500,0,250,1200]}", buffer);
+}
+
+static void test_boot_finished()
+{
+  // Marks after the first publish are ignored
+  warmWake();
+  boot.finish(1250);
+  boot.mark(BOOT_NETWORK, 2000);
+  TEST_ASSERT_TRUE(boot.finished());
+  TEST_ASSERT_EQUAL_UINT32(1250, boot.firstPublishMs());
+  TEST_ASSERT_EQUAL_UINT32(0, boot.durationMs(BOOT_NETWORK));
+
+  char line[160];
+  boot.format(line, sizeof(line));
+  TEST_ASSERT_EQUAL_STRING("Boot: init 40 ms, storage 25 ms, measure 335 ms, wifi 500 ms, mqtt 250 ms, "
+                           "first publish 1250 ms", line);
+  TEST_ASSERT_EQUAL_UINT32(11, boot.format(line, 12));
+  TEST_ASSERT_EQUAL_STRING("Boot: init ", line);
+}
+
+static void test_boot_level_largest()
+{
+  // Every counter of one tank at its largest still fits the buffer, close to
+  // its end: this is the fallback without the boot phases
+  consumptionWarm();
+  ConsumptionState &state = tracker.getState();
+  state.lastVolumeMl = 1000000000;
+  state.rateMlPerDay = 1;
+  state.lastRefillEpoch = UINT32_MAX;
+  state.lastRefillMl = 1000000000;
+  state.refills = UINT16_MAX;
+  state.drops = UINT16_MAX;
+  size_t length = writeLevel(UINT32_MAX, false);
+  TEST_ASSERT_GREATER_THAN_UINT32(0, length);
+  TEST_ASSERT_GREATER_OR_EQUAL_UINT32(sizeof(buffer) - 64, length);
+  TEST_ASSERT_NOT_NULL(strstr(buffer, "\"days_until_empty\":"));
+  // The dimensions are their own message now
+  TEST_ASSERT_NULL(strstr(buffer, "tank_height_in_cm"));
+}
+
+static void test_boot_level_with_phases()
+{
+  // A slow cold boot, each phase taking 100 s, fits with sane counters
+  for (uint8_t i = 0; i < BOOT_PHASES; i++) {
+    boot.mark((BootPhase)i, (i + 1) * 99999);
+  }
+  consumptionWarm();
+  size_t length = writeLevel(99999, true);
+  TEST_ASSERT_GREATER_THAN_UINT32(0, length);
+  TEST_ASSERT_LESS_THAN_UINT32(sizeof(buffer), length);
+  TEST_ASSERT_NOT_NULL(strstr(buffer, "\"boot_ms\":["));
+}
+
+static void test_boot_level_overflow()
+{
+  // Too large a message is reported as empty, never cut short
+  consumptionWarm();
+  for (uint8_t i = 0; i < BOOT_PHASES; i++) {
+    boot.mark((BootPhase)i, UINT32_MAX - BOOT_PHASES + i);
+  }
+  tracker.getState().lastRefillEpoch = UINT32_MAX;
+  TEST_ASSERT_EQUAL_UINT32(0, writeLevel(UINT32_MAX, true));
+}
+
+static void test_boot_fast_wifi()
+{
+  // A fast reconnect in progress is left alone until its timeout
+  ConnectionHooks hooks = { nullptr, bootNever, bootBegin, bootNever, bootBegin, bootNever, bootNever };
+  ConnectionManager connection;
+  connection.begin(hooks, 0);
+  connection.deferAttempt(0, 5000);
+  connection.tick(10);
+  connection.tick(4990);
+  TEST_ASSERT_EQUAL_UINT32(0, bootBegins);
+  connection.tick(5000);
+  TEST_ASSERT_EQUAL_UINT32(1, bootBegins);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_boot_phases);
+  RUN_TEST(test_boot_finished);
+  RUN_TEST(test_boot_level_largest);
+  RUN_TEST(test_boot_level_with_phases);
+  RUN_TEST(test_boot_level_overflow);
+  RUN_TEST(test_boot_fast_wifi);
+  return UNITY_END();
+}
@@ -0,0 +1,186 @@
+#include <unity.h>
+
+#include <vector>
+
+#include "../../src/native/hal_native.h"
+#include "../../src/connection_manager.h"
+
+static const Backoff WIFI_BACKOFF = { 10000, 120000 };
+static const Backoff MQTT_BACKOFF = { 1000, 120000 };
+
+// The board behind the hooks: links go up and down as the test says, each attempt is timed
+struct NetworkFake {
+  bool wifi;
+  bool time;
+  bool mqtt;
+  bool mqttAccepts;   //!< the next mqttConnect() succeeds
+  std::vector<uint32_t> wifiBegins;
+  std::vector<uint32_t> mqttConnects;
+  uint32_t timeSyncs;
+
+  NetworkFake() : wifi(false), time(false), mqtt(false), mqttAccepts(false), timeSyncs(0) {}
+
+  ConnectionHooks hooks()
+  {
+    ConnectionHooks hooks = { this, wifiConnected, wifiBegin, timeValid, timeSyncBegin, mqttConnected, mqttConnect };
+    return hooks;
+  }
+
+  static bool wifiConnected(void *ctx) { return ((NetworkFake *)ctx)->wifi; }
+  static void wifiBegin(void *ctx) { ((NetworkFake *)ctx)->wifiBegins.push_back(halMillis()); }
+  static bool timeValid(void *ctx) { return ((NetworkFake *)ctx)->time; }
+  static void timeSyncBegin(void *ctx) { ((NetworkFake *)ctx)->timeSyncs++; }
+  static bool mqttConnected(void *ctx) { return ((NetworkFake *)ctx)->mqtt; }
+
+  static bool mqttConnect(void *ctx)
+  {
+    NetworkFake &fake = *(NetworkFake *)ctx;
+    fake.mqttConnects.push_back(halMillis());
+    fake.mqtt = fake.mqttAccepts;
+    return fake.mqtt;
+  }
+};
+
+static NetworkFake fake;
+static ConnectionManager connection;
+
+void setUp()
+{
+  halNativeSetClock(0);
+  fake = NetworkFake();
+  connection = ConnectionManager();
+}
+
+// A failed test must not leave the clock frozen for the next one
+void tearDown()
+{
+  halNativeReleaseClock();
+}
+
+// loop() ticking the manager every millisecond for ms
+static void runFor(uint32_t ms)
+{
+  for (uint32_t i = 0; i < ms; i++) {
+    halNativeAdvance(1);
+    connection.tick(halMillis());
+  }
+}
+
+// Every gap between two attempts within [delay, 1.5 delay], the delay doubling from minMs up to maxMs
+static void assertBackoff(const std::vector<uint32_t> &attempts, const Backoff &backoff)
+{
+  uint32_t delay = backoff.minMs;
+  for (size_t i = 1; i < attempts.size(); i++) {
+    TEST_ASSERT_UINT32_WITHIN(delay / 4, delay + delay / 4, attempts[i] - attempts[i - 1]);
+    delay = delay * 2 < backoff.maxMs ? delay * 2 : backoff.maxMs;
+  }
+}
+
+static void test_connection_wifi_backoff()
+{
+  // No access point: 10, 20, 40 and 80 s, then 120 s for good
+  connection.begin(fake.hooks(), halMillis());
+  connection.tick(halMillis());
+  runFor(20 * 60000);
+  size_t n = fake.wifiBegins.size();
+  TEST_ASSERT_EQUAL_UINT8(CONN_WIFI, connection.getState());
+  TEST_ASSERT_EQUAL_UINT32(0, fake.wifiBegins[0]);
+  TEST_ASSERT_UINT32_WITHIN(3, 11, n);
+  TEST_ASSERT_EQUAL_UINT32(n, connection.getAttempts());
+  assertBackoff(fake.wifiBegins, WIFI_BACKOFF);
+  TEST_ASSERT_GREATER_OR_EQUAL_UINT32(WIFI_BACKOFF.maxMs, fake.wifiBegins[n - 1] - fake.wifiBegins[n - 2]);
+  TEST_ASSERT_TRUE(fake.mqttConnects.empty());
+}
+
+static void test_connection_mqtt_backoff()
+{
+  // The broker refuses: its own schedule once WiFi and the clock are up, WiFi left alone
+  fake.wifi = true;
+  fake.time = true;
+  connection.begin(fake.hooks(), halMillis());
+  runFor(10 * 60000);
+  TEST_ASSERT_EQUAL_UINT8(CONN_MQTT, connection.getState());
+  TEST_ASSERT_GREATER_OR_EQUAL_UINT32(8, fake.mqttConnects.size());
+  assertBackoff(fake.mqttConnects, MQTT_BACKOFF);
+  TEST_ASSERT_TRUE(fake.wifiBegins.empty());
+}
+
+static void test_connection_jitter()
+{
+  // Devices rebooting together spread their retries over the whole +50 %
+  uint32_t earliest = UINT32_MAX, latest = 0;
+  for (uint32_t seed = 1; seed <= 200; seed++) {
+    halNativeSetClock(0);
+    fake = NetworkFake();
+    fake.wifi = true;
+    fake.time = true;
+    connection = ConnectionManager();
+    connection.begin(fake.hooks(), halMillis(), seed * 2654435761u);
+    connection.tick(halMillis());
+    runFor(5000);
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32(2, fake.mqttConnects.size());
+    uint32_t first = fake.mqttConnects[1] - fake.mqttConnects[0];
+    earliest = first < earliest ? first : earliest;
+    latest = first > latest ? first : latest;
+  }
+  TEST_ASSERT_UINT32_WITHIN(100, 1000 + 50, earliest);
+  TEST_ASSERT_UINT32_WITHIN(100, 1500 - 50, latest);
+}
+
+static void test_connection_mqtt_lost()
+{
+  fake.wifi = true;
+  fake.time = true;
+  fake.mqttAccepts = true;
+  connection.begin(fake.hooks(), halMillis());
+  runFor(10);
+  TEST_ASSERT_TRUE(connection.connected());
+  TEST_ASSERT_EQUAL_UINT32(1, fake.mqttConnects.size());
+
+  // The broker goes away: only MQTT is retried, WiFi is left alone
+  fake.mqtt = false;
+  fake.mqttAccepts = false;
+  runFor(5000);
+  TEST_ASSERT_EQUAL_UINT8(CONN_MQTT, connection.getState());
+  TEST_ASSERT_EQUAL_UINT32(1, connection.getReconnects());
+  TEST_ASSERT_GREATER_THAN_UINT32(2, fake.mqttConnects.size());
+  TEST_ASSERT_TRUE(fake.wifiBegins.empty());
+}
+
+static void test_connection_wifi_lost()
+{
+  fake.wifi = true;
+  fake.time = true;
+  fake.mqttAccepts = true;
+  connection.begin(fake.hooks(), halMillis());
+  runFor(10);
+
+  // The access point goes away: back to WiFi, with a fresh backoff, MQTT left alone
+  fake.wifi = false;
+  fake.mqtt = false;
+  runFor(16000);
+  TEST_ASSERT_EQUAL_UINT8(CONN_WIFI, connection.getState());
+  TEST_ASSERT_EQUAL_UINT32(1, connection.getReconnects());
+  TEST_ASSERT_EQUAL_UINT32(2, fake.wifiBegins.size());
+  TEST_ASSERT_EQUAL_UINT32(12, fake.wifiBegins[0]);   // the tick after the one that saw the loss
+  assertBackoff(fake.wifiBegins, WIFI_BACKOFF);
+  TEST_ASSERT_EQUAL_UINT32(1, fake.mqttConnects.size());
+
+  // And all the way up again once it is back, the clock kept
+  fake.wifi = true;
+  runFor(10);
+  TEST_ASSERT_TRUE(connection.connected());
+  TEST_ASSERT_EQUAL_UINT32(2, fake.mqttConnects.size());
+  TEST_ASSERT_EQUAL_UINT32(0, fake.timeSyncs);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_connection_wifi_backoff);
+  RUN_TEST(test_connection_mqtt_backoff);
+  RUN_TEST(test_connection_jitter);
+  RUN_TEST(test_connection_mqtt_lost);
+  RUN_TEST(test_connection_wifi_lost);
+  return UNITY_END();
+}
@@ -0,0 +1,141 @@
+#include <unity.h>
+
+#include <string.h>
+
+#include "../../src/native/fixtures.h"
+#include "../../src/native/level_traces.h"
+#include "../../src/consumption.h"
+#include "../../src/telemetry.h"
+
+#define EPOCH 1700000000
+
+static ConsumptionTracker tracker;
+
+void setUp()
+{
+  tracker = ConsumptionTracker();
+}
+
+void tearDown()
+{
+}
+
+// Steady 24 l a day, a level every 10 minutes, count levels
+static uint32_t burn(uint32_t count)
+{
+  uint32_t events = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    events += tracker.update(EPOCH + i * 600, 1000000 - i * 10000 / 60) != CONSUMPTION_NONE;
+  }
+  return events;
+}
+
+static void test_consumption_warmup()
+{
+  // Six hours are not enough to trust the rate
+  burn(6 * 6);
+  TEST_ASSERT_FALSE(tracker.ready());
+  TEST_ASSERT_EQUAL_INT32(-1, tracker.daysUntilEmptyTenths());
+}
+
+static void test_consumption_steady()
+{
+  // Exact rate once warmed up, nothing else
+  TEST_ASSERT_EQUAL_UINT32(0, burn(3 * 144 + 1));
+  TEST_ASSERT_TRUE(tracker.ready());
+  int32_t rate = tracker.rateMlPerDay();
+  TEST_ASSERT_INT32_WITHIN(30, 24000, rate);
+  TEST_ASSERT_EQUAL_UINT8(0, tracker.getState().refills);
+  TEST_ASSERT_EQUAL_UINT8(0, tracker.getState().drops);
+  TEST_ASSERT_EQUAL_INT32((int32_t)(928000ull * 10 / rate), tracker.daysUntilEmptyTenths());
+}
+
+static void test_consumption_out_of_order()
+{
+  // A level older than the last one is ignored, even an empty tank
+  burn(3 * 144 + 1);
+  int32_t rate = tracker.rateMlPerDay();
+  TEST_ASSERT_EQUAL_UINT8(CONSUMPTION_NONE, tracker.update(EPOCH, 0));
+  TEST_ASSERT_EQUAL_INT32(rate, tracker.rateMlPerDay());
+}
+
+static void test_consumption_gap()
+{
+  // A week without levels, then the same volume: no refill, the rate is kept
+  burn(3 * 144 + 1);
+  int32_t rate = tracker.rateMlPerDay();
+  uint32_t last = tracker.getState().lastEpoch;
+  TEST_ASSERT_EQUAL_UINT8(CONSUMPTION_NONE, tracker.update(last + 8 * 86400, tracker.getState().lastVolumeMl));
+  TEST_ASSERT_EQUAL_INT32(rate, tracker.rateMlPerDay());
+}
+
+static void test_consumption_trace()
+{
+  // Recorded trace: one delivery, one siphon, the burn rate unaffected by
+  // either nor by the jitter. The drop is raised as soon as it passes 20 l.
+  ConsumptionTracker restored;
+  uint8_t refills = 0, drops = 0;
+  uint32_t dropMl = 0;
+  const uint32_t count = sizeof(TRACE_REFILL_THEFT) / sizeof(TRACE_REFILL_THEFT[0]);
+  for (uint32_t i = 0; i < count; i++) {
+    const LevelTraceSample &sample = TRACE_REFILL_THEFT[i];
+    switch (tracker.update(EPOCH + sample.offsetS, sample.volumeMl)) {
+      case CONSUMPTION_REFILL:
+        refills++;
+        break;
+      case CONSUMPTION_DROP:
+        drops++;
+        dropMl = tracker.episodeMl();
+        break;
+      default:
+        break;
+    }
+    // Deep sleep halfway through: the RTC copy carries on identically
+    if (i == count / 2) {
+      restored.getState() = tracker.getState();
+    } else if (i > count / 2) {
+      restored.update(EPOCH + sample.offsetS, sample.volumeMl);
+    }
+  }
+  TEST_ASSERT_EQUAL_UINT8(1, refills);
+  TEST_ASSERT_UINT32_WITHIN(20000, 900000, tracker.getState().lastRefillMl);
+  TEST_ASSERT_EQUAL_UINT32(EPOCH + 40 * 3600 + 300, tracker.getState().lastRefillEpoch);
+  TEST_ASSERT_EQUAL_UINT8(1, drops);
+  TEST_ASSERT_GREATER_OR_EQUAL_UINT32(20000, dropMl);
+  TEST_ASSERT_LESS_THAN_UINT32(45000, dropMl);
+  TEST_ASSERT_TRUE(tracker.ready());
+  TEST_ASSERT_INT32_WITHIN(3000, 18000, tracker.rateMlPerDay());
+  TEST_ASSERT_EQUAL_MEMORY(&tracker.getState(), &restored.getState(), sizeof(ConsumptionState));
+}
+
+static void test_consumption_telemetry()
+{
+  // Nothing until the rate is trusted, then the forecast and the counters
+  char buffer[480];
+  TelemetryWriter payload(buffer, sizeof(buffer));
+  payload.beginObject();
+  consumptionWriteTelemetry(payload, tracker);
+  payload.endObject();
+  TEST_ASSERT_EQUAL_STRING("{\"refills\":0,\"abnormal_drops\":0}", buffer);
+
+  burn(3 * 144 + 1);
+  TelemetryWriter ready(buffer, sizeof(buffer));
+  ready.beginObject();
+  consumptionWriteTelemetry(ready, tracker);
+  ready.endObject();
+  TEST_ASSERT_FALSE(ready.overflowed());
+  TEST_ASSERT_NOT_NULL(strstr(buffer, "\"days_until_empty\":"));
+  TEST_ASSERT_NOT_NULL(strstr(buffer, "\"refills\":0,\"abnormal_drops\":0,"));
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_consumption_warmup);
+  RUN_TEST(test_consumption_steady);
+  RUN_TEST(test_consumption_out_of_order);
+  RUN_TEST(test_consumption_gap);
+  RUN_TEST(test_consumption_trace);
+  RUN_TEST(test_consumption_telemetry);
+  return UNITY_END();
+}
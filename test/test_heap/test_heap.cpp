@@ -0,0 +1,212 @@
+#include <unity.h>
+
+#include "../../src/native/alloc_count.h"
+#include "../../src/native/fixtures.h"
+#include "../../src/native/hal_native.h"
+#include "../../src/heap_monitor.h"
+#include "../../src/report.h"
+#include "../../src/scheduler.h"
+#include "../../src/telemetry.h"
+
+struct HeapTask {
+  HeapMonitor *monitor;
+  int8_t section;
+  uint32_t own;      //!< allocations of the task itself per run
+  uint32_t nested;   //!< of its section, which also eats 1 kB and splits the heap
+};
+
+static HalNativeHeap saved;
+static HeapMonitor monitor;
+static Scheduler scheduler;
+static HeapTask sensor, telemetry, ota;
+
+// The halHeap*() fakes, a task allocates by moving the counter
+static void sampleFakeHeap(HeapSample &sample)
+{
+  const HalNativeHeap &heap = halNativeHeap();
+  sample.allocations = heap.allocations;
+  sample.freeBytes = heap.freeBytes;
+  sample.largestBlock = heap.largestBlock;
+}
+
+// The counter of the malloc wrap, see alloc_count.h, the host heap figures mean nothing
+static void sampleHostHeap(HeapSample &sample)
+{
+  sample.allocations = allocCount();
+  sample.freeBytes = 50000;
+  sample.largestBlock = 50000;
+}
+
+static void heapHook(void *ctx, uint8_t id, bool done)
+{
+  HeapMonitor &monitor = *(HeapMonitor *)ctx;
+  if (done) {
+    monitor.leave(id);
+  } else {
+    monitor.enter(id);
+  }
+}
+
+static void heapTask(void *ctx)
+{
+  HeapTask &task = *(HeapTask *)ctx;
+  HalNativeHeap &heap = halNativeHeap();
+  heap.allocations += task.own;
+  if (task.nested) {
+    task.monitor->enter(task.section);
+    heap.allocations += task.nested;
+    heap.freeBytes -= 1000;
+    heap.largestBlock = 5000;
+    task.monitor->leave(task.section);
+  }
+}
+
+// A hot sensor task, a hot telemetry task writing to flash in its own section, the OTA task
+void setUp()
+{
+  halNativeSetClock(0);
+  HalNativeHeap &heap = halNativeHeap();
+  saved = heap;
+  heap = { 40000, 40000, 0 };
+  monitor = HeapMonitor();
+  monitor.begin(sampleFakeHeap);
+  sensor = { &monitor, -1, 0, 0 };
+  telemetry = { &monitor, -1, 0, 3 };
+  ota = { &monitor, -1, 2, 0 };
+  monitor.add("sensor", true);
+  monitor.add("telemetry", true);
+  monitor.add("ota", false);
+  telemetry.section = monitor.add("flash", false);
+  scheduler = Scheduler();
+  scheduler.begin(halMillis, halMicros);
+  scheduler.add("sensor", heapTask, &sensor, 1);
+  scheduler.add("telemetry", heapTask, &telemetry, 1);
+  scheduler.add("ota", heapTask, &ota, 1);
+  scheduler.setHook(heapHook, &monitor);
+}
+
+// A failed test must not leave the clock frozen nor the fake heap drained for the next one
+void tearDown()
+{
+  halNativeHeap() = saved;
+  halNativeReleaseClock();
+}
+
+static void runTasks(uint32_t times)
+{
+  for (uint32_t i = 0; i < times; i++) {
+    scheduler.run();
+    halNativeAdvance(1);
+  }
+}
+
+// Sensor to payload, what the always-on device does between two publishes
+struct SteadyState {
+  TankConfig config;
+  TankContext tank;
+  Reporter reporter;
+  uint32_t clockS;
+};
+
+static void steadyTask(void *ctx)
+{
+  SteadyState &state = *(SteadyState *)ctx;
+  TankContext &tank = state.tank;
+  tank.filter.push(3500 + state.clockS % 7);
+  tankUpdate(state.config, tank.geometry, tank.filter.getEstimate(), TANK_NO_TEMPERATURE, tank.level, tank.alerts);
+  state.clockS += 60;
+  if (state.reporter.decide(state.clockS, tank.level.volumeMl, state.config.fullVolumeMl) != REPORT_SUPPRESSED) {
+    char buffer[480];
+    TelemetryWriter payload(buffer, sizeof(buffer), state.config.telemetryFormat);
+    payload.beginObject();
+    tankWriteTelemetry(payload, tank.level, tank.filter.getEstimate());
+    payload.endObject();
+    halPublish(nullptr, payload.data(), payload.length());
+  }
+}
+
+static void test_heap_fragmentation()
+{
+  TEST_ASSERT_EQUAL_UINT8(0, HeapMonitor::fragmentation(0, 0));
+  TEST_ASSERT_EQUAL_UINT8(0, HeapMonitor::fragmentation(1000, 1000));
+  TEST_ASSERT_EQUAL_UINT8(75, HeapMonitor::fragmentation(1000, 250));
+}
+
+static void test_heap_nested()
+{
+  // A hot task is only charged for itself, not for the section it calls
+  runTasks(10);
+  const HeapStats &flash = monitor.stats(telemetry.section);
+  TEST_ASSERT_EQUAL_UINT32(0, monitor.getViolations());
+  TEST_ASSERT_EQUAL_UINT32(10, monitor.stats(1).runs);
+  TEST_ASSERT_EQUAL_UINT32(0, monitor.stats(1).allocations);
+  TEST_ASSERT_EQUAL_UINT32(10, flash.runs);
+  TEST_ASSERT_EQUAL_UINT32(30, flash.allocations);
+  TEST_ASSERT_EQUAL_UINT32(20, monitor.stats(2).allocations);
+  TEST_ASSERT_EQUAL_UINT32(10, monitor.stats(2).allocatingRuns);
+}
+
+static void test_heap_low_water()
+{
+  // 10 kB eaten by the flash section, the lowest free heap seen where it happened
+  runTasks(10);
+  const HeapStats &flash = monitor.stats(telemetry.section);
+  TEST_ASSERT_EQUAL_UINT32(30000, monitor.minFree());
+  TEST_ASSERT_EQUAL_UINT32(5000, monitor.minLargest());
+  TEST_ASSERT_EQUAL_UINT32(30000, flash.minFree);
+  TEST_ASSERT_EQUAL_UINT32(5000, flash.minLargest);
+  TEST_ASSERT_EQUAL_UINT8(88, flash.maxFragmentation);
+  TEST_ASSERT_EQUAL_UINT32(31000, monitor.stats(0).minFree);
+}
+
+static void test_heap_hot()
+{
+  // One allocation in a hot task is flagged, none once it is not hot
+  sensor.own = 1;
+  runTasks(1);
+  TEST_ASSERT_EQUAL_UINT32(1, monitor.getViolations());
+  monitor.setHot(0, false);
+  runTasks(1);
+  TEST_ASSERT_EQUAL_UINT32(1, monitor.getViolations());
+  TEST_ASSERT_EQUAL_UINT32(1, monitor.stats(0).violations);
+  TEST_ASSERT_EQUAL_UINT32(2, monitor.stats(0).allocatingRuns);
+}
+
+static void test_heap_steady_state()
+{
+  // The real thing: the steady state path does not allocate, nor does the monitoring
+  SteadyState *state = new SteadyState();
+  state->config = fixtureConfig();
+  tankGeometryBuild(state->config, state->tank.geometry);
+  state->reporter.configure(state->config.report);
+  HeapMonitor host;
+  host.begin(sampleHostHeap);
+  host.add("level", true);
+  Scheduler steady;
+  steady.begin(halMillis, halMicros);
+  steady.add("level", steadyTask, state, 1);
+  steady.setHook(heapHook, &host);
+  uint32_t publishes = halNativeNetwork().publishes;
+  uint32_t before = allocCount();
+  for (uint32_t i = 0; i < 2000; i++) {
+    steady.run();
+    halNativeAdvance(1);
+  }
+  uint32_t allocated = allocCount() - before;
+  delete state;
+  TEST_ASSERT_EQUAL_UINT32(0, allocated);
+  TEST_ASSERT_EQUAL_UINT32(0, host.getViolations());
+  TEST_ASSERT_EQUAL_UINT32(2000, host.stats(0).runs);
+  TEST_ASSERT_GREATER_THAN_UINT32(publishes, halNativeNetwork().publishes);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_heap_fragmentation);
+  RUN_TEST(test_heap_nested);
+  RUN_TEST(test_heap_low_water);
+  RUN_TEST(test_heap_hot);
+  RUN_TEST(test_heap_steady_state);
+  return UNITY_END();
+}
@@ -0,0 +1,249 @@
+#include <unity.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "../../src/native/alloc_count.h"
+#include "../../src/native/fixtures.h"
+#include "../../src/native/mem_storage.h"
+#include "../../src/api.h"
+
+#define EPOCH  1700000000u
+
+struct ChunkCapture {
+  std::string body;
+  size_t chunks;
+  size_t largest;
+};
+
+static MemStorage storage;
+static History history;
+static ChunkCapture capture;
+static std::vector<TelemetryRecord> written;
+static char buffer[128];   //!< smaller than API_CHUNK_SIZE, so a response takes many chunks
+
+void setUp()
+{
+  storage = MemStorage();
+  history = History();
+  history.begin(&storage);
+  capture = ChunkCapture { std::string(), 0, 0 };
+  written.clear();
+}
+
+void tearDown()
+{
+}
+
+static void captureChunk(void *ctx, const char *data, size_t len)
+{
+  capture.body.append(data, len);
+  capture.chunks++;
+  capture.largest = len > capture.largest ? len : capture.largest;
+}
+
+static bool collectRecord(void *ctx, const TelemetryRecord &record)
+{
+  ((std::vector<TelemetryRecord> *)ctx)->push_back(record);
+  return true;
+}
+
+// Ten weeks, more than the ring holds, returns the newest timestamp
+static uint32_t fillTenWeeks()
+{
+  historyFill(history, EPOCH, 70 * 1440);
+  return EPOCH + (70 * 1440 - 1) * 60;
+}
+
+// Every field of every record read back as written
+static void assertReadBack(History &from)
+{
+  std::vector<TelemetryRecord> read;
+  from.query(0, UINT32_MAX, collectRecord, &read);
+  TEST_ASSERT_EQUAL_UINT32(written.size(), read.size());
+  for (size_t i = 0; i < read.size(); i++) {
+    TEST_ASSERT_EQUAL_UINT32(written[i].timestamp, read[i].timestamp);
+    TEST_ASSERT_EQUAL_INT32(written[i].volume, read[i].volume);
+    TEST_ASSERT_EQUAL_INT16(written[i].percent, read[i].percent);
+    TEST_ASSERT_EQUAL_UINT16(written[i].flags, read[i].flags);
+  }
+}
+
+static void test_history_ring()
+{
+  // The oldest segments are gone, more than four weeks are left
+  uint32_t newest = fillTenWeeks();
+  TEST_ASSERT_GREATER_THAN_UINT32(HISTORY_BYTES - HISTORY_SEGMENT_SIZE, history.bytes());
+  TEST_ASSERT_LESS_OR_EQUAL_UINT32(HISTORY_BYTES, history.bytes());
+  TEST_ASSERT_EQUAL_UINT32(newest, history.newest());
+  TEST_ASSERT_GREATER_THAN_UINT32(EPOCH, history.oldest());
+  TEST_ASSERT_GREATER_THAN_UINT32(4 * 7 * 86400, newest - history.oldest());
+
+  // Only forward in time
+  TelemetryRecord back = { newest - 60, 0, 0, 0 };
+  TEST_ASSERT_FALSE(history.append(back));
+  TEST_ASSERT_EQUAL_UINT32(newest, history.newest());
+}
+
+static void test_history_lossless()
+{
+  // Every field back as it went in, across blocks, segments and a reboot:
+  // repeated seconds, gaps of a day, jumps of a million liters, every tank
+  uint32_t seed = 7;
+  uint32_t timestamp = EPOCH;
+  int32_t volumes[HISTORY_TANKS] = { 1500, -3, 0, 100000 };
+  for (uint32_t i = 0; i < 5000; i++) {
+    if (i == 3000) {
+      history.begin(&storage);
+    }
+    seed = seed * 1103515245 + 12345;
+    uint32_t r = seed >> 8;
+    timestamp += r % 4 == 0 ? 0 : r % 7 == 0 ? r % 100000 : 60 + r % 3;
+    uint8_t tank = (r >> 4) % HISTORY_TANKS;
+    volumes[tank] += r % 11 == 0 ? (int32_t)(r % 2000000) - 1000000 : (int32_t)(r % 5) - 2;
+    TelemetryRecord record = { timestamp, volumes[tank], (int16_t)((int32_t)(r % 40000) - 20000), tank };
+    TEST_ASSERT_TRUE(history.append(record));
+    written.push_back(record);
+  }
+  assertReadBack(history);
+}
+
+static void test_history_torn()
+{
+  // A power cut in the middle of the last record: lost, the next one goes to a new segment
+  for (uint32_t i = 0; i < 100; i++) {
+    TelemetryRecord record = { EPOCH + i * 60, (int32_t)(1000 + i), 50, 0 };
+    history.append(record);
+    written.push_back(record);
+  }
+  TelemetryRecord cut = { EPOCH + 100 * 60, 2000000, 0, 0 };
+  history.append(cut);
+  size_t segments = storage.files.size();
+  storage.files["/h" + std::string(1, "0123456789abcdef"[segments - 1])].pop_back();
+
+  History torn;
+  torn.begin(&storage);
+  TelemetryRecord after = { EPOCH + 101 * 60, 1, 2, 3 };
+  TEST_ASSERT_TRUE(torn.append(after));
+  written.push_back(after);
+  TEST_ASSERT_EQUAL_UINT32(segments + 1, storage.files.size());
+  assertReadBack(torn);
+}
+
+static void test_history_range()
+{
+  // Restored at boot, the last hour in chunks no larger than the buffer
+  uint32_t newest = fillTenWeeks();
+  History restored;
+  restored.begin(&storage);
+  TEST_ASSERT_EQUAL_UINT32(history.bytes(), restored.bytes());
+  TEST_ASSERT_EQUAL_UINT32(newest, restored.newest());
+  uint32_t sent = apiHistory(restored, newest - 3600, newest, API_HISTORY_MAX_SAMPLES, buffer, sizeof(buffer),
+                             captureChunk, nullptr);
+  TEST_ASSERT_EQUAL_UINT32(61, sent);
+  TEST_ASSERT_LESS_OR_EQUAL_UINT32(sizeof(buffer), capture.largest);
+  TEST_ASSERT_GREATER_THAN_UINT32(10, capture.chunks);
+  char range[64];
+  snprintf(range, sizeof(range), "{\"from\":%u,\"to\":%u,", newest - 3600, newest);
+  TEST_ASSERT_EQUAL_STRING_LEN(range, capture.body.c_str(), strlen(range));
+  TEST_ASSERT_TRUE(capture.body.find("],\"count\":61}") != std::string::npos);
+}
+
+static void test_history_flat()
+{
+  // A binary search of the block headers and the blocks of the range: an
+  // hour of a full ring costs about the same reads as an hour of two hours
+  uint32_t newest = fillTenWeeks();
+  size_t reads = storage.reads;
+  apiHistory(history, newest - 3600, newest, API_HISTORY_MAX_SAMPLES, buffer, sizeof(buffer), captureChunk, nullptr);
+  uint32_t hourReads = storage.reads - reads;
+
+  MemStorage small;
+  History recent;
+  recent.begin(&small);
+  historyFill(recent, newest - 7200, 121);
+  reads = small.reads;
+  apiHistory(recent, newest - 3600, newest, API_HISTORY_MAX_SAMPLES, buffer, sizeof(buffer), captureChunk, nullptr);
+  TEST_ASSERT_LESS_OR_EQUAL_UINT32(small.reads - reads + 5, hourReads);
+  TEST_ASSERT_LESS_THAN_UINT32(12, hourReads);
+}
+
+static void test_history_weeks()
+{
+  // Three weeks of recorded levels in the 64 kB
+  uint32_t samples = historyReplay(history, EPOCH, 21, 1, false);
+  uint32_t visited = 0;
+  history.query(0, UINT32_MAX, countRecord, &visited);
+  TEST_ASSERT_EQUAL_UINT32(21 * 1440, samples);
+  TEST_ASSERT_EQUAL_UINT32(EPOCH, history.oldest());
+  TEST_ASSERT_EQUAL_UINT32(samples, visited);
+}
+
+static void test_history_page()
+{
+  // Pages never split a second, next picks up where the limit stopped
+  for (uint16_t i = 0; i < 10; i++) {
+    for (uint16_t tank = 0; tank < 2; tank++) {
+      TelemetryRecord record = { EPOCH + i * 60, 1000 + tank, 50, tank };
+      history.append(record);
+    }
+  }
+  TEST_ASSERT_EQUAL_UINT32(6, apiHistory(history, 0, UINT32_MAX, 5, buffer, sizeof(buffer), captureChunk, nullptr));
+  TEST_ASSERT_TRUE(capture.body.find(",\"count\":6,\"next\":1700000180}") != std::string::npos);
+
+  capture.body.clear();
+  TEST_ASSERT_EQUAL_UINT32(14, apiHistory(history, EPOCH + 180, UINT32_MAX, API_HISTORY_MAX_SAMPLES, buffer,
+                                          sizeof(buffer), captureChunk, nullptr));
+  TEST_ASSERT_TRUE(capture.body.find(",\"count\":14}") != std::string::npos);
+}
+
+static void test_history_no_heap()
+{
+  // Serving the whole ring and appending to it allocate nothing
+  uint32_t newest = fillTenWeeks();
+  size_t discarded = 0;
+  uint32_t before = allocCount();
+  apiHistory(history, EPOCH, newest, API_HISTORY_MAX_SAMPLES, buffer, sizeof(buffer), discardChunk, &discarded);
+  TelemetryRecord next = { newest + 60, 1100, 70, 0 };
+  TEST_ASSERT_TRUE(history.append(next));
+  TEST_ASSERT_EQUAL_UINT32(before, allocCount());
+}
+
+static void test_api_level()
+{
+  // The first tank measured 30 s ago, the second not yet
+  TankContext contexts[2] = {};
+  TankConfig configs[2];
+  configs[0] = configs[1] = fixtureConfig();
+  tankGeometryBuild(configs[0], contexts[0].geometry);
+  contexts[0].filter.push(3500);
+  tankUpdate(configs[0], contexts[0].geometry, contexts[0].filter.getEstimate(), TANK_NO_TEMPERATURE,
+             contexts[0].level, contexts[0].alerts);
+  contexts[0].levelMs = 1000;
+  char body[API_CHUNK_SIZE];
+  size_t length = apiLevel(body, sizeof(body), configs, contexts, 2, 31000, EPOCH);
+  TEST_ASSERT_EQUAL_UINT32(strlen(body), length);
+  TEST_ASSERT_NOT_NULL(strstr(body, "{\"time\":1700000000,\"tanks\":[{\"measured\":true,\"volume_in_liters\":756,"));
+  TEST_ASSERT_NOT_NULL(strstr(body, "\"age_s\":30}"));
+  TEST_ASSERT_NOT_NULL(strstr(body, "{\"measured\":false}]}"));
+
+  // Too small a buffer gives nothing rather than a cut document
+  TEST_ASSERT_EQUAL_UINT32(0, apiLevel(body, 32, configs, contexts, 2, 31000, EPOCH));
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_history_ring);
+  RUN_TEST(test_history_lossless);
+  RUN_TEST(test_history_torn);
+  RUN_TEST(test_history_range);
+  RUN_TEST(test_history_flat);
+  RUN_TEST(test_history_weeks);
+  RUN_TEST(test_history_page);
+  RUN_TEST(test_history_no_heap);
+  RUN_TEST(test_api_level);
+  return UNITY_END();
+}
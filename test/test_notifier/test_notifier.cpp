@@ -0,0 +1,156 @@
+#include <unity.h>
+
+#include <stdio.h>
+
+#include "../../src/native/notify_sink.h"
+#include "../../src/notifier.h"
+
+static NotifySinkFake fake;
+static Notifier notifier;
+static NotifierConfig config;
+
+void setUp()
+{
+  fake = NotifySinkFake();
+  notifier = Notifier();
+  config = Notifier::defaults();
+  notifier.begin(fake.sink(), 0);
+}
+
+void tearDown()
+{
+}
+
+// Runs the notification task every 500 ms until the queue is empty or until limitMs
+static uint32_t drainNotifier(uint32_t nowMs, uint32_t limitMs)
+{
+  while (!notifier.empty() && nowMs < limitMs) {
+    notifier.tick(nowMs);
+    nowMs += 500;
+  }
+  return nowMs;
+}
+
+static void test_notifier_burst()
+{
+  // A burst goes out on one connection, the rest waits for a token
+  notifier.enqueue("a", 0);
+  notifier.enqueue("b", 0);
+  notifier.enqueue("c", 0);
+  notifier.enqueue("d", 0);
+  for (uint8_t i = 0; i < 4; i++) {
+    notifier.tick(0);
+  }
+  TEST_ASSERT_EQUAL_UINT32(config.burst, fake.delivered.size());
+  TEST_ASSERT_EQUAL_UINT32(1, fake.connections);
+  TEST_ASSERT_EQUAL_UINT8(1, notifier.size());
+
+  uint32_t now = drainNotifier(500, 60000);
+  TEST_ASSERT_EQUAL_UINT32(4, fake.delivered.size());
+  TEST_ASSERT_EQUAL_STRING("d", fake.delivered[3].c_str());
+  TEST_ASSERT_GREATER_THAN_UINT32(config.refillMs, now);
+}
+
+static void test_notifier_duplicates()
+{
+  // The same alert raised on every sample goes out once an hour
+  TEST_ASSERT_TRUE(notifier.enqueue("empty", 0));
+  TEST_ASSERT_FALSE(notifier.enqueue("empty", 0));
+  TEST_ASSERT_EQUAL_UINT32(1, notifier.getDuplicates());
+  notifier.tick(0);
+  TEST_ASSERT_FALSE(notifier.enqueue("empty", config.dedupWindowMs - 1));
+  TEST_ASSERT_TRUE(notifier.enqueue("empty", config.dedupWindowMs));
+  TEST_ASSERT_EQUAL_UINT32(2, notifier.getDuplicates());
+}
+
+static void test_notifier_retry()
+{
+  // Failed sends are retried later with a backoff, each on a new connection, not lost
+  fake.failNext = 2;
+  notifier.enqueue("retried", 0);
+  notifier.tick(0);
+  notifier.tick(500);
+  TEST_ASSERT_EQUAL_UINT32(1, fake.attempts);
+  notifier.tick(config.retryMinMs + config.retryMinMs / 2);
+  TEST_ASSERT_EQUAL_UINT32(2, fake.attempts);
+
+  drainNotifier(config.retryMinMs * 2, 600000);
+  TEST_ASSERT_EQUAL_UINT32(1, fake.delivered.size());
+  TEST_ASSERT_EQUAL_STRING("retried", fake.delivered[0].c_str());
+  TEST_ASSERT_EQUAL_UINT32(3, fake.attempts);
+  TEST_ASSERT_EQUAL_UINT32(3, fake.connections);
+  TEST_ASSERT_EQUAL_UINT32(2, notifier.getFailures());
+  TEST_ASSERT_EQUAL_UINT32(1, notifier.getSent());
+}
+
+static void test_notifier_idle_close()
+{
+  // The connection is kept for a following alert, closed once idle
+  notifier.enqueue("a", 0);
+  notifier.tick(0);
+  notifier.tick(config.idleCloseMs / 2);
+  notifier.enqueue("b", config.idleCloseMs / 2);
+  notifier.tick(config.idleCloseMs / 2);
+  TEST_ASSERT_EQUAL_UINT32(1, fake.connections);
+  notifier.tick(config.idleCloseMs * 2);
+  notifier.enqueue("c", config.idleCloseMs * 2);
+  notifier.tick(config.idleCloseMs * 2);
+  TEST_ASSERT_EQUAL_UINT32(3, fake.delivered.size());
+  TEST_ASSERT_EQUAL_UINT32(2, fake.connections);
+}
+
+static void test_notifier_bounded()
+{
+  // A dead sink drops messages instead of growing, then gives up on the rest
+  fake.failNext = 1000;
+  char text[16];
+  for (uint8_t i = 0; i <= NOTIFY_QUEUE_SIZE; i++) {
+    snprintf(text, sizeof(text), "full %u", i);
+    notifier.enqueue(text, 0);
+  }
+  TEST_ASSERT_EQUAL_UINT8(NOTIFY_QUEUE_SIZE, notifier.size());
+  TEST_ASSERT_EQUAL_UINT32(1, notifier.getDropped());
+
+  drainNotifier(0, 24 * 3600000u);
+  TEST_ASSERT_TRUE(notifier.empty());
+  TEST_ASSERT_EQUAL_UINT32(NOTIFY_QUEUE_SIZE + 1, notifier.getDropped());
+  TEST_ASSERT_EQUAL_UINT32(NOTIFY_QUEUE_SIZE * config.maxAttempts, fake.attempts);
+}
+
+static void test_notifier_not_ready()
+{
+  // An alert raised before WiFi or the chat id waits for them, however long that takes
+  fake.ready = false;
+  notifier.enqueue("empty", 0);
+  uint32_t now = drainNotifier(0, 6 * 3600000u);
+  TEST_ASSERT_EQUAL_UINT8(1, notifier.size());
+  TEST_ASSERT_EQUAL_UINT32(0, fake.attempts);
+  TEST_ASSERT_EQUAL_UINT32(0, notifier.getFailures());
+  TEST_ASSERT_EQUAL_UINT32(0, notifier.getDropped());
+  // Not counted as traffic either: no token spent, nothing to close
+  TEST_ASSERT_FALSE(notifier.tick(now));
+
+  // Once ready it goes out within the wait, as a first attempt with the full burst available
+  fake.ready = true;
+  now = drainNotifier(now, now + config.retryMinMs + 1000);
+  TEST_ASSERT_TRUE(notifier.empty());
+  TEST_ASSERT_EQUAL_UINT32(1, fake.attempts);
+  TEST_ASSERT_EQUAL_UINT32(1, notifier.getSent());
+  notifier.enqueue("x", now);
+  notifier.enqueue("y", now);
+  notifier.tick(now);
+  notifier.tick(now);
+  TEST_ASSERT_EQUAL_UINT32(3, fake.delivered.size());
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_notifier_burst);
+  RUN_TEST(test_notifier_duplicates);
+  RUN_TEST(test_notifier_retry);
+  RUN_TEST(test_notifier_idle_close);
+  RUN_TEST(test_notifier_bounded);
+  RUN_TEST(test_notifier_not_ready);
+  return UNITY_END();
+}
@@ -0,0 +1,76 @@
+#include <unity.h>
+
+#include <string.h>
+
+#include "../../src/native/fixtures.h"
+#include "../../src/ota.h"
+
+// The running image and its successor, 256 kB each, built once in main()
+static OtaFixture ota;
+
+// Nothing flashed yet, a server that does not drop the connection
+void setUp()
+{
+  ota.server.flashed.clear();
+  ota.server.committed = false;
+  ota.server.dropEvery = 0;
+  ota.server.requests = 0;
+}
+
+void tearDown()
+{
+}
+
+static void test_ota_full()
+{
+  TEST_ASSERT_EQUAL_UINT8(OTA_OK, ota.run("/firmware.bin", ota.sha, false));
+  TEST_ASSERT_TRUE(ota.server.committed);
+  TEST_ASSERT_EQUAL_UINT32(ota.target.size(), ota.server.flashed.size());
+  TEST_ASSERT_EQUAL_MEMORY(ota.target.data(), ota.server.flashed.data(), ota.target.size());
+}
+
+static void test_ota_delta_resumed()
+{
+  // The delta is 5 kB, cut it in the middle of operations and data
+  ota.server.dropEvery = 1000;
+  TEST_ASSERT_EQUAL_UINT8(OTA_OK, ota.run("/firmware.delta", ota.sha, true));
+  TEST_ASSERT_TRUE(ota.server.committed);
+  TEST_ASSERT_GREATER_THAN_UINT32(1, ota.server.requests);
+  TEST_ASSERT_EQUAL_UINT32(ota.target.size(), ota.server.flashed.size());
+  TEST_ASSERT_EQUAL_MEMORY(ota.target.data(), ota.server.flashed.data(), ota.target.size());
+}
+
+static void test_ota_hash_mismatch()
+{
+  uint8_t wrong[SHA256_SIZE];
+  memcpy(wrong, ota.sha, sizeof(wrong));
+  wrong[0] ^= 1;
+  TEST_ASSERT_EQUAL_UINT8(OTA_ERROR_HASH, ota.run("/firmware.bin", wrong, false));
+  TEST_ASSERT_FALSE(ota.server.committed);
+}
+
+static void test_ota_delta_mismatch()
+{
+  // A full image where a delta is expected is not applied to the running one
+  TEST_ASSERT_EQUAL_UINT8(OTA_ERROR_PATCH, ota.run("/firmware.bin", ota.sha, true));
+  TEST_ASSERT_FALSE(ota.server.committed);
+}
+
+static void test_ota_missing_file()
+{
+  TEST_ASSERT_EQUAL_UINT8(OTA_ERROR_CONNECT, ota.run("/missing.bin", ota.sha, false));
+  TEST_ASSERT_FALSE(ota.server.committed);
+  TEST_ASSERT_TRUE(ota.server.flashed.empty());
+}
+
+int main(int argc, char **argv)
+{
+  ota.build();
+  UNITY_BEGIN();
+  RUN_TEST(test_ota_full);
+  RUN_TEST(test_ota_delta_resumed);
+  RUN_TEST(test_ota_hash_mismatch);
+  RUN_TEST(test_ota_delta_mismatch);
+  RUN_TEST(test_ota_missing_file);
+  return UNITY_END();
+}
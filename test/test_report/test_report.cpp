@@ -0,0 +1,106 @@
+#include <unity.h>
+
+#include "../../src/native/fixtures.h"
+#include "../../src/report.h"
+
+#define EPOCH 1700000000
+
+static Reporter reporter;
+
+void setUp()
+{
+  reporter = Reporter();
+}
+
+void tearDown()
+{
+}
+
+static void test_report_steady()
+{
+  // A day of levels every minute, 18 l burnt out of 1500 l: never 1 % between
+  // two hourly heartbeats, 24 publishes instead of 1440
+  uint32_t publishes = 0, changes = 0;
+  for (uint32_t i = 0; i < 1440; i++) {
+    ReportReason reason = reporter.decide(EPOCH + i * 60, 1200000 - i * 12500 / 1000 + (i * 7919 % 3) * 1000, 1500000);
+    publishes += reason != REPORT_SUPPRESSED;
+    changes += reason == REPORT_CHANGE;
+  }
+  TEST_ASSERT_EQUAL_UINT32(24, publishes);
+  TEST_ASSERT_EQUAL_UINT32(0, changes);
+  TEST_ASSERT_EQUAL_UINT32(1440 - publishes, reporter.getSuppressed());
+}
+
+static void test_report_min_interval()
+{
+  // A refill: published on change, but at most every 5 minutes
+  uint32_t publishes = 0;
+  for (uint32_t i = 0; i <= 20; i++) {
+    publishes += reporter.decide(EPOCH + i * 60, 300000 + i * 50000, 1500000) != REPORT_SUPPRESSED;
+  }
+  TEST_ASSERT_EQUAL_UINT32(5, publishes);
+  TEST_ASSERT_EQUAL_UINT16(0, reporter.getState().suppressed);
+  TEST_ASSERT_EQUAL_UINT16(4, reporter.getSkipped());
+}
+
+static void test_report_deadband_liters()
+{
+  ReportConfig config = Reporter::defaults();
+  config.deadbandPercent = 0;
+  config.deadbandMl = 5000;
+  config.minIntervalS = 0;
+  reporter.configure(config);
+  TEST_ASSERT_EQUAL_UINT8(REPORT_FIRST, reporter.decide(EPOCH, 1000000, 1500000));
+  TEST_ASSERT_EQUAL_UINT8(REPORT_SUPPRESSED, reporter.decide(EPOCH + 60, 996000, 1500000));
+  TEST_ASSERT_EQUAL_UINT8(REPORT_CHANGE, reporter.decide(EPOCH + 120, 995000, 1500000));
+  TEST_ASSERT_EQUAL_UINT8(REPORT_HEARTBEAT, reporter.decide(EPOCH + 3720, 995000, 1500000));
+  // The clock went back, as after a lost RTC: start over
+  TEST_ASSERT_EQUAL_UINT8(REPORT_FIRST, reporter.decide(EPOCH + 60, 995000, 1500000));
+}
+
+static void test_report_tanks()
+{
+  // Any tank past the deadband publishes them all
+  uint32_t volumes[2] = { 1000000, 2000000 };
+  uint32_t full[2] = { 1500000, 3000000 };
+  TEST_ASSERT_EQUAL_UINT8(REPORT_FIRST, reporter.decide(EPOCH, volumes, full, 2));
+  volumes[1] -= 20000;
+  TEST_ASSERT_EQUAL_UINT8(REPORT_SUPPRESSED, reporter.decide(EPOCH + 600, volumes, full, 2));
+  volumes[1] -= 20000;
+  TEST_ASSERT_EQUAL_UINT8(REPORT_CHANGE, reporter.decide(EPOCH + 1200, volumes, full, 2));
+
+  // Woken from deep sleep with the RTC copy, the last published levels are known
+  Reporter woken;
+  woken.getState() = reporter.getState();
+  volumes[1] -= 20000;
+  TEST_ASSERT_EQUAL_UINT8(REPORT_SUPPRESSED, woken.decide(EPOCH + 1800, volumes, full, 2));
+}
+
+static void test_report_config()
+{
+  TankConfig tank;
+  tankConfigDefaults(tank);
+  TEST_ASSERT_TRUE(parseConfig("{" CONFIG_DIMENSIONS ",\"report_deadband_liters\":10,\"report_deadband_percent\":0,"
+                               "\"report_min_interval_s\":600,\"report_heartbeat_s\":21600}", tank));
+  TEST_ASSERT_EQUAL_UINT32(10000, tank.report.deadbandMl);
+  TEST_ASSERT_EQUAL_UINT32(0, tank.report.deadbandPercent);
+  TEST_ASSERT_EQUAL_UINT32(600, tank.report.minIntervalS);
+  TEST_ASSERT_EQUAL_UINT32(21600, tank.report.heartbeatS);
+
+  // A heartbeat shorter than the minimum interval could never be honoured
+  TEST_ASSERT_FALSE(parseConfig("{" CONFIG_DIMENSIONS ",\"report_min_interval_s\":600,\"report_heartbeat_s\":300}",
+                                tank));
+  TEST_ASSERT_EQUAL_UINT32(21600, tank.report.heartbeatS);
+  TEST_ASSERT_EQUAL_UINT32(Reporter::defaults().heartbeatS, fixtureConfig().report.heartbeatS);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_report_steady);
+  RUN_TEST(test_report_min_interval);
+  RUN_TEST(test_report_deadband_liters);
+  RUN_TEST(test_report_tanks);
+  RUN_TEST(test_report_config);
+  return UNITY_END();
+}
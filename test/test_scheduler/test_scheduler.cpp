@@ -0,0 +1,178 @@
+#include <unity.h>
+
+#include <vector>
+
+#include "../../src/native/hal_native.h"
+#include "../../src/scheduler.h"
+
+static Scheduler scheduler;
+static std::vector<uint8_t> order;
+
+void setUp()
+{
+  halNativeSetClock(0);
+  order.clear();
+  scheduler = Scheduler();
+  scheduler.begin(halMillis, halMicros);
+}
+
+// A failed test must not leave the clock frozen for the next one
+void tearDown()
+{
+  halNativeReleaseClock();
+}
+
+// A task that records when it ran and in which order, and keeps the clock busyMs
+struct TimedTask {
+  uint8_t id;
+  uint32_t busyMs;
+  std::vector<uint32_t> runs;
+
+  TimedTask(uint8_t id, uint32_t busyMs) : id(id), busyMs(busyMs) {}
+};
+
+static void timedTask(void *ctx)
+{
+  TimedTask &task = *(TimedTask *)ctx;
+  task.runs.push_back(halMillis());
+  order.push_back(task.id);
+  halNativeAdvance(task.busyMs);
+}
+
+// loop(): run() then sleep what it returned, at most a millisecond, until untilMs
+static void loopUntil(uint32_t untilMs)
+{
+  while ((int32_t)(halMillis() - untilMs) < 0) {
+    uint32_t sleep = scheduler.run();
+    halNativeAdvance(sleep < 1 ? sleep : 1);
+  }
+}
+
+static void reperiodTask(void *)
+{
+  scheduler.setPeriod(0, 10);
+}
+
+static void test_scheduler_order()
+{
+  // Due together, they run in the order they were added, a slow one delays the others
+  TimedTask slow(0, 3);
+  TimedTask fast(1, 0);
+  TimedTask rare(2, 0);
+  scheduler.add("slow", timedTask, &slow, 10);
+  scheduler.add("fast", timedTask, &fast, 5);
+  scheduler.add("rare", timedTask, &rare, 20);
+  scheduler.run();
+  const uint8_t expected[] = { 0, 1, 2 };
+  TEST_ASSERT_EQUAL_UINT32(3, order.size());
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, order.data(), 3);
+  TEST_ASSERT_EQUAL_UINT32(3, fast.runs[0]);
+  TEST_ASSERT_EQUAL_UINT32(3, rare.runs[0]);
+}
+
+static void test_scheduler_grid()
+{
+  // Late behind the slow one, but still on its own 5 ms grid
+  TimedTask slow(0, 3);
+  TimedTask fast(1, 0);
+  TimedTask rare(2, 0);
+  scheduler.add("slow", timedTask, &slow, 10);
+  scheduler.add("fast", timedTask, &fast, 5);
+  scheduler.add("rare", timedTask, &rare, 20);
+  loopUntil(40);
+  TEST_ASSERT_EQUAL_UINT32(8, fast.runs.size());
+  for (size_t i = 0; i < fast.runs.size(); i++) {
+    TEST_ASSERT_UINT32_WITHIN(3, i * 5, fast.runs[i]);
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32(i * 5, fast.runs[i]);
+  }
+  TEST_ASSERT_EQUAL_UINT32(4, slow.runs.size());
+  TEST_ASSERT_EQUAL_UINT32(30, slow.runs[3]);
+  TEST_ASSERT_EQUAL_UINT32(2, rare.runs.size());
+  TEST_ASSERT_EQUAL_UINT32(3, scheduler.task(1).stats.maxJitterMs);
+  TEST_ASSERT_EQUAL_UINT32(0, scheduler.task(1).stats.overruns);
+}
+
+static void test_scheduler_late()
+{
+  // 4 ms late: the next run is back on the grid, the delay does not add up
+  TimedTask task(0, 0);
+  scheduler.add("task", timedTask, &task, 10);
+  scheduler.run();
+  halNativeSetClock(14);
+  scheduler.run();
+  TEST_ASSERT_EQUAL_UINT32(6, scheduler.run());
+  TEST_ASSERT_EQUAL_UINT32(2, task.runs.size());
+  TEST_ASSERT_EQUAL_UINT32(14, task.runs[1]);
+  TEST_ASSERT_EQUAL_UINT32(4, scheduler.task(0).stats.lastJitterMs);
+  TEST_ASSERT_EQUAL_UINT32(0, scheduler.task(0).stats.overruns);
+}
+
+static void test_scheduler_catch_up()
+{
+  // Stalled for 3.5 periods: one run, not a burst of the missed ones, then a fresh grid
+  TimedTask task(0, 0);
+  scheduler.add("task", timedTask, &task, 10);
+  scheduler.run();
+  halNativeSetClock(20);
+  scheduler.run();
+  halNativeSetClock(55);
+  scheduler.run();
+  TEST_ASSERT_EQUAL_UINT32(10, scheduler.run());
+  TEST_ASSERT_EQUAL_UINT32(3, task.runs.size());
+  TEST_ASSERT_EQUAL_UINT32(55, task.runs[2]);
+  loopUntil(86);
+  const uint32_t expected[] = { 0, 20, 55, 65, 75, 85 };
+  TEST_ASSERT_EQUAL_UINT32(6, task.runs.size());
+  TEST_ASSERT_EQUAL_UINT32_ARRAY(expected, task.runs.data(), 6);
+  TEST_ASSERT_EQUAL_UINT32(1, scheduler.task(0).stats.overruns);
+  TEST_ASSERT_EQUAL_UINT32(25, scheduler.task(0).stats.maxJitterMs);
+}
+
+static void test_scheduler_millis_wrap()
+{
+  // millis() wraps after 49.7 days, 50 ms after the first run here
+  halNativeSetClock(UINT32_MAX - 49);
+  TimedTask every20(0, 0);
+  TimedTask every7(1, 1);
+  scheduler.add("every20", timedTask, &every20, 20);
+  scheduler.add("every7", timedTask, &every7, 7);
+  uint32_t start = halMillis();
+  uint32_t maxSleep = 0;
+  while (halMillis() - start < 200) {
+    uint32_t sleep = scheduler.run();
+    maxSleep = sleep > maxSleep ? sleep : maxSleep;
+    halNativeAdvance(sleep < 1 ? sleep : 1);
+  }
+  TEST_ASSERT_LESS_THAN_UINT32(start, halMillis());
+  TEST_ASSERT_EQUAL_UINT32(10, every20.runs.size());
+  for (size_t i = 1; i < every20.runs.size(); i++) {
+    TEST_ASSERT_EQUAL_UINT32(20, every20.runs[i] - every20.runs[i - 1]);
+  }
+  TEST_ASSERT_EQUAL_UINT32(29, every7.runs.size());
+  TEST_ASSERT_LESS_OR_EQUAL_UINT32(1, scheduler.task(0).stats.maxJitterMs);
+  TEST_ASSERT_LESS_OR_EQUAL_UINT32(1, scheduler.task(1).stats.maxJitterMs);
+  TEST_ASSERT_LESS_OR_EQUAL_UINT32(20, maxSleep);
+}
+
+static void test_scheduler_own_period()
+{
+  // A task that changes its own period is next run one new period later
+  scheduler.add("a", reperiodTask, nullptr, 2);
+  for (uint32_t i = 0; i < 100; i++) {
+    scheduler.run();
+    halNativeAdvance(1);
+  }
+  TEST_ASSERT_EQUAL_UINT32(10, scheduler.task(0).stats.runs);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_scheduler_order);
+  RUN_TEST(test_scheduler_grid);
+  RUN_TEST(test_scheduler_late);
+  RUN_TEST(test_scheduler_catch_up);
+  RUN_TEST(test_scheduler_millis_wrap);
+  RUN_TEST(test_scheduler_own_period);
+  return UNITY_END();
+}
@@ -0,0 +1,170 @@
+#include <unity.h>
+
+#include "../../src/native/hal_native.h"
+#include "../../src/sonar.h"
+
+#define TEST_TRIG_PIN   16
+#define TEST_ECHO_US    5830   //!< 1 m at 20 degrees, there and back
+
+static Sonar sonar;
+static SonarSample sample;
+static uint32_t triggers;
+
+// The trigger of the firmware, a 10 us pulse on the fake pins
+static void triggerPulse(void *)
+{
+  triggers++;
+  halPinWrite(TEST_TRIG_PIN, true);
+  halDelayMicroseconds(10);
+  halPinWrite(TEST_TRIG_PIN, false);
+}
+
+void setUp()
+{
+  halNativeSetClock(1000);
+  triggers = 0;
+  sample = SonarSample();
+  sonar = Sonar();
+  sonar.begin(triggerPulse, nullptr);
+}
+
+// A failed test must not leave the clock frozen for the next one
+void tearDown()
+{
+  halNativeReleaseClock();
+}
+
+// An echo line edge afterUs after the previous event, as the CHANGE interrupt reports it
+static void echoEdge(bool high, uint32_t afterUs)
+{
+  halDelayMicroseconds(afterUs);
+  sonar.onEchoEdge(high, halMicros());
+}
+
+// Polls every 100 us like the sensor task would, until a sample or limitUs
+static bool pollFor(uint32_t limitUs)
+{
+  for (uint32_t waited = 0; waited <= limitUs; waited += 100) {
+    if (sonar.poll(halMicros(), sample)) {
+      return true;
+    }
+    halDelayMicroseconds(100);
+  }
+  return false;
+}
+
+static void test_sonar_start()
+{
+  // One trigger pulse, then busy until the measurement is over
+  TEST_ASSERT_TRUE(sonar.start(halMicros(), halMillis()));
+  TEST_ASSERT_EQUAL_UINT32(1, triggers);
+  TEST_ASSERT_FALSE(halNativePin(TEST_TRIG_PIN));
+  TEST_ASSERT_TRUE(sonar.busy());
+  TEST_ASSERT_FALSE(sonar.start(halMicros(), halMillis()));
+  TEST_ASSERT_EQUAL_UINT32(1, triggers);
+}
+
+static void test_sonar_echo()
+{
+  sonar.start(halMicros(), halMillis());
+  echoEdge(true, 450);
+  TEST_ASSERT_FALSE(sonar.poll(halMicros(), sample));
+  echoEdge(false, TEST_ECHO_US);
+  TEST_ASSERT_TRUE(sonar.poll(halMicros(), sample));
+  TEST_ASSERT_EQUAL_UINT8(SONAR_OK, sample.status);
+  TEST_ASSERT_EQUAL_UINT32(TEST_ECHO_US, sample.durationUs);
+  TEST_ASSERT_EQUAL_UINT32(1000, sample.timestampMs);
+  TEST_ASSERT_FALSE(sonar.busy());
+  // Each sample is returned once
+  TEST_ASSERT_FALSE(sonar.poll(halMicros(), sample));
+}
+
+static void test_sonar_no_echo()
+{
+  sonar.start(halMicros(), halMillis());
+  TEST_ASSERT_FALSE(pollFor(SONAR_DEFAULT_TIMEOUT_US - 200));
+  TEST_ASSERT_TRUE(sonar.busy());
+  TEST_ASSERT_TRUE(pollFor(400));
+  TEST_ASSERT_EQUAL_UINT8(SONAR_NO_ECHO, sample.status);
+  TEST_ASSERT_EQUAL_UINT32(0, sample.durationUs);
+  TEST_ASSERT_FALSE(sonar.busy());
+  TEST_ASSERT_TRUE(sonar.start(halMicros(), halMillis()));
+  TEST_ASSERT_EQUAL_UINT32(2, triggers);
+}
+
+static void test_sonar_no_fall()
+{
+  // The echo line went high and stayed so, a dead or unplugged sensor
+  sonar.begin(triggerPulse, nullptr, 10000);
+  sonar.start(halMicros(), halMillis());
+  echoEdge(true, 450);
+  TEST_ASSERT_FALSE(pollFor(9900));
+  TEST_ASSERT_TRUE(sonar.busy());
+  TEST_ASSERT_TRUE(pollFor(200));
+  TEST_ASSERT_EQUAL_UINT8(SONAR_OUT_OF_RANGE, sample.status);
+  TEST_ASSERT_EQUAL_UINT32(0, sample.durationUs);
+  TEST_ASSERT_FALSE(sonar.busy());
+
+  // The late edge is ignored, the next measurement is not fooled by it
+  echoEdge(false, 1000);
+  sonar.start(halMicros(), halMillis());
+  echoEdge(true, 450);
+  echoEdge(false, TEST_ECHO_US);
+  TEST_ASSERT_TRUE(sonar.poll(halMicros(), sample));
+  TEST_ASSERT_EQUAL_UINT8(SONAR_OK, sample.status);
+  TEST_ASSERT_EQUAL_UINT32(TEST_ECHO_US, sample.durationUs);
+}
+
+static void test_sonar_micros_wrap()
+{
+  // micros() wraps every 71 minutes, here between the trigger and the echo
+  halNativeSetClock(4294967);
+  uint32_t before = halMicros();
+  sonar.start(halMicros(), halMillis());
+  echoEdge(true, 450);
+  uint32_t rise = halMicros();
+  echoEdge(false, TEST_ECHO_US);
+  TEST_ASSERT_GREATER_THAN_UINT32(0xFFFFF000u, before);
+  TEST_ASSERT_LESS_THAN_UINT32(1000, rise);
+  TEST_ASSERT_TRUE(sonar.poll(halMicros(), sample));
+  TEST_ASSERT_EQUAL_UINT8(SONAR_OK, sample.status);
+  TEST_ASSERT_EQUAL_UINT32(TEST_ECHO_US, sample.durationUs);
+
+  // Nor does the timeout of a missing echo fire early or never
+  halNativeSetClock(4294967);
+  sonar.start(halMicros(), halMillis());
+  TEST_ASSERT_FALSE(pollFor(SONAR_DEFAULT_TIMEOUT_US - 200));
+  TEST_ASSERT_TRUE(pollFor(400));
+  TEST_ASSERT_EQUAL_UINT8(SONAR_NO_ECHO, sample.status);
+}
+
+static void test_sonar_out_of_range()
+{
+  // Nothing in range: the 38 ms pulse of the HC-SR04
+  sonar.start(halMicros(), halMillis());
+  echoEdge(true, 450);
+  echoEdge(false, 38000);
+  TEST_ASSERT_TRUE(sonar.poll(halMicros(), sample));
+  TEST_ASSERT_EQUAL_UINT8(SONAR_OUT_OF_RANGE, sample.status);
+  TEST_ASSERT_EQUAL_UINT32(0, sample.durationUs);
+
+  // An echo of exactly the timeout is still a level
+  sonar.start(halMicros(), halMillis());
+  echoEdge(true, 450);
+  echoEdge(false, SONAR_DEFAULT_TIMEOUT_US);
+  TEST_ASSERT_TRUE(sonar.poll(halMicros(), sample));
+  TEST_ASSERT_EQUAL_UINT8(SONAR_OK, sample.status);
+  TEST_ASSERT_EQUAL_UINT32(SONAR_DEFAULT_TIMEOUT_US, sample.durationUs);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_sonar_start);
+  RUN_TEST(test_sonar_echo);
+  RUN_TEST(test_sonar_no_echo);
+  RUN_TEST(test_sonar_no_fall);
+  RUN_TEST(test_sonar_micros_wrap);
+  RUN_TEST(test_sonar_out_of_range);
+  return UNITY_END();
+}
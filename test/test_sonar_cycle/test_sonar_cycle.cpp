@@ -0,0 +1,91 @@
+#include <unity.h>
+
+#include <string.h>
+
+#include "../../src/native/fixtures.h"
+#include "../../src/native/sonar_field.h"
+#include "../../src/sonar_cycle.h"
+
+static SonarFieldFake field;
+static SonarCycle cycle;
+static uint32_t counts[2][2];   //!< per sensor, failed and valid samples
+
+void setUp()
+{
+  field = SonarFieldFake();
+  cycle = SonarCycle();
+  memset(counts, 0, sizeof(counts));
+}
+
+void tearDown()
+{
+}
+
+static void countSample(void *ctx, uint8_t index, const SonarSample &sample)
+{
+  counts[index][sample.status == SONAR_OK]++;
+}
+
+static void test_sonar_cycle_shared()
+{
+  // Sensors of one group take turns: no crosstalk, and together about as fast as one
+  uint32_t crosstalk = 0;
+  double single = sonarThroughput(1, true, crosstalk);
+  double shared = sonarThroughput(4, true, crosstalk);
+  TEST_ASSERT_EQUAL_UINT32(0, crosstalk);
+  TEST_ASSERT_GREATER_THAN_UINT32(40, (uint32_t)shared);
+  TEST_ASSERT_GREATER_THAN_UINT32((uint32_t)(single * 0.9), (uint32_t)shared);
+}
+
+static void test_sonar_cycle_groups()
+{
+  // Sensors that cannot hear each other fire together
+  uint32_t crosstalk = 0;
+  double single = sonarThroughput(1, true, crosstalk);
+  double separate = sonarThroughput(4, false, crosstalk);
+  TEST_ASSERT_EQUAL_UINT32(0, crosstalk);
+  TEST_ASSERT_GREATER_THAN_UINT32((uint32_t)(single * 3.5), (uint32_t)separate);
+}
+
+static void test_sonar_cycle_timeout()
+{
+  // A dead sensor times out without holding the other one, each keeps its period
+  cycle.begin(countSample, nullptr);
+  cycle.add(&field.sensors[field.add(0, 0)].sonar, 0, 500);
+  cycle.add(&field.sensors[field.add(5800, 0)].sonar, 0, 500);
+  field.run(cycle, 10000000);
+  TEST_ASSERT_EQUAL_UINT32(0, field.crosstalk);
+  TEST_ASSERT_EQUAL_UINT32(20, counts[0][0]);
+  TEST_ASSERT_EQUAL_UINT32(0, counts[0][1]);
+  TEST_ASSERT_EQUAL_UINT32(0, counts[1][0]);
+  TEST_ASSERT_EQUAL_UINT32(20, counts[1][1]);
+  TEST_ASSERT_GREATER_THAN_UINT32(0, cycle.getDeferred());
+}
+
+static void test_sonar_cycle_fair()
+{
+  // Four sensors of one group, always due, fire as often as each other
+  cycle.begin(nullptr, nullptr);
+  for (uint8_t i = 0; i < 4; i++) {
+    cycle.add(&field.sensors[field.add(2000 + i * 4000, 0)].sonar, 0, 1);
+  }
+  field.run(cycle, 10000000);
+  uint32_t least = UINT32_MAX, most = 0;
+  for (uint8_t i = 0; i < 4; i++) {
+    least = field.sensors[i].triggers < least ? field.sensors[i].triggers : least;
+    most = field.sensors[i].triggers > most ? field.sensors[i].triggers : most;
+  }
+  TEST_ASSERT_EQUAL_UINT32(0, field.crosstalk);
+  TEST_ASSERT_GREATER_THAN_UINT32(0, least);
+  TEST_ASSERT_LESS_OR_EQUAL_UINT32(1, most - least);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_sonar_cycle_shared);
+  RUN_TEST(test_sonar_cycle_groups);
+  RUN_TEST(test_sonar_cycle_timeout);
+  RUN_TEST(test_sonar_cycle_fair);
+  return UNITY_END();
+}
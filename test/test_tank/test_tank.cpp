@@ -0,0 +1,329 @@
+#include <unity.h>
+
+#include <math.h>
+#include <string.h>
+
+#include "../../src/native/fixtures.h"
+#include "../../src/native/mem_storage.h"
+#include "../../src/consumption.h"
+#include "../../src/tank.h"
+#include "../../src/telemetry.h"
+
+// CONFIG_JSON, 1500 l in 120 x 180 x 70 cm, and its volume table
+static TankConfig config;
+static TankGeometry geometry;
+
+void setUp()
+{
+  config = fixtureConfig();
+  tankGeometryBuild(config, geometry);
+}
+
+void tearDown()
+{
+}
+
+// The level of an echo of echoUs, the first sample of a fresh tank
+static TankLevel levelOf(int32_t echoUs, TankAlerts &alerts, int16_t temperatureDeciC = TANK_NO_TEMPERATURE)
+{
+  FilterEstimate estimate = fixtureEstimate();
+  estimate.value = echoUs;
+  TankLevel level = {};
+  tankUpdate(config, geometry, estimate, temperatureDeciC, level, alerts);
+  return level;
+}
+
+static void test_config_parse()
+{
+  TEST_ASSERT_TRUE(tankConfigured(config));
+  TEST_ASSERT_EQUAL_UINT32(1500000, config.fullVolumeMl);
+  TEST_ASSERT_EQUAL_UINT32(1200, config.heightMm);
+  TEST_ASSERT_EQUAL_UINT32(1800, config.lengthMm);
+  TEST_ASSERT_EQUAL_UINT32(700, config.widthMm);
+  TEST_ASSERT_EQUAL_STRING("L", config.unit);
+  TEST_ASSERT_EQUAL_STRING("123456789", config.chatId);
+  TEST_ASSERT_EQUAL_UINT8(TELEMETRY_JSON, config.telemetryFormat);
+  TEST_ASSERT_EQUAL_UINT8(TANK_RECTANGULAR, config.shape);
+}
+
+static void test_config_rejected()
+{
+  // Each one is off in a single way, and none may touch the config in place
+  static const char *const invalid[] = {
+    "{\"full_volume_in_liters\":1500,\"tank_height_in_cm\":120,\"tank_lenght_in_cm\":180}",
+    "{\"full_volume_in_liters\":1500,\"tank_height_in_cm\":-120,\"tank_lenght_in_cm\":180,\"tank_width_in_cm\":70}",
+    "{\"full_volume_in_liters\":1500,\"tank_height_in_cm\":100001,\"tank_lenght_in_cm\":180,\"tank_width_in_cm\":70}",
+    "{" CONFIG_DIMENSIONS ",\"unit\":\"imperial gallons\"}",
+    "{" CONFIG_DIMENSIONS ",\"telemetry_format\":\"xml\"}",
+    "{" CONFIG_DIMENSIONS ",\"temperature_in_c\":85}",
+    "{" CONFIG_DIMENSIONS ",\"tank_shape\":\"sphere\"}",
+    "{\"full_volume_in_liters\":",
+  };
+  TankConfig before = config;
+  for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+    TEST_ASSERT_FALSE_MESSAGE(parseConfig(invalid[i], config), invalid[i]);
+    TEST_ASSERT_EQUAL_MEMORY(&before, &config, sizeof(config));
+  }
+}
+
+static void test_config_persisted()
+{
+  // Nothing in flash yet: the defaults, which measure no level
+  MemStorage storage;
+  TankConfigState state;
+  TEST_ASSERT_FALSE(tankConfigLoad(storage, state));
+  TEST_ASSERT_FALSE(tankConfigured(state.tanks[0]));
+
+  char json[sizeof(CONFIG_JSON)];
+  memcpy(json, CONFIG_JSON, sizeof(json));
+  TEST_ASSERT_EQUAL_UINT8(TANK_CONFIG_UPDATED, tankConfigUpdate(state, json, sizeof(json) - 1));
+  TEST_ASSERT_TRUE(tankConfigSave(storage, state));
+  TankConfigState restored;
+  TEST_ASSERT_TRUE(tankConfigLoad(storage, restored));
+  TEST_ASSERT_EQUAL_MEMORY(&state, &restored, sizeof(state));
+
+  // Cloud IoT sends the config again on every connection, it is not written again
+  uint32_t writes = storage.writes;
+  memcpy(json, CONFIG_JSON, sizeof(json));
+  TEST_ASSERT_EQUAL_UINT8(TANK_CONFIG_UNCHANGED, tankConfigUpdate(restored, json, sizeof(json) - 1));
+  TEST_ASSERT_EQUAL_UINT32(writes, storage.writes);
+
+  storage.files[TANK_CONFIG_PATH][20] ^= 1;
+  TEST_ASSERT_FALSE(tankConfigLoad(storage, restored));
+  TEST_ASSERT_FALSE(tankConfigured(restored.tanks[0]));
+}
+
+static void test_config_tanks()
+{
+  // The second tank has its own shape, the device settings come from the top
+  TankConfig tanks[3];
+  for (uint8_t i = 0; i < 3; i++) {
+    tankConfigDefaults(tanks[i]);
+  }
+  TEST_ASSERT_TRUE(parseConfig("{" CONFIG_DIMENSIONS ",\"telegram_chat_id\":\"42\","
+                               "\"tanks\":[{\"full_volume_in_liters\":3000,\"tank_height_in_cm\":200,"
+                               "\"tank_shape\":\"vertical_cylinder\",\"tank_diameter_in_cm\":140}]}", tanks, 3));
+  TEST_ASSERT_EQUAL_UINT32(1200, tanks[0].heightMm);
+  TEST_ASSERT_EQUAL_UINT32(2000, tanks[1].heightMm);
+  TEST_ASSERT_EQUAL_UINT32(1400, tanks[1].diameterMm);
+  TEST_ASSERT_EQUAL_UINT8(TANK_VERTICAL_CYLINDER, tanks[1].shape);
+  TEST_ASSERT_EQUAL_STRING("42", tanks[1].chatId);
+  TEST_ASSERT_FALSE(tankConfigured(tanks[2]));
+
+  // One bad tank rejects the whole document
+  TEST_ASSERT_FALSE(parseConfig("{" CONFIG_DIMENSIONS ",\"tanks\":[{\"full_volume_in_liters\":3000}]}", tanks, 3));
+  TEST_ASSERT_FALSE(parseConfig("{" CONFIG_DIMENSIONS ",\"tanks\":{}}", tanks, 3));
+  TEST_ASSERT_EQUAL_UINT32(2000, tanks[1].heightMm);
+  TEST_ASSERT_EQUAL_STRING("42", tanks[0].chatId);
+}
+
+// Circular segment, the reference the table approximates
+static double cylinderLiters(double diameterMm, double lengthMm, double levelMm)
+{
+  double r = diameterMm / 2;
+  double area = r * r * acos((r - levelMm) / r) - (r - levelMm) * sqrt(2 * r * levelMm - levelMm * levelMm);
+  return area * lengthMm / 1e6;
+}
+
+static void test_geometry_horizontal_cylinder()
+{
+  // Within 0.1 % of the capacity at every mm
+  geometry.horizontalCylinder(1200, 1800);
+  double capacity = cylinderLiters(1200, 1800, 1200);
+  double worst = 0;
+  for (uint32_t level = 0; level <= 1200; level++) {
+    double error = fabs(geometry.volumeMl(level) / 1000.0 - cylinderLiters(1200, 1800, level));
+    worst = error > worst ? error : worst;
+  }
+  TEST_ASSERT_LESS_THAN_UINT32((uint32_t)capacity, (uint32_t)(worst * 1000));
+  TEST_ASSERT_UINT32_WITHIN(10, (uint32_t)(capacity * 1000), geometry.capacityMl());
+
+  TEST_ASSERT_TRUE(parseConfig("{\"full_volume_in_liters\":2000,\"tank_height_in_cm\":120,"
+                               "\"tank_shape\":\"horizontal_cylinder\",\"tank_lenght_in_cm\":180}", config));
+  TEST_ASSERT_EQUAL_UINT8(TANK_HORIZONTAL_CYLINDER, config.shape);
+  TEST_ASSERT_EQUAL_UINT32(1200, config.diameterMm);
+}
+
+static void test_geometry_shapes()
+{
+  geometry.verticalCylinder(1000, 1500);
+  TEST_ASSERT_EQUAL_UINT32(589048, geometry.volumeMl(750));
+  TEST_ASSERT_EQUAL_UINT32(1178097, geometry.volumeMl(2000));
+  geometry.rectangular(1200, 1800, 700);
+  TEST_ASSERT_EQUAL_UINT32(0, geometry.volumeMl(0));
+  TEST_ASSERT_EQUAL_UINT32(756000, geometry.volumeMl(600));
+}
+
+static void test_geometry_strapping()
+{
+  // Linear between the points, flat past the last one
+  GeometryPoint table[] = { { 0, 0 }, { 100, 20000 }, { 500, 300000 }, { 1000, 900000 } };
+  TEST_ASSERT_TRUE(geometry.strapping(table, 4));
+  TEST_ASSERT_EQUAL_UINT32(10000, geometry.volumeMl(50));
+  TEST_ASSERT_EQUAL_UINT32(600000, geometry.volumeMl(750));
+  TEST_ASSERT_EQUAL_UINT32(900000, geometry.volumeMl(1200));
+  table[2].levelMm = 90;
+  TEST_ASSERT_FALSE(geometry.strapping(table, 4));
+  TEST_ASSERT_TRUE(geometry.empty());
+
+  TEST_ASSERT_TRUE(parseConfig("{\"full_volume_in_liters\":900,\"tank_height_in_cm\":100,"
+                               "\"tank_shape\":\"table\",\"strapping_levels_in_cm\":[0,10,50,100],"
+                               "\"strapping_liters\":[0,20,300,900]}", config));
+  TEST_ASSERT_EQUAL_UINT8(4, config.strappingCount);
+  TEST_ASSERT_EQUAL_UINT32(500, config.strapping[2].levelMm);
+  TEST_ASSERT_EQUAL_UINT32(900000, config.strapping[3].volumeMl);
+  TEST_ASSERT_FALSE(parseConfig("{\"full_volume_in_liters\":900,\"tank_height_in_cm\":100,"
+                                "\"tank_shape\":\"table\",\"strapping_levels_in_cm\":[0,10,50],"
+                                "\"strapping_liters\":[0,20,300,900]}", config));
+}
+
+static void test_sound_speed()
+{
+  // 331.3 m/s * sqrt(1 + T / 273.15) within 5 mm/s over the table
+  for (int16_t t = TANK_TEMPERATURE_MIN_DC; t <= TANK_TEMPERATURE_MAX_DC; t++) {
+    TEST_ASSERT_UINT32_WITHIN(5, (uint32_t)(331300 * sqrt(1 + t / 2731.5) + 0.5), tankSoundSpeed(t));
+  }
+  TEST_ASSERT_EQUAL_UINT32(TANK_SOUND_SPEED_MM_S, tankSoundSpeed(TANK_NO_TEMPERATURE));
+  TEST_ASSERT_EQUAL_UINT32(tankSoundSpeed(TANK_TEMPERATURE_MIN_DC), tankSoundSpeed(-1000));
+
+  // 1 m at 20 degrees is 5830 us there and back, 7 % less at -20
+  TEST_ASSERT_EQUAL_UINT32(1000, tankEchoToMm(5830, tankSoundSpeed(200)));
+  TEST_ASSERT_EQUAL_UINT32(930, tankEchoToMm(5830, tankSoundSpeed(-200)));
+}
+
+static void test_level_sweep()
+{
+  // Every echo the 1.2 m tank can return against doubles: the integer chain
+  // is within half a unit and never worse than the float one it replaced
+  FilterEstimate estimate = fixtureEstimate();
+  double worstDistance = 0, worstVolume = 0, worstPercent = 0;
+  double worstLegacyVolume = 0, worstLegacyPercent = 0;
+  for (int32_t echo = 600; echo <= 6990; echo++) {
+    TankAlerts alerts = { false, true };
+    TankLevel level = levelOf(echo, alerts);
+    estimate.value = echo;
+    LegacyLevel legacy = {};
+    legacyLevel(config.heightMm / 10.0f, config.fullVolumeMl / 1000.0f, geometry, estimate, legacy);
+
+    double distance = echo * 0.343 / 2;
+    double volume = (config.heightMm - distance) * config.lengthMm * config.widthMm / 1e6;
+    double percent = volume * 1e5 / config.fullVolumeMl;
+    worstDistance = fmax(worstDistance, fabs(level.distanceMm - distance));
+    worstVolume = fmax(worstVolume, fabs(level.volumeMl / 1000.0 - volume));
+    worstPercent = fmax(worstPercent, fabs(level.percent - percent));
+    worstLegacyVolume = fmax(worstLegacyVolume, fabs(legacy.volume - volume));
+    worstLegacyPercent = fmax(worstLegacyPercent, fabs(legacy.percent - percent));
+  }
+  TEST_ASSERT_TRUE(worstDistance <= 0.5);
+  TEST_ASSERT_TRUE(worstPercent <= 0.5);
+  TEST_ASSERT_TRUE(worstVolume <= worstLegacyVolume);
+  TEST_ASSERT_TRUE(worstPercent <= worstLegacyPercent);
+}
+
+static void test_level_temperature()
+{
+  // The sensor wins over the configured temperature
+  TEST_ASSERT_TRUE(parseConfig("{" CONFIG_DIMENSIONS ",\"temperature_in_c\":-12.5}", config));
+  TEST_ASSERT_EQUAL_INT16(-125, config.temperatureDeciC);
+  TankAlerts alerts = {};
+  config.temperatureDeciC = -100;
+  TEST_ASSERT_EQUAL_UINT32(813, levelOf(5000, alerts).distanceMm);
+  TEST_ASSERT_EQUAL_UINT32(873, levelOf(5000, alerts, 300).distanceMm);
+}
+
+static void test_level_below_tank()
+{
+  // 8 ms is 1.37 m, deeper than the 1.2 m tank: empty, not a negative volume
+  TankAlerts alerts = { false, true };
+  TankLevel level = levelOf(8000, alerts);
+  TEST_ASSERT_GREATER_THAN_UINT32(config.heightMm, level.distanceMm);
+  TEST_ASSERT_EQUAL_UINT32(0, level.volumeMl);
+  TEST_ASSERT_EQUAL_INT32(0, level.volume);
+  TEST_ASSERT_EQUAL_INT16(0, level.percent);
+}
+
+static void test_level_alerts()
+{
+  // Each crossing is announced once, until the level crosses the other way
+  TankAlerts alerts = {};
+  FilterEstimate estimate = fixtureEstimate();
+  TankLevel level = {};
+  const int32_t echoes[] = { 3500, 500, 500, 3500, 6000, 6000, 500 };
+  const char *const expected[] = { nullptr, "La citerne est pleine!", nullptr, nullptr, "La citerne est vide!!!",
+                                   nullptr, "La citerne est pleine!" };
+  for (size_t i = 0; i < sizeof(echoes) / sizeof(echoes[0]); i++) {
+    estimate.value = echoes[i];
+    const char *alert = tankUpdate(config, geometry, estimate, TANK_NO_TEMPERATURE, level, alerts);
+    if (expected[i]) {
+      TEST_ASSERT_NOT_NULL(alert);
+      TEST_ASSERT_EQUAL_STRING(expected[i], alert);
+    } else {
+      TEST_ASSERT_NULL(alert);
+    }
+  }
+
+  // Nor any before the first config, whatever the echo
+  tankConfigDefaults(config);
+  alerts = TankAlerts();
+  estimate.value = 6000;
+  TEST_ASSERT_NULL(tankUpdate(config, geometry, estimate, TANK_NO_TEMPERATURE, level, alerts));
+  TEST_ASSERT_EQUAL_INT32(0, level.volume);
+}
+
+static void test_telemetry_tanks()
+{
+  // Every tank and the consumption in one message, with the counters at their largest
+  TankContext contexts[TANK_MAX_SENSORS] = {};
+  for (uint8_t i = 0; i < TANK_MAX_SENSORS; i++) {
+    contexts[i].geometry = geometry;
+    contexts[i].filter.push(3500 + i * 100);
+    contexts[i].failures = UINT32_MAX;
+    tankUpdate(config, contexts[i].geometry, contexts[i].filter.getEstimate(), TANK_NO_TEMPERATURE,
+               contexts[i].level, contexts[i].alerts);
+  }
+  char buffer[480];
+  TelemetryWriter payload(buffer, sizeof(buffer), TELEMETRY_JSON);
+  payload.beginObject();
+  tankWriteBatchTelemetry(payload, contexts, TANK_MAX_SENSORS);
+  consumptionWriteTelemetry(payload, ConsumptionTracker());
+  payload.addUInt("suppressed_reports", 65535);
+  payload.endObject();
+  TEST_ASSERT_FALSE(payload.overflowed());
+  TEST_ASSERT_NOT_NULL(strstr(buffer, "{\"tanks\":[{\"volume_in_liters\":756,\"percent\":50,"));
+  TEST_ASSERT_NOT_NULL(strstr(buffer, "\"failures\":4294967295}],"));
+}
+
+static void test_telemetry_dimensions()
+{
+  // The "tank" message of publishDimensions() with the largest dimensions accepted
+  config.heightMm = config.lengthMm = config.widthMm = TANK_MAX_CM * 10;
+  config.fullVolumeMl = TANK_MAX_LITERS * 1000;
+  char buffer[480];
+  TelemetryWriter payload(buffer, sizeof(buffer), TELEMETRY_JSON);
+  payload.beginObject();
+  payload.addUInt("tank", TANK_MAX_SENSORS - 1);
+  tankWriteDimensions(payload, config);
+  payload.endObject();
+  TEST_ASSERT_EQUAL_STRING("{\"tank\":3,\"full_volume_in_liters\":1000000.000,\"tank_height_in_cm\":10000.0,"
+                           "\"tank_lenght_in_cm\":10000.0,\"tank_width_in_cm\":10000.0}", buffer);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_config_parse);
+  RUN_TEST(test_config_rejected);
+  RUN_TEST(test_config_persisted);
+  RUN_TEST(test_config_tanks);
+  RUN_TEST(test_geometry_horizontal_cylinder);
+  RUN_TEST(test_geometry_shapes);
+  RUN_TEST(test_geometry_strapping);
+  RUN_TEST(test_sound_speed);
+  RUN_TEST(test_level_sweep);
+  RUN_TEST(test_level_temperature);
+  RUN_TEST(test_level_below_tank);
+  RUN_TEST(test_level_alerts);
+  RUN_TEST(test_telemetry_tanks);
+  RUN_TEST(test_telemetry_dimensions);
+  return UNITY_END();
+}
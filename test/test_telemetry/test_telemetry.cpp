@@ -0,0 +1,141 @@
+#include <unity.h>
+
+#include <string.h>
+
+#include "../../src/telemetry.h"
+
+static char buffer[64];
+
+void setUp()
+{
+  memset(buffer, 0x55, sizeof(buffer));
+}
+
+void tearDown()
+{
+}
+
+static void test_telemetry_numbers()
+{
+  TelemetryWriter payload(buffer, sizeof(buffer));
+  payload.beginObject();
+  payload.addUInt("u", UINT32_MAX);
+  payload.addInt("i", INT32_MIN);
+  payload.addBool("b", false);
+  payload.endObject();
+  TEST_ASSERT_FALSE(payload.overflowed());
+  TEST_ASSERT_EQUAL_STRING("{\"u\":4294967295,\"i\":-2147483648,\"b\":false}", buffer);
+  TEST_ASSERT_EQUAL_UINT32(strlen(buffer), payload.length());
+}
+
+static void test_telemetry_fixed()
+{
+  // Integer units printed with their decimals, no float on the way
+  TelemetryWriter payload(buffer, sizeof(buffer));
+  payload.beginObject();
+  payload.addFixed("a", 1500000, 3);
+  payload.addFixed("b", -25, 1);
+  payload.addFixed("c", 7, 2);
+  payload.addFixed("d", INT32_MIN, 0);
+  payload.endObject();
+  TEST_ASSERT_EQUAL_STRING("{\"a\":1500.000,\"b\":-2.5,\"c\":0.07,\"d\":-2147483648}", buffer);
+}
+
+static void test_telemetry_strings()
+{
+  // Quotes and backslashes escaped, control characters cannot break the document
+  TelemetryWriter payload(buffer, sizeof(buffer));
+  payload.beginObject();
+  payload.addString("s", "a\"b\\c\nd");
+  payload.endObject();
+  TEST_ASSERT_EQUAL_STRING("{\"s\":\"a\\\"b\\\\c d\"}", buffer);
+}
+
+static void test_telemetry_arrays()
+{
+  TelemetryWriter payload(buffer, sizeof(buffer));
+  payload.beginObject();
+  payload.beginArray("v");
+  payload.addInt(nullptr, 1);
+  payload.beginObject();
+  payload.addInt("x", -1);
+  payload.endObject();
+  payload.endArray();
+  payload.addUInt("n", 2);
+  payload.endObject();
+  TEST_ASSERT_EQUAL_STRING("{\"v\":[1,{\"x\":-1}],\"n\":2}", buffer);
+}
+
+static void test_telemetry_buffer_limit()
+{
+  // {"a":1} is 7 bytes and its terminator: it fits 8 exactly
+  TelemetryWriter fits(buffer, 8);
+  fits.beginObject();
+  fits.addUInt("a", 1);
+  fits.endObject();
+  TEST_ASSERT_FALSE(fits.overflowed());
+  TEST_ASSERT_EQUAL_UINT32(7, fits.length());
+  TEST_ASSERT_EQUAL_STRING("{\"a\":1}", buffer);
+
+  // One byte short is an overflow, reported as an empty message rather than
+  // a cut one, and nothing is written past the capacity
+  memset(buffer, 0x55, sizeof(buffer));
+  TelemetryWriter cut(buffer, 7);
+  cut.beginObject();
+  cut.addUInt("a", 1);
+  cut.endObject();
+  TEST_ASSERT_TRUE(cut.overflowed());
+  TEST_ASSERT_EQUAL_UINT32(0, cut.length());
+  TEST_ASSERT_EQUAL_UINT8(0x55, buffer[7]);
+
+  // Nothing written after an overflow, even what would fit
+  cut.addUInt(nullptr, 0);
+  TEST_ASSERT_EQUAL_UINT32(0, cut.length());
+}
+
+static void test_telemetry_structure()
+{
+  // Unbalanced or too deep documents are overflows, not malformed output
+  TelemetryWriter closed(buffer, sizeof(buffer));
+  closed.endObject();
+  TEST_ASSERT_TRUE(closed.overflowed());
+
+  TelemetryWriter deep(buffer, sizeof(buffer));
+  for (uint8_t i = 0; i < TELEMETRY_MAX_DEPTH; i++) {
+    deep.beginArray();
+  }
+  TEST_ASSERT_TRUE(deep.overflowed());
+  TEST_ASSERT_EQUAL_UINT32(0, deep.length());
+}
+
+static void test_telemetry_cbor()
+{
+  // Indefinite length containers, the shortest head for each integer, floats for fixed point
+  TelemetryWriter payload(buffer, sizeof(buffer), TELEMETRY_CBOR);
+  payload.beginObject();
+  payload.addUInt("a", 24);
+  payload.beginArray("b");
+  payload.addInt(nullptr, -1);
+  payload.addBool(nullptr, true);
+  payload.endArray();
+  payload.addFixed("c", 15, 1);
+  payload.endObject();
+  const uint8_t expected[] = { 0xBF, 0x61, 'a', 0x18, 24, 0x61, 'b', 0x9F, 0x20, 0xF5, 0xFF,
+                               0x61, 'c', 0xFA, 0x3F, 0xC0, 0x00, 0x00, 0xFF };
+  TEST_ASSERT_FALSE(payload.overflowed());
+  TEST_ASSERT_EQUAL_UINT32(sizeof(expected), payload.length());
+  TEST_ASSERT_EQUAL_MEMORY(expected, buffer, sizeof(expected));
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_telemetry_numbers);
+  RUN_TEST(test_telemetry_fixed);
+  RUN_TEST(test_telemetry_strings);
+  RUN_TEST(test_telemetry_arrays);
+  RUN_TEST(test_telemetry_buffer_limit);
+  RUN_TEST(test_telemetry_structure);
+  RUN_TEST(test_telemetry_cbor);
+  return UNITY_END();
+}
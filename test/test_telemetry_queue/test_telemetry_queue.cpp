@@ -0,0 +1,241 @@
+#include <unity.h>
+
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "../../src/native/mem_storage.h"
+#include "../../src/telemetry_queue.h"
+
+#define TEST_BATCH_SIZE  5                                        //!< TELEMETRY_BATCH_SIZE of main.cpp
+#define TEST_BUFFER_SIZE 480                                      //!< TELEMETRY_BUFFER_SIZE of main.cpp
+#define TEST_QUEUE_SIZE  (TQ_SEGMENTS * TQ_RECORDS_PER_SEGMENT)   //!< records kept before the oldest go
+
+static MemStorage storage;
+static TelemetryQueue queue;
+static std::vector<TelemetryRecord> sent;
+static char buffer[TEST_BUFFER_SIZE];
+static uint32_t publishes;         //!< left before the broker stops answering
+static uint32_t messages;
+
+void setUp()
+{
+  storage = MemStorage();
+  queue = TelemetryQueue();
+  queue.begin(&storage);
+  sent.clear();
+  publishes = UINT32_MAX;
+  messages = 0;
+}
+
+void tearDown()
+{
+}
+
+// The nth level of an outage, one a minute, alternating between tanks
+static TelemetryRecord queueRecord(uint32_t n, uint16_t tanks = 2)
+{
+  TelemetryRecord record = { 1700000000 + n * 60, (int32_t)(1200 - n), (int16_t)(80 - n / 10), (uint16_t)(n % tanks) };
+  return record;
+}
+
+static void fill(uint32_t first, uint32_t count, uint16_t tanks = 2)
+{
+  for (uint32_t i = first; i < first + count; i++) {
+    queue.push(queueRecord(i, tanks));
+  }
+}
+
+// drainTelemetryQueue() of main.cpp: false once empty or when the publish fails
+static bool drain(TelemetryQueue &from, bool withTank = false)
+{
+  TelemetryRecord records[TEST_BATCH_SIZE];
+  uint16_t count = from.peek(records, TEST_BATCH_SIZE);
+  if (count == 0) {
+    return false;
+  }
+  size_t length;
+  count = telemetryWriteBatch(buffer, sizeof(buffer), TELEMETRY_JSON, records, count, withTank, length);
+  if (count == 0) {
+    from.pop(1);
+    return true;
+  }
+  if (publishes == 0) {
+    return false;
+  }
+  publishes--;
+  messages++;
+  sent.insert(sent.end(), records, records + count);
+  from.pop(count);
+  return true;
+}
+
+// The duty cycle loop before deep sleep, bounded so a spin fails instead of hanging
+static void drainAll(TelemetryQueue &from, bool withTank = false)
+{
+  for (uint32_t i = 0; i < 1000 && drain(from, withTank); i++) {
+  }
+}
+
+// Records first..first + count - 1, in that order
+static void assertSent(uint32_t first, uint32_t count, uint16_t tanks = 2)
+{
+  TEST_ASSERT_EQUAL_UINT32(count, sent.size());
+  for (uint32_t i = 0; i < count; i++) {
+    TelemetryRecord expected = queueRecord(first + i, tanks);
+    TEST_ASSERT_EQUAL_MEMORY(&expected, &sent[i], sizeof(expected));
+  }
+}
+
+static void test_queue_replay()
+{
+  fill(0, 150);
+  TEST_ASSERT_EQUAL_UINT32(150, queue.size());
+
+  // Batches never cross a segment: 64 + 64 + 22 records, one cursor write each
+  size_t written = storage.bytesWritten;
+  drainAll(queue);
+  assertSent(0, 150);
+  TEST_ASSERT_TRUE(queue.empty());
+  TEST_ASSERT_EQUAL_UINT32(0, queue.dropped());
+  TEST_ASSERT_EQUAL_UINT32(13 + 13 + 5, messages);
+  TEST_ASSERT_EQUAL_UINT32(messages * 8, storage.bytesWritten - written);
+  TEST_ASSERT_EQUAL_UINT32(1, storage.files.size());
+
+  // Emptied, it keeps going from where it was
+  fill(150, 1);
+  sent.clear();
+  drainAll(queue);
+  assertSent(150, 1);
+}
+
+static void test_queue_publish_fails()
+{
+  // The broker stops answering after two messages: the drain stops there
+  // instead of retrying the same batch until the deadline
+  fill(0, 100);
+  publishes = 2;
+  drainAll(queue);
+  TEST_ASSERT_EQUAL_UINT32(2, messages);
+  TEST_ASSERT_EQUAL_UINT32(100 - 2 * TEST_BATCH_SIZE, queue.size());
+  TEST_ASSERT_FALSE(drain(queue));
+  TEST_ASSERT_EQUAL_UINT32(100 - 2 * TEST_BATCH_SIZE, queue.size());
+
+  // The next wake resumes with the first record not acknowledged
+  TelemetryQueue woken;
+  woken.begin(&storage);
+  publishes = UINT32_MAX;
+  drainAll(woken);
+  assertSent(0, 100);
+  TEST_ASSERT_TRUE(woken.empty());
+}
+
+static void test_queue_reboot()
+{
+  fill(0, 100);
+  publishes = 3;
+  drainAll(queue);
+
+  // Only what was acknowledged is gone, the rest is replayed from where it stopped
+  TelemetryQueue rebooted;
+  rebooted.begin(&storage);
+  TEST_ASSERT_EQUAL_UINT32(85, rebooted.size());
+  sent.clear();
+  publishes = UINT32_MAX;
+  drainAll(rebooted);
+  assertSent(15, 85);
+  TEST_ASSERT_TRUE(rebooted.empty());
+}
+
+static void test_queue_torn()
+{
+  // A power cut in the middle of an append: that record is lost, not the others
+  fill(0, 10);
+  for (auto &file : storage.files) {
+    if (file.first != TQ_META_PATH) {
+      file.second.resize(file.second.size() - sizeof(TelemetryRecord) / 2);
+    }
+  }
+  TelemetryQueue torn;
+  torn.begin(&storage);
+  torn.push(queueRecord(10));
+  drainAll(torn);
+  TEST_ASSERT_EQUAL_UINT32(10, sent.size());
+  TEST_ASSERT_EQUAL_UINT32(queueRecord(10).timestamp, sent[9].timestamp);
+  sent.resize(9);
+  assertSent(0, 9);
+}
+
+static void test_queue_overflow()
+{
+  // Past the ring, the oldest segment goes as a whole
+  fill(0, TEST_QUEUE_SIZE);
+  TEST_ASSERT_EQUAL_UINT32(TEST_QUEUE_SIZE, queue.size());
+  TEST_ASSERT_EQUAL_UINT32(0, queue.dropped());
+  fill(TEST_QUEUE_SIZE, 1);
+  TEST_ASSERT_EQUAL_UINT32(TEST_QUEUE_SIZE + 1 - TQ_RECORDS_PER_SEGMENT, queue.size());
+  TEST_ASSERT_EQUAL_UINT32(TQ_RECORDS_PER_SEGMENT, queue.dropped());
+
+  // Records already sent out of the dropped segment are not counted as lost
+  publishes = 2;
+  drainAll(queue);
+  fill(TEST_QUEUE_SIZE + 1, TQ_RECORDS_PER_SEGMENT);
+  TEST_ASSERT_EQUAL_UINT32(2 * TQ_RECORDS_PER_SEGMENT - 2 * TEST_BATCH_SIZE, queue.dropped());
+
+  // What is left is the newest, in order, and survives a reboot
+  TelemetryQueue rebooted;
+  rebooted.begin(&storage);
+  uint32_t size = queue.size();
+  TEST_ASSERT_EQUAL_UINT32(TEST_QUEUE_SIZE + 1 - TQ_RECORDS_PER_SEGMENT, size);
+  sent.clear();
+  publishes = UINT32_MAX;
+  drainAll(rebooted);
+  assertSent(2 * TQ_RECORDS_PER_SEGMENT, size);
+}
+
+static void test_queue_drain_tanks()
+{
+  // Four tanks: five records and their index no longer fit one message,
+  // the drain sends the four that do and pops only those
+  fill(0, 100, 4);
+  drainAll(queue, true);
+  TEST_ASSERT_TRUE(queue.empty());
+  assertSent(0, 100, 4);
+  TEST_ASSERT_EQUAL_UINT32(25, messages);
+  TEST_ASSERT_NOT_NULL(strstr(buffer, "\"tank\":3"));
+}
+
+static void test_queue_batch_limits()
+{
+  TelemetryRecord batch[TEST_BATCH_SIZE];
+  for (uint32_t i = 0; i < TEST_BATCH_SIZE; i++) {
+    batch[i] = queueRecord(i, 4);
+  }
+  size_t length;
+  uint16_t count = telemetryWriteBatch(buffer, sizeof(buffer), TELEMETRY_JSON, batch, TEST_BATCH_SIZE, true, length);
+  TEST_ASSERT_EQUAL_UINT16(TEST_BATCH_SIZE - 1, count);
+  TEST_ASSERT_EQUAL_UINT32(strlen(buffer), length);
+  TEST_ASSERT_EQUAL_UINT8('}', buffer[length - 1]);
+
+  // CBOR is compact enough for a full batch
+  TEST_ASSERT_EQUAL_UINT16(TEST_BATCH_SIZE, telemetryWriteBatch(buffer, sizeof(buffer), TELEMETRY_CBOR, batch,
+                                                                 TEST_BATCH_SIZE, true, length));
+  TEST_ASSERT_LESS_THAN_UINT32(sizeof(buffer), length);
+
+  // A buffer too small for a single record writes nothing
+  TEST_ASSERT_EQUAL_UINT16(0, telemetryWriteBatch(buffer, 40, TELEMETRY_JSON, batch, TEST_BATCH_SIZE, true, length));
+  TEST_ASSERT_EQUAL_UINT32(0, length);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_queue_replay);
+  RUN_TEST(test_queue_publish_fails);
+  RUN_TEST(test_queue_reboot);
+  RUN_TEST(test_queue_torn);
+  RUN_TEST(test_queue_overflow);
+  RUN_TEST(test_queue_drain_tanks);
+  RUN_TEST(test_queue_batch_limits);
+  return UNITY_END();
+}
@@ -0,0 +1,73 @@
+#include <unity.h>
+
+#include <string.h>
+
+#include "../../src/tls_profile.h"
+
+static TlsGate gate;
+static char host[48];
+static uint16_t port;
+
+void setUp()
+{
+  gate = TlsGate();
+  memset(host, 0, sizeof(host));
+  port = 0;
+}
+
+void tearDown()
+{
+}
+
+static void closeNotify(void *)
+{
+  gate.release(TLS_NOTIFY, 40000);
+}
+
+static void test_tls_url()
+{
+  TEST_ASSERT_TRUE(tlsParseUrl("https://storage.googleapis.com/bucket/firmware.bin", host, sizeof(host), port));
+  TEST_ASSERT_EQUAL_STRING("storage.googleapis.com", host);
+  TEST_ASSERT_EQUAL_UINT16(443, port);
+}
+
+static void test_tls_url_port()
+{
+  TEST_ASSERT_TRUE(tlsParseUrl("http://192.168.1.10:8080/notify", host, sizeof(host), port));
+  TEST_ASSERT_EQUAL_STRING("192.168.1.10", host);
+  TEST_ASSERT_EQUAL_UINT16(8080, port);
+}
+
+static void test_tls_url_too_long()
+{
+  TEST_ASSERT_FALSE(tlsParseUrl("https://a-very-long-host-name-that-does-not-fit-the-buffer.example.com/",
+                                host, sizeof(host), port));
+}
+
+static void test_tls_gate()
+{
+  // A kept-open notification connection is closed when OTA needs the gate
+  gate.setClose(TLS_NOTIFY, closeNotify, nullptr);
+  gate.acquire(TLS_NOTIFY, 40000);
+  gate.sample(34000);
+  TEST_ASSERT_TRUE(gate.held());
+  gate.acquire(TLS_OTA, 40000);
+  gate.sample(20000);
+  gate.release(TLS_OTA, 39000);
+  gate.record(TLS_MQTT, 22000);
+  TEST_ASSERT_FALSE(gate.held());
+  TEST_ASSERT_EQUAL_UINT32(6000, gate.usage(TLS_NOTIFY).peakBytes);
+  TEST_ASSERT_EQUAL_UINT32(20000, gate.usage(TLS_OTA).peakBytes);
+  TEST_ASSERT_EQUAL_UINT32(1, gate.usage(TLS_OTA).connects);
+  TEST_ASSERT_EQUAL_UINT32(22000, gate.usage(TLS_MQTT).peakBytes);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_tls_url);
+  RUN_TEST(test_tls_url_port);
+  RUN_TEST(test_tls_url_too_long);
+  RUN_TEST(test_tls_gate);
+  return UNITY_END();
+}